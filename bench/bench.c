@@ -0,0 +1,544 @@
+// A load generator for reki. It keeps a number of connections open to a
+// running tracker, and drives announces and scrapes through them, either
+// as fast as the tracker answers (closed loop) or at a fixed rate no
+// matter how far behind the tracker falls (open loop). In open loop
+// mode, latency is counted from when a request was due to go out, not
+// from when a connection was free to send it, so a stalled tracker
+// can't hide its stalls.
+
+#include <uv.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strncasecmp
+#include <unistd.h> // getopt
+
+#include "../src/Histogram.h"
+#include "../src/macros.h"
+#include "../src/dbg.h"
+
+typedef struct _Bench Bench;
+typedef struct _BenchConfig BenchConfig;
+typedef struct _BenchConnection BenchConnection;
+typedef struct _BenchResults BenchResults;
+typedef enum _BenchRequestType BenchRequestType;
+
+// How often the open loop schedule is topped up.
+#define TickMS 1
+// requests that came due while every connection was busy.
+#define BacklogSize (1 << 20)
+// a scrape's hashes go in one request, at 71 bytes each, so the buffer
+// is sized to fit the most -H allows.
+#define MaxScrapeHashes 8
+#define MaxRequestSize 1024
+#define MaxResponseSize 8192
+// after the run, how long to wait for answers that are still coming.
+#define DrainMS 2000
+
+enum _BenchRequestType {
+	BenchRequest_announce,
+	BenchRequest_scrape,
+	BenchRequest_count,
+};
+
+static const char *requestNames[BenchRequest_count] = { "announce", "scrape" };
+
+struct _BenchConfig {
+	const char *host;
+	int port;
+	int connections;
+	// requests per second across all connections. 0 runs closed loop.
+	double rate;
+	double duration;
+	int torrents;
+	// popularity of torrents follows a zipf distribution with this
+	// exponent. 0 makes them all equally popular.
+	double zipf;
+	// fractions of announces from seeds and from IPv6 peers, and of
+	// requests that are scrapes.
+	double seedRatio;
+	double ipv6Ratio;
+	double scrapeRatio;
+	int scrapeHashes;
+	// send Connection: close and reconnect for every request.
+	bool reconnect;
+};
+
+struct _BenchResults {
+	Histogram latency;
+	uint64_t errors;
+};
+
+struct _BenchConnection {
+	uv_tcp_t tcp;
+	uv_connect_t connect;
+	uv_write_t write;
+	Bench *bench;
+	bool busy;
+	bool connected;
+
+	BenchRequestType type;
+	// when the request was due, in ns.
+	uint64_t due;
+	char request[MaxRequestSize];
+	size_t requestLength;
+	char response[MaxResponseSize];
+	size_t responseLength;
+};
+
+struct _Bench {
+	BenchConfig config;
+	uv_loop_t *loop;
+	uv_timer_t tick;
+	uv_timer_t drain;
+	struct sockaddr_storage address;
+	BenchConnection *connections;
+
+	// cumulative distribution over torrents.
+	double *popularity;
+	uint64_t random;
+
+	uint64_t start;
+	uint64_t issued;
+	bool stopping;
+	// a ring of due times for requests waiting on a connection.
+	uint64_t *backlog;
+	size_t backlogHead, backlogCount;
+	uint64_t dropped;
+	uint64_t inFlight;
+	uint64_t connectErrors;
+
+	BenchResults results[BenchRequest_count];
+};
+
+// splitmix64, which is plenty for picking torrents and making up peers.
+static uint64_t nextRandom( uint64_t *state ) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static double randomUnit( uint64_t *state ) {
+	return (nextRandom( state ) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int Bench_buildPopularity( Bench *bench ) {
+	int torrents = bench->config.torrents;
+	bench->popularity = malloc( torrents * sizeof(*bench->popularity) );
+	if ( !bench->popularity ) return 1;
+
+	double total = 0;
+	for ( int i = 0; i < torrents; i++ ) {
+		total += 1.0 / pow( i + 1, bench->config.zipf );
+		bench->popularity[i] = total;
+	}
+	for ( int i = 0; i < torrents; i++ )
+		bench->popularity[i] /= total;
+	return 0;
+}
+
+static int Bench_pickTorrent( Bench *bench ) {
+	double target = randomUnit( &bench->random );
+	int low = 0, high = bench->config.torrents - 1;
+	while ( low < high ) {
+		int middle = (low + high) / 2;
+		if ( bench->popularity[middle] < target )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+// Every torrent gets a fixed, made up info hash, written out URL encoded.
+// Gives -1 if it didn't fit in size.
+static int appendInfoHash( char *out, size_t size, int torrent ) {
+	uint64_t state = torrent + 1, word = 0;
+	size_t written = 0;
+	for ( int i = 0; i < 20; i++ ) {
+		if ( i % 8 == 0 )
+			word = nextRandom( &state );
+		int length = snprintf( out + written, size - written, "%%%02x", (unsigned)((word >> (i % 8 * 8)) & 0xFF) );
+		if ( length < 0 || (size_t)length >= size - written )
+			return -1;
+		written += length;
+	}
+	return written;
+}
+
+static void Bench_buildAnnounce( Bench *bench, BenchConnection *connection ) {
+	BenchConfig *config = &bench->config;
+	uint64_t peer = nextRandom( &bench->random );
+	char infoHash[64];
+	appendInfoHash( infoHash, sizeof(infoHash), Bench_pickTorrent( bench ) );
+
+	char ip[48];
+	if ( randomUnit( &bench->random ) < config->ipv6Ratio )
+		snprintf( ip, sizeof(ip), "fd00%%3A%%3A%x%%3A%x", (unsigned)(peer & 0xFFFF), (unsigned)((peer >> 16) & 0xFFFF) );
+	else
+		snprintf( ip, sizeof(ip), "10.%u.%u.%u", (unsigned)(peer & 0xFF), (unsigned)((peer >> 8) & 0xFF), (unsigned)((peer >> 16) & 0xFF) );
+
+	bool seed = randomUnit( &bench->random ) < config->seedRatio;
+	connection->type = BenchRequest_announce;
+	connection->requestLength = snprintf( connection->request, MaxRequestSize,
+		"GET /announce?info_hash=%s&peer_id=-RB0001-%012llx&port=%u&uploaded=0&downloaded=0&left=%s&ip=%s&compact=1 HTTP/1.1\r\n"
+		"Host: %s\r\nConnection: %s\r\n\r\n",
+		infoHash, (unsigned long long)(peer >> 16), (unsigned)(1024 + (peer >> 48) % 60000), seed? "0": "1000", ip,
+		config->host, config->reconnect? "close": "keep-alive" );
+}
+
+// Anything that would run past the buffer is left off, rather than
+// sending bytes that were never written.
+static void Bench_buildScrape( Bench *bench, BenchConnection *connection ) {
+	BenchConfig *config = &bench->config;
+	char *request = connection->request;
+	size_t length = snprintf( request, MaxRequestSize, "GET /scrape?" );
+	for ( int i = 0; i < config->scrapeHashes; i++ ) {
+		int field = snprintf( request + length, MaxRequestSize - length, "%sinfo_hash=", i? "&": "" );
+		if ( field < 0 || (size_t)field >= MaxRequestSize - length ) break;
+		int hash = appendInfoHash( request + length + field, MaxRequestSize - length - field, Bench_pickTorrent( bench ) );
+		if ( hash < 0 ) break;
+		length += field + hash;
+	}
+	int tail = snprintf( request + length, MaxRequestSize - length,
+		" HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", config->host, config->reconnect? "close": "keep-alive" );
+	if ( tail > 0 )
+		length = (size_t)tail < MaxRequestSize - length? length + tail: MaxRequestSize - 1;
+
+	connection->type = BenchRequest_scrape;
+	connection->requestLength = length;
+}
+
+static void BenchConnection_connect( BenchConnection *connection );
+static void BenchConnection_send( BenchConnection *connection, uint64_t due );
+static void Bench_drained( uv_timer_t *drain );
+
+// Hands the next request to an idle connection, if anything is waiting.
+static void Bench_dispatch( Bench *bench, BenchConnection *connection ) {
+	if ( bench->stopping || connection->busy || !connection->connected ) return;
+
+	if ( bench->config.rate == 0 ) {
+		BenchConnection_send( connection, uv_hrtime( ) );
+		return;
+	}
+
+	if ( !bench->backlogCount ) return;
+	uint64_t due = bench->backlog[bench->backlogHead];
+	bench->backlogHead = (bench->backlogHead + 1) % BacklogSize;
+	bench->backlogCount--;
+	BenchConnection_send( connection, due );
+}
+
+static void BenchConnection_closed( uv_handle_t *handle ) {
+	BenchConnection *connection = handle->data;
+	if ( !connection->bench->stopping )
+		BenchConnection_connect( connection );
+}
+
+static void BenchConnection_reset( BenchConnection *connection ) {
+	connection->connected = false;
+	uv_close( (uv_handle_t *)&connection->tcp, BenchConnection_closed );
+}
+
+static void BenchConnection_finish( BenchConnection *connection, bool error ) {
+	Bench *bench = connection->bench;
+	BenchResults *results = bench->results + connection->type;
+	if ( error )
+		results->errors++;
+	else
+		Histogram_record( &results->latency, (uv_hrtime( ) - connection->due) / 1000 );
+
+	connection->busy = false;
+	bench->inFlight--;
+	if ( bench->stopping && !bench->inFlight ) {
+		Bench_drained( &bench->drain );
+		return;
+	}
+	if ( error || bench->config.reconnect ) {
+		BenchConnection_reset( connection );
+		return;
+	}
+	Bench_dispatch( bench, connection );
+}
+
+// Returns how long the whole response is, or 0 if it hasn't all arrived.
+static size_t responseLength( const char *response, size_t length, size_t *headerLength ) {
+	const char *end = NULL;
+	for ( size_t i = 3; i < length; i++ ) {
+		if ( response[i-3] == '\r' && response[i-2] == '\n' && response[i-1] == '\r' && response[i] == '\n' ) {
+			end = response + i + 1;
+			break;
+		}
+	}
+	if ( !end ) return 0;
+
+	const char *header = NULL;
+	for ( const char *scan = response; scan + 15 < end; scan++ ) {
+		if ( !strncasecmp( scan, "Content-Length:", 15 ) ) {
+			header = scan + 15;
+			break;
+		}
+	}
+	size_t bodyLength = header? strtoul( header, NULL, 10 ): 0;
+	*headerLength = end - response;
+	size_t total = *headerLength + bodyLength;
+	return total <= length? total: 0;
+}
+
+static void BenchConnection_alloc( uv_handle_t *handle, size_t suggested, uv_buf_t *buf ) {
+	BenchConnection *connection = handle->data;
+	*buf = uv_buf_init( connection->response + connection->responseLength, MaxResponseSize - connection->responseLength );
+}
+
+static void BenchConnection_read( uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf ) {
+	BenchConnection *connection = stream->data;
+	if ( nread < 0 ) {
+		uv_read_stop( stream );
+		if ( connection->busy )
+			BenchConnection_finish( connection, true );
+		else if ( connection->connected )
+			BenchConnection_reset( connection );
+		return;
+	}
+
+	connection->responseLength += nread;
+	size_t headerLength;
+	size_t length = responseLength( connection->response, connection->responseLength, &headerLength );
+	if ( !length ) {
+		if ( connection->responseLength == MaxResponseSize ) {
+			uv_read_stop( stream );
+			BenchConnection_finish( connection, true );
+		}
+		return;
+	}
+
+	const char *body = connection->response + headerLength;
+	bool error = strncmp( connection->response, "HTTP/1.1 200", 12 )
+	             || (length - headerLength >= 11 && !strncmp( body, "d14:failure", 11 ));
+	if ( error )
+		dbg_warn( "%.*s", (int)length, connection->response );
+	// the tracker only answers one request at a time, so nothing follows.
+	connection->responseLength = 0;
+	if ( connection->busy )
+		BenchConnection_finish( connection, error );
+}
+
+static void BenchConnection_written( uv_write_t *write, int status ) {
+	BenchConnection *connection = write->data;
+	if ( status < 0 && connection->busy )
+		BenchConnection_finish( connection, true );
+}
+
+static void BenchConnection_send( BenchConnection *connection, uint64_t due ) {
+	Bench *bench = connection->bench;
+	if ( randomUnit( &bench->random ) < bench->config.scrapeRatio )
+		Bench_buildScrape( bench, connection );
+	else
+		Bench_buildAnnounce( bench, connection );
+
+	connection->busy = true;
+	connection->due = due;
+	connection->responseLength = 0;
+	bench->inFlight++;
+	uv_buf_t buf = uv_buf_init( connection->request, connection->requestLength );
+	uv_write( &connection->write, (uv_stream_t *)&connection->tcp, &buf, 1, BenchConnection_written );
+}
+
+static void BenchConnection_connected( uv_connect_t *connect, int status ) {
+	BenchConnection *connection = connect->data;
+	Bench *bench = connection->bench;
+	if ( status < 0 ) {
+		bench->connectErrors++;
+		if ( bench->connectErrors == 1 )
+			log_warn( "Could not connect: %s", uv_strerror( status ) );
+		uv_close( (uv_handle_t *)&connection->tcp, BenchConnection_closed );
+		return;
+	}
+
+	connection->connected = true;
+	uv_read_start( (uv_stream_t *)&connection->tcp, BenchConnection_alloc, BenchConnection_read );
+	Bench_dispatch( bench, connection );
+}
+
+static void BenchConnection_connect( BenchConnection *connection ) {
+	Bench *bench = connection->bench;
+	uv_tcp_init( bench->loop, &connection->tcp );
+	uv_tcp_nodelay( &connection->tcp, 1 );
+	connection->tcp.data = connection;
+	connection->connect.data = connection;
+	connection->write.data = connection;
+	connection->responseLength = 0;
+	if ( uv_tcp_connect( &connection->connect, &connection->tcp, (struct sockaddr *)&bench->address, BenchConnection_connected ) ) {
+		bench->connectErrors++;
+		uv_close( (uv_handle_t *)&connection->tcp, NULL );
+	}
+}
+
+static void Bench_closeConnection( uv_handle_t *handle, void *arg ) {
+	if ( !uv_is_closing( handle ) )
+		uv_close( handle, NULL );
+}
+
+static void Bench_drained( uv_timer_t *drain ) {
+	Bench *bench = drain->data;
+	uv_walk( bench->loop, Bench_closeConnection, NULL );
+}
+
+static void Bench_tick( uv_timer_t *tick ) {
+	Bench *bench = tick->data;
+	uint64_t now = uv_hrtime( );
+	double elapsed = (now - bench->start) / 1e9;
+	if ( elapsed >= bench->config.duration ) {
+		bench->stopping = true;
+		uv_timer_stop( tick );
+		uv_timer_start( &bench->drain, Bench_drained, DrainMS, 0 );
+		return;
+	}
+	if ( bench->config.rate == 0 ) return;
+
+	// Everything that should have gone out by now, each stamped with the
+	// time it was due.
+	uint64_t due = elapsed * bench->config.rate;
+	for ( ; bench->issued < due; bench->issued++ ) {
+		if ( bench->backlogCount == BacklogSize ) {
+			bench->dropped++;
+			continue;
+		}
+		uint64_t at = bench->start + bench->issued * 1e9 / bench->config.rate;
+		bench->backlog[(bench->backlogHead + bench->backlogCount) % BacklogSize] = at;
+		bench->backlogCount++;
+	}
+
+	for ( int i = 0; i < bench->config.connections && bench->backlogCount; i++ )
+		Bench_dispatch( bench, bench->connections + i );
+}
+
+static void Bench_report( Bench *bench, double elapsed ) {
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	printf( "%-9s %10s %8s %10s", "", "requests", "errors", "req/s" );
+	for ( size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++ )
+		printf( "   p%-5g", percentiles[i] );
+	printf( "      max (ms)\n" );
+
+	Histogram total;
+	Histogram_init( &total );
+	uint64_t errors = 0;
+	for ( int type = 0; type <= BenchRequest_count; type++ ) {
+		const Histogram *latency = type < BenchRequest_count? &bench->results[type].latency: &total;
+		uint64_t typeErrors = type < BenchRequest_count? bench->results[type].errors: errors;
+		if ( type < BenchRequest_count ) {
+			Histogram_merge( &total, latency );
+			errors += typeErrors;
+		}
+
+		printf( "%-9s %10llu %8llu %10.0f", type < BenchRequest_count? requestNames[type]: "total",
+		        (unsigned long long)latency->count, (unsigned long long)typeErrors, latency->count / elapsed );
+		for ( size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++ )
+			printf( " %8.3f", Histogram_percentile( latency, percentiles[i] ) / 1000.0 );
+		printf( " %13.3f\n", latency->max / 1000.0 );
+	}
+
+	if ( bench->dropped || bench->backlogCount || bench->connectErrors )
+		printf( "\n%llu requests never went out, %llu connection attempts failed.\n",
+		        (unsigned long long)(bench->dropped + bench->backlogCount), (unsigned long long)bench->connectErrors );
+}
+
+static void usage( const char *name ) {
+	fprintf( stderr,
+		"usage: %s [options]\n"
+		"  -h host     tracker address (127.0.0.1)\n"
+		"  -p port     tracker port (9001)\n"
+		"  -c count    connections (64)\n"
+		"  -r rate     requests per second, 0 for as fast as possible (0)\n"
+		"  -d seconds  how long to run (10)\n"
+		"  -t count    torrents (10000)\n"
+		"  -z s        zipf exponent for torrent popularity, 0 for uniform (1)\n"
+		"  -s ratio    fraction of announces from seeds (0.5)\n"
+		"  -6 ratio    fraction of announces from IPv6 peers (0.2)\n"
+		"  -S ratio    fraction of requests that are scrapes (0.1)\n"
+		"  -H count    info hashes per scrape, at most %d (1)\n"
+		"  -n          open a new connection for every request\n", name, MaxScrapeHashes );
+}
+
+int main( int argc, char **argv ) {
+	Bench *bench = calloc( 1, sizeof(*bench) );
+	checkConstructor( bench );
+
+	bench->config = (BenchConfig){
+		.host = "127.0.0.1", .port = 9001, .connections = 64, .rate = 0, .duration = 10,
+		.torrents = 10000, .zipf = 1, .seedRatio = 0.5, .ipv6Ratio = 0.2, .scrapeRatio = 0.1,
+		.scrapeHashes = 1, .reconnect = false
+	};
+	BenchConfig *config = &bench->config;
+
+	int option;
+	while ( (option = getopt( argc, argv, "h:p:c:r:d:t:z:s:6:S:H:n" )) != -1 ) {
+		switch ( option ) {
+			case 'h': config->host = optarg; break;
+			case 'p': config->port = atoi( optarg ); break;
+			case 'c': config->connections = atoi( optarg ); break;
+			case 'r': config->rate = atof( optarg ); break;
+			case 'd': config->duration = atof( optarg ); break;
+			case 't': config->torrents = atoi( optarg ); break;
+			case 'z': config->zipf = atof( optarg ); break;
+			case 's': config->seedRatio = atof( optarg ); break;
+			case '6': config->ipv6Ratio = atof( optarg ); break;
+			case 'S': config->scrapeRatio = atof( optarg ); break;
+			case 'H': config->scrapeHashes = atoi( optarg ); break;
+			case 'n': config->reconnect = true; break;
+			default: {
+				usage( argv[0] );
+				return 1;
+			}
+		}
+	}
+	// a scrape's hashes have to fit in one request.
+	if ( config->connections < 1 || config->torrents < 1 || config->duration <= 0 || config->rate < 0
+	     || config->scrapeHashes < 1 || config->scrapeHashes > MaxScrapeHashes ) {
+		usage( argv[0] );
+		return 1;
+	}
+
+	if ( uv_ip4_addr( config->host, config->port, (struct sockaddr_in *)&bench->address )
+	     && uv_ip6_addr( config->host, config->port, (struct sockaddr_in6 *)&bench->address ) ) {
+		log_err( "%s is not an IP address.", config->host );
+		return 1;
+	}
+
+	checkFunction( Bench_buildPopularity( bench ) );
+	bench->backlog = malloc( BacklogSize * sizeof(*bench->backlog) );
+	checkConstructor( bench->backlog );
+	bench->connections = calloc( config->connections, sizeof(*bench->connections) );
+	checkConstructor( bench->connections );
+	for ( int i = 0; i < BenchRequest_count; i++ )
+		Histogram_init( &bench->results[i].latency );
+	bench->random = uv_hrtime( );
+
+	bench->loop = uv_default_loop( );
+	uv_timer_init( bench->loop, &bench->tick );
+	uv_timer_init( bench->loop, &bench->drain );
+	bench->tick.data = bench->drain.data = bench;
+
+	printf( "%d connections to %s:%d for %gs, %s, %d torrents (zipf %g)\n", config->connections, config->host, config->port,
+	        config->duration, config->rate? "open loop": "closed loop", config->torrents, config->zipf );
+	if ( config->rate )
+		printf( "at %g requests/s\n", config->rate );
+
+	bench->start = uv_hrtime( );
+	for ( int i = 0; i < config->connections; i++ ) {
+		bench->connections[i].bench = bench;
+		BenchConnection_connect( bench->connections + i );
+	}
+	uv_timer_start( &bench->tick, Bench_tick, TickMS, TickMS );
+
+	uv_run( bench->loop, UV_RUN_DEFAULT );
+	// answers that came in while draining still count, but the rate is
+	// over the time requests were being sent.
+	puts( "" );
+	Bench_report( bench, config->duration );
+	return 0;
+}
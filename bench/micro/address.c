@@ -0,0 +1,144 @@
+// Numeric address parsing, against getaddrinfo with AI_NUMERICHOST,
+// which allocated a result list for every address an announce named.
+
+#include <netdb.h> // getaddrinfo
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h>
+
+#include "microbench.h"
+#include "../../src/CompactAddress.h"
+
+// Addresses the way they show up in ip, ipv4, ipv6 and X-Real-IP.
+static const char *addresses[] = {
+	"93.184.216.34",
+	"81.2.69.160:51413",
+	"2a00:1450:4001:82a::200e",
+	"[2001:4860:4860::8888]:6881",
+	"2a02:8108:1140:4e00:d1c3:5ab2:c1e4:f0a9",
+	"::ffff:93.184.216.34",
+};
+#define AddressCount (sizeof(addresses) / sizeof(*addresses))
+
+// Only checked, not timed. getaddrinfo also reads forms like 1.2.3 and
+// 0x7f.0.0.1, which nobody sends and the new parser refuses, so those
+// aren't here.
+static const char *checkAddresses[] = {
+	"0.0.0.0", "255.255.255.255", "1.2.3.4:1", "1.2.3.4:65535", "::", "::1", "1::", "1:2:3:4:5:6:7:8",
+	"1:2:3:4:5:6:7::", "::2:3:4:5:6:7:8", "fe80::1:2", "[::1]", "[::1]:80", "::1.2.3.4", "1:2:3:4:5:6:1.2.3.4",
+	"FFFF::aBcD", "nope", "", "1.2.3.4.5", "1.2.3.256", "1.2.3.4:", "1.2.3.4:70000", "1.2.3.4:x",
+	"1::2::3", "1:2:3:4:5:6:7:8:9", "::12345", ":1::2", "1:", "[::1", "[::1]:", "[::1]x", "[1.2.3.4]",
+	"1:2:3:4:5:6:7:1.2.3.4",
+};
+#define CheckAddressCount (sizeof(checkAddresses) / sizeof(*checkAddresses))
+
+CompactError Reference_compactFromString( char *compact, const char *address, const char *port ) {
+	struct addrinfo hints, *res;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICHOST;
+	if ( getaddrinfo( address, port, &hints, &res ) )
+		return CompactError_malformedAddress;
+
+	CompactError status = CompactAddress_fromSocket( compact, (struct sockaddr_storage *)res->ai_addr, port != NULL );
+	freeaddrinfo( res );
+	return status;
+}
+
+// The way the announce handlers used getaddrinfo: a terminated copy,
+// with the port split off by hand.
+static CompactError Reference_fromString( char *compact, const char *address, size_t length ) {
+	char copy[64], *host = copy, *port = NULL;
+	if ( length >= sizeof(copy) ) return CompactError_malformedAddress;
+	memcpy( copy, address, length );
+	copy[length] = '\0';
+
+	int portFlag = CompactAddress_IPv4PortFlag;
+	if ( copy[0] == '[' ) {
+		char *close = strchr( copy, ']' );
+		if ( !close || (close[1] && close[1] != ':') ) return CompactError_malformedAddress;
+		*close = '\0';
+		host++;
+		if ( close[1] ) port = close + 2;
+		portFlag = CompactAddress_IPv6PortFlag;
+	} else {
+		char *colon = strchr( copy, ':' );
+		if ( colon && !strchr( colon + 1, ':' ) ) {
+			*colon = '\0';
+			port = colon + 1;
+		}
+	}
+	// getaddrinfo takes 0 and service names, neither of which is a port.
+	if ( port && (!*port || strspn( port, "0123456789" ) != strlen( port ) || strlen( port ) > 5 || !atoi( port ) || atoi( port ) > 65535) )
+		return CompactError_malformedAddress;
+
+	CompactError status = Reference_compactFromString( compact, host, port );
+	if ( !status && port )
+		compact[0] |= compact[0] & CompactAddress_IPv4Flag? CompactAddress_IPv4PortFlag: CompactAddress_IPv6PortFlag;
+	// [1.2.3.4] isn't an IPv6 address.
+	if ( !status && portFlag == CompactAddress_IPv6PortFlag && !(compact[0] & CompactAddress_IPv6Flag) )
+		return CompactError_malformedAddress;
+	return status;
+}
+
+static CompactError Current_fromString( char *compact, const char *address, size_t length ) {
+	return CompactAddress_fromString( compact, address, length, CompactAddress_IPv4Flag | CompactAddress_IPv6Flag );
+}
+
+typedef CompactError (AddressParser)( char *compact, const char *address, size_t length );
+
+static uint64_t AddressParse_run( AddressParser *parser, size_t iterations ) {
+	size_t lengths[AddressCount];
+	for ( size_t i = 0; i < AddressCount; i++ )
+		lengths[i] = strlen( addresses[i] );
+
+	uint64_t result = 0;
+	char compact[CompactAddress_Size];
+	for ( size_t i = 0; i < iterations; i++ ) {
+		size_t address = i % AddressCount;
+		CompactAddress_init( compact );
+		result += parser( compact, addresses[address], lengths[address] );
+		result = result * 31 + (unsigned char)compact[CompactAddress_IPv4AddressOffset + 3];
+		result = result * 31 + (unsigned char)compact[CompactAddress_IPv6AddressOffset + 15];
+	}
+	return result;
+}
+
+static uint64_t AddressParse_reference( size_t iterations ) {
+	return AddressParse_run( Reference_fromString, iterations );
+}
+
+static uint64_t AddressParse_current( size_t iterations ) {
+	return AddressParse_run( Current_fromString, iterations );
+}
+
+static int AddressParse_compare( const char *address ) {
+	char reference[CompactAddress_Size], current[CompactAddress_Size];
+	CompactAddress_init( reference );
+	CompactAddress_init( current );
+	bool referenceOkay = !Reference_fromString( reference, address, strlen( address ) );
+	bool currentOkay = !Current_fromString( current, address, strlen( address ) );
+
+	int differs = referenceOkay != currentOkay || (referenceOkay && memcmp( reference, current, CompactAddress_Size ));
+	if ( differs )
+		fprintf( stderr, "address: %s and %s for \"%s\"\n", referenceOkay? "okay": "malformed", currentOkay? "okay": "malformed", address );
+	return differs;
+}
+
+static int AddressParse_check( void ) {
+	int differs = 0;
+	for ( size_t i = 0; i < AddressCount; i++ )
+		differs |= AddressParse_compare( addresses[i] );
+	for ( size_t i = 0; i < CheckAddressCount; i++ )
+		differs |= AddressParse_compare( checkAddresses[i] );
+	return differs;
+}
+
+static const MicroBenchmark benchmarks[] = {
+	{ "getaddrinfo", AddressParse_reference },
+	{ "in place", AddressParse_current },
+	{ NULL, NULL },
+};
+
+const MicroBenchmarkGroup AddressBenchmarks = { "address", AddressParse_check, benchmarks };
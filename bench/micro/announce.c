@@ -0,0 +1,313 @@
+// The announce query parser, against the one it replaced: a strncmp
+// for every field name, strtol for every escaped byte, snprintf for
+// every byte of a hex info hash for the redis keys, and strtoul for the
+// numbers.
+
+#include <ctype.h> // tolower
+#include <limits.h> // UCHAR_MAX
+#include <stdio.h> // snprintf
+#include <stdlib.h>
+#include <string.h>
+
+#include "microbench.h"
+#include "../../src/announce.h"
+#include "../../src/URLCommon.h"
+#include "../../src/macros.h"
+
+// What reki might be sent by qBittorrent, Transmission and a client
+// with an escaped peer_id. Addresses are left out, since parsing them
+// with getaddrinfo would swamp everything else here. The address group
+// times those.
+static const char *queries[] = {
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=-qB4250-a9Xv0(3s!ZRk&port=51413"
+	"&uploaded=0&downloaded=0&left=1503238553&corrupt=0&key=4B5C1A07&event=started&numwant=200&compact=1"
+	"&no_peer_id=1&supportcrypto=1&redundant=0",
+	"info_hash=%b2%7d%b1%f6%b8%ff%2e%a1%d4%3b%cc%ab%9a%d0%07%5c%11%22%33%44&peer_id=-TR3000-1z2x3c4v5b6n"
+	"&port=6881&uploaded=1024&downloaded=4096&left=0&numwant=80&key=1c2d3e4f&compact=1&supportcrypto=1"
+	"&event=completed",
+	"info_hash=%01%23%45%67%89%AB%CD%EF%01%23%45%67%89%AB%CD%EF%01%23%45%67&peer_id=%2DRB0001%2D000000abcdef"
+	"&port=1&left=5&numwant=7&compact=1",
+};
+#define QueryCount (sizeof(queries) / sizeof(*queries))
+
+// Only checked, not timed: the parsers have to agree on addresses and on
+// what's wrong with a query.
+static const char *checkQueries[] = {
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=abc&port=1&left=0&ip=10.1.2.3",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=abc&port=1&left=0&ipv6=%5B2001%3Adb8%3A%3A1%5D%3A6881",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=abc&port=1&left=0&ipv4=10.0.0.1%3A99",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=abc&port=1&left=0&ip=nope",
+	"info_hash=%01%23&peer_id=-qB4250-a9Xv0(3s!ZRk&port=51413&left=0",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=-qB4250-a9Xv0(3s!ZRk&port=0&left=0",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&peer_id=-qB4250-a9Xv0(3s!ZRk&port=70000&left=0",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&port=1&left=0",
+	"info_hash=%d4%8f%a8%1bq%a1%9c%b2X%01%f2%0e%fb%bd%e0%a6k%0b%12%34&compact&peer_id=abc&port=1&left=0",
+	"",
+};
+#define CheckQueryCount (sizeof(checkQueries) / sizeof(*checkQueries))
+
+// Everything below, down to Reference_fromQuery, is the old parser.
+
+static int Reference_decodeURLString( const char *input, size_t length, char *output, size_t outputLength ) {
+	int o = 0;
+	for ( int i = 0; (i < length) && (o < outputLength); i++, o++ ) {
+		if ( input[i] == '%' ) {
+			if ( i + 2 >= length )
+				return -1;
+			char encodedChar[3] = { input[i + 1], input[i + 2], '\0' };
+			long decodedChar = strtol( encodedChar, NULL, 16 );
+			if ( decodedChar <= UCHAR_MAX )
+				output[o] = (char)decodedChar;
+			else
+				return -2;
+			i += 2;
+		} else
+			output[o] = input[i];
+	}
+	output[o] = '\0';
+	return o;
+}
+
+static int Reference_dualDecodeInfoHash( const char *input, size_t length, char *compactHash, char *infoHash ) {
+	int c = 0, h = 0;
+	for ( int i = 0; (i < length) && (c < 20) && (h < 40); i++, c++, h++ ) {
+		if ( input[i] == '%' ) {
+			if ( i + 2 >= length )
+				return -1;
+			char encodedChar[3] = { input[i + 1], input[i + 2], '\0' };
+			long decodedChar = strtol( encodedChar, NULL, 16 );
+			if ( decodedChar <= UCHAR_MAX )
+				compactHash[c] = (char)decodedChar;
+			else
+				return -2;
+
+			infoHash[h++] = tolower( input[i + 1] );
+			infoHash[h]   = tolower( input[i + 2] );
+			i += 2;
+		} else {
+			compactHash[c] = input[i];
+			snprintf( infoHash + h++, 3, "%02x", (unsigned char)input[i] );
+		}
+	}
+	infoHash[h] = '\0';
+	return h;
+}
+
+#define IPStringSize 64
+static int Reference_handleIPv4( ClientAnnounceData *announce, const char *value, size_t valueLength ) {
+	char ipv4[IPStringSize];
+	int decodedLength = Reference_decodeURLString( value, valueLength, ipv4, sizeof(ipv4) - 1 );
+	// 0.0.0.0 the shortest ipv4 address?
+	if ( decodedLength < 7 ) return 1;
+
+	char *port;
+	int portLength = 0;
+	for ( int i = 7; i < decodedLength; i++ ) {
+		if ( ipv4[i] == ':' ) {
+			ipv4[i] = '\0';
+			port = ipv4 + i + 1;
+			portLength = decodedLength - i - 1;
+		}
+	}
+
+	int status = Reference_compactFromString( announce->compact, ipv4, portLength? port: NULL );
+	if ( portLength )
+		announce->compact[0] |= CompactAddress_IPv4PortFlag;
+
+	return status;
+}
+
+static int Reference_handleIPv6( ClientAnnounceData *announce, const char *value, size_t valueLength ) {
+	// ipv6 can be of form: [::1]:9001 or ::1
+	char ipv6[IPStringSize];
+	int decodedLength = Reference_decodeURLString( value, valueLength, ipv6, sizeof(ipv6) - 1 );
+	if ( decodedLength < 2 ) return 1;
+
+	char *port, *scratch = ipv6;
+	int portLength = 0;
+	if ( scratch[0] == '[' ) {
+		// chop off the [
+		scratch++;
+		for( int i = 2; i < decodedLength - 1; i++ ) {
+			if ( scratch[i] == ']' ) {
+				// null terminate ipv6. port will already be null terminated
+				// because Reference_decodeURLString null terminates its output.
+				scratch[i] = '\0';
+				port = scratch + i + 2;
+				portLength = decodedLength - i - 3;
+				if ( portLength < 1 || portLength > 5 || i < 2 ) return 1;
+				break;
+			}
+		}
+	}
+
+	int status = Reference_compactFromString( announce->compact, scratch, portLength? port: NULL );
+	if ( portLength )
+		announce->compact[0] |= CompactAddress_IPv6PortFlag;
+
+	return status;
+}
+
+
+enum {
+	Reference_peer_id   = 1 << 0,
+	Reference_info_hash = 1 << 1,
+	Reference_port      = 1 << 2,
+	Reference_event     = 1 << 3,
+	Reference_ip        = 1 << 4,
+	Reference_ipv4      = 1 << 5,
+	Reference_ipv6      = 1 << 6,
+	Reference_left      = 1 << 7,
+	Reference_numwant   = 1 << 8,
+	Reference_required  = Reference_peer_id | Reference_info_hash | Reference_port | Reference_left,
+};
+
+// The hex info hash the old parser made, which nothing uses any more.
+static char referenceInfoHash[41];
+
+#define CheckError( boolean, err ) if ( boolean ) { return err; }
+#define CheckField( fieldName ) !(announce->seenFields & Reference_##fieldName) && EqualLiteralLength( key, keyLength, #fieldName )
+static int Reference_parse( void *data, const char *key, size_t keyLength, const char *value, size_t valueLength ) {
+	ClientAnnounceData *announce = data;
+
+	if ( CheckField( peer_id ) ) {
+		CheckError( Reference_decodeURLString( value, valueLength, announce->id, 20 ) < 1, AnnounceError_malformedID );
+		announce->seenFields |= Reference_peer_id;
+
+	} else if ( CheckField( info_hash ) ) {
+		CheckError( Reference_dualDecodeInfoHash( value, valueLength, announce->compactHash, referenceInfoHash ) != 40, AnnounceError_malformedInfoHash );
+		announce->seenFields |= Reference_info_hash;
+
+	} else if ( CheckField( ip ) ) {
+		char ip[IPStringSize];
+		CheckError( Reference_decodeURLString( value, valueLength, ip, sizeof(ip) - 1 ) < 1, AnnounceError_malformedIP );
+		CheckError( Reference_compactFromString( announce->compact, ip, NULL), AnnounceError_malformedIP );
+		announce->seenFields |= Reference_ip;
+
+	} else if ( CheckField( ipv4 ) ) {
+		CheckError( Reference_handleIPv4( announce, value, valueLength ), AnnounceError_malformedIPv4 );
+		announce->seenFields |= Reference_ipv4;
+
+	} else if ( CheckField( ipv6 ) ) {
+		CheckError( Reference_handleIPv6( announce, value, valueLength ), AnnounceError_malformedIPv6 );
+		announce->seenFields |= Reference_ipv6;
+
+	} else if ( CheckField( port ) ) {
+		unsigned long port = strtoul( value, NULL, 10 );
+		CheckError( (port < 1) || (port > 65535), AnnounceError_malformedPort );
+		CompactAddress_setPort( announce->compact, (uint16_t)port );
+		announce->seenFields |= Reference_port;
+
+	} else if ( CheckField( left ) ) {
+		announce->left = strtoull( value, NULL, 10 );
+		announce->seenFields |= Reference_left;
+
+	} else if ( CheckField( event ) ) {
+		if ( EqualLiteralLength( value, valueLength, "started" ) )
+			announce->event = AnnounceEvent_start;
+		else if ( EqualLiteralLength( value, valueLength, "completed" ) )
+			announce->event = AnnounceEvent_complete;
+		else if ( EqualLiteralLength( value, valueLength, "stopped" ) ) {
+			announce->event = AnnounceEvent_stop;
+			return AnnounceError_okay;
+		} else
+			announce->event = AnnounceEvent_unknown;
+
+		announce->seenFields |= Reference_event;
+
+	} else if ( CheckField( numwant ) ) {
+		unsigned long numwant = strtoul( value, NULL, 10 );
+		if ( numwant < MaxNumwant && numwant > 0 )
+			announce->numwant = numwant;
+
+		announce->seenFields |= Reference_numwant;
+	}
+
+	return AnnounceError_okay;
+}
+
+static AnnounceError Reference_fromQuery( ClientAnnounceData *announce, const char *query, size_t queryLength ) {
+	int e = parseQueryString( query, queryLength, Reference_parse, announce );
+	if ( e )
+		return e;
+	if ( (announce->seenFields & Reference_required) != Reference_required )
+		return AnnounceError_missingField;
+	return AnnounceError_okay;
+}
+
+typedef AnnounceError (AnnounceParser)( ClientAnnounceData *announce, const char *query, size_t queryLength );
+
+// What a parse left behind, folded down to a number.
+static uint64_t AnnounceParse_result( ClientAnnounceData *announce, AnnounceError error ) {
+	uint64_t result = error;
+	result = result * 31 + announce->left;
+	result = result * 31 + announce->numwant;
+	result = result * 31 + announce->event;
+	result = result * 31 + (unsigned char)announce->compactHash[19];
+	result = result * 31 + (unsigned char)announce->compact[CompactAddress_IPv4PortOffset];
+	return result;
+}
+
+static uint64_t AnnounceParse_run( AnnounceParser *parser, size_t iterations ) {
+	size_t lengths[QueryCount];
+	for ( size_t i = 0; i < QueryCount; i++ )
+		lengths[i] = strlen( queries[i] );
+
+	Arena *arena = Arena_new( 1024 );
+	if ( !arena ) return 0;
+	uint64_t result = 0;
+	for ( size_t i = 0; i < iterations; i++ ) {
+		size_t query = i % QueryCount;
+		ClientAnnounceData *announce = ClientAnnounceData_new( arena );
+		result += AnnounceParse_result( announce, parser( announce, queries[query], lengths[query] ) );
+		Arena_reset( arena );
+	}
+	Arena_free( arena );
+	return result;
+}
+
+static uint64_t AnnounceParse_reference( size_t iterations ) {
+	return AnnounceParse_run( Reference_fromQuery, iterations );
+}
+
+static uint64_t AnnounceParse_current( size_t iterations ) {
+	return AnnounceParse_run( ClientAnnounceData_fromQuery, iterations );
+}
+
+static int AnnounceParse_compare( const char *query ) {
+	Arena *arena = Arena_new( 1024 );
+	if ( !arena ) return 1;
+	ClientAnnounceData *reference = ClientAnnounceData_new( arena ), *current = ClientAnnounceData_new( arena );
+	AnnounceError referenceError = Reference_fromQuery( reference, query, strlen( query ) );
+	AnnounceError currentError = ClientAnnounceData_fromQuery( current, query, strlen( query ) );
+
+	int differs = referenceError != currentError;
+	if ( !referenceError && !differs ) {
+		differs = strcmp( reference->id, current->id )
+		       || memcmp( reference->compactHash, current->compactHash, sizeof(current->compactHash) )
+		       || memcmp( reference->compact, current->compact, sizeof(current->compact) )
+		       || reference->left != current->left || reference->numwant != current->numwant
+		       || reference->event != current->event;
+	}
+	if ( differs )
+		fprintf( stderr, "announce: errors %d and %d for %s\n", referenceError, currentError, query );
+	Arena_free( arena );
+	return differs;
+}
+
+static int AnnounceParse_check( void ) {
+	int differs = 0;
+	for ( size_t i = 0; i < QueryCount; i++ )
+		differs |= AnnounceParse_compare( queries[i] );
+	for ( size_t i = 0; i < CheckQueryCount; i++ )
+		differs |= AnnounceParse_compare( checkQueries[i] );
+	return differs;
+}
+
+static const MicroBenchmark benchmarks[] = {
+	{ "strncmp chain", AnnounceParse_reference },
+	{ "single pass", AnnounceParse_current },
+	{ NULL, NULL },
+};
+
+const MicroBenchmarkGroup AnnounceBenchmarks = { "announce", AnnounceParse_check, benchmarks };
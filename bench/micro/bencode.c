@@ -0,0 +1,190 @@
+// Writing the buffered parts of announce, scrape and error replies with
+// the bencode writer, against the printf path it replaced, which
+// measured everything with one snprintf and then formatted it all again.
+
+#include <limits.h> // LLONG_MAX
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "microbench.h"
+#include "../../src/Bencode.h"
+
+// AnnounceInterval, as the tracker has it.
+#define Interval 1800
+#define HashLength 20
+// Room for the biggest reply below.
+#define ReplySize 1024
+
+typedef struct {
+	long long complete, incomplete;
+	// the peers themselves are sent from where they are, so only their
+	// lengths get formatted.
+	size_t peers, peers6;
+} ReplyCounts;
+
+// Swarms the way they tend to look: mostly small, a few big ones.
+static const ReplyCounts counts[] = {
+	{ 0, 1, 0, 0 },
+	{ 3, 12, 72, 0 },
+	{ 1, 0, 0, 18 },
+	{ 148, 2031, 300, 360 },
+	{ 12, 9, 54, 90 },
+	{ 54811, 1203, 300, 0 },
+	{ 7, 99, 300, 900 },
+	{ 2, 4, 36, 36 },
+};
+#define CountsCount (sizeof(counts) / sizeof(*counts))
+
+// Only checked, not timed.
+static const ReplyCounts checkCounts[] = {
+	{ 0, 0, 0, 0 }, { 9, 10, 99, 100 }, { 999, 1000, 9999, 10000 }, { 99999, 100000, 999999, 1000000 },
+	{ -1, -10, 1, 10 }, { LLONG_MAX - 2, LLONG_MIN, 123456789, 987654321 }, { LLONG_MIN + 1, -9999, 18, 6 },
+};
+#define CheckCountsCount (sizeof(checkCounts) / sizeof(*checkCounts))
+
+static const char hash[HashLength + 1] = "\x12\x34\x56\x78\x9a\xbc\xde\xf0\x12\x34\x56\x78\x9a\xbc\xde\xf0\x12\x34\x56\x78";
+static const char errorMessage[] = "Invalid announce request.";
+
+// StringBuffer_safeSprintf, without the buffer.
+static int Reference_safeSprintf( char *out, const char *format, ... ) {
+	va_list args, args2;
+	va_start( args, format );
+	va_copy( args2, args );
+	int length = vsnprintf( NULL, 0, format, args );
+	va_end( args );
+	vsnprintf( out, length + 1, format, args2 );
+	va_end( args2 );
+	return length;
+}
+
+// Every reply below writes one announce, a scrape of three files and an
+// error, one after the other, and returns how long all of it came to.
+static size_t Reference_write( char *out, const ReplyCounts *reply ) {
+	char *start = out;
+
+	char head[128], tail[32];
+	int headLength = snprintf( head, sizeof(head), "d8:completei%llde10:incompletei%llde8:intervali%de5:peers%zu:", reply->complete, reply->incomplete, Interval, reply->peers );
+	int tailLength = snprintf( tail, sizeof(tail), "6:peers6%zu:", reply->peers6 );
+	size_t length = headLength + reply->peers + tailLength + reply->peers6 + 1;
+	out += Reference_safeSprintf( out, "%zu\r\n\r\n%s", length, head );
+	memcpy( out, tail, tailLength );
+	out += tailLength;
+
+	#define ScrapeFileFormat "d8:completei%llde10:downloadedi0e10:incompletei%lldee"
+	length = 9 + 2;
+	for ( int file = 0; file < 3; file++ )
+		length += 3 + 20 + snprintf( NULL, 0, ScrapeFileFormat, reply->complete + file, reply->incomplete );
+	out += Reference_safeSprintf( out, "%zu\r\n\r\n", length );
+	memcpy( out, "d5:filesd", 9 );
+	out += 9;
+	for ( int file = 0; file < 3; file++ ) {
+		memcpy( out, "20:", 3 );
+		memcpy( out + 3, hash, HashLength );
+		out += 3 + HashLength;
+		out += Reference_safeSprintf( out, ScrapeFileFormat, reply->complete + file, reply->incomplete );
+	}
+	memcpy( out, "ee", 2 );
+	out += 2;
+	#undef ScrapeFileFormat
+
+	#define ErrorFormat "d14:failure reason%lu:%se"
+	int errorLength = snprintf( NULL, 0, ErrorFormat, (unsigned long)strlen( errorMessage ), errorMessage );
+	out += Reference_safeSprintf( out, "%u\r\n\r\n" ErrorFormat, errorLength, (unsigned long)strlen( errorMessage ), errorMessage );
+	#undef ErrorFormat
+
+	return out - start;
+}
+
+static size_t Current_write( char *out, const ReplyCounts *reply ) {
+	char *start = out;
+
+	size_t head = Bencode_literalLength( "d" )
+		+ Bencode_keyLength( "complete" ) + Bencode_integerLength( reply->complete )
+		+ Bencode_keyLength( "incomplete" ) + Bencode_integerLength( reply->incomplete )
+		+ Bencode_keyLength( "interval" ) + Bencode_integerLength( Interval )
+		+ Bencode_keyLength( "peers" ) + Bencode_decimalLength( reply->peers ) + 1;
+	size_t tail = Bencode_keyLength( "peers6" ) + Bencode_decimalLength( reply->peers6 ) + 1;
+	out = Bencode_writeContentLength( out, head + reply->peers + tail + reply->peers6 + 1 );
+	out = Bencode_writeLiteral( out, "d" );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "complete" ), reply->complete );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "incomplete" ), reply->incomplete );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "interval" ), Interval );
+	out = Bencode_writeStringHeader( Bencode_writeKey( out, "peers" ), reply->peers );
+	out = Bencode_writeStringHeader( Bencode_writeKey( out, "peers6" ), reply->peers6 );
+
+	size_t length = Bencode_literalLength( "d" ) + Bencode_keyLength( "files" ) + Bencode_literalLength( "d" ) + Bencode_literalLength( "ee" );
+	for ( int file = 0; file < 3; file++ )
+		length += Bencode_stringLength( HashLength ) + Bencode_literalLength( "d" )
+			+ Bencode_keyLength( "complete" ) + Bencode_integerLength( reply->complete + file )
+			+ Bencode_keyLength( "downloaded" ) + Bencode_integerLength( 0 )
+			+ Bencode_keyLength( "incomplete" ) + Bencode_integerLength( reply->incomplete )
+			+ Bencode_literalLength( "e" );
+	out = Bencode_writeContentLength( out, length );
+	out = Bencode_writeLiteral( Bencode_writeKey( Bencode_writeLiteral( out, "d" ), "files" ), "d" );
+	for ( int file = 0; file < 3; file++ ) {
+		out = Bencode_writeLiteral( Bencode_writeString( out, hash, HashLength ), "d" );
+		out = Bencode_writeInteger( Bencode_writeKey( out, "complete" ), reply->complete + file );
+		out = Bencode_writeInteger( Bencode_writeKey( out, "downloaded" ), 0 );
+		out = Bencode_writeInteger( Bencode_writeKey( out, "incomplete" ), reply->incomplete );
+		out = Bencode_writeLiteral( out, "e" );
+	}
+	out = Bencode_writeLiteral( out, "ee" );
+
+	size_t messageLength = Bencode_literalLength( errorMessage );
+	length = Bencode_literalLength( "d" ) + Bencode_keyLength( "failure reason" ) + Bencode_stringLength( messageLength ) + Bencode_literalLength( "e" );
+	out = Bencode_writeContentLength( out, length );
+	out = Bencode_writeKey( Bencode_writeLiteral( out, "d" ), "failure reason" );
+	out = Bencode_writeLiteral( Bencode_writeString( out, errorMessage, messageLength ), "e" );
+
+	return out - start;
+}
+
+typedef size_t (ReplyWriter)( char *out, const ReplyCounts *reply );
+
+static uint64_t ReplyWrite_run( ReplyWriter *writer, size_t iterations ) {
+	uint64_t result = 0;
+	char out[ReplySize];
+	for ( size_t i = 0; i < iterations; i++ ) {
+		size_t length = writer( out, &counts[i % CountsCount] );
+		result = result * 31 + length;
+		result = result * 31 + (unsigned char)out[length / 2];
+	}
+	return result;
+}
+
+static uint64_t ReplyWrite_reference( size_t iterations ) {
+	return ReplyWrite_run( Reference_write, iterations );
+}
+
+static uint64_t ReplyWrite_current( size_t iterations ) {
+	return ReplyWrite_run( Current_write, iterations );
+}
+
+static int ReplyWrite_compare( const ReplyCounts *reply ) {
+	char reference[ReplySize], current[ReplySize];
+	size_t referenceLength = Reference_write( reference, reply );
+	size_t currentLength = Current_write( current, reply );
+
+	int differs = referenceLength != currentLength || memcmp( reference, current, referenceLength );
+	if ( differs )
+		fprintf( stderr, "bencode: \"%.*s\" and \"%.*s\"\n", (int)referenceLength, reference, (int)currentLength, current );
+	return differs;
+}
+
+static int ReplyWrite_check( void ) {
+	int differs = 0;
+	for ( size_t i = 0; i < CountsCount; i++ )
+		differs |= ReplyWrite_compare( &counts[i] );
+	for ( size_t i = 0; i < CheckCountsCount; i++ )
+		differs |= ReplyWrite_compare( &checkCounts[i] );
+	return differs;
+}
+
+static const MicroBenchmark benchmarks[] = {
+	{ "snprintf", ReplyWrite_reference },
+	{ "bencode writer", ReplyWrite_current },
+	{ NULL, NULL },
+};
+
+const MicroBenchmarkGroup BencodeBenchmarks = { "bencode", ReplyWrite_check, benchmarks };
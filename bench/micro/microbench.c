@@ -0,0 +1,106 @@
+// Times small pieces of the tracker in a loop, each against the code it
+// replaced, so a change to a hot path can show what it's worth without
+// a tracker and a load generator in the way.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // getopt
+
+#include "microbench.h"
+
+#define DefaultIterations 1000000
+// The best of this many runs is reported, which is the one least
+// disturbed by everything else on the machine.
+#define Runs 5
+
+static const MicroBenchmarkGroup *groups[] = {
+	&AnnounceBenchmarks,
+	&AddressBenchmarks,
+	&BencodeBenchmarks,
+};
+#define GroupCount (sizeof(groups) / sizeof(*groups))
+
+// keeps the results of every run alive.
+static volatile uint64_t sink;
+
+static uint64_t now( void ) {
+	struct timespec time;
+	clock_gettime( CLOCK_MONOTONIC, &time );
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// In nanoseconds per iteration.
+static double MicroBenchmark_time( const MicroBenchmark *benchmark, size_t iterations ) {
+	sink += benchmark->run( iterations / 10 + 1 );
+
+	double best = 0;
+	for ( int run = 0; run < Runs; run++ ) {
+		uint64_t start = now();
+		sink += benchmark->run( iterations );
+		double elapsed = (double)(now() - start) / iterations;
+		if ( !run || elapsed < best )
+			best = elapsed;
+	}
+	return best;
+}
+
+static int MicroBenchmarkGroup_run( const MicroBenchmarkGroup *group, size_t iterations ) {
+	if ( group->check && group->check() ) {
+		fprintf( stderr, "%s: the benchmarks disagree, not timing them.\n", group->name );
+		return 1;
+	}
+
+	printf( "%s\n", group->name );
+	double baseline = 0;
+	for ( const MicroBenchmark *benchmark = group->benchmarks; benchmark->name; benchmark++ ) {
+		double elapsed = MicroBenchmark_time( benchmark, iterations );
+		if ( benchmark == group->benchmarks ) {
+			baseline = elapsed;
+			printf( "  %-24s %10.1f ns/op\n", benchmark->name, elapsed );
+		} else
+			printf( "  %-24s %10.1f ns/op %8.2fx\n", benchmark->name, elapsed, baseline / elapsed );
+	}
+	return 0;
+}
+
+static void usage( const char *name ) {
+	fprintf( stderr,
+		"Usage: %s [-n iterations] [group ...]\n"
+		"  -n  iterations per run (default %d)\n"
+		"Runs every group unless some are named:\n", name, DefaultIterations );
+	for ( size_t i = 0; i < GroupCount; i++ )
+		fprintf( stderr, "  %s\n", groups[i]->name );
+}
+
+int main( int argc, char **argv ) {
+	size_t iterations = DefaultIterations;
+	int option;
+	while ( (option = getopt( argc, argv, "n:" )) != -1 ) {
+		switch ( option ) {
+			case 'n':
+				iterations = strtoul( optarg, NULL, 10 );
+				break;
+			default:
+				usage( argv[0] );
+				return 1;
+		}
+	}
+	if ( iterations < 1 ) {
+		usage( argv[0] );
+		return 1;
+	}
+
+	int status = 0;
+	for ( size_t i = 0; i < GroupCount; i++ ) {
+		bool wanted = optind == argc;
+		for ( int arg = optind; arg < argc; arg++ )
+			if ( !strcmp( argv[arg], groups[i]->name ) )
+				wanted = true;
+		if ( wanted )
+			status |= MicroBenchmarkGroup_run( groups[i], iterations );
+	}
+	return status;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+#include "../../src/CompactAddress.h"
+
+typedef struct _MicroBenchmark MicroBenchmark;
+typedef struct _MicroBenchmarkGroup MicroBenchmarkGroup;
+
+// Does whatever is being measured iterations times. The result is
+// something that depends on all the work done, so none of it can be
+// optimized away.
+typedef uint64_t (MicroBenchmarkRun)( size_t iterations );
+// Makes sure everything in a group gives the same answers before any of
+// it is timed. 0 when they do.
+typedef int (MicroBenchmarkCheck)( void );
+
+struct _MicroBenchmark {
+	const char *name;
+	MicroBenchmarkRun *run;
+};
+
+// The first benchmark of a group is the baseline the rest are compared
+// to. benchmarks ends with an empty entry.
+struct _MicroBenchmarkGroup {
+	const char *name;
+	MicroBenchmarkCheck *check;
+	const MicroBenchmark *benchmarks;
+};
+
+extern const MicroBenchmarkGroup AnnounceBenchmarks;
+extern const MicroBenchmarkGroup AddressBenchmarks;
+extern const MicroBenchmarkGroup BencodeBenchmarks;
+
+// CompactAddress_fromString as it was, on getaddrinfo, which the old
+// announce parser needs too. port can be NULL.
+CompactError Reference_compactFromString( char *compact, const char *address, const char *port );
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+
+#include "Arena.h"
+#include "dbg.h"
+
+// Enough for anything that's put in an arena: integers, pointers and
+// character arrays.
+#define ArenaAlignment 16
+#define ArenaAlign( size ) (((size) + ArenaAlignment - 1) & ~(size_t)(ArenaAlignment - 1))
+
+typedef struct _ArenaOverflow ArenaOverflow;
+
+// the data follows the header.
+struct _ArenaOverflow {
+	ArenaOverflow *next;
+};
+#define ArenaOverflowData( overflow ) ((char *)(overflow) + ArenaAlign( sizeof(ArenaOverflow) ))
+
+struct _Arena {
+	char *data;
+	size_t size;
+	size_t used;
+	ArenaOverflow *overflow;
+	size_t overflowCount;
+};
+
+Arena *Arena_new( size_t size ) {
+	Arena *arena = malloc( sizeof(*arena) );
+	if ( !arena ) goto badArena;
+
+	arena->size = ArenaAlign( size );
+	arena->data = malloc( arena->size );
+	if ( !arena->data ) goto badData;
+
+	arena->used = 0;
+	arena->overflow = NULL;
+	arena->overflowCount = 0;
+	return arena;
+
+badData:
+	free( arena );
+badArena:
+	return NULL;
+}
+
+void Arena_free( Arena *arena ) {
+	if ( !arena ) return;
+
+	Arena_reset( arena );
+	free( arena->data );
+	free( arena );
+}
+
+void *Arena_alloc( Arena *arena, size_t size ) {
+	size = ArenaAlign( size );
+	if ( size <= arena->size - arena->used ) {
+		void *memory = arena->data + arena->used;
+		arena->used += size;
+		return memory;
+	}
+
+	dbg_info( "Arena overflow: %zu bytes", size );
+	ArenaOverflow *overflow = malloc( ArenaAlign( sizeof(*overflow) ) + size );
+	if ( !overflow ) return NULL;
+
+	overflow->next = arena->overflow;
+	arena->overflow = overflow;
+	arena->overflowCount++;
+	return ArenaOverflowData( overflow );
+}
+
+size_t Arena_reset( Arena *arena ) {
+	while ( arena->overflow ) {
+		ArenaOverflow *next = arena->overflow->next;
+		free( arena->overflow );
+		arena->overflow = next;
+	}
+
+	size_t overflowCount = arena->overflowCount;
+	arena->used = 0;
+	arena->overflowCount = 0;
+	return overflowCount;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h> // size_t
+
+typedef struct _Arena Arena;
+
+// A bump allocator for state that only lives as long as one request.
+// Nothing allocated from it is freed individually: Arena_reset throws
+// everything away at once, and keeps the arena's own block around for
+// the next request. Allocations that don't fit in the block get a
+// block of their own, which is released by the next reset.
+Arena *Arena_new( size_t size );
+void Arena_free( Arena *arena );
+void *Arena_alloc( Arena *arena, size_t size );
+// Returns how many allocations didn't fit since the last reset.
+size_t Arena_reset( Arena *arena );
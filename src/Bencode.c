@@ -0,0 +1,72 @@
+#include "Bencode.h"
+
+// Every pair of digits, so numbers are written two digits per division.
+static const char DigitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Negating LLONG_MIN as a long long overflows.
+static unsigned long long Bencode_magnitude( long long value ) {
+	return value < 0? 0ULL - (unsigned long long)value: (unsigned long long)value;
+}
+
+size_t Bencode_integerLength( long long value ) {
+	return (value < 0) + Bencode_decimalLength( Bencode_magnitude( value ) ) + 2;
+}
+
+size_t Bencode_stringLength( size_t length ) {
+	return Bencode_decimalLength( length ) + 1 + length;
+}
+
+size_t Bencode_contentLengthLength( size_t length ) {
+	return Bencode_decimalLength( length ) + 4;
+}
+
+// Back to front, since the length is known before the digits are.
+char *Bencode_writeDecimal( char *out, unsigned long long value ) {
+	char *end = out + Bencode_decimalLength( value ), *digit = end;
+	while ( value >= 100 ) {
+		const char *pair = DigitPairs + (value % 100) * 2;
+		value /= 100;
+		*--digit = pair[1];
+		*--digit = pair[0];
+	}
+	if ( value >= 10 ) {
+		const char *pair = DigitPairs + value * 2;
+		*--digit = pair[1];
+		*--digit = pair[0];
+	} else
+		*--digit = '0' + value;
+	return end;
+}
+
+char *Bencode_writeInteger( char *out, long long value ) {
+	*out++ = 'i';
+	if ( value < 0 )
+		*out++ = '-';
+	out = Bencode_writeDecimal( out, Bencode_magnitude( value ) );
+	*out++ = 'e';
+	return out;
+}
+
+char *Bencode_writeStringHeader( char *out, size_t length ) {
+	out = Bencode_writeDecimal( out, length );
+	*out++ = ':';
+	return out;
+}
+
+char *Bencode_writeString( char *out, const char *string, size_t length ) {
+	return Bencode_writeBytes( Bencode_writeStringHeader( out, length ), string, length );
+}
+
+char *Bencode_writeContentLength( char *out, size_t length ) {
+	return Bencode_writeLiteral( Bencode_writeDecimal( out, length ), "\r\n\r\n" );
+}
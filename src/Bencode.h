@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <string.h> // memcpy
+
+// Bencode for replies, written straight into memory that's already big
+// enough. Everything a reply is made of can be measured without
+// formatting it, so a reply is measured first, its Content-Length goes
+// out ahead of it, and its buffer grows at most once, before any of it
+// is written. Every writer returns the end of what it wrote.
+
+// Literals and keys are sized when they're compiled, so
+// Bencode_writeKey( out, "complete" ) writes 8:complete without
+// counting anything.
+#define Bencode_literalLength( literal ) (sizeof(literal) - 1)
+#define Bencode_keyLength( key ) (Bencode_decimalLength( Bencode_literalLength( key ) ) + 1 + Bencode_literalLength( key ))
+#define Bencode_writeLiteral( out, literal ) Bencode_writeBytes( out, literal, Bencode_literalLength( literal ) )
+#define Bencode_writeKey( out, key ) Bencode_writeString( out, key, Bencode_literalLength( key ) )
+
+static inline size_t Bencode_decimalLength( unsigned long long value ) {
+	size_t length = 1;
+	for ( ;; ) {
+		if ( value < 10 ) return length;
+		if ( value < 100 ) return length + 1;
+		if ( value < 1000 ) return length + 2;
+		if ( value < 10000 ) return length + 3;
+		value /= 10000;
+		length += 4;
+	}
+}
+
+static inline char *Bencode_writeBytes( char *out, const char *bytes, size_t length ) {
+	memcpy( out, bytes, length );
+	return out + length;
+}
+
+// i<value>e
+size_t Bencode_integerLength( long long value );
+// <length>:<string>
+size_t Bencode_stringLength( size_t length );
+// <length>\r\n\r\n, which finishes off a header that ends in
+// Content-Length:.
+size_t Bencode_contentLengthLength( size_t length );
+
+char *Bencode_writeDecimal( char *out, unsigned long long value );
+char *Bencode_writeInteger( char *out, long long value );
+// Just the <length>: in front of a string, for one that's sent from
+// somewhere else.
+char *Bencode_writeStringHeader( char *out, size_t length );
+char *Bencode_writeString( char *out, const char *string, size_t length );
+char *Bencode_writeContentLength( char *out, size_t length );
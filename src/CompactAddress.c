@@ -1,11 +1,52 @@
-// #include <netinet/in.h> // struct sockaddr
-#include <netdb.h>  // getaddrinfo
+#include <arpa/inet.h>  // htons
+#include <netinet/in.h> // sockaddr_in, sockaddr_in6
 #include <string.h> // memcpy
 #include <stdint.h>
 
 #include "CompactAddress.h"
 #include "dbg.h"
 
+typedef struct _Bogon Bogon;
+
+struct _Bogon {
+	uint8_t prefix[16];
+	int bits;
+};
+
+static const Bogon ipv4Bogons[] = {
+	{ {   0 },          8 }, // this network
+	{ {  10 },          8 }, // private
+	{ { 100,  64 },    10 }, // carrier-grade NAT
+	{ { 127 },          8 }, // loopback
+	{ { 169, 254 },    16 }, // link-local
+	{ { 172,  16 },    12 }, // private
+	{ { 192,   0,   0 }, 24 }, // protocol assignments
+	{ { 192,   0,   2 }, 24 }, // documentation
+	{ { 192, 168 },    16 }, // private
+	{ { 198,  18 },    15 }, // benchmarking
+	{ { 198,  51, 100 }, 24 }, // documentation
+	{ { 203,   0, 113 }, 24 }, // documentation
+	{ { 224 },          4 }, // multicast
+	{ { 240 },          4 }, // reserved, and broadcast
+};
+
+static const Bogon ipv6Bogons[] = {
+	{ { 0 },                     128 }, // unspecified
+	{ { [15] = 1 },              128 }, // loopback
+	{ { 0x01, 0x00 },             64 }, // discard
+	{ { 0x20, 0x01, 0x0d, 0xb8 }, 32 }, // documentation
+	{ { 0xfc },                    7 }, // unique local
+	{ { 0xfe, 0x80 },             10 }, // link-local
+	{ { 0xff },                    8 }, // multicast
+};
+
+// ::ffff:0:0/96, which is judged by the IPv4 address in its last 4 bytes.
+static const Bogon mappedIPv4 = { { [10] = 0xff, [11] = 0xff }, 96 };
+
+#define BogonCount( list ) (sizeof(list) / sizeof(*list))
+
+static bool rejectBogons = false;
+
 void CompactAddress_init( char *compact ) {
 	memset( compact, 0, CompactAddress_Size );
 }
@@ -40,9 +81,62 @@ CompactError CompactAddress_setPort( char *compact, uint16_t port ) {
 	return 0;
 }
 
+void CompactAddress_setRejectBogons( bool reject ) {
+	rejectBogons = reject;
+}
+
+static bool Bogon_matches( const Bogon *bogon, const uint8_t *address ) {
+	int bytes = bogon->bits / 8, bits = bogon->bits % 8;
+	if ( memcmp( address, bogon->prefix, bytes ) )
+		return false;
+	if ( !bits )
+		return true;
+	uint8_t mask = 0xff << (8 - bits);
+	return (address[bytes] & mask) == bogon->prefix[bytes];
+}
+
+static bool isBogon( int family, const uint8_t *address ) {
+	const Bogon *list = ipv4Bogons;
+	size_t count = BogonCount( ipv4Bogons );
+	if ( family == CompactAddress_IPv6Flag ) {
+		if ( Bogon_matches( &mappedIPv4, address ) )
+			return isBogon( CompactAddress_IPv4Flag, address + 12 );
+		list = ipv6Bogons;
+		count = BogonCount( ipv6Bogons );
+	}
+
+	for ( size_t i = 0; i < count; i++ )
+		if ( Bogon_matches( list + i, address ) )
+			return true;
+	return false;
+}
+
+bool CompactAddress_isRejected( int family, const uint8_t *address ) {
+	return rejectBogons && isBogon( family, address );
+}
+
+bool CompactAddress_socketIsIPv4( const struct sockaddr_storage *socket ) {
+	return socket->ss_family == AF_INET || (socket->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED( &((struct sockaddr_in6*)socket)->sin6_addr ));
+}
+
 CompactError CompactAddress_fromSocket( char *compact, struct sockaddr_storage *socket, bool hasPort ) {
+	// a dual-stack socket hands IPv4 clients over as mapped addresses,
+	// which are stored as the IPv4 addresses they are.
+	if ( socket->ss_family == AF_INET6 && CompactAddress_socketIsIPv4( socket ) ) {
+		struct sockaddr_in6 *mapped = (struct sockaddr_in6*)socket;
+		if ( CompactAddress_isRejected( CompactAddress_IPv4Flag, mapped->sin6_addr.s6_addr + 12 ) )
+			return CompactError_rejectedAddress;
+		memcpy( compact + CompactAddress_IPv4AddressOffset, mapped->sin6_addr.s6_addr + 12, 4 );
+		if ( hasPort )
+			memcpy( compact + CompactAddress_IPv4PortOffset, &mapped->sin6_port, 2 );
+		compact[0] |= CompactAddress_IPv4Flag;
+		return CompactError_okay;
+	}
+
 	switch ( socket->ss_family ) {
 		case AF_INET: {
+			if ( CompactAddress_isRejected( CompactAddress_IPv4Flag, (uint8_t*)&((struct sockaddr_in*)socket)->sin_addr ) )
+				return CompactError_rejectedAddress;
 			dbg_info( "fromSocket: %08X", ntohl(((struct sockaddr_in*)socket)->sin_addr.s_addr) );
 			memcpy( compact + CompactAddress_IPv4AddressOffset, &((struct sockaddr_in*)socket)->sin_addr, 4 );
 			if ( hasPort )
@@ -55,6 +149,8 @@ CompactError CompactAddress_fromSocket( char *compact, struct sockaddr_storage *
 #define dumb(x) ntohs(*(uint16_t*)(x + 0)), ntohs(*(uint16_t*)(x + 2)), ntohs(*(uint16_t*)(x + 4)), ntohs(*(uint16_t*)(x + 6)), ntohs(*(uint16_t*)(x + 8)), ntohs(*(uint16_t*)(x + 10)), ntohs(*(uint16_t*)(x + 12)), ntohs(*(uint16_t*)(x + 14))
 			dbg_info( "fromSocket: %04X:%04X:%04X:%04X:%04X:%04X:%04X:%04X", dumb(((struct sockaddr_in6*)socket)->sin6_addr.s6_addr) );
 #undef dumb
+			if ( CompactAddress_isRejected( CompactAddress_IPv6Flag, ((struct sockaddr_in6*)socket)->sin6_addr.s6_addr ) )
+				return CompactError_rejectedAddress;
 			memcpy( compact + CompactAddress_IPv6AddressOffset, &((struct sockaddr_in6*)socket)->sin6_addr, 16 );
 			if ( hasPort )
 				memcpy( compact + CompactAddress_IPv6PortOffset , &((struct sockaddr_in6*)socket)->sin6_port,  2 );
@@ -70,22 +166,160 @@ CompactError CompactAddress_fromSocket( char *compact, struct sockaddr_storage *
 	return CompactError_okay;
 }
 
-CompactError CompactAddress_fromString( char *compact, const char *address, const char *port ) {
-	CompactError status;
-	struct addrinfo hints, *res;
-	memset( &hints, 0, sizeof(hints) );
-	// OS X manpage says PF_UNSPEC but linux says AF_UNSPEC. PF_UNSPEC is
-	// defined as AF_UNSPEC on OS X, so we'll just use that. They're both
-	// defined as 0.
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_flags = AI_NUMERICHOST;
-	// uv_getaddrinfo is async. If hostname lookup is ever implemented,
-	// this will probably need to be switched.
-	int e = getaddrinfo( address, port, &hints, &res );
-	if ( e )
-		return CompactError_getaddrinfoFailed;
-
-	status = CompactAddress_fromSocket( compact, (struct sockaddr_storage *)res->ai_addr, port != NULL );
-	freeaddrinfo( res );
-	return status;
+static int hexValue( char digit ) {
+	if ( digit >= '0' && digit <= '9' ) return digit - '0';
+	if ( digit >= 'a' && digit <= 'f' ) return digit - 'a' + 10;
+	if ( digit >= 'A' && digit <= 'F' ) return digit - 'A' + 10;
+	return -1;
+}
+
+// Reads a dotted quad from the start of address into 4 bytes. Gives how
+// many characters it took, or 0 if there isn't one. Like inet_pton, and
+// unlike getaddrinfo, it only takes four decimal parts without leading
+// zeros.
+static size_t parseIPv4( const char *address, size_t length, uint8_t *bytes ) {
+	size_t i = 0;
+	for ( int part = 0; part < 4; part++ ) {
+		if ( part ) {
+			if ( i >= length || address[i] != '.' ) return 0;
+			i++;
+		}
+		size_t start = i;
+		unsigned value = 0;
+		while ( i < length && i - start < 3 && address[i] >= '0' && address[i] <= '9' )
+			value = value * 10 + (address[i++] - '0');
+		if ( i == start || value > 255 || (i - start > 1 && address[start] == '0') ) return 0;
+		bytes[part] = value;
+	}
+	return i;
+}
+
+// Reads an IPv6 address from the start of address into 16 bytes, the
+// same way as parseIPv4. It can end in a dotted quad.
+static size_t parseIPv6( const char *address, size_t length, uint8_t *bytes ) {
+	uint8_t groups[16];
+	size_t i = 0, filled = 0;
+	// where the :: goes, in bytes, or -1 if there isn't one.
+	int gap = -1;
+	// only right after a :: is it fine for the address to stop.
+	bool afterGap = false;
+	if ( length >= 2 && address[0] == ':' && address[1] == ':' ) {
+		gap = 0;
+		afterGap = true;
+		i = 2;
+	}
+
+	while ( filled < 16 ) {
+		size_t start = i;
+		unsigned value = 0;
+		int digit;
+		while ( i < length && i - start < 4 && (digit = hexValue( address[i] )) >= 0 ) {
+			value = value << 4 | digit;
+			i++;
+		}
+		if ( i == start ) {
+			if ( !afterGap ) return 0;
+			break;
+		}
+
+		if ( i < length && address[i] == '.' ) {
+			size_t used = filled <= 12? parseIPv4( address + start, length - start, groups + filled ): 0;
+			if ( !used ) return 0;
+			filled += 4;
+			i = start + used;
+			break;
+		}
+
+		groups[filled++] = value >> 8;
+		groups[filled++] = value & 0xff;
+		if ( filled == 16 || i >= length || address[i] != ':' )
+			break;
+
+		if ( i + 1 < length && address[i + 1] == ':' ) {
+			if ( gap >= 0 ) return 0;
+			gap = filled;
+			afterGap = true;
+			i += 2;
+		} else {
+			afterGap = false;
+			i++;
+		}
+	}
+
+	if ( gap < 0 ) {
+		if ( filled != 16 ) return 0;
+		memcpy( bytes, groups, 16 );
+	} else {
+		// :: has to stand for at least one group.
+		if ( filled == 16 ) return 0;
+		size_t tail = filled - gap;
+		memcpy( bytes, groups, gap );
+		memset( bytes + gap, 0, 16 - filled );
+		memcpy( bytes + 16 - tail, groups + gap, tail );
+	}
+	return i;
+}
+
+// Reads port, everything after the colon, which has to be 1 through
+// 65535. Gives it in network byte order, or 0 if it's no good.
+static uint16_t parsePort( const char *port, size_t length ) {
+	if ( length < 1 || length > 5 ) return 0;
+	uint32_t value = 0;
+	for ( size_t i = 0; i < length; i++ ) {
+		if ( port[i] < '0' || port[i] > '9' ) return 0;
+		value = value * 10 + (port[i] - '0');
+	}
+	return value > 65535? 0: htons( value );
+}
+
+// port is in network byte order, and 0 when there wasn't one.
+static CompactError CompactAddress_set( char *compact, int family, const uint8_t *address, uint16_t port ) {
+	if ( CompactAddress_isRejected( family, address ) )
+		return CompactError_rejectedAddress;
+
+	if ( family == CompactAddress_IPv4Flag ) {
+		memcpy( compact + CompactAddress_IPv4AddressOffset, address, 4 );
+		if ( port ) {
+			memcpy( compact + CompactAddress_IPv4PortOffset, &port, 2 );
+			compact[0] |= CompactAddress_IPv4PortFlag;
+		}
+	} else {
+		memcpy( compact + CompactAddress_IPv6AddressOffset, address, 16 );
+		if ( port ) {
+			memcpy( compact + CompactAddress_IPv6PortOffset, &port, 2 );
+			compact[0] |= CompactAddress_IPv6PortFlag;
+		}
+	}
+	compact[0] |= family;
+	return CompactError_okay;
+}
+
+CompactError CompactAddress_fromString( char *compact, const char *address, size_t length, int families ) {
+	uint8_t bytes[16];
+	uint16_t port = 0;
+	size_t used;
+	if ( (families & CompactAddress_IPv4Flag) && (used = parseIPv4( address, length, bytes )) ) {
+		if ( used < length && (address[used] != ':' || !(port = parsePort( address + used + 1, length - used - 1 ))) )
+			return CompactError_malformedAddress;
+		return CompactAddress_set( compact, CompactAddress_IPv4Flag, bytes, port );
+	}
+
+	if ( !(families & CompactAddress_IPv6Flag) || !length )
+		return CompactError_malformedAddress;
+
+	if ( address[0] == '[' ) {
+		used = parseIPv6( address + 1, length - 1, bytes );
+		if ( !used || used + 1 >= length || address[used + 1] != ']' )
+			return CompactError_malformedAddress;
+		used += 2;
+		if ( used < length && (address[used] != ':' || !(port = parsePort( address + used + 1, length - used - 1 ))) )
+			return CompactError_malformedAddress;
+	} else if ( parseIPv6( address, length, bytes ) != length )
+		return CompactError_malformedAddress;
+
+	// Stored as the IPv4 address it is, like a mapped address from a
+	// socket, so a peer lands in the same family however it's named.
+	if ( (families & CompactAddress_IPv4Flag) && Bogon_matches( &mappedIPv4, bytes ) )
+		return CompactAddress_set( compact, CompactAddress_IPv4Flag, bytes + 12, port );
+	return CompactAddress_set( compact, CompactAddress_IPv6Flag, bytes, port );
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
 #include <sys/socket.h> // sockaddr_storage
 
 #define CompactAddress_IPv4Flag     1
@@ -32,12 +34,34 @@ typedef enum _CompactError CompactError;
 enum _CompactError {
 	CompactError_okay = 0,
 	CompactError_unknownAddressFamily,
-	CompactError_getaddrinfoFailed,
+	CompactError_malformedAddress,
 	CompactError_getpeernameFailed,
+	// in the reject list, and left out of compact.
+	CompactError_rejectedAddress,
 };
 
 void CompactAddress_init( char *compact );
 void CompactAddress_dump( char *compact );
 CompactError CompactAddress_setPort( char *compact, uint16_t port );
-CompactError CompactAddress_fromString( char *compact, const char *address, const char *port );
+// Reads a numeric address of one of the families in the families mask
+// (CompactAddress_IPv4Flag and CompactAddress_IPv6Flag): a.b.c.d or
+// a.b.c.d:port, or an IPv6 address, bare, in brackets or as [v6]:port.
+// A port sets that family's port flag. An IPv4-mapped IPv6 address is
+// read as IPv4 when the mask allows it, the same as from a socket.
+// compact is only written to when the whole of address is good. Nothing
+// is allocated.
+CompactError CompactAddress_fromString( char *compact, const char *address, size_t length, int families );
+// An IPv4-mapped IPv6 address, from a dual-stack socket, comes out as
+// IPv4.
 CompactError CompactAddress_fromSocket( char *compact, struct sockaddr_storage *socket, bool hasPort );
+// Whether socket is IPv4, including mapped into IPv6.
+bool CompactAddress_socketIsIPv4( const struct sockaddr_storage *socket );
+// Turns the reject list on or off for every thread. It covers private,
+// loopback, link-local, multicast, documentation and other addresses
+// nobody could connect to from the internet, and when it's on,
+// CompactAddress_fromString and CompactAddress_fromSocket refuse them.
+// Off to start with, and only meant to be set before the workers start.
+void CompactAddress_setRejectBogons( bool reject );
+// Whether the reject list is on and has address, which is 4 bytes for
+// CompactAddress_IPv4Flag and 16 for CompactAddress_IPv6Flag.
+bool CompactAddress_isRejected( int family, const uint8_t *address );
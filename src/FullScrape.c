@@ -0,0 +1,318 @@
+#include <stdio.h>  // fopen, rename
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "FullScrape.h"
+#include "Bencode.h"
+#include "Scrape.h"
+#include "dbg.h"
+
+#define InfoHashSize 20
+#define InitialCapacity 4096
+
+typedef struct _FullScrapeEntry FullScrapeEntry;
+
+struct _FullScrapeEntry {
+	char infoHash[InfoHashSize];
+	long long complete, incomplete;
+};
+
+struct _FullScrape {
+	// where each snapshot is also written, gzipped, or NULL.
+	char *path;
+	uv_mutex_t lock;
+	// signalled when a build comes back from the threadpool.
+	uv_cond_t finished;
+	FullScrapeSnapshot *current;
+	FullScrapeStats stats;
+
+	// The build in progress, which belongs to the loop that walks the
+	// swarms until it's finished, and then to the threadpool.
+	FullScrapeEntry *entries;
+	size_t count, capacity;
+	uint64_t started;
+	// From begin until it's published or abandoned, and while it's on the
+	// threadpool, both guarded by the lock.
+	bool building;
+	bool finishing;
+	uv_work_t work;
+};
+
+FullScrape *FullScrape_new( const char *path ) {
+	FullScrape *scrape = calloc( 1, sizeof(*scrape) );
+	if ( !scrape ) goto badScrape;
+
+	if ( path ) {
+		scrape->path = strdup( path );
+		if ( !scrape->path ) goto badPath;
+	}
+
+	scrape->entries = malloc( InitialCapacity * sizeof(*scrape->entries) );
+	if ( !scrape->entries ) goto badEntries;
+	scrape->capacity = InitialCapacity;
+
+	if ( uv_mutex_init( &scrape->lock ) ) goto badLock;
+	if ( uv_cond_init( &scrape->finished ) ) goto badCond;
+
+	scrape->work.data = scrape;
+	return scrape;
+
+badCond:
+	uv_mutex_destroy( &scrape->lock );
+badLock:
+	free( scrape->entries );
+badEntries:
+	free( scrape->path );
+badPath:
+	free( scrape );
+badScrape:
+	return NULL;
+}
+
+static void FullScrapeSnapshot_free( FullScrapeSnapshot *snapshot ) {
+	if ( !snapshot ) return;
+
+	free( snapshot->plain );
+	free( snapshot->gzip );
+	free( snapshot );
+}
+
+void FullScrape_free( FullScrape *scrape ) {
+	if ( !scrape ) return;
+
+	uv_mutex_lock( &scrape->lock );
+	while ( scrape->finishing )
+		uv_cond_wait( &scrape->finished, &scrape->lock );
+	FullScrapeSnapshot *current = scrape->current;
+	scrape->current = NULL;
+	uv_mutex_unlock( &scrape->lock );
+
+	// Anything still being written from the current snapshot has already
+	// been cut off by now.
+	FullScrapeSnapshot_free( current );
+	uv_cond_destroy( &scrape->finished );
+	uv_mutex_destroy( &scrape->lock );
+	free( scrape->entries );
+	free( scrape->path );
+	free( scrape );
+}
+
+bool FullScrape_begin( FullScrape *scrape ) {
+	uv_mutex_lock( &scrape->lock );
+	bool busy = scrape->building;
+	scrape->building = true;
+	uv_mutex_unlock( &scrape->lock );
+	if ( busy ) return false;
+
+	scrape->count = 0;
+	scrape->started = uv_hrtime( );
+	return true;
+}
+
+int FullScrape_add( FullScrape *scrape, const char *infoHash, long long complete, long long incomplete ) {
+	if ( scrape->count == scrape->capacity ) {
+		FullScrapeEntry *entries = realloc( scrape->entries, scrape->capacity * 2 * sizeof(*entries) );
+		if ( !entries ) return 1;
+		scrape->entries = entries;
+		scrape->capacity *= 2;
+	}
+
+	FullScrapeEntry *entry = &scrape->entries[scrape->count++];
+	memcpy( entry->infoHash, infoHash, InfoHashSize );
+	entry->complete = complete;
+	entry->incomplete = incomplete;
+	return 0;
+}
+
+size_t FullScrape_count( FullScrape *scrape ) {
+	return scrape->count;
+}
+
+void FullScrape_setCounts( FullScrape *scrape, size_t position, long long complete, long long incomplete ) {
+	scrape->entries[position].complete = complete;
+	scrape->entries[position].incomplete = incomplete;
+}
+
+void FullScrape_abandon( FullScrape *scrape ) {
+	scrape->count = 0;
+	uv_mutex_lock( &scrape->lock );
+	scrape->building = false;
+	scrape->stats.failedBuilds++;
+	uv_mutex_unlock( &scrape->lock );
+}
+
+static int FullScrapeEntry_compare( const void *a, const void *b ) {
+	return memcmp( ((const FullScrapeEntry *)a)->infoHash, ((const FullScrapeEntry *)b)->infoHash, InfoHashSize );
+}
+
+// Dictionary keys have to be sorted, and a walk can turn up the same
+// torrent twice, so the entries are put in order and duplicates dropped
+// before any of them are written.
+static int FullScrape_encode( FullScrape *scrape, FullScrapeSnapshot *snapshot ) {
+	qsort( scrape->entries, scrape->count, sizeof(*scrape->entries), FullScrapeEntry_compare );
+	size_t count = 0;
+	for ( size_t i = 0; i < scrape->count; i++ ) {
+		if ( count && !FullScrapeEntry_compare( &scrape->entries[count - 1], &scrape->entries[i] ) ) continue;
+		scrape->entries[count++] = scrape->entries[i];
+	}
+	scrape->count = count;
+
+	size_t length = Bencode_literalLength( "d" ) + Bencode_keyLength( "files" ) + Bencode_literalLength( "d" ) + Bencode_literalLength( "ee" );
+	for ( size_t i = 0; i < count; i++ )
+		length += Scrape_fileLength( scrape->entries[i].complete, scrape->entries[i].incomplete );
+
+	snapshot->plain = malloc( length );
+	if ( !snapshot->plain ) return 1;
+
+	char *cursor = Bencode_writeLiteral( Bencode_writeKey( Bencode_writeLiteral( snapshot->plain, "d" ), "files" ), "d" );
+	for ( size_t i = 0; i < count; i++ )
+		cursor = Scrape_writeFile( cursor, scrape->entries[i].infoHash, scrape->entries[i].complete, scrape->entries[i].incomplete );
+	cursor = Bencode_writeLiteral( cursor, "ee" );
+	snapshot->plainSize = cursor - snapshot->plain;
+	snapshot->torrents = count;
+	return 0;
+}
+
+static int FullScrape_compress( FullScrapeSnapshot *snapshot ) {
+	z_stream stream;
+	memset( &stream, 0, sizeof(stream) );
+	// 16 more window bits asks for a gzip wrapper rather than zlib's.
+	if ( deflateInit2( &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		return 1;
+
+	size_t bound = deflateBound( &stream, snapshot->plainSize );
+	snapshot->gzip = malloc( bound );
+	if ( !snapshot->gzip ) goto badDeflate;
+
+	// Bounded, so it all goes in one call.
+	stream.next_in = (Bytef *)snapshot->plain;
+	stream.avail_in = snapshot->plainSize;
+	stream.next_out = (Bytef *)snapshot->gzip;
+	stream.avail_out = bound;
+	if ( deflate( &stream, Z_FINISH ) != Z_STREAM_END ) goto badDeflate;
+
+	snapshot->gzipSize = stream.total_out;
+	deflateEnd( &stream );
+	return 0;
+
+badDeflate:
+	deflateEnd( &stream );
+	return 1;
+}
+
+// Written beside the file and renamed over it, so whatever reads the
+// file never sees half of one.
+static void FullScrape_writeFile( FullScrape *scrape, FullScrapeSnapshot *snapshot ) {
+	size_t pathLength = strlen( scrape->path );
+	char *temporary = malloc( pathLength + sizeof(".tmp") );
+	if ( !temporary ) return;
+	memcpy( temporary, scrape->path, pathLength );
+	memcpy( temporary + pathLength, ".tmp", sizeof(".tmp") );
+
+	FILE *file = fopen( temporary, "wb" );
+	if ( !file ) {
+		fancy_perror( "fopen" );
+		goto done;
+	}
+	size_t written = fwrite( snapshot->gzip, 1, snapshot->gzipSize, file );
+	if ( fclose( file ) || written != snapshot->gzipSize ) {
+		log_warn( "Couldn't write the full scrape to %s.", temporary );
+		remove( temporary );
+		goto done;
+	}
+	if ( rename( temporary, scrape->path ) )
+		fancy_perror( "rename" );
+done:
+	free( temporary );
+}
+
+static void FullScrape_publish( FullScrape *scrape, FullScrapeSnapshot *snapshot ) {
+	uv_mutex_lock( &scrape->lock );
+	FullScrapeSnapshot *last = scrape->current;
+	if ( snapshot ) {
+		scrape->current = snapshot;
+		scrape->stats.builds++;
+		scrape->stats.torrents  = snapshot->torrents;
+		scrape->stats.plainSize = snapshot->plainSize;
+		scrape->stats.gzipSize  = snapshot->gzipSize;
+		scrape->stats.built     = snapshot->built;
+		scrape->stats.buildMS   = (uv_hrtime( ) - scrape->started) / 1000000;
+		if ( last && --last->references )
+			last = NULL;
+	} else {
+		scrape->stats.failedBuilds++;
+		last = NULL;
+	}
+	scrape->building = false;
+	scrape->finishing = false;
+	uv_cond_signal( &scrape->finished );
+	uv_mutex_unlock( &scrape->lock );
+
+	FullScrapeSnapshot_free( last );
+}
+
+// On the threadpool, which is the only thing touching the entries until
+// the snapshot is published.
+static void FullScrape_build( uv_work_t *work ) {
+	FullScrape *scrape = work->data;
+	FullScrapeSnapshot *snapshot = calloc( 1, sizeof(*snapshot) );
+	if ( !snapshot ) goto badSnapshot;
+
+	snapshot->owner = scrape;
+	snapshot->built = uv_hrtime( );
+	snapshot->references = 1;
+	if ( FullScrape_encode( scrape, snapshot ) || FullScrape_compress( snapshot ) ) goto badEncode;
+	if ( scrape->path )
+		FullScrape_writeFile( scrape, snapshot );
+
+	dbg_info( "Full scrape of %zu torrents: %zu bytes, %zu gzipped.", snapshot->torrents, snapshot->plainSize, snapshot->gzipSize );
+	FullScrape_publish( scrape, snapshot );
+	return;
+
+badEncode:
+	FullScrapeSnapshot_free( snapshot );
+badSnapshot:
+	log_warn( "Couldn't build the full scrape." );
+	FullScrape_publish( scrape, NULL );
+}
+
+int FullScrape_finish( FullScrape *scrape, uv_loop_t *loop ) {
+	uv_mutex_lock( &scrape->lock );
+	scrape->finishing = true;
+	uv_mutex_unlock( &scrape->lock );
+	if ( uv_queue_work( loop, &scrape->work, FullScrape_build, NULL ) ) {
+		uv_mutex_lock( &scrape->lock );
+		scrape->finishing = false;
+		uv_mutex_unlock( &scrape->lock );
+		FullScrape_abandon( scrape );
+		return 1;
+	}
+	return 0;
+}
+
+FullScrapeSnapshot *FullScrape_acquire( FullScrape *scrape ) {
+	uv_mutex_lock( &scrape->lock );
+	FullScrapeSnapshot *snapshot = scrape->current;
+	if ( snapshot )
+		snapshot->references++;
+	uv_mutex_unlock( &scrape->lock );
+	return snapshot;
+}
+
+void FullScrapeSnapshot_release( FullScrapeSnapshot *snapshot ) {
+	if ( !snapshot ) return;
+
+	FullScrape *scrape = snapshot->owner;
+	uv_mutex_lock( &scrape->lock );
+	bool last = !--snapshot->references;
+	uv_mutex_unlock( &scrape->lock );
+	if ( last )
+		FullScrapeSnapshot_free( snapshot );
+}
+
+void FullScrape_stats( FullScrape *scrape, FullScrapeStats *stats ) {
+	uv_mutex_lock( &scrape->lock );
+	*stats = scrape->stats;
+	uv_mutex_unlock( &scrape->lock );
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+#include <uv.h>
+
+typedef struct _FullScrape FullScrape;
+typedef struct _FullScrapeSnapshot FullScrapeSnapshot;
+typedef struct _FullScrapeStats FullScrapeStats;
+
+// One finished full scrape, which never changes once it's published.
+struct _FullScrapeSnapshot {
+	FullScrape *owner;
+	// d5:filesd...ee, ready to go out as a reply's body.
+	char *plain;
+	size_t plainSize;
+	// the same, gzipped.
+	char *gzip;
+	size_t gzipSize;
+	size_t torrents;
+	// uv_hrtime when the walk it came from finished.
+	uint64_t built;
+	// Replies still being written from it, plus one while it's the
+	// current snapshot. Guarded by the owner's lock.
+	int references;
+};
+
+struct _FullScrapeStats {
+	uint64_t builds;
+	// walks that didn't get through every torrent, which leave the last
+	// snapshot in place.
+	uint64_t failedBuilds;
+	// of the current snapshot, all 0 until there is one.
+	size_t torrents;
+	size_t plainSize;
+	size_t gzipSize;
+	uint64_t built;
+	// how long the last build took, from the start of its walk until it
+	// was published.
+	uint64_t buildMS;
+};
+
+// Every torrent's counts in one bencoded blob, so a scrape with no info
+// hash costs nothing but the write. The store that owns the swarms walks
+// them every so often, adding each torrent as it goes; the blob is then
+// sorted, encoded and gzipped on the loop's threadpool, optionally
+// written to path as well, and swapped in for the last one. Snapshots
+// are reference counted, so any worker can serve the current one
+// straight from memory while the next is being built.
+FullScrape *FullScrape_new( const char *path );
+// Waits for a build that's on the threadpool.
+void FullScrape_free( FullScrape *scrape );
+
+// Only the loop that builds snapshots calls these. begin fails while the
+// last build is still being finished. Torrents whose counts aren't known
+// yet can be added with zeros, and filled in later by their position,
+// which is the count before they were added.
+bool FullScrape_begin( FullScrape *scrape );
+int  FullScrape_add( FullScrape *scrape, const char *infoHash, long long complete, long long incomplete );
+size_t FullScrape_count( FullScrape *scrape );
+void FullScrape_setCounts( FullScrape *scrape, size_t position, long long complete, long long incomplete );
+// Hands what's been added to the threadpool, which publishes it.
+int  FullScrape_finish( FullScrape *scrape, uv_loop_t *loop );
+// Throws away a walk that went wrong.
+void FullScrape_abandon( FullScrape *scrape );
+
+// Any thread. NULL until the first snapshot is ready. Each acquired
+// snapshot has to be released.
+FullScrapeSnapshot *FullScrape_acquire( FullScrape *scrape );
+void FullScrapeSnapshot_release( FullScrapeSnapshot *snapshot );
+void FullScrape_stats( FullScrape *scrape, FullScrapeStats *stats );
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "Histogram.h"
+
+#define HistogramMaxValue ((UINT64_C(1) << HistogramMaxBits) - 1)
+
+// Recording happens on every request, so this uses the single
+// instruction when there is one. value is never 0.
+static int highestBit( uint64_t value ) {
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll( value );
+#else
+	int bit = 0;
+	while ( value >>= 1 )
+		bit++;
+	return bit;
+#endif
+}
+
+// Values below 2^HistogramSubBucketBits get a bucket each. Past that,
+// every power of two gets HistogramSubBuckets of them, indexed by the
+// value's top HistogramSubBucketBits bits.
+static size_t Histogram_index( uint64_t value ) {
+	if ( value > HistogramMaxValue )
+		value = HistogramMaxValue;
+
+	if ( value < (1 << HistogramSubBucketBits) )
+		return value;
+
+	int top = highestBit( value );
+	int shift = top - HistogramSubBucketBits + 1;
+	return (shift + 1) * HistogramSubBuckets + (value >> shift) - HistogramSubBuckets;
+}
+
+uint64_t Histogram_bucketLimit( size_t index ) {
+	if ( index < 2 * HistogramSubBuckets )
+		return index;
+
+	int shift = index / HistogramSubBuckets - 1;
+	uint64_t top = index % HistogramSubBuckets + HistogramSubBuckets;
+	return ((top + 1) << shift) - 1;
+}
+
+void Histogram_init( Histogram *histogram ) {
+	memset( histogram, 0, sizeof(*histogram) );
+}
+
+void Histogram_record( Histogram *histogram, uint64_t value ) {
+	histogram->counts[Histogram_index( value )]++;
+	histogram->count++;
+	histogram->sum += value;
+	if ( value > histogram->max )
+		histogram->max = value;
+}
+
+void Histogram_merge( Histogram *into, const Histogram *from ) {
+	for ( size_t i = 0; i < HistogramBucketCount; i++ )
+		into->counts[i] += from->counts[i];
+	into->count += from->count;
+	into->sum   += from->sum;
+	if ( from->max > into->max )
+		into->max = from->max;
+}
+
+uint64_t Histogram_percentile( const Histogram *histogram, double percentile ) {
+	if ( !histogram->count ) return 0;
+
+	// the rank of the value wanted, counting from 1.
+	uint64_t rank = percentile / 100 * histogram->count + 0.5;
+	if ( rank < 1 ) rank = 1;
+
+	uint64_t seen = 0;
+	for ( size_t i = 0; i < HistogramBucketCount; i++ ) {
+		seen += histogram->counts[i];
+		if ( seen >= rank ) {
+			uint64_t limit = Histogram_bucketLimit( i );
+			return limit < histogram->max? limit: histogram->max;
+		}
+	}
+	return histogram->max;
+}
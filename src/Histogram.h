@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+typedef struct _Histogram Histogram;
+
+// Log-linear buckets, in the style of HdrHistogram: every power of two
+// is split into HistogramSubBuckets equal steps, so any recorded value
+// is known to within about 3%, from single units up to
+// 2^HistogramMaxBits. Larger values land in the last bucket.
+#define HistogramSubBucketBits 6
+#define HistogramSubBuckets (1 << (HistogramSubBucketBits - 1))
+#define HistogramMaxBits 36
+#define HistogramBucketCount ((HistogramMaxBits - HistogramSubBucketBits + 2) * HistogramSubBuckets)
+
+// Plain counters with no locking, so a histogram belongs to one thread.
+// Merge them to combine several.
+struct _Histogram {
+	uint64_t counts[HistogramBucketCount];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+void Histogram_init( Histogram *histogram );
+void Histogram_record( Histogram *histogram, uint64_t value );
+void Histogram_merge( Histogram *into, const Histogram *from );
+// percentile runs from 0 to 100. Gives the upper end of the bucket it
+// falls in, which is never more than max.
+uint64_t Histogram_percentile( const Histogram *histogram, double percentile );
+// The largest value that lands in bucket index.
+uint64_t Histogram_bucketLimit( size_t index );
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "Listener.h"
+#include "dbg.h"
+
+// A number for an option, which has to be above 0 and fit in an int.
+static int Listener_number( const char *spec, const char *name, const char *value, int *number ) {
+	char *end;
+	long parsed = value? strtol( value, &end, 10 ): 0;
+	if ( !value || !*value || *end || parsed <= 0 || parsed > INT_MAX ) {
+		log_err( "%s: %s needs a number above 0.", spec, name );
+		return 1;
+	}
+	*number = (int)parsed;
+	return 0;
+}
+
+static int Listener_option( Listener *listener, const char *spec, char *option ) {
+	char *value = strchr( option, '=' );
+	if ( value ) *value++ = '\0';
+
+	ServerOptions *options = &listener->options;
+	bool tcp = listener->protocol == ServerProtocol_TCP;
+	if ( strcmp( option, "backlog" ) == 0 )
+		return Listener_number( spec, option, value, &options->backlog );
+	if ( strcmp( option, "rcvbuf" ) == 0 )
+		return Listener_number( spec, option, value, &options->receiveBuffer );
+	if ( strcmp( option, "sndbuf" ) == 0 )
+		return Listener_number( spec, option, value, &options->sendBuffer );
+	if ( tcp && strcmp( option, "defer-accept" ) == 0 )
+		return Listener_number( spec, option, value, &options->deferAccept );
+	if ( !value && strcmp( option, "v6only" ) == 0 ) {
+		options->v6Only = true;
+		return 0;
+	}
+	if ( !value && tcp && strcmp( option, "nodelay" ) == 0 ) {
+		options->noDelay = true;
+		return 0;
+	}
+	if ( !value && tcp && strcmp( option, "uring" ) == 0 ) {
+		options->ioUring = true;
+		return 0;
+	}
+
+	log_err( "%s: %s isn't a%s option.", spec, option, tcp? "": " UDP" );
+	return 1;
+}
+
+Listener *Listener_parse( const char *spec ) {
+	Listener *listener = calloc( 1, sizeof(*listener) );
+	if ( !listener ) goto badListener;
+
+	char *copy = strdup( spec );
+	if ( !copy ) goto badCopy;
+
+	char *rest = copy;
+	if ( strncmp( rest, "tcp:", 4 ) == 0 )
+		listener->protocol = ServerProtocol_TCP;
+	else if ( strncmp( rest, "udp:", 4 ) == 0 )
+		listener->protocol = ServerProtocol_UDP;
+	else {
+		log_err( "%s: a listener starts with tcp: or udp:.", spec );
+		goto badSpec;
+	}
+	rest += 4;
+
+	char *options = strchr( rest, ',' );
+	if ( options ) *options++ = '\0';
+
+	// an IPv6 address has colons of its own.
+	char *address = rest, *port;
+	if ( address[0] == '[' ) {
+		char *close = strchr( address, ']' );
+		if ( !close || close[1] != ':' ) {
+			log_err( "%s: an IPv6 address goes in brackets, followed by :port.", spec );
+			goto badSpec;
+		}
+		*close = '\0';
+		address++;
+		port = close + 2;
+	} else {
+		port = strrchr( address, ':' );
+		if ( !port ) {
+			log_err( "%s: the address needs a :port.", spec );
+			goto badSpec;
+		}
+		*port++ = '\0';
+	}
+	char *end;
+	long portNumber = strtol( port, &end, 10 );
+	if ( !*address || !*port || *end || portNumber <= 0 || portNumber > 65535 ) {
+		log_err( "%s: the address needs a port between 1 and 65535.", spec );
+		goto badSpec;
+	}
+
+	char *state;
+	for ( char *option = options? strtok_r( options, ",", &state ): NULL; option; option = strtok_r( NULL, ",", &state ) ) {
+		if ( Listener_option( listener, spec, option ) ) goto badSpec;
+	}
+
+	listener->address = strdup( address );
+	if ( !listener->address ) goto badSpec;
+	listener->port = strdup( port );
+	if ( !listener->port ) goto badPort;
+
+	free( copy );
+	return listener;
+
+badPort:
+	free( listener->address );
+badSpec:
+	free( copy );
+badCopy:
+	free( listener );
+badListener:
+	return NULL;
+}
+
+void Listener_free( Listener *listener ) {
+	while ( listener ) {
+		Listener *next = listener->next;
+		free( listener->address );
+		free( listener->port );
+		free( listener );
+		listener = next;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+typedef struct _Listener Listener;
+
+#include "server.h"
+
+// One address for every worker to listen on, as given with -l:
+//
+//   tcp:[::]:9001,backlog=1024,nodelay
+//   udp:0.0.0.0:6969,rcvbuf=4194304
+//
+// An IPv6 address goes in brackets. The options after it are backlog,
+// rcvbuf, sndbuf, v6only, and for TCP only, nodelay, defer-accept,
+// which is in seconds, and uring.
+struct _Listener {
+	ServerProtocol protocol;
+	char *address;
+	char *port;
+	ServerOptions options;
+	Listener *next;
+};
+
+// Logs what's wrong with spec and returns NULL if it doesn't parse.
+Listener *Listener_parse( const char *spec );
+// Along with every one after it.
+void Listener_free( Listener *listener );
@@ -0,0 +1,356 @@
+#if defined(__linux__)
+// MAP_ANONYMOUS and MAP_NORESERVE are outside of POSIX.
+#define _DEFAULT_SOURCE
+#elif defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h> // offsetof
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <uv.h> // uv_mutex_t
+
+#include "MappedHeap.h"
+#include "dbg.h"
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+#define MappedHeapMagic "rekiheap"
+#define MappedHeapFormat 2
+// Address space set aside when the heap is opened, so that the mapping
+// can grow without moving. None of it costs anything until it's used.
+#define MappedHeapReserve ((size_t)1 << (sizeof(size_t) == 8? 36: 30))
+// The mapping grows by doubling, in steps of at least this much.
+#define MappedHeapGrowth ((size_t)1 << 20)
+// Blocks come in four sizes between each power of two, starting from
+// 32 bytes, so every block is 8 byte aligned.
+#define MappedHeapMinimumBits 5
+#define MappedHeapClassCount 192
+
+typedef struct _MappedHeapHeader MappedHeapHeader;
+
+struct _MappedHeapHeader {
+	char magic[8];
+	uint32_t format;
+	uint32_t version;
+	// the end of the last block handed out.
+	uint64_t used;
+	uint64_t root;
+	// freed blocks of each size, linked through their first 8 bytes.
+	uint64_t freeLists[MappedHeapClassCount];
+	uint64_t clean;
+	// over everything above.
+	uint64_t checksum;
+	// These two change without anything else in the file changing, so
+	// they're left out of the checksum. Closed is set once the whole file
+	// has been written back at the end, and boot is the machine's boot it
+	// was last opened in.
+	uint64_t closed;
+	uint64_t boot;
+};
+
+// blocks start after the header, on a cache line.
+#define MappedHeapFirstBlock ((sizeof(MappedHeapHeader) + 63) & ~(size_t)63)
+
+struct _MappedHeap {
+	char *base;
+	MappedHeapHeader *header;
+	// how much of the reserved range is mapped, which a file is always
+	// at least as long as.
+	size_t mapped;
+	// -1 for anonymous memory.
+	int fd;
+	bool reopened;
+	// whether the file was left as it was last synced.
+	bool clean;
+	// Whoever owns the heap may be changing different parts of it from
+	// several threads, but the allocator's state is shared by them all.
+	uv_mutex_t lock;
+};
+
+static int highestBit( uint64_t value ) {
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll( value );
+#else
+	int bit = 0;
+	while ( value >>= 1 )
+		bit++;
+	return bit;
+#endif
+}
+
+static int sizeClass( size_t size ) {
+	if ( size <= (1 << MappedHeapMinimumBits) )
+		return 0;
+
+	// 2^bits < size <= 2^(bits + 1), split into quarters.
+	int bits = highestBit( size - 1 );
+	size_t quarters = (size - ((size_t)1 << bits) + ((size_t)1 << (bits - 2)) - 1) >> (bits - 2);
+	return (bits - MappedHeapMinimumBits) * 4 + quarters;
+}
+
+static size_t classSize( int class ) {
+	if ( !class )
+		return 1 << MappedHeapMinimumBits;
+
+	int bits = MappedHeapMinimumBits + (class - 1) / 4;
+	return ((size_t)1 << bits) + (size_t)((class - 1) % 4 + 1) * ((size_t)1 << (bits - 2));
+}
+
+// FNV-1a. The header is small and only summed when it's synced or
+// opened.
+static uint64_t MappedHeap_checksum( MappedHeapHeader *header ) {
+	const unsigned char *bytes = (const unsigned char *)header;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for ( size_t i = 0; i < offsetof( MappedHeapHeader, checksum ); i++ )
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	return hash;
+}
+
+// Identifies the machine's current boot, or is 0 where that can't be
+// told. Until the machine goes down, everything written to the mapping
+// is in the file, whether it has been written back yet or not.
+static uint64_t MappedHeap_boot( void ) {
+	uint64_t hash = 0;
+#if defined(__linux__)
+	char id[64];
+	int fd = open( "/proc/sys/kernel/random/boot_id", O_RDONLY );
+	if ( fd < 0 ) return 0;
+
+	ssize_t length = read( fd, id, sizeof(id) );
+	close( fd );
+	if ( length <= 0 ) return 0;
+
+	hash = 0xCBF29CE484222325ULL;
+	for ( ssize_t i = 0; i < length; i++ )
+		hash = (hash ^ (unsigned char)id[i]) * 0x100000001B3ULL;
+#endif
+	return hash;
+}
+
+// Makes sure at least size bytes from the start are mapped.
+static int MappedHeap_map( MappedHeap *heap, size_t size ) {
+	if ( size <= heap->mapped ) return 0;
+	if ( size > MappedHeapReserve ) return 1;
+
+	size_t target = heap->mapped * 2 > size? heap->mapped * 2: size;
+	target = (target + MappedHeapGrowth - 1) & ~(MappedHeapGrowth - 1);
+	if ( target > MappedHeapReserve )
+		target = MappedHeapReserve;
+
+	char *start = heap->base + heap->mapped;
+	size_t length = target - heap->mapped;
+	if ( heap->fd < 0 ) {
+		if ( mprotect( start, length, PROT_READ | PROT_WRITE ) ) return 1;
+	} else {
+		if ( ftruncate( heap->fd, target ) ) return 1;
+		if ( mmap( start, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, heap->fd, heap->mapped ) == MAP_FAILED ) return 1;
+	}
+	heap->mapped = target;
+	return 0;
+}
+
+// A file that wasn't closed is only as good as what made it to disk,
+// which is anyone's guess once the machine has gone down: a sync only
+// starts writing it back. If the machine is still up, it's exactly how
+// the last tracker left it, and its owner can tell whether that was
+// partway through a change.
+static bool MappedHeap_check( MappedHeap *heap, const char *path, size_t fileSize, uint32_t version, uint64_t boot ) {
+	// nothing to complain about in a new file.
+	if ( !fileSize ) return false;
+
+	MappedHeapHeader *header = heap->header;
+	const char *problem = NULL;
+	if ( fileSize < sizeof(*header) || memcmp( header->magic, MappedHeapMagic, sizeof(header->magic) ) )
+		problem = "isn't one of reki's";
+	else if ( header->format != MappedHeapFormat || header->version != version )
+		problem = "is from another version of reki";
+	else if ( !header->closed && (!boot || header->boot != boot) )
+		problem = "wasn't closed before the machine went down";
+	else if ( header->clean && header->checksum != MappedHeap_checksum( header ) )
+		problem = "has been damaged";
+	else if ( header->used > fileSize || !header->root || header->root >= header->used )
+		problem = "has been cut short";
+
+	if ( problem )
+		log_warn( "%s %s, so it's being started over.", path, problem );
+	return !problem;
+}
+
+static void MappedHeap_reset( MappedHeap *heap, uint32_t version ) {
+	MappedHeapHeader *header = heap->header;
+	memset( header, 0, sizeof(*header) );
+	memcpy( header->magic, MappedHeapMagic, sizeof(header->magic) );
+	header->format  = MappedHeapFormat;
+	header->version = version;
+	header->used    = MappedHeapFirstBlock;
+}
+
+MappedHeap *MappedHeap_open( const char *path, uint32_t version ) {
+	MappedHeap *heap = malloc( sizeof(*heap) );
+	if ( !heap ) goto badHeap;
+
+	heap->mapped = 0;
+	heap->fd = -1;
+	heap->reopened = false;
+	heap->clean = false;
+	heap->base = mmap( NULL, MappedHeapReserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if ( heap->base == MAP_FAILED ) {
+		log_err( "Couldn't reserve address space for a heap: %s", strerror( errno ) );
+		goto badReserve;
+	}
+	heap->header = (MappedHeapHeader *)heap->base;
+	if ( uv_mutex_init( &heap->lock ) ) goto badLock;
+
+	size_t fileSize = 0;
+	if ( path ) {
+		heap->fd = open( path, O_RDWR | O_CREAT, 0644 );
+		if ( heap->fd < 0 ) {
+			log_err( "Couldn't open %s: %s", path, strerror( errno ) );
+			goto badFile;
+		}
+
+		struct stat info;
+		if ( fstat( heap->fd, &info ) ) goto badMap;
+		fileSize = info.st_size;
+	}
+
+	if ( MappedHeap_map( heap, fileSize > sizeof(MappedHeapHeader)? fileSize: sizeof(MappedHeapHeader) ) ) {
+		log_err( "Couldn't map %s: %s", path? path: "a heap", strerror( errno ) );
+		goto badMap;
+	}
+
+	uint64_t boot = MappedHeap_boot( );
+	if ( path )
+		heap->reopened = MappedHeap_check( heap, path, fileSize, version, boot );
+	if ( !heap->reopened )
+		MappedHeap_reset( heap, version );
+	heap->clean = heap->reopened && heap->header->clean;
+	heap->header->closed = 0;
+	heap->header->boot = boot;
+	return heap;
+
+badMap:
+	if ( heap->fd >= 0 )
+		close( heap->fd );
+badFile:
+	uv_mutex_destroy( &heap->lock );
+badLock:
+	munmap( heap->base, MappedHeapReserve );
+badReserve:
+	free( heap );
+badHeap:
+	return NULL;
+}
+
+void MappedHeap_close( MappedHeap *heap ) {
+	if ( !heap ) return;
+
+	// closed only goes out once everything else is in the file.
+	if ( heap->fd >= 0 ) {
+		if ( MappedHeap_sync( heap, true ) )
+			log_warn( "Couldn't write the heap back: %s", strerror( errno ) );
+		else {
+			heap->header->closed = 1;
+			if ( msync( heap->base, MappedHeapFirstBlock, MS_SYNC ) )
+				log_warn( "Couldn't mark the heap closed: %s", strerror( errno ) );
+		}
+		close( heap->fd );
+	}
+	munmap( heap->base, MappedHeapReserve );
+	uv_mutex_destroy( &heap->lock );
+	free( heap );
+}
+
+bool MappedHeap_reopened( MappedHeap *heap ) {
+	return heap->reopened;
+}
+
+bool MappedHeap_clean( MappedHeap *heap ) {
+	return heap->clean;
+}
+
+void MappedHeap_startOver( MappedHeap *heap ) {
+	uint32_t version = heap->header->version;
+	uint64_t boot = heap->header->boot;
+	MappedHeap_reset( heap, version );
+	heap->header->boot = boot;
+	heap->reopened = false;
+	heap->clean = false;
+}
+
+char *MappedHeap_base( MappedHeap *heap ) {
+	return heap->base;
+}
+
+uint64_t MappedHeap_root( MappedHeap *heap ) {
+	return heap->header->root;
+}
+
+void MappedHeap_setRoot( MappedHeap *heap, uint64_t root ) {
+	heap->header->root = root;
+}
+
+uint64_t MappedHeap_alloc( MappedHeap *heap, size_t size ) {
+	int class = sizeClass( size );
+	if ( class >= MappedHeapClassCount ) return 0;
+
+	MappedHeapHeader *header = heap->header;
+	uv_mutex_lock( &heap->lock );
+	uint64_t block = header->freeLists[class];
+	if ( block ) {
+		memcpy( &header->freeLists[class], heap->base + block, sizeof(block) );
+		goto done;
+	}
+
+	size_t blockSize = classSize( class );
+	if ( MappedHeap_map( heap, header->used + blockSize ) ) goto done;
+
+	block = header->used;
+	header->used += blockSize;
+done:
+	uv_mutex_unlock( &heap->lock );
+	return block;
+}
+
+void MappedHeap_release( MappedHeap *heap, uint64_t offset, size_t size ) {
+	if ( !offset ) return;
+
+	int class = sizeClass( size );
+	uv_mutex_lock( &heap->lock );
+	memcpy( heap->base + offset, &heap->header->freeLists[class], sizeof(offset) );
+	heap->header->freeLists[class] = offset;
+	uv_mutex_unlock( &heap->lock );
+}
+
+size_t MappedHeap_used( MappedHeap *heap ) {
+	uv_mutex_lock( &heap->lock );
+	size_t used = heap->header->used;
+	uv_mutex_unlock( &heap->lock );
+	return used;
+}
+
+// Several threads can be making changes at once, and all of them clear
+// the same flag.
+void MappedHeap_touch( MappedHeap *heap ) {
+	if ( __atomic_load_n( &heap->header->clean, __ATOMIC_RELAXED ) )
+		__atomic_store_n( &heap->header->clean, 0, __ATOMIC_RELAXED );
+}
+
+int MappedHeap_sync( MappedHeap *heap, bool wait ) {
+	if ( heap->fd < 0 ) return 0;
+
+	heap->header->clean = 1;
+	heap->header->checksum = MappedHeap_checksum( heap->header );
+	return msync( heap->base, heap->header->used, wait? MS_SYNC: MS_ASYNC );
+}
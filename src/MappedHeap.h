@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+typedef struct _MappedHeap MappedHeap;
+
+// Memory handed out from one mapping, either of a file, which then
+// holds everything its owner keeps in it from one run to the next, or
+// of anonymous memory that goes away with the process. Blocks are named
+// by their offset from the start of the mapping, since the file can be
+// mapped anywhere when it's reopened, but the mapping never moves while
+// it's open, so pointers into it stay good until it's closed. 0 is never
+// a block.
+//
+// The file starts with a header holding the allocator's state, the
+// owner's format version and a checksum. It's only marked clean while
+// nothing has changed since it was last synced. A file left behind by a
+// tracker that died is still everything it wrote, as long as the
+// machine hasn't gone down since, so it's kept for the owner to judge.
+// One that wasn't closed before the machine went down is started over.
+
+// path is NULL for anonymous memory. A file that's missing, or isn't a
+// heap of this version, is started over.
+MappedHeap *MappedHeap_open( const char *path, uint32_t version );
+// Syncs a file, marks it clean and closed, and unmaps it.
+void MappedHeap_close( MappedHeap *heap );
+// Whether open found the owner's blocks from last time.
+bool MappedHeap_reopened( MappedHeap *heap );
+// Whether they're as they were when it was last synced. If not, the
+// tracker before didn't get to close it, and it's up to the owner to
+// check it hadn't stopped partway through a change, and start over if
+// it had.
+bool MappedHeap_clean( MappedHeap *heap );
+void MappedHeap_startOver( MappedHeap *heap );
+
+char *MappedHeap_base( MappedHeap *heap );
+// The owner's first block, which leads to everything else.
+uint64_t MappedHeap_root( MappedHeap *heap );
+void MappedHeap_setRoot( MappedHeap *heap, uint64_t root );
+// Alloc, release and touch can be called from several threads at once,
+// as long as they're changing different blocks.
+// Returns 0 when there's no more room.
+uint64_t MappedHeap_alloc( MappedHeap *heap, size_t size );
+// size is the size the block was allocated with.
+void MappedHeap_release( MappedHeap *heap, uint64_t offset, size_t size );
+// Bytes of the mapping in use, including freed blocks waiting for reuse.
+size_t MappedHeap_used( MappedHeap *heap );
+
+// Has to be called before each change to anything in the heap.
+void MappedHeap_touch( MappedHeap *heap );
+// Marks a file clean and starts writing it back, waiting for that to
+// finish if wait is set.
+int MappedHeap_sync( MappedHeap *heap, bool wait );
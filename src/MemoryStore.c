@@ -3,39 +3,250 @@
 #include <uv.h>
 #include <hiredis/hiredis.h> // hiredis
 #include <hiredis/async.h>
-#include <hiredis/adapters/libuv.h>
 
 #include "MemoryStore.h"
 #include "StringBuffer.h"
+#include "Bencode.h"
 #include "CompactAddress.h"
 #include "announce.h"
 #include "Scrape.h"
+#include "UDPTracker.h"
+#include "SwarmTable.h"
+#include "RedisPool.h"
 #include "dbg.h"
+#include "macros.h"
+
+typedef struct _MemoryStoreScript MemoryStoreScript;
+typedef struct _MemoryStoreShard MemoryStoreShard;
+typedef struct _MemoryStoreScrapeGather MemoryStoreScrapeGather;
+typedef struct _MemoryStoreScrapePart MemoryStoreScrapePart;
+
+struct _MemoryStoreScript {
+	const char *name;
+	const char *source;
+	// SHA1 of the source once redis has loaded it, empty until then.
+	char sha[41];
+};
+
+// One redis server, which holds every torrent the info hash sends its
+// way, along with its own index of them to sweep.
+struct _MemoryStoreShard {
+	MemoryStore *store;
+	RedisPool *redis;
+	// the slice size for the pass in progress.
+	size_t passSlice;
+	// SSCAN cursor over the torrent index, "0" between passes.
+	char expiryCursor[24];
+	bool expiryInFlight;
+	uint64_t passStart;
+	// announces and scrapes sent to this shard and not yet answered.
+	size_t outstanding;
+	// SSCAN cursor for the full scrape's walk, and where the slice that's
+	// being counted sits among the snapshot's torrents. Other shards add
+	// theirs in between, but each slice is added all at once.
+	char fullScrapeCursor[24];
+	size_t fullScrapeFirst, fullScrapeCount;
+};
+
+// A scrape that covers torrents on several shards asks each of them
+// about its own, and only replies once all of them have answered.
+struct _MemoryStoreScrapePart {
+	MemoryStoreScrapeGather *gather;
+	// NULL for shards the scrape has nothing to ask.
+	MemoryStoreShard *shard;
+};
+
+struct _MemoryStoreScrapeGather {
+	ClientConnection *client;
+	size_t pending;
+	// the first thing that went wrong, which is what the reply says.
+	const char *error;
+	MemoryStoreScrapePart parts[];
+};
 
 struct _MemoryStore {
-	redisAsyncContext *context;
+	MemoryStoreBackend backend;
+	MemoryStoreShard *shards;
+	size_t shardCount;
+	SwarmTable *swarms;
+	// only the store that owns the swarms (the swarm table, or the keys
+	// under the namespace in redis) sweeps them, and frees the table.
+	bool ownsSwarms;
 	uv_timer_t *timer;
 	char *namespace;
-	uint64_t cleanupTime;
+	MemoryStoreScript announceScript;
+	MemoryStoreScript expireScript;
+
+	// How many buckets (native) or torrents (redis) each expiry step
+	// covers. 0 sizes it so a pass takes about ExpiryPassMS.
+	size_t expirySlice;
+	// when the native pass in progress started. Each shard keeps its own.
+	uint64_t passStart;
+	// expiry steps since the native swarms were last synced.
+	int syncStep;
+	MemoryStoreExpiryStats expiry;
+	// Redis requests sent and not yet answered, and how many of those
+	// there can be before requests are turned away. 0 is no limit.
+	size_t outstanding;
+	size_t outstandingLimit;
+	MemoryStorePeerSelection peerSelection;
+	// xorshift state for seeding each announce's sample.
+	uint64_t random;
+	// only used with redis, and NULL when disabled.
+	ScrapeCache *scrapeCache;
+	// Shared by every store, and NULL when disabled. Only the owner of the
+	// swarms builds it, every fullScrapePeriod milliseconds.
+	FullScrape *fullScrape;
+	uv_timer_t *fullScrapeTimer;
+	uint64_t fullScrapePeriod;
+	bool fullScrapeWalking;
+	// where a native walk has got to, and how many shards are still
+	// walking with redis, along with whether any of them failed.
+	SwarmTableCursor fullScrapePosition;
+	size_t fullScrapeShards;
+	bool fullScrapeFailed;
 };
 
-static void redisConnectCb( const redisAsyncContext *redis, int status ) {
-	if ( status != REDIS_OK ) {
-		log_err( "Redis error: %s", redis->errstr );
-		exit( 1 );
-	}
-	dbg_info( "Connected to redis." );
-}
+// In redis, each torrent is six sorted sets scored by announce time,
+// namespace:<info hash>:seeds4, :peers4, :seeds6, :peers6, :seeds46 and
+// :peers46, where the info hash is its raw 20 bytes. Their members are
+// the 6 byte IPv4 or 18 byte IPv6 address and port, exactly as they go
+// out in a response. A peer with both kinds of address is in both
+// families, and in :seeds46 or :peers46 under the two together, so that
+// it's only counted once. The torrent index, namespace:torrents, is a
+// set of the same raw hashes.
+// reki-migrate rewrites namespaces from before this layout, which keyed
+// torrents by their hex info hash or kept whole CompactAddresses in
+// :seeds and :peers.
+static const char *familyKeys[] = { ":seeds4", ":peers4", ":seeds6", ":peers6", ":seeds46", ":peers46" };
+#define FamilyKeyCount (sizeof(familyKeys) / sizeof(*familyKeys))
+#define FamilyKeyLongest (sizeof(":seeds46") - 1)
 
-static void redisDisconnectCb( const redisAsyncContext *redis, int status ) {
-	if ( status != REDIS_OK ) {
-		log_err( "Redis error: %s", redis->errstr );
-		return;
-	}
-	dbg_info( "Disconnected from redis." );
+// A torrent's seed or leecher count, from the sizes of its sets.
+// Dual stack peers are taken off once. The sets expire apart, so they
+// can be briefly out of step, but there are never more dual peers than
+// either family has.
+static long long MemoryStore_distinct( long long ipv4, long long ipv6, long long dual ) {
+	long long both = ipv4 < ipv6? ipv4: ipv6;
+	return ipv4 + ipv6 - (dual < both? dual: both);
 }
 
-MemoryStore *MemoryStore_new( const char *namespace ) {
+// Does all of the work of an announce in one round trip: counts the
+// swarm, picks up to numwant peers (and seeds, unless the announcer is
+// seeding), either the newest or a random sample, from the announcer's
+// own family first, which is IPv4 unless it only has IPv6, and then
+// records the announcer under each address it has. Members are already
+// in their compact form, so each family's picks are just joined
+// together. It also keeps the announced torrent in the torrent index,
+// which is what expiry walks.
+//   KEYS: seeds4, peers4, seeds6, peers6, torrent index, seeds46, peers46
+//   ARGV: now, then, numwant, seeding (1 or 0), IPv4 address, IPv6
+//         address (either may be empty), info hash, and a seed for the
+//         sample, or 0 for the newest peers
+//   returns: { seedCount, peerCount, peers, peers6 }
+static const char AnnounceScript[] =
+	"local now, since, numwant = ARGV[1], ARGV[2], tonumber( ARGV[3] )\n"
+	"local seeding = ARGV[4] == '1'\n"
+	"local function distinct( four, six, both )\n"
+	"	local ipv4, ipv6 = redis.call( 'ZCARD', four ), redis.call( 'ZCARD', six )\n"
+	"	return ipv4 + ipv6 - math.min( redis.call( 'ZCARD', both ), ipv4, ipv6 )\n"
+	"end\n"
+	"local seedCount = distinct( KEYS[1], KEYS[3], KEYS[6] )\n"
+	"local peerCount = distinct( KEYS[2], KEYS[4], KEYS[7] )\n"
+	"local function newest( key, wanted, found )\n"
+	"	local more = redis.call( 'ZREVRANGEBYSCORE', key, now, since, 'LIMIT', 0, wanted )\n"
+	"	for i = 1, #more do found[#found + 1] = more[i] end\n"
+	"end\n"
+	// Everyone seen since then is at the top of the set, so a random rank
+	// among them is a random fresh peer. Floyd's algorithm draws wanted
+	// distinct ranks out of count with wanted draws, and each rank is a
+	// single O(log n) lookup.
+	"local function sample( key, wanted, found )\n"
+	"	local count = redis.call( 'ZCOUNT', key, since, '+inf' )\n"
+	"	if count == 0 then return end\n"
+	"	if count <= wanted then\n"
+	"		local more = redis.call( 'ZREVRANGE', key, 0, count - 1 )\n"
+	"		for i = 1, #more do found[#found + 1] = more[i] end\n"
+	"		return\n"
+	"	end\n"
+	"	local chosen = {}\n"
+	"	for j = count - wanted, count - 1 do\n"
+	"		local rank = math.random( 0, j )\n"
+	"		if chosen[rank] then rank = j end\n"
+	"		chosen[rank] = true\n"
+	"		found[#found + 1] = redis.call( 'ZREVRANGE', key, rank, rank )[1]\n"
+	"	end\n"
+	"end\n"
+	// Scripts start with the same random seed every time, so each
+	// announce brings its own.
+	"local choose = newest\n"
+	"if ARGV[8] ~= '0' then\n"
+	"	math.randomseed( tonumber( ARGV[8] ) )\n"
+	"	choose = sample\n"
+	"end\n"
+	"local function pick( seeds, peers, wanted )\n"
+	"	local found = {}\n"
+	"	if wanted <= 0 then return '', 0 end\n"
+	"	choose( peers, wanted, found )\n"
+	// don't give seeds to seeds.
+	"	if not seeding and #found < wanted then\n"
+	"		choose( seeds, wanted - #found, found )\n"
+	"	end\n"
+	"	return table.concat( found ), #found\n"
+	"end\n"
+	"local function record( seeds, peers, address )\n"
+	"	if address == '' then return end\n"
+	"	if seeding then\n"
+	"		redis.call( 'ZREM', peers, address )\n"
+	"		redis.call( 'ZADD', seeds, now, address )\n"
+	"	else\n"
+	"		redis.call( 'ZREM', seeds, address )\n"
+	"		redis.call( 'ZADD', peers, now, address )\n"
+	"	end\n"
+	"end\n"
+	"local peers, peers6, found\n"
+	"if ARGV[5] == '' then\n"
+	"	peers6, found = pick( KEYS[3], KEYS[4], numwant )\n"
+	"	peers = pick( KEYS[1], KEYS[2], numwant - found )\n"
+	"else\n"
+	"	peers, found = pick( KEYS[1], KEYS[2], numwant )\n"
+	"	peers6 = pick( KEYS[3], KEYS[4], numwant - found )\n"
+	"end\n"
+	"record( KEYS[1], KEYS[2], ARGV[5] )\n"
+	"record( KEYS[3], KEYS[4], ARGV[6] )\n"
+	"if ARGV[5] ~= '' and ARGV[6] ~= '' then\n"
+	"	record( KEYS[6], KEYS[7], ARGV[5] .. ARGV[6] )\n"
+	"end\n"
+	"redis.call( 'SADD', KEYS[5], ARGV[7] )\n"
+	"return { seedCount, peerCount, peers, peers6 }\n";
+
+// Drops everything older than then from a slice of the torrent index,
+// and takes torrents with nobody left out of the index.
+//   KEYS: torrent index, then the six sets of each torrent
+//   ARGV: then, then the info hash of each torrent
+//   returns: { peers dropped, torrents dropped }
+static const char ExpireScript[] =
+	"local since = ARGV[1]\n"
+	"local expired, emptied = 0, 0\n"
+	"for i = 2, #ARGV do\n"
+	"	local first = (i - 2) * 6 + 2\n"
+	"	local dropped = 0\n"
+	"	for key = first, first + 3 do\n"
+	"		dropped = dropped + redis.call( 'ZREMRANGEBYSCORE', KEYS[key], 0, since )\n"
+	"	end\n"
+	// a peer in the dual sets was dropped from both families, and is only
+	// one peer.
+	"	dropped = dropped - redis.call( 'ZREMRANGEBYSCORE', KEYS[first + 4], 0, since )\n"
+	"	dropped = dropped - redis.call( 'ZREMRANGEBYSCORE', KEYS[first + 5], 0, since )\n"
+	"	expired = expired + math.max( dropped, 0 )\n"
+	"	if redis.call( 'EXISTS', KEYS[first], KEYS[first + 1], KEYS[first + 2], KEYS[first + 3], KEYS[first + 4], KEYS[first + 5] ) == 0 then\n"
+	"		redis.call( 'SREM', KEYS[1], ARGV[i] )\n"
+	"		emptied = emptied + 1\n"
+	"	end\n"
+	"end\n"
+	"return { expired, emptied }\n";
+
+MemoryStore *MemoryStore_new( const char *namespace, MemoryStoreBackend backend ) {
 	MemoryStore *store = malloc( sizeof(*store) );
 	if ( !store ) goto badStore;
 
@@ -45,9 +256,44 @@ MemoryStore *MemoryStore_new( const char *namespace ) {
 	store->timer = malloc( sizeof(*store->timer) );
 	if ( !store->timer ) goto badTimer;
 
+	store->fullScrapeTimer = malloc( sizeof(*store->fullScrapeTimer) );
+	if ( !store->fullScrapeTimer ) goto badFullScrapeTimer;
+
+	store->backend = backend;
+	store->shards  = NULL;
+	store->shardCount = 0;
+	store->swarms  = NULL;
+	store->ownsSwarms = true;
+	store->announceScript = (MemoryStoreScript){ "announce", AnnounceScript, "" };
+	store->expireScript   = (MemoryStoreScript){ "expire", ExpireScript, "" };
+	store->expirySlice = 0;
+	store->passStart = 0;
+	store->syncStep = 0;
+	memset( &store->expiry, 0, sizeof(store->expiry) );
+	store->outstanding = 0;
+	store->outstandingLimit = 0;
+	store->peerSelection = MemoryStorePeerSelection_newest;
+	store->random = 0;
+	store->scrapeCache = NULL;
+	store->fullScrape = NULL;
+	store->fullScrapePeriod = 0;
+	store->fullScrapeWalking = false;
+	store->fullScrapePosition = (SwarmTableCursor){ 0, 0 };
+	store->fullScrapeShards = 0;
+	store->fullScrapeFailed = false;
+	if ( backend == MemoryStoreBackend_native ) {
+		store->swarms = SwarmTable_new( NULL );
+		if ( !store->swarms ) goto badSwarms;
+	}
+
 	store->timer->data = store;
+	store->fullScrapeTimer->data = store;
 	return store;
 
+badSwarms:
+	free( store->fullScrapeTimer );
+badFullScrapeTimer:
+	free( store->timer );
 badTimer:
 	free( store->namespace );
 badNamespace:
@@ -59,232 +305,1029 @@ badStore:
 void MemoryStore_free( MemoryStore *store ) {
 	if ( !store ) return;
 
+	if ( store->ownsSwarms )
+		SwarmTable_free( store->swarms );
+	ScrapeCache_free( store->scrapeCache );
+	for ( size_t i = 0; i < store->shardCount; i++ )
+		RedisPool_free( store->shards[i].redis );
+	free( store->shards );
 	free( store->namespace );
+	free( store->fullScrapeTimer );
 	free( store->timer );
 	free( store );
 }
 
-int MemoryStore_initConnection( MemoryStore *store, const char *host, short port ) {
-	store->context = redisAsyncConnect( host, port );
-	if ( store->context->err ) {
-		log_err( "Redis error: %s\n", store->context->errstr );
-		return 1;
+// addresses is a comma separated list of redis servers, each host:port
+// or the path to a unix socket, that the torrents are split between.
+// Each server gets that many connections.
+int MemoryStore_initConnection( MemoryStore *store, const char *addresses, size_t connections ) {
+	// the native backend has nothing to connect to.
+	if ( store->backend == MemoryStoreBackend_native ) return 0;
+
+	char *list = strdup( addresses );
+	if ( !list ) goto badList;
+
+	size_t count = 1;
+	for ( const char *c = addresses; *c; c++ )
+		count += *c == ',';
+	store->shards = calloc( count, sizeof(*store->shards) );
+	if ( !store->shards ) goto badShards;
+
+	char *next = NULL;
+	for ( char *address = strtok_r( list, ",", &next ); address; address = strtok_r( NULL, ",", &next ) ) {
+		MemoryStoreShard *shard = &store->shards[store->shardCount];
+		shard->store = store;
+		shard->redis = RedisPool_new( address, connections );
+		if ( !shard->redis ) goto badShards;
+
+		strcpy( shard->expiryCursor, "0" );
+		strcpy( shard->fullScrapeCursor, "0" );
+		store->shardCount++;
+	}
+	if ( !store->shardCount ) {
+		log_err( "There's no redis server in \"%s\".", addresses );
+		goto badShards;
+	}
+
+	free( list );
+	return 0;
+
+badShards:
+	free( list );
+badList:
+	return 1;
+}
+
+// Lets several workers' stores serve the same swarms, leaving expiry to
+// the owner. With redis, there's no table to share, but only one of
+// the stores should be sweeping it.
+void MemoryStore_shareSwarms( MemoryStore *store, MemoryStore *owner ) {
+	if ( store->ownsSwarms )
+		SwarmTable_free( store->swarms );
+	store->swarms = owner->swarms;
+	store->ownsSwarms = false;
+}
+
+// Moves the owner's swarms into a file, picking up whatever a previous
+// run left there. Only the native backend keeps swarms of its own.
+int MemoryStore_setSwarmFile( MemoryStore *store, const char *path ) {
+	if ( store->backend != MemoryStoreBackend_native ) {
+		log_warn( "Redis keeps its own swarms, so %s isn't used.", path );
+		return 0;
 	}
+
+	SwarmTable *swarms = SwarmTable_new( path );
+	if ( !swarms ) return 1;
+
+	SwarmTable_free( store->swarms );
+	store->swarms = swarms;
 	return 0;
 }
 
+void MemoryStore_setBackendLimit( MemoryStore *store, size_t limit ) {
+	store->outstandingLimit = limit;
+}
+
+void MemoryStore_setExpirySlice( MemoryStore *store, size_t slice ) {
+	store->expirySlice = slice;
+}
+
+int MemoryStore_setPeerSelection( MemoryStore *store, MemoryStorePeerSelection selection ) {
+	store->peerSelection = selection;
+	if ( selection != MemoryStorePeerSelection_random )
+		return 0;
+
+	// xorshift never leaves 0, so it can't start there either.
+	do {
+		if ( uv_random( NULL, NULL, &store->random, sizeof(store->random), 0, NULL ) )
+			return 1;
+	} while ( !store->random );
+	return 0;
+}
+
+// The native backend counts a swarm about as quickly as it could look
+// it up in the cache, so only redis gets one. A ttl of 0 disables it.
+int MemoryStore_setScrapeCache( MemoryStore *store, size_t capacity, uint64_t ttl ) {
+	ScrapeCache_free( store->scrapeCache );
+	store->scrapeCache = NULL;
+	if ( store->backend == MemoryStoreBackend_native || !ttl || !capacity )
+		return 0;
+
+	store->scrapeCache = ScrapeCache_new( capacity, ttl );
+	return store->scrapeCache? 0: 1;
+}
+
+// Every store serves the same full scrape, and the one that owns the
+// swarms builds it. A period of 0 leaves it off.
+void MemoryStore_setFullScrape( MemoryStore *store, FullScrape *scrape, uint64_t period ) {
+	store->fullScrape = period? scrape: NULL;
+	store->fullScrapePeriod = period;
+}
+
+FullScrape *MemoryStore_fullScrape( MemoryStore *store ) {
+	return store->fullScrape;
+}
+
+// Returns false past the last shard, which is straight away if the
+// store doesn't use redis.
+bool MemoryStore_redisStats( MemoryStore *store, size_t shard, MemoryStoreRedisStats *stats ) {
+	if ( shard >= store->shardCount ) return false;
+
+	RedisPool_stats( store->shards[shard].redis, &stats->pool );
+	stats->outstanding = store->shards[shard].outstanding;
+	return true;
+}
+
+// Returns false if the store has no cache.
+bool MemoryStore_scrapeCacheStats( MemoryStore *store, ScrapeCacheStats *stats ) {
+	if ( !store->scrapeCache ) return false;
+
+	ScrapeCache_stats( store->scrapeCache, stats );
+	return true;
+}
+
 int MemoryStore_disconnect( MemoryStore *store ) {
-	redisAsyncDisconnect( store->context );
+	for ( size_t i = 0; i < store->shardCount; i++ )
+		RedisPool_disconnect( store->shards[i].redis );
 	return 0;
 }
 
-// 30 mins
-#define AnnounceInterval 1800
 #define DropCount 3
 #define DropIntervalMS (AnnounceInterval * DropCount * 1000)
-static void MemoryStore_cleanPeersTimer( uv_timer_t *timer );
+// uv_now counts from an arbitrary point, which may be less than
+// DropIntervalMS ago.
+#define DropThreshold( now ) ((now) > DropIntervalMS? (now) - DropIntervalMS: 0)
+
+// A seed for one announce's random sample, or 0 for the newest peers.
+// math.randomseed in redis takes an int, so it's kept to 31 bits.
+static uint32_t MemoryStore_sampleSeed( MemoryStore *store ) {
+	if ( store->peerSelection != MemoryStorePeerSelection_random )
+		return 0;
+
+	uint64_t x = store->random;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	store->random = x;
+	return (uint32_t)(x >> 33) | 1;
+}
+// Both backends expire a slice of the swarms every step, rather than
+// everything at once, so that a full pass takes about ExpiryPassMS.
+#define ExpiryStepMS 1000
+#define ExpiryPassMS (10 * 60 * 1000)
+#define ExpirySlice( total ) ((total) / (ExpiryPassMS / ExpiryStepMS) + 1)
+// How often the native backend writes its swarms back to their file, if
+// they have one. The kernel writes them back on its own as well; this
+// is what leaves the file good to reopen if the tracker dies.
+#define SyncSteps 10
+static void MemoryStore_expirePeersTimer( uv_timer_t *timer );
+static void MemoryStore_expireSwarmsTimer( uv_timer_t *timer );
+static void MemoryStore_fullScrapeStep( uv_timer_t *timer );
+
+static void MemoryStore_scriptLoaded( redisAsyncContext *context, void *voidReply, void *voidScript ) {
+	redisReply *reply = voidReply;
+	MemoryStoreScript *script = voidScript;
+	if ( !reply || (reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_STATUS) || reply->len != sizeof(script->sha) - 1 ) {
+		// the whole script keeps being sent with EVAL instead.
+		log_warn( "Could not load the %s script.", script->name );
+		return;
+	}
+
+	memcpy( script->sha, reply->str, reply->len );
+	script->sha[reply->len] = '\0';
+	dbg_info( "Loaded the %s script: %s", script->name, script->sha );
+}
+
+static void MemoryStore_loadScript( redisAsyncContext *context, MemoryStoreScript *script ) {
+	script->sha[0] = '\0';
+	redisAsyncCommand( context, MemoryStore_scriptLoaded, script, "SCRIPT LOAD %s", script->source );
+}
+
+// Every connection loads the scripts as it comes up, since it may be to
+// a redis that was restarted since the last one did. They're sent ahead
+// of anything else on the connection, so they're answered first.
+static void MemoryStore_connected( redisAsyncContext *context, void *voidStore ) {
+	MemoryStore *store = voidStore;
+	MemoryStore_loadScript( context, &store->announceScript );
+	MemoryStore_loadScript( context, &store->expireScript );
+}
+
+static bool MemoryStore_missingScript( redisAsyncContext *context, MemoryStoreScript *script, redisReply *reply ) {
+	if ( reply->type != REDIS_REPLY_ERROR || !EqualLiteral( reply->str, "NOSCRIPT" ) )
+		return false;
+
+	// redis was restarted or had its scripts flushed.
+	if ( script->sha[0] ) {
+		log_warn( "The %s script went missing from redis, reloading it.", script->name );
+		MemoryStore_loadScript( context, script );
+	}
+	return true;
+}
+
+// The first snapshot is built a step in, once redis is connected.
+static void MemoryStore_startFullScrape( MemoryStore *store, uv_loop_t *loop ) {
+	uv_timer_init( loop, store->fullScrapeTimer );
+	if ( store->fullScrape && store->ownsSwarms )
+		uv_timer_start( store->fullScrapeTimer, MemoryStore_fullScrapeStep, ExpiryStepMS, 0 );
+}
 
 int MemoryStore_attachToLoop( MemoryStore *store, uv_loop_t *loop ) {
-	redisLibuvAttach( store->context, loop );
-	redisAsyncSetConnectCallback( store->context, redisConnectCb );
-	redisAsyncSetDisconnectCallback( store->context, redisDisconnectCb );
 	uv_timer_init( loop, store->timer );
-	uv_timer_start( store->timer, MemoryStore_cleanPeersTimer, DropIntervalMS, DropIntervalMS );
+	store->passStart = uv_now( loop );
+	store->expiry.targetPassMS = ExpiryPassMS;
+	if ( store->backend == MemoryStoreBackend_native ) {
+		if ( store->ownsSwarms )
+			uv_timer_start( store->timer, MemoryStore_expireSwarmsTimer, ExpiryStepMS, ExpiryStepMS );
+		MemoryStore_startFullScrape( store, loop );
+		return 0;
+	}
+
+	for ( size_t i = 0; i < store->shardCount; i++ ) {
+		MemoryStoreShard *shard = &store->shards[i];
+		shard->passStart = store->passStart;
+		RedisPool_setConnectCallback( shard->redis, MemoryStore_connected, store );
+		if ( RedisPool_attachToLoop( shard->redis, loop ) ) return 1;
+	}
+	if ( store->ownsSwarms )
+		uv_timer_start( store->timer, MemoryStore_expirePeersTimer, ExpiryStepMS, ExpiryStepMS );
+	MemoryStore_startFullScrape( store, loop );
 	return 0;
 }
 
-// This, fairly obviously, does not scale well to millions of torrents.
-// However, purging the seeds/peers on every single announce/scrape
-// obviously didn't scale to millions of peers either, and since a
-// single torrent is more than likely to have multiple peers, this
-// presumably chews up a lot less cycles overall. The tradeoff is one
-// big chugging cleanup task, that could potentially stall redis, cause
-// huge memory spikes, etc. A better solution might consist of
-// splitting up the torrent index across several fixed-size keys, and
-// staggering the cleanup tasks across those. An alternate option would
-// be to use SSCAN to iterate over the keys in the set in fixed-size
-// chunks.
-static void MemoryStore_cleanPeers( redisAsyncContext *context, void *voidReply, void *voidStore ) {
-	dbg_info( "cleanPeers" );
-	redisReply *reply = voidReply;
-	if ( reply->elements == 0 ) return;
-	MemoryStore *store = voidStore;
-	uint64_t then = store->cleanupTime - DropIntervalMS;
-	redisAsyncCommand( context, NULL, NULL, "MULTI" );
-	for ( int i = 0; i < reply->elements; i++ ) {
-		const char *infoHash = reply->element[i]->str;
-		redisAsyncCommand( context, NULL, NULL, "ZREMRANGEBYSCORE %s:%s:seeds 0 %llu", store->namespace, infoHash, then );
-		redisAsyncCommand( context, NULL, NULL, "ZREMRANGEBYSCORE %s:%s:peers 0 %llu", store->namespace, infoHash, then );
+// With several shards, each makes its own passes, and the current pass
+// is the one that has been going the longest.
+void MemoryStore_expiryStats( MemoryStore *store, MemoryStoreExpiryStats *stats ) {
+	uint64_t passStart = store->passStart;
+	for ( size_t i = 0; i < store->shardCount; i++ ) {
+		if ( store->shards[i].passStart < passStart )
+			passStart = store->shards[i].passStart;
 	}
-	redisAsyncCommand( context, NULL, NULL, "EXEC" );
+	*stats = store->expiry;
+	stats->currentPassMS = uv_now( store->timer->loop ) - passStart;
+
+	uint64_t slowest = stats->lastPassMS > stats->currentPassMS? stats->lastPassMS: stats->currentPassMS;
+	stats->lagMS = slowest > stats->targetPassMS? slowest - stats->targetPassMS: 0;
 }
 
-static void MemoryStore_cleanPeersTimer( uv_timer_t *timer ) {
+static void MemoryStore_expiredSlice( MemoryStore *store, uint64_t *passStart, size_t expired, size_t emptied, bool passDone ) {
+	store->expiry.expiredPeers  += expired;
+	store->expiry.emptiedSwarms += emptied;
+	if ( !passDone ) return;
+
+	uint64_t now = uv_now( store->timer->loop );
+	store->expiry.passes++;
+	store->expiry.lastPassMS = now - *passStart;
+	*passStart = now;
+	if ( store->expiry.lastPassMS > ExpiryPassMS + ExpiryStepMS )
+		log_warn( "Expiry is running behind: the last pass took %llums.", (unsigned long long)store->expiry.lastPassMS );
+}
+
+static void MemoryStore_expireSwarmsTimer( uv_timer_t *timer ) {
 	MemoryStore *store = timer->data;
-	store->cleanupTime = uv_now( timer->loop );
-	redisAsyncCommand( store->context, MemoryStore_cleanPeers, store, "SMEMBERS %s:torrents", store->namespace );
+	size_t expired = 0, emptied = 0;
+	size_t budget = store->expirySlice? store->expirySlice: ExpirySlice( SwarmTable_bucketCount( store->swarms ) );
+	uint64_t now = SwarmTable_now( store->swarms, uv_now( timer->loop ) );
+	bool passDone = SwarmTable_expire( store->swarms, DropThreshold( now ), budget, &expired, &emptied );
+	if ( ++store->syncStep >= SyncSteps ) {
+		store->syncStep = 0;
+		if ( SwarmTable_sync( store->swarms ) )
+			log_warn( "Couldn't write the swarms back to their file." );
+	}
+	MemoryStore_expiredSlice( store, &store->passStart, expired, emptied, passDone );
 }
 
-static void MemoryStore_backendAnnounceResponse( redisAsyncContext *context, void *voidReply, void *voidClient ) {
-	dbg_info( "backendAnnounceResponse" );
-	if ( !voidReply || !voidClient ) {
-		log_err( "WHat?????" );
+// The redis backend walks each shard's torrent index with SSCAN, one
+// slice per step, and never has more than one slice in flight on a
+// shard.
+static void MemoryStore_expiredPeers( redisAsyncContext *context, void *voidReply, void *voidShard ) {
+	redisReply *reply = voidReply;
+	MemoryStoreShard *shard = voidShard;
+	MemoryStore *store = shard->store;
+	shard->expiryInFlight = false;
+	if ( !reply ) return;
+
+	bool passDone = strcmp( shard->expiryCursor, "0" ) == 0;
+	if ( MemoryStore_missingScript( context, &store->expireScript, reply ) ) {
+		// this slice will be picked up again on the next pass.
+		MemoryStore_expiredSlice( store, &shard->passStart, 0, 0, passDone );
+		return;
+	}
+
+	if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ) {
+		log_warn( "Expiring peers failed: %s", reply->type == REDIS_REPLY_ERROR? reply->str: "unexpected reply" );
+		MemoryStore_expiredSlice( store, &shard->passStart, 0, 0, passDone );
+		return;
+	}
+
+	MemoryStore_expiredSlice( store, &shard->passStart, reply->element[0]->integer, reply->element[1]->integer, passDone );
+}
+
+static size_t MemoryStore_writeKey( char *key, const char *namespace, const char *infoHash, size_t infoHashLength, const char *suffix ) {
+	size_t namespaceLength = strlen( namespace ), suffixLength = strlen( suffix );
+	memcpy( key, namespace, namespaceLength );
+	key[namespaceLength] = ':';
+	memcpy( key + namespaceLength + 1, infoHash, infoHashLength );
+	memcpy( key + namespaceLength + 1 + infoHashLength, suffix, suffixLength );
+	return namespaceLength + 1 + infoHashLength + suffixLength;
+}
+
+static int MemoryStore_expireSlice( MemoryStoreShard *shard, redisAsyncContext *context, redisReply *infoHashes ) {
+	MemoryStore *store = shard->store;
+	size_t count = infoHashes->elements;
+	MemoryStoreScript *script = &store->expireScript;
+	// EVALSHA sha numkeys index {seeds4 peers4 seeds6 peers6 seeds46 peers46}... then {infoHash}...
+	size_t argc = 4 + FamilyKeyCount * count + 1 + count;
+	const char **argv = malloc( argc * sizeof(*argv) );
+	if ( !argv ) goto badArgv;
+
+	size_t *argvlen = malloc( argc * sizeof(*argvlen) );
+	if ( !argvlen ) goto badArgvlen;
+
+	size_t namespaceLength = strlen( store->namespace ), keysLength = namespaceLength + sizeof(":torrents");
+	for ( size_t i = 0; i < count; i++ )
+		keysLength += FamilyKeyCount * (namespaceLength + 1 + infoHashes->element[i]->len + FamilyKeyLongest);
+
+	char *keys = malloc( keysLength );
+	if ( !keys ) goto badKeys;
+
+	char numKeys[24], then[24];
+	snprintf( numKeys, sizeof(numKeys), "%zu", 1 + FamilyKeyCount * count );
+	snprintf( then, sizeof(then), "%llu", (unsigned long long)DropThreshold( uv_now( store->timer->loop ) ) );
+
+	size_t arg = 0;
+	if ( script->sha[0] ) {
+		argv[arg] = "EVALSHA"; argvlen[arg++] = 7;
+		argv[arg] = script->sha; argvlen[arg++] = strlen( script->sha );
+	} else {
+		argv[arg] = "EVAL"; argvlen[arg++] = 4;
+		argv[arg] = script->source; argvlen[arg++] = strlen( script->source );
+	}
+	argv[arg] = numKeys; argvlen[arg++] = strlen( numKeys );
+
+	char *key = keys;
+	argv[arg] = key; argvlen[arg] = MemoryStore_writeKey( key, store->namespace, "", 0, "torrents" );
+	key += argvlen[arg++];
+	for ( size_t i = 0; i < count; i++ ) {
+		redisReply *infoHash = infoHashes->element[i];
+		for ( size_t k = 0; k < FamilyKeyCount; k++ ) {
+			argv[arg] = key; argvlen[arg] = MemoryStore_writeKey( key, store->namespace, infoHash->str, infoHash->len, familyKeys[k] );
+			key += argvlen[arg++];
+		}
+	}
+
+	argv[arg] = then; argvlen[arg++] = strlen( then );
+	for ( size_t i = 0; i < count; i++ ) {
+		argv[arg] = infoHashes->element[i]->str; argvlen[arg++] = infoHashes->element[i]->len;
+	}
+
+	// hiredis copies the arguments into its own buffer.
+	int status = redisAsyncCommandArgv( context, MemoryStore_expiredPeers, shard, argc, argv, argvlen );
+	free( keys );
+	free( argvlen );
+	free( argv );
+	return status != REDIS_OK;
+
+badKeys:
+	free( argvlen );
+badArgvlen:
+	free( argv );
+badArgv:
+	return 1;
+}
+
+static void MemoryStore_scannedSlice( redisAsyncContext *context, void *voidReply, void *voidShard ) {
+	redisReply *reply = voidReply;
+	MemoryStoreShard *shard = voidShard;
+	if ( !reply ) {
+		shard->expiryInFlight = false;
+		return;
+	}
+
+	if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 2
+	     || reply->element[0]->type != REDIS_REPLY_STRING || reply->element[0]->len >= sizeof(shard->expiryCursor)
+	     || reply->element[1]->type != REDIS_REPLY_ARRAY ) {
+		log_warn( "Scanning the torrent index failed: %s", reply->type == REDIS_REPLY_ERROR? reply->str: "unexpected reply" );
+		shard->expiryInFlight = false;
 		return;
 	}
 
+	memcpy( shard->expiryCursor, reply->element[0]->str, reply->element[0]->len );
+	shard->expiryCursor[reply->element[0]->len] = '\0';
+
+	redisReply *infoHashes = reply->element[1];
+	if ( !infoHashes->elements || MemoryStore_expireSlice( shard, context, infoHashes ) ) {
+		shard->expiryInFlight = false;
+		MemoryStore_expiredSlice( shard->store, &shard->passStart, 0, 0, strcmp( shard->expiryCursor, "0" ) == 0 );
+	}
+}
+
+// Each step stays on one connection from start to finish. If that goes
+// down partway, the step is over, and the next one starts again from the
+// same cursor on whichever connection is up.
+static void MemoryStore_scanSlice( MemoryStoreShard *shard, redisAsyncContext *context ) {
+	if ( redisAsyncCommand( context, MemoryStore_scannedSlice, shard, "SSCAN %s:torrents %s COUNT %llu", shard->store->namespace, shard->expiryCursor, (unsigned long long)shard->passSlice ) != REDIS_OK )
+		shard->expiryInFlight = false;
+}
+
+static void MemoryStore_sizedPass( redisAsyncContext *context, void *voidReply, void *voidShard ) {
 	redisReply *reply = voidReply;
-	ClientConnection *client = voidClient;
-	ClientAnnounceData *announce = client->request.announce;
-	if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 4 ) {
-		Client_replyErrorLen( client, "A database error occurred." );
+	MemoryStoreShard *shard = voidShard;
+	if ( !reply || reply->type != REDIS_REPLY_INTEGER ) {
+		shard->expiryInFlight = false;
 		return;
 	}
 
-	for ( int i = 0; i < reply->elements; i++ ) {
-		if ( reply->element[i]->type == REDIS_REPLY_ERROR ) {
-			Client_replyErrorLen( client, "A database error occurred." );
+	shard->passSlice = ExpirySlice( (size_t)reply->integer );
+	MemoryStore_scanSlice( shard, context );
+}
+
+static void MemoryStore_expireShard( MemoryStoreShard *shard ) {
+	MemoryStore *store = shard->store;
+	if ( shard->expiryInFlight ) {
+		store->expiry.skippedSteps++;
+		return;
+	}
+
+	redisAsyncContext *context = RedisPool_pick( shard->redis, NULL, 0 );
+	if ( !context ) {
+		store->expiry.skippedSteps++;
+		return;
+	}
+
+	shard->expiryInFlight = true;
+	// each pass is sized from the index as it was when it started.
+	if ( strcmp( shard->expiryCursor, "0" ) == 0 ) {
+		if ( !store->expirySlice ) {
+			if ( redisAsyncCommand( context, MemoryStore_sizedPass, shard, "SCARD %s:torrents", store->namespace ) != REDIS_OK )
+				shard->expiryInFlight = false;
 			return;
 		}
+		shard->passSlice = store->expirySlice;
 	}
+	MemoryStore_scanSlice( shard, context );
+}
 
-	// now that the error checking is out of the way, sort of, grab what
-	// we came for.
-	long long   seedCount = reply->element[0]->integer,
-	            peerCount = reply->element[1]->integer;
-	redisReply *seeds = reply->element[2],
-	           *peers = reply->element[3];
-
-	dbg_info( "s: %zu, p: %zu", seeds->elements, peers->elements );
-	StringBuffer *peerBuf  = StringBuffer_new( );
-	if ( !peerBuf ) goto badPeerBuf;
-
-	StringBuffer *peerBuf6 = StringBuffer_new( );
-	if ( !peerBuf6 ) goto badPeerBuf6;
-
-	int i = 0;
-	while ( i < peers->elements && i < announce->numwant ) {
-		char *compact = peers->element[i]->str;
-		CompactAddress_dump( compact );
-		if ( compact[0] & CompactAddress_IPv4Flag ) {
-			StringBuffer_append( peerBuf, compact + CompactAddress_IPv4AddressOffset, CompactAddress_IPv4Size );
-		} else {//if ( announce->compact[0] & CompactAddress_IPv6Flag ) {
-			StringBuffer_append( peerBuf6, compact + CompactAddress_IPv6AddressOffset, CompactAddress_IPv6Size );
-		}
-		i++;
+static void MemoryStore_expirePeersTimer( uv_timer_t *timer ) {
+	MemoryStore *store = timer->data;
+	for ( size_t i = 0; i < store->shardCount; i++ )
+		MemoryStore_expireShard( &store->shards[i] );
+}
+
+// A full scrape walks every swarm, a slice at a time like expiry, but
+// one slice straight after another rather than one a step, and hands
+// what it found to the FullScrape to finish off the loop. A walk that
+// fails is tried again after a step, rather than a whole period.
+#define FullScrapeSlice 1024
+#define FullScrapeRetryMS ExpiryStepMS
+static void MemoryStore_fullScrapeStep( uv_timer_t *timer );
+static void MemoryStore_fullScrapeWalked( MemoryStore *store, bool failed );
+
+static void MemoryStore_fullScrapeVisit( void *voidStore, Swarm *swarm ) {
+	MemoryStore *store = voidStore;
+	if ( FullScrape_add( store->fullScrape, Swarm_infoHash( swarm ), Swarm_seedCount( swarm ), Swarm_peerCount( swarm ) ) )
+		store->fullScrapeFailed = true;
+}
+
+// The walk locks one stripe at a time, so the other workers only ever
+// wait on a piece of one slice.
+static void MemoryStore_nativeFullScrapeSlice( MemoryStore *store ) {
+	bool done = SwarmTable_walk( store->swarms, &store->fullScrapePosition, FullScrapeSlice, MemoryStore_fullScrapeVisit, store );
+	if ( done )
+		MemoryStore_fullScrapeWalked( store, store->fullScrapeFailed );
+	else
+		uv_timer_start( store->fullScrapeTimer, MemoryStore_fullScrapeStep, 0, 0 );
+}
+
+static void MemoryStore_fullScrapeShardWalked( MemoryStoreShard *shard, bool failed ) {
+	MemoryStore *store = shard->store;
+	store->fullScrapeFailed |= failed;
+	if ( !--store->fullScrapeShards )
+		MemoryStore_fullScrapeWalked( store, store->fullScrapeFailed );
+}
+
+static void MemoryStore_fullScrapeScanSlice( MemoryStoreShard *shard, redisAsyncContext *context );
+
+// The counts come back in the order the torrents were added, six sets
+// to each.
+static void MemoryStore_fullScrapeCounted( redisAsyncContext *context, void *voidReply, void *voidShard ) {
+	redisReply *reply = voidReply;
+	MemoryStoreShard *shard = voidShard;
+	FullScrape *scrape = shard->store->fullScrape;
+	size_t count = shard->fullScrapeCount;
+	if ( !reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != FamilyKeyCount * count ) {
+		MemoryStore_fullScrapeShardWalked( shard, true );
+		return;
 	}
 
-	// don't give seeds to seeds.
-	if ( announce->left != 0) {
-		int j = 0;
-		while ( j < seeds->elements && i < announce->numwant ) {
-			char *compact = seeds->element[j]->str;
-			CompactAddress_dump( compact );
-			if ( compact[0] & CompactAddress_IPv4Flag ) {
-				StringBuffer_append( peerBuf, compact + CompactAddress_IPv4AddressOffset, CompactAddress_IPv4Size );
-			} else {//if ( announce->compact[0] & CompactAddress_IPv6Flag ) {
-				StringBuffer_append( peerBuf6, compact + CompactAddress_IPv6AddressOffset, CompactAddress_IPv6Size );
+	for ( size_t i = 0; i < count; i++ ) {
+		redisReply **sets = reply->element + FamilyKeyCount * i;
+		for ( size_t k = 0; k < FamilyKeyCount; k++ ) {
+			if ( sets[k]->type != REDIS_REPLY_INTEGER ) {
+				MemoryStore_fullScrapeShardWalked( shard, true );
+				return;
 			}
-			j++;
-			i++;
 		}
+		FullScrape_setCounts( scrape, shard->fullScrapeFirst + i,
+		                      MemoryStore_distinct( sets[0]->integer, sets[2]->integer, sets[4]->integer ),
+		                      MemoryStore_distinct( sets[1]->integer, sets[3]->integer, sets[5]->integer ) );
+	}
+
+	if ( strcmp( shard->fullScrapeCursor, "0" ) == 0 )
+		MemoryStore_fullScrapeShardWalked( shard, false );
+	else
+		MemoryStore_fullScrapeScanSlice( shard, context );
+}
+
+// Each shard is walked on one of its connections, and a slice's counts
+// go in a single transaction, so that nothing else lands among them.
+// Every slice's torrents are added as soon as they come in and counted
+// in place, from the position they were added at.
+static void MemoryStore_fullScrapeScanned( redisAsyncContext *context, void *voidReply, void *voidShard ) {
+	redisReply *reply = voidReply;
+	MemoryStoreShard *shard = voidShard;
+	MemoryStore *store = shard->store;
+	if ( !reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2
+	     || reply->element[0]->type != REDIS_REPLY_STRING || reply->element[0]->len >= sizeof(shard->fullScrapeCursor)
+	     || reply->element[1]->type != REDIS_REPLY_ARRAY ) {
+		MemoryStore_fullScrapeShardWalked( shard, true );
+		return;
+	}
+
+	memcpy( shard->fullScrapeCursor, reply->element[0]->str, reply->element[0]->len );
+	shard->fullScrapeCursor[reply->element[0]->len] = '\0';
+
+	redisReply *infoHashes = reply->element[1];
+	shard->fullScrapeFirst = FullScrape_count( store->fullScrape );
+	shard->fullScrapeCount = 0;
+	bool counting = false;
+	for ( size_t i = 0; i < infoHashes->elements; i++ ) {
+		redisReply *infoHash = infoHashes->element[i];
+		if ( infoHash->type != REDIS_REPLY_STRING || infoHash->len != 20 ) continue;
+		if ( FullScrape_add( store->fullScrape, infoHash->str, 0, 0 ) ) {
+			store->fullScrapeFailed = true;
+			break;
+		}
+		if ( !counting ) {
+			redisAsyncCommand( context, NULL, NULL, "MULTI" );
+			counting = true;
+		}
+		shard->fullScrapeCount++;
+		for ( size_t k = 0; k < FamilyKeyCount; k++ )
+			redisAsyncCommand( context, NULL, NULL, "ZCARD %s:%b%s", store->namespace, infoHash->str, infoHash->len, familyKeys[k] );
+	}
+
+	if ( counting ) {
+		redisAsyncCommand( context, MemoryStore_fullScrapeCounted, shard, "EXEC" );
+	} else if ( strcmp( shard->fullScrapeCursor, "0" ) == 0 )
+		MemoryStore_fullScrapeShardWalked( shard, false );
+	else
+		MemoryStore_fullScrapeScanSlice( shard, context );
+}
+
+static void MemoryStore_fullScrapeScanSlice( MemoryStoreShard *shard, redisAsyncContext *context ) {
+	if ( redisAsyncCommand( context, MemoryStore_fullScrapeScanned, shard, "SSCAN %s:torrents %s COUNT %d", shard->store->namespace, shard->fullScrapeCursor, FullScrapeSlice ) != REDIS_OK )
+		MemoryStore_fullScrapeShardWalked( shard, true );
+}
+
+static void MemoryStore_redisFullScrape( MemoryStore *store ) {
+	// counted down as each shard finishes, including ones that can't start.
+	store->fullScrapeShards = store->shardCount;
+	for ( size_t i = 0; i < store->shardCount; i++ ) {
+		MemoryStoreShard *shard = &store->shards[i];
+		redisAsyncContext *context = RedisPool_pick( shard->redis, NULL, 0 );
+		strcpy( shard->fullScrapeCursor, "0" );
+		if ( !context ) {
+			MemoryStore_fullScrapeShardWalked( shard, true );
+			continue;
+		}
+		MemoryStore_fullScrapeScanSlice( shard, context );
+	}
+}
+
+static void MemoryStore_fullScrapeWalked( MemoryStore *store, bool failed ) {
+	store->fullScrapeWalking = false;
+	if ( failed ) {
+		log_warn( "The full scrape's walk didn't make it through every torrent, trying again shortly." );
+		FullScrape_abandon( store->fullScrape );
+	} else if ( !FullScrape_finish( store->fullScrape, store->fullScrapeTimer->loop ) ) {
+		uv_timer_start( store->fullScrapeTimer, MemoryStore_fullScrapeStep, store->fullScrapePeriod, 0 );
+		return;
+	}
+	uv_timer_start( store->fullScrapeTimer, MemoryStore_fullScrapeStep, FullScrapeRetryMS, 0 );
+}
+
+static void MemoryStore_fullScrapeStep( uv_timer_t *timer ) {
+	MemoryStore *store = timer->data;
+	if ( store->fullScrapeWalking ) {
+		MemoryStore_nativeFullScrapeSlice( store );
+		return;
+	}
+
+	// the last one is still being compressed.
+	if ( !FullScrape_begin( store->fullScrape ) ) {
+		uv_timer_start( timer, MemoryStore_fullScrapeStep, FullScrapeRetryMS, 0 );
+		return;
+	}
+	store->fullScrapeWalking = true;
+	store->fullScrapeFailed = false;
+	if ( store->backend == MemoryStoreBackend_native ) {
+		store->fullScrapePosition = (SwarmTableCursor){ 0, 0 };
+		MemoryStore_nativeFullScrapeSlice( store );
+	} else
+		MemoryStore_redisFullScrape( store );
+}
+
+// Both backends finish up here, so the reply encoding only lives in one
+// place. The peers are sent straight from peerBuf and peerBuf6, so they
+// have to last as long as the request does.
+static void MemoryStore_replyAnnounce( ClientConnection *client, long long seedCount, long long peerCount, StringBuffer *peerBuf, StringBuffer *peerBuf6 ) {
+	Stats *stats = client->server->stats;
+	if ( !stats->firstAnnounce )
+		stats->firstAnnounce = uv_hrtime( );
+
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		UDPTracker_appendAnnounce( client, seedCount, peerCount, peerBuf, peerBuf6 );
+		Client_reply( client );
+		return;
 	}
 
 	// According to BEP23, only supporting compact responses is allowed:
 	// http://bittorrent.org/beps/bep_0023.html
-	StringBuffer *bencode = StringBuffer_new( );
-	if ( !bencode ) goto badBencode;
-
-	StringBuffer_sprintf( bencode, "d8:completei%llde10:incompletei%llde8:intervali%de5:peers%lu:", seedCount, peerCount, AnnounceInterval, peerBuf->size );
-	StringBuffer_join( bencode, peerBuf );
-	StringBuffer_sprintf( bencode, "6:peers6%lu:", peerBuf6->size );
-	StringBuffer_join( bencode, peerBuf6 );
-	StringBuffer_append( bencode, "e", 1 );
-	StringBuffer_free( peerBuf );
-	StringBuffer_free( peerBuf6 );
-
-	StringBuffer_sprintf( client->writeBuffer, "%d\r\n\r\n", bencode->size );
-	StringBuffer_join( client->writeBuffer, bencode );
-	StringBuffer_free( bencode );
-
-	if ( announce->left == 0 )
-		redisAsyncCommand( context, NULL, NULL, "ZADD %s:%s:seeds %llu %b", client->server->memStore->namespace, announce->infoHash, announce->score, announce->compact, (size_t)CompactAddress_Size );
-	else
-		redisAsyncCommand( context, NULL, NULL, "ZADD %s:%s:peers %llu %b", client->server->memStore->namespace, announce->infoHash, announce->score, announce->compact, (size_t)CompactAddress_Size );
+	// Only the counts and lengths are written out. The peers and the
+	// closing literal go out as they are, alongside the header, in one
+	// write.
+	size_t head = Bencode_literalLength( "d" )
+		+ Bencode_keyLength( "complete" ) + Bencode_integerLength( seedCount )
+		+ Bencode_keyLength( "incomplete" ) + Bencode_integerLength( peerCount )
+		+ Bencode_keyLength( "interval" ) + Bencode_integerLength( AnnounceInterval )
+		+ Bencode_keyLength( "peers" ) + Bencode_decimalLength( peerBuf->size ) + 1;
+	size_t tail = Bencode_keyLength( "peers6" ) + Bencode_decimalLength( peerBuf6->size ) + 1;
+	size_t length = head + peerBuf->size + tail + peerBuf6->size + 1;
 
+	StringBuffer *out = client->writeBuffer;
+	char *cursor = StringBuffer_reserve( out, Bencode_contentLengthLength( length ) + head );
+	cursor = Bencode_writeContentLength( cursor, length );
+	cursor = Bencode_writeLiteral( cursor, "d" );
+	cursor = Bencode_writeInteger( Bencode_writeKey( cursor, "complete" ), seedCount );
+	cursor = Bencode_writeInteger( Bencode_writeKey( cursor, "incomplete" ), peerCount );
+	cursor = Bencode_writeInteger( Bencode_writeKey( cursor, "interval" ), AnnounceInterval );
+	cursor = Bencode_writeStringHeader( Bencode_writeKey( cursor, "peers" ), peerBuf->size );
+	StringBuffer_commit( out, cursor );
+	Client_appendReference( client, peerBuf->str, peerBuf->size );
+
+	// Already room, unless the peers had to be copied in after all.
+	cursor = StringBuffer_reserve( out, tail );
+	cursor = Bencode_writeStringHeader( Bencode_writeKey( cursor, "peers6" ), peerBuf6->size );
+	StringBuffer_commit( out, cursor );
+	Client_appendReference( client, peerBuf6->str, peerBuf6->size );
+	Client_appendReference( client, "e", 1 );
 	Client_reply( client );
-	return;
+}
 
+// Expects complete and incomplete to have been filled in on every entry
+// of the client's scrape list.
+static void MemoryStore_replyScrape( ClientConnection *client ) {
+	ScrapeData *scrape = client->request.scrape;
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		for ( ; scrape; scrape = scrape->next )
+			UDPTracker_appendScrape( client, scrape->complete, scrape->incomplete );
+		Client_reply( client );
+		return;
+	}
 
-badBencode:
-	StringBuffer_free( peerBuf6 );
-badPeerBuf6:
-	StringBuffer_free( peerBuf );
-badPeerBuf:
-	Client_replyErrorLen( client, "An unknown error occurred." );
+	// d5:filesd, then an entry keyed by the 20 byte hash for every file,
+	// and ee.
+	size_t length = Bencode_literalLength( "d" ) + Bencode_keyLength( "files" ) + Bencode_literalLength( "d" ) + Bencode_literalLength( "ee" );
+	for ( ScrapeData *file = scrape; file; file = file->next )
+		length += Scrape_fileLength( file->complete, file->incomplete );
+
+	StringBuffer *out = client->writeBuffer;
+	char *cursor = StringBuffer_reserve( out, Bencode_contentLengthLength( length ) + length );
+	cursor = Bencode_writeContentLength( cursor, length );
+	cursor = Bencode_writeLiteral( Bencode_writeKey( Bencode_writeLiteral( cursor, "d" ), "files" ), "d" );
+	for ( ; scrape; scrape = scrape->next )
+		cursor = Scrape_writeFile( cursor, scrape->compactHash, scrape->complete, scrape->incomplete );
+	cursor = Bencode_writeLiteral( cursor, "ee" );
+	StringBuffer_commit( out, cursor );
+	Client_reply( client );
 }
 
-void MemoryStore_processAnnounce( MemoryStore *store, ClientConnection *client ) {
+static void MemoryStore_redisAnnounce( MemoryStore *store, ClientConnection *client );
+
+// Whether there's room for another redis request. Past half of the
+// limit, only announces get through, since those are what keep swarms
+// alive, and scrapes are the first to go. Anything turned away gets a
+// canned reply and never reaches redis.
+static bool MemoryStore_admit( MemoryStore *store, ClientConnection *client ) {
+	size_t limit = store->outstandingLimit;
+	if ( client->requestType == ClientRequest_scrape )
+		limit = (limit + 1) / 2;
+	if ( !store->outstandingLimit || store->outstanding < limit ) {
+		store->outstanding++;
+		return true;
+	}
+
+	client->server->stats->shedRequests[client->requestType == ClientRequest_scrape? StatsRoute_scrape: StatsRoute_announce]++;
+	Client_replyBusy( client );
+	return false;
+}
+
+// Jump consistent hash (Lamping and Veach), so that adding a shard to
+// the end of the list only moves the torrents that now belong on it. The
+// key is read big endian, so every tracker agrees on where a torrent is,
+// and it's the start of the info hash, where the pool's hash for picking
+// a connection is over all of it.
+static MemoryStoreShard *MemoryStore_shard( MemoryStore *store, const char *infoHash ) {
+	uint64_t key = 0;
+	for ( int i = 0; i < 8; i++ )
+		key = key << 8 | (unsigned char)infoHash[i];
+
+	int64_t bucket = -1, next = 0;
+	while ( next < (int64_t)store->shardCount ) {
+		bucket = next;
+		key = key * 2862933555777941757ULL + 1;
+		next = (int64_t)((bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+	return &store->shards[bucket];
+}
+
+// For requests redis never answered, either because no connection was
+// up to send them on, or because theirs went down first. They're failed
+// straight away rather than held until it comes back.
+#define UnavailableMessage "The database is unavailable, try again later."
+static void MemoryStore_replyUnavailable( ClientConnection *client ) {
+	client->server->stats->redisErrors++;
+	Client_replyErrorLen( client, UnavailableMessage );
+}
+
+static void MemoryStore_backendAnnounceResponse( redisAsyncContext *context, void *voidReply, void *voidClient ) {
+	dbg_info( "backendAnnounceResponse" );
+	ClientConnection *client = voidClient;
+	MemoryStore *store = client->server->memStore;
+	store->outstanding--;
+	MemoryStore_shard( store, client->request.announce->compactHash )->outstanding--;
+	if ( !voidReply ) {
+		MemoryStore_replyUnavailable( client );
+		return;
+	}
+
+	redisReply *reply = voidReply;
+	// Only EVALSHA can fail this way, and the retry sends the whole
+	// script, so it can't loop.
+	if ( MemoryStore_missingScript( context, &store->announceScript, reply ) ) {
+		store->outstanding++;
+		MemoryStore_redisAnnounce( store, client );
+		return;
+	}
+
+	if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 4
+	     || reply->element[0]->type != REDIS_REPLY_INTEGER || reply->element[1]->type != REDIS_REPLY_INTEGER
+	     || reply->element[2]->type != REDIS_REPLY_STRING  || reply->element[3]->type != REDIS_REPLY_STRING ) {
+		client->server->stats->redisErrors++;
+		Client_replyErrorLen( client, "A database error occurred." );
+		return;
+	}
+
+	// The script has already packed the peers, so they can be handed to
+	// the reply as they are. hiredis frees the reply as soon as this
+	// returns, though, so a TCP reply needs them moved somewhere that lasts
+	// until it has been written.
+	StringBuffer peerBuf  = { reply->element[2]->str, reply->element[2]->len, reply->element[2]->len };
+	StringBuffer peerBuf6 = { reply->element[3]->str, reply->element[3]->len, reply->element[3]->len };
+	if ( client->server->protocol == ServerProtocol_TCP ) {
+		peerBuf.str  = Arena_alloc( client->arena, peerBuf.size + peerBuf6.size );
+		Client_CheckAllocReplyError( client, peerBuf.str );
+		peerBuf6.str = peerBuf.str + peerBuf.size;
+		memcpy( peerBuf.str,  reply->element[2]->str, peerBuf.size );
+		memcpy( peerBuf6.str, reply->element[3]->str, peerBuf6.size );
+	}
+	dbg_info( "s: %zu, p6: %zu", peerBuf.size, peerBuf6.size );
+	MemoryStore_replyAnnounce( client, reply->element[0]->integer, reply->element[1]->integer, &peerBuf, &peerBuf6 );
+}
+
+static void MemoryStore_redisAnnounce( MemoryStore *store, ClientConnection *client ) {
 	ClientAnnounceData *announce = client->request.announce;
-	uint64_t then = announce->score - DropIntervalMS;
-	redisAsyncCommand( store->context, NULL, NULL, "MULTI" );
+	uint64_t then = DropThreshold( announce->score );
+	const char *seeding = announce->left == 0? "1": "0";
 
 	// Used for complete and incomplete fields in response. May be a bit
 	// inaccurate, since old peer pruning is run in its own separate loop.
 	// I doubt this is really a problem.
-	redisAsyncCommand( store->context, NULL, NULL, "ZCARD %s:%s:seeds", store->namespace, announce->infoHash );
-	redisAsyncCommand( store->context, NULL, NULL, "ZCARD %s:%s:peers", store->namespace, announce->infoHash );
+	MemoryStoreScript *script = &store->announceScript;
+	const char *namespace = store->namespace, *hash = announce->compactHash, *compact = announce->compact;
+	size_t hashSize = sizeof(announce->compactHash);
+	size_t ipv4Size = compact[0] & CompactAddress_IPv4Flag? CompactAddress_IPv4Size: 0,
+	       ipv6Size = compact[0] & CompactAddress_IPv6Flag? CompactAddress_IPv6Size: 0;
+	MemoryStoreShard *shard = MemoryStore_shard( store, hash );
+	redisAsyncContext *context = RedisPool_pick( shard->redis, hash, hashSize );
+	if ( !context || redisAsyncCommand( context, MemoryStore_backendAnnounceResponse, client, "%s %s 7 %s:%b:seeds4 %s:%b:peers4 %s:%b:seeds6 %s:%b:peers6 %s:torrents %s:%b:seeds46 %s:%b:peers46 %llu %llu %d %s %b %b %b %u",
+	                                    script->sha[0]? "EVALSHA": "EVAL", script->sha[0]? script->sha: script->source,
+	                                    namespace, hash, hashSize, namespace, hash, hashSize, namespace, hash, hashSize, namespace, hash, hashSize, namespace,
+	                                    namespace, hash, hashSize, namespace, hash, hashSize,
+	                                    announce->score, then, announce->numwant, seeding,
+	                                    compact + CompactAddress_IPv4AddressOffset, ipv4Size, compact + CompactAddress_IPv6AddressOffset, ipv6Size, hash, hashSize,
+	                                    MemoryStore_sampleSeed( store ) ) != REDIS_OK ) {
+		store->outstanding--;
+		MemoryStore_replyUnavailable( client );
+		return;
+	}
+	shard->outstanding++;
+}
 
-	redisAsyncCommand( store->context, NULL, NULL, "ZREVRANGEBYSCORE %s:%s:seeds %llu %llu LIMIT 0 %d", store->namespace, announce->infoHash, announce->score, then, announce->numwant );
-	redisAsyncCommand( store->context, NULL, NULL, "ZREVRANGEBYSCORE %s:%s:peers %llu %llu LIMIT 0 %d", store->namespace, announce->infoHash, announce->score, then, announce->numwant );
+static void MemoryStore_nativeAnnounce( MemoryStore *store, ClientConnection *client ) {
+	ClientAnnounceData *announce = client->request.announce;
+	uint64_t now = SwarmTable_now( store->swarms, announce->score ), then = DropThreshold( now );
+	// numwant is capped when the announce is parsed, so each family's
+	// peers always fit here and the buffers never need to grow. They come from the
+	// arena because the reply is written straight from them.
+	size_t peersSize = MaxNumwant * CompactAddress_IPv4Size, peers6Size = MaxNumwant * CompactAddress_IPv6Size;
+	char *peers = Arena_alloc( client->arena, peersSize + peers6Size );
+	Client_CheckAllocReplyError( client, peers );
+	StringBuffer peerBuf  = { peers, 0, peersSize };
+	StringBuffer peerBuf6 = { peers + peersSize, 0, peers6Size };
 
-	redisAsyncCommand( store->context, MemoryStore_backendAnnounceResponse, client, "EXEC" );
+	size_t stripe = SwarmTable_lock( store->swarms, announce->compactHash );
+	Swarm *swarm = SwarmTable_findOrCreate( store->swarms, announce->compactHash );
+	if ( !swarm ) goto badSwarm;
+
+	// Same order as the redis backend: count and pick peers first, and
+	// only then add the announcing peer.
+	long long seedCount = Swarm_seedCount( swarm ),
+	          peerCount = Swarm_peerCount( swarm );
+	bool ipv6First = !(announce->compact[0] & CompactAddress_IPv4Flag);
+	SwarmTable_selectPeers( store->swarms, swarm, announce->left == 0, ipv6First, then, announce->numwant, MemoryStore_sampleSeed( store ), &peerBuf, &peerBuf6 );
+
+	if ( SwarmTable_announce( store->swarms, swarm, announce->compact, announce->left == 0, now, then ) )
+		log_warn( "Could not add peer to swarm." );
+	SwarmTable_unlock( store->swarms, stripe );
+
+	MemoryStore_replyAnnounce( client, seedCount, peerCount, &peerBuf, &peerBuf6 );
+	return;
+
+badSwarm:
+	SwarmTable_unlock( store->swarms, stripe );
+	Client_replyErrorLen( client, "An unknown error occurred." );
 }
 
-static void MemoryStore_backendScrapeResponse( redisAsyncContext *context, void *voidReply, void *voidClient ) {
-	dbg_info( "backendScrapeResponse" );
-	if ( !voidReply || !voidClient ) {
-		log_err( "What2???" );
+void MemoryStore_processAnnounce( MemoryStore *store, ClientConnection *client ) {
+	if ( store->backend == MemoryStoreBackend_native ) {
+		MemoryStore_nativeAnnounce( store, client );
 		return;
 	}
 
-	redisReply *reply = voidReply;
-	ClientConnection *client = voidClient;
-	if ( reply->type != REDIS_REPLY_ARRAY ) {
-		Client_replyErrorLen( client, "A database error occurred." );
+	if ( MemoryStore_admit( store, client ) )
+		MemoryStore_redisAnnounce( store, client );
+}
+
+static void MemoryStore_scrapeGathered( MemoryStoreScrapeGather *gather ) {
+	ClientConnection *client = gather->client;
+	client->server->memStore->outstanding--;
+	if ( gather->error ) {
+		client->server->stats->redisErrors++;
+		Client_replyErrorLen( client, gather->error );
 		return;
 	}
+	MemoryStore_replyScrape( client );
+}
 
-	ScrapeData *scrape = client->request.scrape;
-	StringBuffer *bencode  = StringBuffer_new( );
-	Client_CheckAllocReplyError( client, bencode );
+static void MemoryStore_backendScrapeResponse( redisAsyncContext *context, void *voidReply, void *voidPart ) {
+	dbg_info( "backendScrapeResponse" );
+	MemoryStoreScrapePart *part = voidPart;
+	MemoryStoreScrapeGather *gather = part->gather;
+	MemoryStoreShard *shard = part->shard;
+	MemoryStore *store = shard->store;
+	shard->outstanding--;
 
-	StringBuffer_sprintf( bencode, "d5:filesd" );
-	for ( int i = 0; i < reply->elements; i += 2, scrape = scrape->next ) {
-		if ( reply->element[i]->type == REDIS_REPLY_ERROR || reply->element[i+1]->type == REDIS_REPLY_ERROR ) {
-			Client_replyErrorLen( client, "A database error occurred." );
-			return;
+	redisReply *reply = voidReply;
+	if ( !reply ) {
+		if ( !gather->error )
+			gather->error = UnavailableMessage;
+		goto gathered;
+	}
+	if ( reply->type != REDIS_REPLY_ARRAY ) goto badReply;
+
+	// Only the hashes on this shard that missed the cache were asked
+	// about, in the order they were asked.
+	ScrapeData *scrape = gather->client->request.scrape;
+	uint64_t now = uv_now( store->timer->loop );
+	// each one is seeds4, peers4, seeds6, peers6, seeds46, peers46.
+	for ( int i = 0; i + FamilyKeyCount <= reply->elements && scrape; scrape = scrape->next ) {
+		if ( scrape->cached || MemoryStore_shard( store, scrape->compactHash ) != shard ) continue;
+
+		for ( int k = 0; k < FamilyKeyCount; k++ ) {
+			if ( reply->element[i + k]->type != REDIS_REPLY_INTEGER ) goto badReply;
 		}
-		long long complete   = reply->element[i]->integer;
-		long long incomplete = reply->element[i+1]->integer;
-		StringBuffer_append( bencode, "20:", 4 );
-		StringBuffer_append( bencode, scrape->compactHash, 20 );
-		StringBuffer_safeSprintf( bencode, "d8:completei%llde10:downloadedi0e10:incompletei%lldee", complete, incomplete );
+		redisReply **sets = reply->element + i;
+		scrape->complete   = MemoryStore_distinct( sets[0]->integer, sets[2]->integer, sets[4]->integer );
+		scrape->incomplete = MemoryStore_distinct( sets[1]->integer, sets[3]->integer, sets[5]->integer );
+		if ( store->scrapeCache )
+			ScrapeCache_store( store->scrapeCache, scrape->compactHash, now, scrape->complete, scrape->incomplete );
+		i += FamilyKeyCount;
 	}
+	goto gathered;
 
-	StringBuffer_append( bencode, "ee", 2 );
-	StringBuffer_sprintf( client->writeBuffer, "%d\r\n\r\n", bencode->size );
-	StringBuffer_join( client->writeBuffer, bencode );
-	StringBuffer_free( bencode );
-	Client_reply( client );
+badReply:
+	if ( !gather->error )
+		gather->error = "A database error occurred.";
+gathered:
+	if ( !--gather->pending )
+		MemoryStore_scrapeGathered( gather );
+}
+
+// Sends a shard its part of a scrape, as one transaction on one
+// connection. Returns false if it couldn't be sent.
+static bool MemoryStore_sendScrapePart( MemoryStoreScrapePart *part ) {
+	MemoryStoreShard *shard = part->shard;
+	MemoryStore *store = shard->store;
+	ScrapeData *scrape = part->gather->client->request.scrape;
+	// the connection for the first torrent the shard is asked about.
+	while ( scrape->cached || MemoryStore_shard( store, scrape->compactHash ) != shard )
+		scrape = scrape->next;
+	redisAsyncContext *context = RedisPool_pick( shard->redis, scrape->compactHash, sizeof(scrape->compactHash) );
+	// Once MULTI is in, the connection can only fail by going down, which
+	// answers EXEC with a NULL reply along with everything else.
+	if ( !context || redisAsyncCommand( context, NULL, NULL, "MULTI" ) != REDIS_OK )
+		return false;
+
+	for ( ; scrape; scrape = scrape->next ) {
+		if ( scrape->cached || MemoryStore_shard( store, scrape->compactHash ) != shard ) continue;
+
+		for ( size_t k = 0; k < FamilyKeyCount; k++ )
+			redisAsyncCommand( context, NULL, NULL, "ZCARD %s:%b%s", store->namespace, scrape->compactHash, sizeof(scrape->compactHash), familyKeys[k] );
+	}
+	redisAsyncCommand( context, MemoryStore_backendScrapeResponse, part, "EXEC" );
+	shard->outstanding++;
+	return true;
+}
+
+// Fills in whatever the cache knows about. Returns true if that was all
+// of them.
+static bool MemoryStore_cachedScrape( MemoryStore *store, ScrapeData *scrape ) {
+	uint64_t now = uv_now( store->timer->loop );
+	bool complete = true;
+	for ( ; scrape; scrape = scrape->next ) {
+		scrape->cached = ScrapeCache_lookup( store->scrapeCache, scrape->compactHash, now, &scrape->complete, &scrape->incomplete );
+		complete &= scrape->cached;
+	}
+	return complete;
 }
 
 void MemoryStore_processScrape( MemoryStore *store, ClientConnection *client ) {
 	ScrapeData *scrape = client->request.scrape;
-	redisAsyncCommand( store->context, NULL, NULL, "MULTI" );
-	while ( scrape ) {
-		redisAsyncCommand( store->context, NULL, NULL, "ZCARD %s:%s:seeds", store->namespace, scrape->infoHash );
-		redisAsyncCommand( store->context, NULL, NULL, "ZCARD %s:%s:peers", store->namespace, scrape->infoHash );
-		scrape = scrape->next;
+	if ( store->backend == MemoryStoreBackend_native ) {
+		for ( ; scrape; scrape = scrape->next ) {
+			size_t stripe = SwarmTable_lock( store->swarms, scrape->compactHash );
+			Swarm *swarm = SwarmTable_find( store->swarms, scrape->compactHash );
+			scrape->complete   = swarm? Swarm_seedCount( swarm ): 0;
+			scrape->incomplete = swarm? Swarm_peerCount( swarm ): 0;
+			SwarmTable_unlock( store->swarms, stripe );
+		}
+		MemoryStore_replyScrape( client );
+		return;
+	}
+
+	if ( store->scrapeCache && MemoryStore_cachedScrape( store, scrape ) ) {
+		MemoryStore_replyScrape( client );
+		return;
+	}
+	if ( !MemoryStore_admit( store, client ) ) return;
+
+	// It lives in the client's arena, which lasts until the reply has
+	// gone out, even if the connection has given up on it by then.
+	MemoryStoreScrapeGather *gather = Arena_alloc( client->arena, sizeof(*gather) + store->shardCount * sizeof(*gather->parts) );
+	if ( !gather ) {
+		store->outstanding--;
+		Client_replyErrorLen( client, "An unknown error occurred." );
+		return;
+	}
+	gather->client = client;
+	gather->pending = 0;
+	gather->error = NULL;
+	for ( size_t i = 0; i < store->shardCount; i++ )
+		gather->parts[i] = (MemoryStoreScrapePart){ gather, NULL };
+
+	// Everything is counted before anything is sent, so that no answer
+	// can look like the last one early.
+	for ( scrape = client->request.scrape; scrape; scrape = scrape->next ) {
+		if ( scrape->cached ) continue;
+
+		MemoryStoreShard *shard = MemoryStore_shard( store, scrape->compactHash );
+		MemoryStoreScrapePart *part = &gather->parts[shard - store->shards];
+		if ( !part->shard ) {
+			part->shard = shard;
+			gather->pending++;
+		}
+	}
+
+	size_t unsent = 0;
+	for ( size_t i = 0; i < store->shardCount; i++ ) {
+		if ( gather->parts[i].shard && !MemoryStore_sendScrapePart( &gather->parts[i] ) )
+			unsent++;
+	}
+	if ( unsent ) {
+		gather->error = UnavailableMessage;
+		gather->pending -= unsent;
+		if ( !gather->pending )
+			MemoryStore_scrapeGathered( gather );
 	}
-	redisAsyncCommand( store->context, MemoryStore_backendScrapeResponse, client, "EXEC" );
 }
@@ -1,14 +1,79 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+#include "RedisPool.h"
+
 typedef struct _MemoryStore MemoryStore;
+typedef enum _MemoryStoreBackend MemoryStoreBackend;
+typedef enum _MemoryStorePeerSelection MemoryStorePeerSelection;
+typedef struct _MemoryStoreExpiryStats MemoryStoreExpiryStats;
+typedef struct _MemoryStoreRedisStats MemoryStoreRedisStats;
+
+enum _MemoryStoreBackend {
+	MemoryStoreBackend_redis,
+	// swarms are kept in the tracker process itself.
+	MemoryStoreBackend_native,
+};
+
+// Which of a swarm's peers an announce gets back.
+enum _MemoryStorePeerSelection {
+	// the most recently seen.
+	MemoryStorePeerSelection_newest,
+	// an even sample of everyone seen within the drop interval, which
+	// spreads new connections over the whole of a large swarm.
+	MemoryStorePeerSelection_random,
+};
+
+struct _MemoryStoreExpiryStats {
+	uint64_t passes;
+	// How long the last full pass over the swarms took, how long the
+	// current one has been going, and how long a pass should take.
+	uint64_t lastPassMS;
+	uint64_t currentPassMS;
+	uint64_t targetPassMS;
+	// how far the slower of the two is past the target.
+	uint64_t lagMS;
+	// peers and swarms dropped by the sweep.
+	uint64_t expiredPeers;
+	uint64_t emptiedSwarms;
+	// steps skipped because redis hadn't finished the previous slice.
+	uint64_t skippedSteps;
+};
+
+// for one shard.
+struct _MemoryStoreRedisStats {
+	RedisPoolStats pool;
+	// requests sent to it and not yet answered.
+	size_t outstanding;
+};
+
+// 30 mins
+#define AnnounceInterval 1800
 
 #include "client.h"
+#include "ScrapeCache.h"
+#include "FullScrape.h"
 
-MemoryStore *MemoryStore_new( const char *namespace );
+MemoryStore *MemoryStore_new( const char *namespace, MemoryStoreBackend backend );
 void MemoryStore_free( MemoryStore *store );
-int  MemoryStore_initConnection( MemoryStore *store, const char *host, short port );
+int  MemoryStore_initConnection( MemoryStore *store, const char *addresses, size_t connections );
 int  MemoryStore_attachToLoop( MemoryStore *store, uv_loop_t *loop );
 int  MemoryStore_disconnect( MemoryStore *store );
+void MemoryStore_shareSwarms( MemoryStore *store, MemoryStore *owner );
+int  MemoryStore_setSwarmFile( MemoryStore *store, const char *path );
+void MemoryStore_setBackendLimit( MemoryStore *store, size_t limit );
+void MemoryStore_setExpirySlice( MemoryStore *store, size_t slice );
+void MemoryStore_expiryStats( MemoryStore *store, MemoryStoreExpiryStats *stats );
+int  MemoryStore_setPeerSelection( MemoryStore *store, MemoryStorePeerSelection selection );
+int  MemoryStore_setScrapeCache( MemoryStore *store, size_t capacity, uint64_t ttl );
+bool MemoryStore_scrapeCacheStats( MemoryStore *store, ScrapeCacheStats *stats );
+bool MemoryStore_redisStats( MemoryStore *store, size_t shard, MemoryStoreRedisStats *stats );
+// period in ms, 0 for none.
+void MemoryStore_setFullScrape( MemoryStore *store, FullScrape *scrape, uint64_t period );
+FullScrape *MemoryStore_fullScrape( MemoryStore *store );
 
 void MemoryStore_processAnnounce( MemoryStore *store, ClientConnection *client );
 void MemoryStore_processScrape( MemoryStore *store, ClientConnection *client );
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/adapters/libuv.h>
+
+#include "RedisPool.h"
+#include "dbg.h"
+
+#define RedisPoolFirstRetryMS 100
+#define RedisPoolLastRetryMS  10000
+
+typedef struct _RedisConnection RedisConnection;
+
+struct _RedisConnection {
+	RedisPool *pool;
+	// NULL while waiting to try again.
+	redisAsyncContext *context;
+	bool connected;
+	// set once the connection has been lost, or never made, until it's
+	// back.
+	bool lost;
+	// attempts in a row that didn't work, which sets the backoff.
+	unsigned failures;
+	uv_timer_t retry;
+};
+
+struct _RedisPool {
+	// as it was given, for messages.
+	char *address;
+	// either a path for a unix socket, or a host and port.
+	char *path;
+	char *host;
+	int port;
+	uv_loop_t *loop;
+	RedisPoolConnectCallback *connectCallback;
+	void *connectData;
+	bool stopping;
+	uint64_t reconnects;
+	uint64_t disconnects;
+	size_t size;
+	RedisConnection connections[];
+};
+
+RedisPool *RedisPool_new( const char *address, size_t size ) {
+	if ( !size ) size = 1;
+	RedisPool *pool = malloc( sizeof(*pool) + size * sizeof(*pool->connections) );
+	if ( !pool ) goto badPool;
+
+	pool->address = strdup( address );
+	if ( !pool->address ) goto badAddress;
+
+	pool->path = NULL;
+	pool->host = NULL;
+	pool->port = 6379;
+	if ( address[0] == '/' ) {
+		pool->path = strdup( address );
+		if ( !pool->path ) goto badHost;
+	} else {
+		pool->host = strdup( address );
+		if ( !pool->host ) goto badHost;
+
+		// a bracketed IPv6 address has colons of its own.
+		char *port = strrchr( pool->host, ':' ), *close = strrchr( pool->host, ']' );
+		if ( port && (!close || port > close) ) {
+			*port++ = '\0';
+			pool->port = atoi( port );
+		}
+		if ( pool->host[0] == '[' && close ) {
+			*strrchr( pool->host, ']' ) = '\0';
+			memmove( pool->host, pool->host + 1, strlen( pool->host ) );
+		}
+		if ( !pool->host[0] || pool->port <= 0 || pool->port > 65535 ) {
+			log_err( "%s isn't a host:port or a path to a unix socket.", address );
+			goto badPort;
+		}
+	}
+
+	pool->loop = NULL;
+	pool->connectCallback = NULL;
+	pool->connectData = NULL;
+	pool->stopping = false;
+	pool->reconnects = 0;
+	pool->disconnects = 0;
+	pool->size = size;
+	for ( size_t i = 0; i < size; i++ ) {
+		RedisConnection *connection = &pool->connections[i];
+		connection->pool = pool;
+		connection->context = NULL;
+		connection->connected = false;
+		connection->lost = false;
+		connection->failures = 0;
+	}
+	return pool;
+
+badPort:
+	free( pool->host );
+badHost:
+	free( pool->address );
+badAddress:
+	free( pool );
+badPool:
+	return NULL;
+}
+
+// Only once the loop is done with, since hiredis still has contexts that
+// point back here.
+void RedisPool_free( RedisPool *pool ) {
+	if ( !pool ) return;
+
+	free( pool->address );
+	free( pool->path );
+	free( pool->host );
+	free( pool );
+}
+
+void RedisPool_setConnectCallback( RedisPool *pool, RedisPoolConnectCallback *callback, void *data ) {
+	pool->connectCallback = callback;
+	pool->connectData = data;
+}
+
+static void RedisPool_connect( RedisConnection *connection );
+
+static void RedisPool_retryTimer( uv_timer_t *timer ) {
+	RedisPool_connect( timer->data );
+}
+
+// Waits a little longer after each failure in a row.
+static void RedisPool_retry( RedisConnection *connection ) {
+	RedisPool *pool = connection->pool;
+	connection->context = NULL;
+	connection->connected = false;
+	if ( pool->stopping ) return;
+
+	uint64_t delay = RedisPoolFirstRetryMS;
+	for ( unsigned i = 0; i < connection->failures && delay < RedisPoolLastRetryMS; i++ )
+		delay *= 2;
+	if ( delay > RedisPoolLastRetryMS )
+		delay = RedisPoolLastRetryMS;
+	connection->failures++;
+	uv_timer_start( &connection->retry, RedisPool_retryTimer, delay, 0 );
+}
+
+static void RedisPool_connected( const redisAsyncContext *context, int status ) {
+	RedisConnection *connection = context->data;
+	RedisPool *pool = connection->pool;
+	if ( status != REDIS_OK ) {
+		// hiredis frees the context once this returns.
+		if ( !connection->failures )
+			log_warn( "Couldn't connect to redis at %s: %s", pool->address, context->errstr );
+		connection->lost = true;
+		RedisPool_retry( connection );
+		return;
+	}
+
+	connection->connected = true;
+	connection->failures = 0;
+	if ( connection->lost ) {
+		connection->lost = false;
+		pool->reconnects++;
+		log_info( "Reconnected to redis at %s.", pool->address );
+	} else
+		dbg_info( "Connected to redis." );
+	if ( pool->connectCallback )
+		pool->connectCallback( connection->context, pool->connectData );
+}
+
+// Anything still waiting on the context has already been called with a
+// NULL reply by the time this is.
+static void RedisPool_disconnected( const redisAsyncContext *context, int status ) {
+	RedisConnection *connection = context->data;
+	RedisPool *pool = connection->pool;
+	if ( pool->stopping ) {
+		dbg_info( "Disconnected from redis." );
+		connection->context = NULL;
+		connection->connected = false;
+		return;
+	}
+
+	log_warn( "Lost the connection to redis at %s: %s", pool->address, status == REDIS_OK? "closed": context->errstr );
+	pool->disconnects++;
+	connection->lost = true;
+	RedisPool_retry( connection );
+}
+
+static void RedisPool_connect( RedisConnection *connection ) {
+	RedisPool *pool = connection->pool;
+	redisAsyncContext *context = pool->path? redisAsyncConnectUnix( pool->path ): redisAsyncConnect( pool->host, pool->port );
+	if ( !context ) {
+		connection->lost = true;
+		RedisPool_retry( connection );
+		return;
+	}
+	if ( context->err ) {
+		if ( !connection->failures )
+			log_warn( "Couldn't connect to redis at %s: %s", pool->address, context->errstr );
+		redisAsyncFree( context );
+		connection->lost = true;
+		RedisPool_retry( connection );
+		return;
+	}
+
+	context->data = connection;
+	connection->context = context;
+	redisLibuvAttach( context, pool->loop );
+	redisAsyncSetConnectCallback( context, RedisPool_connected );
+	redisAsyncSetDisconnectCallback( context, RedisPool_disconnected );
+}
+
+// Connections that can't be made yet are tried again later, rather than
+// keeping the tracker from starting.
+int RedisPool_attachToLoop( RedisPool *pool, uv_loop_t *loop ) {
+	pool->loop = loop;
+	for ( size_t i = 0; i < pool->size; i++ ) {
+		RedisConnection *connection = &pool->connections[i];
+		if ( uv_timer_init( loop, &connection->retry ) ) return 1;
+		connection->retry.data = connection;
+		RedisPool_connect( connection );
+	}
+	return 0;
+}
+
+void RedisPool_disconnect( RedisPool *pool ) {
+	pool->stopping = true;
+	if ( !pool->loop ) return;
+
+	for ( size_t i = 0; i < pool->size; i++ ) {
+		RedisConnection *connection = &pool->connections[i];
+		uv_timer_stop( &connection->retry );
+		uv_close( (uv_handle_t *)&connection->retry, NULL );
+		// Freed rather than disconnected, which would wait on anything
+		// outstanding, so that the context's handles are already closing
+		// when the worker closes whatever is left on its loop. Anything
+		// waiting is called with a NULL reply.
+		if ( connection->context )
+			redisAsyncFree( connection->context );
+		connection->context = NULL;
+		connection->connected = false;
+	}
+}
+
+// FNV-1a, which spreads out even keys that are mostly the same, and is
+// quick over something the size of an info hash.
+static uint32_t RedisPool_hash( const char *key, size_t length ) {
+	uint32_t hash = 0x811C9DC5;
+	for ( size_t i = 0; i < length; i++ )
+		hash = (hash ^ (unsigned char)key[i]) * 0x01000193;
+	return hash;
+}
+
+redisAsyncContext *RedisPool_pick( RedisPool *pool, const char *key, size_t length ) {
+	size_t first = key? RedisPool_hash( key, length ) % pool->size: 0;
+	for ( size_t i = 0; i < pool->size; i++ ) {
+		RedisConnection *connection = &pool->connections[(first + i) % pool->size];
+		if ( connection->connected )
+			return connection->context;
+	}
+	return NULL;
+}
+
+void RedisPool_stats( RedisPool *pool, RedisPoolStats *stats ) {
+	stats->address = pool->address;
+	stats->size = pool->size;
+	stats->connected = 0;
+	for ( size_t i = 0; i < pool->size; i++ )
+		stats->connected += pool->connections[i].connected;
+	stats->reconnects = pool->reconnects;
+	stats->disconnects = pool->disconnects;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+#include <uv.h>
+#include <hiredis/async.h>
+
+typedef struct _RedisPool RedisPool;
+typedef struct _RedisPoolStats RedisPoolStats;
+typedef void (RedisPoolConnectCallback)( redisAsyncContext *context, void *data );
+
+struct _RedisPoolStats {
+	// the server, as the pool was given it.
+	const char *address;
+	size_t size;
+	size_t connected;
+	// connections that came back after being lost or failing to connect.
+	uint64_t reconnects;
+	uint64_t disconnects;
+};
+
+// Several connections to one redis server, on one loop. Each one that
+// drops, or fails to connect, is tried again after a backoff that starts
+// at 100ms and doubles up to 10 seconds, while the others carry on.
+// address is host:port, or a path for a unix socket.
+RedisPool *RedisPool_new( const char *address, size_t size );
+void RedisPool_free( RedisPool *pool );
+// Called with each connection as it comes up, including after a
+// reconnect, which may be to a redis that has lost its scripts.
+void RedisPool_setConnectCallback( RedisPool *pool, RedisPoolConnectCallback *callback, void *data );
+int  RedisPool_attachToLoop( RedisPool *pool, uv_loop_t *loop );
+// Closes every connection straight away, answering anything outstanding
+// with a NULL reply, and stops reconnecting.
+void RedisPool_disconnect( RedisPool *pool );
+
+// The connection for key, so everything about one torrent goes down the
+// same one, in order. If that one is down, it's the next one that's up,
+// and NULL if none of them are. A NULL key starts from the first.
+redisAsyncContext *RedisPool_pick( RedisPool *pool, const char *key, size_t length );
+void RedisPool_stats( RedisPool *pool, RedisPoolStats *stats );
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 
 #include "../http-parser/http_parser.h"
 
@@ -7,27 +8,45 @@
 #include "macros.h"
 #include "dbg.h"
 
+// Marks an offset that hasn't been seen yet.
+#define Unset ((size_t)-1)
+
+// Everything lives in the one allocation, so a connection's parser
+// costs a single malloc, and nothing at all once it's reset for reuse.
 struct _HttpParserInfo {
-	http_parser *parser;
+	http_parser parser;
 	http_parser_settings *settings;
 
-	// pointers into the client->readBuffer string.
-	char *URLString;
+	// The read buffer can be reallocated between reads, so everything
+	// below is kept as an offset from the start of the buffer most
+	// recently handed to HttpParser_parse.
+	const char *buffer;
+	// how much of the buffer belongs to the current request.
+	size_t parsed;
+
+	size_t URLString;
 	int URLStringLength;
-	char *lastHeader;
+	size_t lastHeader;
 	int lastHeaderLength;
-	char *lastValue;
+	size_t lastValue;
 	int lastValueLength;
+	size_t acceptEncoding;
+	int acceptEncodingLength;
+	// set when a value has been seen since the last header field.
+	bool inValue;
 
-	struct http_parser_url *parsedURL;
+	struct http_parser_url parsedURL;
+	// neither X-Real-IP nor Accept-Encoding can show up any more.
 	bool httpParserDone;
+	bool messageComplete;
+	bool keepAlive;
 };
 
 static int httpURL( http_parser *parser, const char *at, size_t length ) {
 	dbg_info( "httpUrl" );
 	HttpParserInfo *parserInfo = parser->data;
-	if ( !parserInfo->URLString )
-		parserInfo->URLString = (char*)at;
+	if ( parserInfo->URLString == Unset )
+		parserInfo->URLString = at - parserInfo->buffer;
 	parserInfo->URLStringLength += length;
 
 	return 0;
@@ -37,17 +56,24 @@ static int httpURL( http_parser *parser, const char *at, size_t length ) {
 static int httpHeaderField( http_parser *parser, const char *at, size_t length ) {
 	dbg_info( "Header: %.*s", (int)length, at );
 	HttpParserInfo *parserInfo = parser->data;
-	// lastValue has been set, which means we've already seen the x-real-
-	// IP header, if it was sent.
-	if ( parserInfo->lastValue ) {
-		if ( parserInfo->httpParserDone ) return 0;
+	if ( parserInfo->httpParserDone ) return 0;
 
+	// Both values have been set, which means we've already seen every
+	// header that matters.
+	if ( parserInfo->lastValue != Unset && parserInfo->acceptEncoding != Unset ) {
 		parserInfo->httpParserDone = true;
 		return 0;
 	}
 
-	if ( !parserInfo->lastHeader )
-		parserInfo->lastHeader = (char*)at;
+	// a new header field is starting.
+	if ( parserInfo->inValue ) {
+		parserInfo->inValue = false;
+		parserInfo->lastHeader = Unset;
+		parserInfo->lastHeaderLength = 0;
+	}
+
+	if ( parserInfo->lastHeader == Unset )
+		parserInfo->lastHeader = at - parserInfo->buffer;
 	parserInfo->lastHeaderLength += length;
 
 	return 0;
@@ -57,13 +83,20 @@ static int httpHeaderField( http_parser *parser, const char *at, size_t length )
 static int httpHeaderValue( http_parser *parser, const char *at, size_t length ) {
 	dbg_info( "httpHeaderValueCb" );
 	HttpParserInfo *parserInfo = parser->data;
-	// x-real ip has already been seen, and the parsing work is done.
+	// x-real ip and accept-encoding have already been seen, and the
+	// parsing work is done.
 	if ( parserInfo->httpParserDone ) return 0;
 
-	if ( EqualLiteralLength( parserInfo->lastHeader, parserInfo->lastHeaderLength, "X-Real-IP" ) ) {
-		if ( !parserInfo->lastValue )
-			parserInfo->lastValue = (char*)at;
+	parserInfo->inValue = true;
+	const char *header = parserInfo->buffer + parserInfo->lastHeader;
+	if ( EqualLiteralLength( header, parserInfo->lastHeaderLength, "X-Real-IP" ) ) {
+		if ( parserInfo->lastValue == Unset )
+			parserInfo->lastValue = at - parserInfo->buffer;
 		parserInfo->lastValueLength += length;
+	} else if ( parserInfo->lastHeaderLength == strlen( "Accept-Encoding" ) && strncasecmp( header, "Accept-Encoding", strlen( "Accept-Encoding" ) ) == 0 ) {
+		if ( parserInfo->acceptEncoding == Unset )
+			parserInfo->acceptEncoding = at - parserInfo->buffer;
+		parserInfo->acceptEncodingLength += length;
 	}
 
 	return 0;
@@ -72,98 +105,148 @@ static int httpHeaderValue( http_parser *parser, const char *at, size_t length )
 static int httpHeadersComplete( http_parser *parser ) {
 	dbg_info( "httpHeadersComplete" );
 	HttpParserInfo *parserInfo = parser->data;
-	if ( !parserInfo->httpParserDone ) {
-		parserInfo->httpParserDone = true;
-		// maybe return an error to abort parsing at this point?
-	}
+	parserInfo->httpParserDone = true;
 
 	return 0;
 }
 
-HttpParserInfo *HttpParser_new( void ) {
-	static http_parser_settings settings = {
-		.on_url              = httpURL,
-		.on_header_field     = httpHeaderField,
-		.on_header_value     = httpHeaderValue,
-		.on_headers_complete = httpHeadersComplete
-	};
-
-	HttpParserInfo *parserInfo = malloc( sizeof(*parserInfo) );
-	if ( !parserInfo ) goto badParserInfo;
-
-	parserInfo->parsedURL = malloc( sizeof(*parserInfo->parsedURL) );
-	if ( !parserInfo->parsedURL ) goto badParsedURL;
+static int httpMessageComplete( http_parser *parser ) {
+	dbg_info( "httpMessageComplete" );
+	HttpParserInfo *parserInfo = parser->data;
+	parserInfo->messageComplete = true;
+	parserInfo->keepAlive = http_should_keep_alive( parser );
+	// Stop here, so that anything pipelined behind this request stays in
+	// the buffer until it has been answered.
+	http_parser_pause( parser, 1 );
 
-	parserInfo->parser = malloc( sizeof(*parserInfo->parser) );
-	if ( !parserInfo->parser ) goto badParser;
+	return 0;
+}
 
-	http_parser_init( parserInfo->parser, HTTP_REQUEST );
+static void HttpParser_clear( HttpParserInfo *parserInfo ) {
+	http_parser_init( &parserInfo->parser, HTTP_REQUEST );
+	parserInfo->parser.data = parserInfo;
 
 	// callback state
-	parserInfo->URLString = NULL;
+	parserInfo->buffer = NULL;
+	parserInfo->parsed = 0;
+	parserInfo->URLString = Unset;
 	parserInfo->URLStringLength = 0;
-	parserInfo->lastHeader = NULL;
+	parserInfo->lastHeader = Unset;
 	parserInfo->lastHeaderLength = 0;
-	parserInfo->lastValue = NULL;
+	parserInfo->lastValue = Unset;
 	parserInfo->lastValueLength = 0;
+	parserInfo->acceptEncoding = Unset;
+	parserInfo->acceptEncodingLength = 0;
+	parserInfo->inValue = false;
 
 	parserInfo->httpParserDone = false;
+	parserInfo->messageComplete = false;
+	parserInfo->keepAlive = false;
+}
+
+HttpParserInfo *HttpParser_new( void ) {
+	static http_parser_settings settings = {
+		.on_url              = httpURL,
+		.on_header_field     = httpHeaderField,
+		.on_header_value     = httpHeaderValue,
+		.on_headers_complete = httpHeadersComplete,
+		.on_message_complete = httpMessageComplete
+	};
+
+	HttpParserInfo *parserInfo = malloc( sizeof(*parserInfo) );
+	if ( !parserInfo ) return NULL;
 
+	HttpParser_clear( parserInfo );
 	parserInfo->settings = &settings;
-	parserInfo->parser->data = parserInfo;
 
 	return parserInfo;
-
-badParser:
-	free( parserInfo->parsedURL );
-badParsedURL:
-	free( parserInfo );
-badParserInfo:
-	return NULL;
 }
 
 void HttpParser_free( HttpParserInfo *parserInfo ) {
 	if ( !parserInfo ) return;
 
 	dbg_info( "HttpParser_free" );
-	free( parserInfo->parser );
-	free( parserInfo->parsedURL );
 	free( parserInfo );
 }
 
+// Gets ready for the next request on a kept-alive connection.
+void HttpParser_reset( HttpParserInfo *parserInfo ) {
+	HttpParser_clear( parserInfo );
+}
+
 bool HttpParser_done( HttpParserInfo *parserInfo ) {
-	return parserInfo->httpParserDone;
+	return parserInfo->messageComplete;
+}
+
+bool HttpParser_keepAlive( HttpParserInfo *parserInfo ) {
+	return parserInfo->keepAlive;
 }
 
-HttpParserError HttpParser_parse( HttpParserInfo *parserInfo, const char *input, size_t length ) {
-	http_parser_execute( parserInfo->parser, parserInfo->settings, input, length );
+size_t HttpParser_parsedLength( HttpParserInfo *parserInfo ) {
+	return parserInfo->parsed;
+}
+
+// buffer is everything read so far. Parsing picks up where the last call
+// left off, and stops at the end of the first complete request.
+HttpParserError HttpParser_parse( HttpParserInfo *parserInfo, const char *buffer, size_t length ) {
+	parserInfo->buffer = buffer;
+	if ( parserInfo->messageComplete || length == parserInfo->parsed )
+		return ParserError_okay;
+
+	parserInfo->parsed += http_parser_execute( &parserInfo->parser, parserInfo->settings, buffer + parserInfo->parsed, length - parserInfo->parsed );
 	dbg_info( "http_parser_execute has completed running." );
 
-	if ( parserInfo->parser->http_errno || parserInfo->parser->upgrade )
+	if ( parserInfo->parser.http_errno == HPE_PAUSED )
+		return ParserError_okay;
+
+	if ( parserInfo->parser.http_errno || parserInfo->parser.upgrade )
 		return ParserError_httpParserError;
 
 	return ParserError_okay;
 }
 
-char *HttpParser_realIP( HttpParserInfo *parserInfo ) {
-	if ( !parserInfo->lastValue ) return NULL;
-
-	char *address = malloc( (parserInfo->lastValueLength + 1) * sizeof(*address) );
-	if ( !address ) return NULL;
+// Copies X-Real-IP into address, which has room for size bytes including
+// the terminator. Returns false if there wasn't one or it doesn't fit.
+bool HttpParser_realIP( HttpParserInfo *parserInfo, char *address, size_t size ) {
+	if ( parserInfo->lastValue == Unset || (size_t)parserInfo->lastValueLength >= size )
+		return false;
 
-	memcpy( address, parserInfo->lastValue, parserInfo->lastValueLength );
+	memcpy( address, parserInfo->buffer + parserInfo->lastValue, parserInfo->lastValueLength );
 	address[parserInfo->lastValueLength] = '\0';
-	return address;
+	return true;
+}
+
+// Whether Accept-Encoding mentions gzip. q-values aren't looked at, so a
+// client that lists gzip only to refuse it still gets it.
+bool HttpParser_acceptsGzip( HttpParserInfo *parserInfo ) {
+	if ( parserInfo->acceptEncoding == Unset ) return false;
+
+	const char *value = parserInfo->buffer + parserInfo->acceptEncoding;
+	for ( int i = 0; i + (int)strlen( "gzip" ) <= parserInfo->acceptEncodingLength; i++ )
+		if ( strncasecmp( value + i, "gzip", strlen( "gzip" ) ) == 0 )
+			return true;
+	return false;
 }
 
 HttpParserError HttpParser_parseURL( HttpParserInfo *parserInfo, char **path, size_t *pathSize, char **query, size_t *querySize ) {
-	if ( http_parser_parse_url( parserInfo->URLString, parserInfo->URLStringLength, 0, parserInfo->parsedURL ) )
+	if ( parserInfo->URLString == Unset )
 		return ParserError_urlParserError;
 
-	*path      = parserInfo->URLString + parserInfo->parsedURL->field_data[UF_PATH].off;
-	*pathSize  = parserInfo->parsedURL->field_data[UF_PATH].len;
-	*query     = parserInfo->URLString + parserInfo->parsedURL->field_data[UF_QUERY].off;
-	*querySize = parserInfo->parsedURL->field_data[UF_QUERY].len;
+	char *URLString = (char*)parserInfo->buffer + parserInfo->URLString;
+	if ( http_parser_parse_url( URLString, parserInfo->URLStringLength, 0, &parserInfo->parsedURL ) )
+		return ParserError_urlParserError;
+
+	*path      = URLString + parserInfo->parsedURL.field_data[UF_PATH].off;
+	*pathSize  = parserInfo->parsedURL.field_data[UF_PATH].len;
+	// field_data is only filled in for the fields that are there, so a
+	// URL without a query would otherwise get the last request's.
+	if ( parserInfo->parsedURL.field_set & (1 << UF_QUERY) ) {
+		*query     = URLString + parserInfo->parsedURL.field_data[UF_QUERY].off;
+		*querySize = parserInfo->parsedURL.field_data[UF_QUERY].len;
+	} else {
+		*query     = *path + *pathSize;
+		*querySize = 0;
+	}
 
 	return ParserError_okay;
 }
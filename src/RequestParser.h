@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h> // size_t
 
 typedef struct _HttpParserInfo HttpParserInfo;
 typedef enum _HttpParserError HttpParserError;
@@ -14,7 +15,12 @@ enum _HttpParserError {
 HttpParserInfo *HttpParser_new( void );
 void HttpParser_free( HttpParserInfo *parserInfo );
 
+void HttpParser_reset( HttpParserInfo *parserInfo );
+
 bool HttpParser_done( HttpParserInfo *parserInfo );
-char *HttpParser_realIP( HttpParserInfo *parserInfo );
+bool HttpParser_keepAlive( HttpParserInfo *parserInfo );
+size_t HttpParser_parsedLength( HttpParserInfo *parserInfo );
+bool HttpParser_realIP( HttpParserInfo *parserInfo, char *address, size_t size );
+bool HttpParser_acceptsGzip( HttpParserInfo *parserInfo );
 HttpParserError HttpParser_parse( HttpParserInfo *parserInfo, const char *input, size_t length );
 HttpParserError HttpParser_parseURL( HttpParserInfo *parserInfo, char **path, size_t *pathSize, char **query, size_t *querySize );
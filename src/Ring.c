@@ -0,0 +1,634 @@
+#if defined(__linux__)
+// syscall and MAP_ANONYMOUS are outside of POSIX.
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Ring.h"
+#include "dbg.h"
+#include "macros.h"
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Multishot recv is the newest of what's used here, from Linux 6.0.
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+
+// Submissions, and completions, which can run well ahead of them since
+// a multishot accept or recv goes on posting them.
+#define RingEntries     1024
+#define RingCompletions 4096
+// What the kernel reads into, which is plenty for an announce, or a
+// scrape of a few dozen hashes. A bigger request takes several reads.
+#define RingBufferCount 1024
+#define RingBufferSize  2048
+#define RingBufferGroup 0
+
+// What a completion is for goes in the low bits of its user data, next
+// to the ring or client it belongs to, which are at least 8 byte aligned.
+enum {
+	RingOp_accept,
+	RingOp_recv,
+	RingOp_send,
+	RingOp_cancel,
+	RingOp_close,
+};
+#define RingOpMask 7
+#define RingData( pointer, op ) ((uint64_t)(uintptr_t)(pointer) | (op))
+
+struct _Ring {
+	Server *server;
+	uv_loop_t *loop;
+	int fd;
+	int listenFd;
+	// the submission and completion queues, shared with the kernel.
+	void *queues;
+	size_t queuesSize;
+	struct io_uring_sqe *entries;
+	size_t entriesSize;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqFlags;
+	unsigned *sqArray;
+	unsigned sqEntries;
+	// entries filled in since the last io_uring_enter.
+	unsigned queued;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *completions;
+	// the buffers the kernel picks from for each read.
+	struct io_uring_buf_ring *buffers;
+	size_t buffersSize;
+	char *bufferData;
+	uint16_t bufferTail;
+	uv_poll_t poll;
+	uv_prepare_t flush;
+};
+
+static void Ring_recycle( Ring *ring, uint16_t id ) {
+	struct io_uring_buf *buffer = &ring->buffers->bufs[ring->bufferTail & (RingBufferCount - 1)];
+	buffer->addr = (uintptr_t)(ring->bufferData + (size_t)id * RingBufferSize);
+	buffer->len  = RingBufferSize;
+	buffer->bid  = id;
+	ring->bufferTail++;
+	__atomic_store_n( &ring->buffers->tail, ring->bufferTail, __ATOMIC_RELEASE );
+}
+
+static struct io_uring_sqe *Ring_entry( Ring *ring, uint8_t opcode, int fd, uint64_t data );
+
+// Submits whatever is queued and waits for the next completion, for the
+// checks Ring_new makes before there's a loop to reap completions.
+static bool Ring_wait( Ring *ring, int *result, uint32_t *flags ) {
+	int submitted;
+	do {
+		submitted = syscall( __NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+	} while ( submitted < 0 && errno == EINTR );
+	if ( submitted < 0 ) return false;
+	ring->queued -= submitted;
+
+	unsigned head = *ring->cqHead;
+	if ( head == __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE ) ) return false;
+	struct io_uring_cqe *completion = &ring->completions[head & *ring->cqMask];
+	*result = completion->res;
+	*flags = completion->flags;
+	__atomic_store_n( ring->cqHead, head + 1, __ATOMIC_RELEASE );
+	return true;
+}
+
+// Kernels from before 6.0 can have everything else this needs, and still
+// turn down a multishot recv, but only once a connection is being read.
+// Trying one on a socket pair catches that up front. The recv stays armed
+// until the pair is shut down, and the buffers it used go back.
+static bool Ring_canReceive( Ring *ring ) {
+	int pair[2];
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, pair ) ) {
+		fancy_perror( "socketpair" );
+		return false;
+	}
+
+	bool supported = false;
+	int result = 0;
+	uint32_t flags = 0;
+	if ( write( pair[1], "", 1 ) != 1 ) goto done;
+	struct io_uring_sqe *entry = Ring_entry( ring, IORING_OP_RECV, pair[0], 0 );
+	entry->ioprio = IORING_RECV_MULTISHOT;
+	entry->flags = IOSQE_BUFFER_SELECT;
+	entry->buf_group = RingBufferGroup;
+	if ( !Ring_wait( ring, &result, &flags ) ) goto done;
+
+	supported = result == 1 && (flags & IORING_CQE_F_BUFFER);
+	shutdown( pair[1], SHUT_WR );
+	while ( true ) {
+		if ( flags & IORING_CQE_F_BUFFER )
+			Ring_recycle( ring, flags >> IORING_CQE_BUFFER_SHIFT );
+		if ( !(flags & IORING_CQE_F_MORE) ) break;
+		if ( !Ring_wait( ring, &result, &flags ) ) {
+			supported = false;
+			break;
+		}
+	}
+
+done:
+	if ( !supported )
+		log_err( "This kernel's io_uring can't do a multishot recv (%s), which needs Linux 6.0 or later.", result < 0? strerror( -result ): "no data" );
+	close( pair[0] );
+	close( pair[1] );
+	return supported;
+}
+
+Ring *Ring_new( Server *server ) {
+	Ring *ring = calloc( 1, sizeof(*ring) );
+	if ( !ring ) goto badRing;
+	ring->server = server;
+
+	struct io_uring_params params;
+	memset( &params, 0, sizeof(params) );
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = RingCompletions;
+	ring->fd = syscall( __NR_io_uring_setup, RingEntries, &params );
+	if ( ring->fd < 0 ) {
+		log_err( "Couldn't set up io_uring: %s", strerror( errno ) );
+		goto badSetup;
+	}
+	if ( !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ) {
+		log_err( "This kernel's io_uring is too old." );
+		goto badQueues;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->queuesSize = sqSize > cqSize? sqSize: cqSize;
+	ring->queues = mmap( NULL, ring->queuesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	if ( ring->queues == MAP_FAILED ) goto badQueues;
+
+	ring->entriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->entries = mmap( NULL, ring->entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+	if ( ring->entries == MAP_FAILED ) goto badEntries;
+
+	char *queues = ring->queues;
+	ring->sqHead  = (unsigned *)(queues + params.sq_off.head);
+	ring->sqTail  = (unsigned *)(queues + params.sq_off.tail);
+	ring->sqMask  = (unsigned *)(queues + params.sq_off.ring_mask);
+	ring->sqFlags = (unsigned *)(queues + params.sq_off.flags);
+	ring->sqArray = (unsigned *)(queues + params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->cqHead  = (unsigned *)(queues + params.cq_off.head);
+	ring->cqTail  = (unsigned *)(queues + params.cq_off.tail);
+	ring->cqMask  = (unsigned *)(queues + params.cq_off.ring_mask);
+	ring->completions = (struct io_uring_cqe *)(queues + params.cq_off.cqes);
+
+	// the kernel wants the buffer ring page aligned.
+	ring->buffersSize = RingBufferCount * sizeof(struct io_uring_buf);
+	ring->buffers = mmap( NULL, ring->buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if ( ring->buffers == MAP_FAILED ) goto badBuffers;
+
+	ring->bufferData = malloc( (size_t)RingBufferCount * RingBufferSize );
+	if ( !ring->bufferData ) goto badBufferData;
+
+	struct io_uring_buf_reg registration;
+	memset( &registration, 0, sizeof(registration) );
+	registration.ring_addr = (uintptr_t)ring->buffers;
+	registration.ring_entries = RingBufferCount;
+	registration.bgid = RingBufferGroup;
+	if ( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1 ) ) {
+		log_err( "Couldn't register buffers with io_uring: %s", strerror( errno ) );
+		goto badRegister;
+	}
+	for ( unsigned i = 0; i < RingBufferCount; i++ )
+		Ring_recycle( ring, i );
+
+	if ( !Ring_canReceive( ring ) ) goto badRegister;
+
+	return ring;
+
+badRegister:
+	free( ring->bufferData );
+badBufferData:
+	munmap( ring->buffers, ring->buffersSize );
+badBuffers:
+	munmap( ring->entries, ring->entriesSize );
+badEntries:
+	munmap( ring->queues, ring->queuesSize );
+badQueues:
+	close( ring->fd );
+badSetup:
+	free( ring );
+badRing:
+	return NULL;
+}
+
+// Only once the loop is done with, since its handles live here.
+void Ring_free( Ring *ring ) {
+	if ( !ring ) return;
+
+	close( ring->fd );
+	free( ring->bufferData );
+	munmap( ring->buffers, ring->buffersSize );
+	munmap( ring->entries, ring->entriesSize );
+	munmap( ring->queues, ring->queuesSize );
+	free( ring );
+}
+
+// Everything queued goes to the kernel in one call. GETEVENTS, when the
+// completion queue has overflowed, moves what the kernel held back into
+// it.
+static int Ring_submit( Ring *ring, unsigned flags ) {
+	int submitted;
+	do {
+		submitted = syscall( __NR_io_uring_enter, ring->fd, ring->queued, 0, flags, NULL, 0 );
+	} while ( submitted < 0 && errno == EINTR );
+	if ( submitted < 0 ) {
+		// short of memory, or of room for completions, for now.
+		if ( errno != EAGAIN && errno != EBUSY )
+			log_err( "io_uring_enter failed: %s", strerror( errno ) );
+		return 1;
+	}
+	ring->queued -= submitted;
+	return 0;
+}
+
+// Makes sure there's room for count entries, which is all of a linked
+// chain at once, so it can't be split between two submissions.
+static bool Ring_reserve( Ring *ring, unsigned count ) {
+	if ( *ring->sqTail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE ) + count <= ring->sqEntries )
+		return true;
+	Ring_submit( ring, 0 );
+	return *ring->sqTail - __atomic_load_n( ring->sqHead, __ATOMIC_ACQUIRE ) + count <= ring->sqEntries;
+}
+
+// Only after Ring_reserve. Nothing reads the entry until the next
+// io_uring_enter, so it can be filled in after it's queued.
+static struct io_uring_sqe *Ring_entry( Ring *ring, uint8_t opcode, int fd, uint64_t data ) {
+	unsigned tail = *ring->sqTail;
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe *entry = &ring->entries[index];
+	memset( entry, 0, sizeof(*entry) );
+	entry->opcode = opcode;
+	entry->fd = fd;
+	entry->user_data = data;
+	ring->sqArray[index] = index;
+	__atomic_store_n( ring->sqTail, tail + 1, __ATOMIC_RELEASE );
+	ring->queued++;
+	return entry;
+}
+
+static void Ring_accept( Ring *ring ) {
+	if ( !Ring_reserve( ring, 1 ) ) {
+		log_err( "Couldn't queue an accept, so [%s]:%s has stopped taking connections.", ring->server->bindIP, ring->server->bindPort );
+		return;
+	}
+	struct io_uring_sqe *entry = Ring_entry( ring, IORING_OP_ACCEPT, ring->listenFd, RingData( ring, RingOp_accept ) );
+	entry->ioprio = IORING_ACCEPT_MULTISHOT;
+	entry->accept_flags = SOCK_CLOEXEC;
+}
+
+// One recv that goes on reading into whichever buffer the kernel picks
+// until it's cancelled or the connection ends. Returns false if there
+// was no room for it, and the client has been terminated.
+static bool Ring_receive( ClientConnection *client ) {
+	Ring *ring = client->server->ring;
+	RingConnection *connection = &client->ring;
+	if ( !Ring_reserve( ring, 1 ) ) {
+		Client_terminate( client );
+		return false;
+	}
+	struct io_uring_sqe *entry = Ring_entry( ring, IORING_OP_RECV, connection->fd, RingData( client, RingOp_recv ) );
+	entry->ioprio = IORING_RECV_MULTISHOT;
+	entry->flags = IOSQE_BUFFER_SELECT;
+	entry->buf_group = RingBufferGroup;
+	connection->receiving = true;
+	connection->pending++;
+	return true;
+}
+
+// Cancels everything else on the socket, then closes it, whether or not
+// there was anything to cancel.
+static void Ring_queueClose( Ring *ring, ClientConnection *client ) {
+	RingConnection *connection = &client->ring;
+	struct io_uring_sqe *entry = Ring_entry( ring, IORING_OP_ASYNC_CANCEL, connection->fd, RingData( client, RingOp_cancel ) );
+	entry->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	entry->flags = IOSQE_IO_HARDLINK;
+	Ring_entry( ring, IORING_OP_CLOSE, connection->fd, RingData( client, RingOp_close ) );
+	connection->pending += 2;
+}
+
+// Gives the kernel back whatever was being held for the next request.
+static void Ring_dropHeld( ClientConnection *client ) {
+	RingConnection *connection = &client->ring;
+	for ( int i = 0; i < connection->heldCount; i++ )
+		Ring_recycle( client->server->ring, connection->held[i] );
+	connection->heldCount = 0;
+}
+
+// Once the socket is closed and nothing is left in flight, the client
+// is done with. However it was closed, anything it was holding goes
+// back first, or the buffers would be lost for good.
+static void Ring_settle( ClientConnection *client ) {
+	if ( client->ring.closed && !client->ring.pending ) {
+		Ring_dropHeld( client );
+		Client_closed( client );
+	}
+}
+
+void Ring_close( ClientConnection *client ) {
+	Ring *ring = client->server->ring;
+	RingConnection *connection = &client->ring;
+	if ( connection->closing ) {
+		// The close is waiting on a reply that isn't getting anywhere.
+		// Cancelling it lets the close go ahead.
+		if ( connection->closeLinked && connection->sending && Ring_reserve( ring, 1 ) ) {
+			connection->closeLinked = false;
+			Ring_entry( ring, IORING_OP_ASYNC_CANCEL, -1, RingData( client, RingOp_cancel ) )->addr = RingData( client, RingOp_send );
+			connection->pending++;
+		}
+		return;
+	}
+
+	connection->closing = true;
+	if ( !Ring_reserve( ring, 2 ) ) {
+		// shutting it down wakes up anything still waiting on it, which
+		// then comes back with an error.
+		log_err( "Couldn't queue a close, so it's done straight away." );
+		shutdown( connection->fd, SHUT_RDWR );
+		close( connection->fd );
+		connection->closed = true;
+		Ring_settle( client );
+		return;
+	}
+	Ring_queueClose( ring, client );
+}
+
+// Copies what the kernel read into the read buffer, which has to grow
+// for it, and gives the kernel its buffer back.
+static bool Ring_take( ClientConnection *client, uint16_t id, uint32_t length ) {
+	Ring *ring = client->server->ring;
+	StringBuffer *readBuffer = client->readBuffer;
+	bool taken = StringBuffer_ensureFreeSize( readBuffer, length ) >= length;
+	if ( taken )
+		memcpy( readBuffer->str + readBuffer->size, ring->bufferData + (size_t)id * RingBufferSize, length );
+	Ring_recycle( ring, id );
+	return taken;
+}
+
+// Held reads that can't all be taken would leave a hole in the middle of
+// the request stream, so the connection goes instead.
+bool Ring_read( ClientConnection *client ) {
+	RingConnection *connection = &client->ring;
+	connection->reading = true;
+	for ( int i = 0; i < connection->heldCount; i++ ) {
+		if ( !Ring_take( client, connection->held[i], connection->heldLength[i] ) ) {
+			for ( int j = i + 1; j < connection->heldCount; j++ )
+				Ring_recycle( client->server->ring, connection->held[j] );
+			connection->heldCount = 0;
+			Client_terminate( client );
+			return false;
+		}
+		client->readBuffer->size += connection->heldLength[i];
+	}
+	connection->heldCount = 0;
+	if ( !connection->receiving )
+		return Ring_receive( client );
+	return true;
+}
+
+void Ring_stopReading( ClientConnection *client ) {
+	client->ring.reading = false;
+}
+
+void Ring_send( ClientConnection *client, uv_buf_t *buffers, int count ) {
+	Ring *ring = client->server->ring;
+	RingConnection *connection = &client->ring;
+	bool closeAfter = !client->keepAlive;
+	if ( !Ring_reserve( ring, closeAfter? 3: 1 ) ) {
+		Client_terminate( client );
+		return;
+	}
+
+	// uv_buf_t is laid out like struct iovec on every platform with
+	// io_uring.
+	memset( &connection->message, 0, sizeof(connection->message) );
+	connection->message.msg_iov = (struct iovec *)buffers;
+	connection->message.msg_iovlen = count;
+	// MSG_WAITALL has the kernel finish a short write itself.
+	struct io_uring_sqe *entry = Ring_entry( ring, IORING_OP_SENDMSG, connection->fd, RingData( client, RingOp_send ) );
+	entry->addr = (uintptr_t)&connection->message;
+	entry->len = 1;
+	entry->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	connection->sending = true;
+	connection->pending++;
+	if ( closeAfter ) {
+		// hard linked, so the close happens even if the write fails.
+		entry->flags = IOSQE_IO_HARDLINK;
+		connection->closing = true;
+		connection->closeLinked = true;
+		Ring_queueClose( ring, client );
+	}
+}
+
+int Ring_peerName( ClientConnection *client, struct sockaddr_storage *address ) {
+	socklen_t length = sizeof(*address);
+	return getpeername( client->ring.fd, (struct sockaddr *)address, &length );
+}
+
+static void Ring_accepted( Ring *ring, int fd ) {
+	Server *server = ring->server;
+	ClientConnection *client = Client_new( server );
+	if ( !client ) {
+		log_warn( "Couldn't allocate a client." );
+		close( fd );
+		return;
+	}
+
+	RingConnection *connection = &client->ring;
+	memset( connection, 0, sizeof(*connection) );
+	connection->fd = fd;
+	client->handle.stream = NULL;
+	client->requestStart = uv_hrtime( );
+	server->stats->connections++;
+	server->stats->openConnections++;
+#if defined(CLIENTTIMEINFO)
+	client->startTime = uv_now( ring->loop );
+#endif
+	if ( server->maxConnections && server->stats->openConnections > server->maxConnections ) {
+		server->stats->shedConnections++;
+		Client_terminate( client );
+		return;
+	}
+	Client_handleConnection( client );
+}
+
+static void Ring_received( ClientConnection *client, int result, uint32_t flags ) {
+	Ring *ring = client->server->ring;
+	RingConnection *connection = &client->ring;
+	if ( !(flags & IORING_CQE_F_MORE) ) {
+		connection->receiving = false;
+		connection->pending--;
+	}
+	bool buffered = flags & IORING_CQE_F_BUFFER;
+	uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+	if ( connection->closing ) {
+		if ( buffered )
+			Ring_recycle( ring, id );
+		Ring_settle( client );
+		return;
+	}
+
+	// Nothing is read while a request is being answered, and that goes
+	// for errors too: a client that's stopped sending still gets its
+	// reply. The recv has stopped, and the next one comes back with the
+	// same error once reading starts again.
+	if ( !connection->reading ) {
+		if ( result <= 0 )
+			return;
+		if ( connection->heldCount == RingMaxHeldBuffers ) {
+			Ring_recycle( ring, id );
+			Ring_dropHeld( client );
+			dbg_info( "Too much pipelined behind one request." );
+			Client_terminate( client );
+			return;
+		}
+		connection->held[connection->heldCount] = id;
+		connection->heldLength[connection->heldCount++] = result;
+		return;
+	}
+
+	// Running out of buffers (ENOBUFS) is an error like any other, and
+	// costs the connection rather than leaving it to try again until one
+	// comes free.
+	if ( result <= 0 ) {
+		Client_read( client, result? result: UV_EOF );
+		return;
+	}
+
+	// a multishot recv can stop without anything being wrong, when the
+	// kernel runs short of room for completions.
+	if ( !connection->receiving && !Ring_receive( client ) ) {
+		Ring_recycle( ring, id );
+		return;
+	}
+	if ( !Ring_take( client, id, result ) ) {
+		Client_terminate( client );
+		return;
+	}
+	Client_read( client, result );
+}
+
+static void Ring_sent( ClientConnection *client, int result ) {
+	RingConnection *connection = &client->ring;
+	connection->sending = false;
+	connection->pending--;
+	// it ran out of time, and the connection is already being closed.
+	if ( connection->closing && !connection->closeLinked ) {
+		Ring_settle( client );
+		return;
+	}
+
+	size_t length = 0;
+	for ( size_t i = 0; i < connection->message.msg_iovlen; i++ )
+		length += connection->message.msg_iov[i].iov_len;
+	if ( result >= 0 && (size_t)result < length )
+		result = UV_EPIPE;
+	Client_written( client, result < 0? result: 0 );
+}
+
+static void Ring_complete( Ring *ring, uint64_t data, int result, uint32_t flags ) {
+	ClientConnection *client = (ClientConnection *)(uintptr_t)(data & ~(uint64_t)RingOpMask);
+	switch ( data & RingOpMask ) {
+		case RingOp_accept: {
+			if ( result >= 0 )
+				Ring_accepted( ring, result );
+			else
+				log_warn( "Connection error: %s", uv_err_name( result ) );
+			if ( !(flags & IORING_CQE_F_MORE) )
+				Ring_accept( ring );
+			break;
+		}
+		case RingOp_recv: {
+			Ring_received( client, result, flags );
+			break;
+		}
+		case RingOp_send: {
+			Ring_sent( client, result );
+			break;
+		}
+		case RingOp_cancel: {
+			client->ring.pending--;
+			Ring_settle( client );
+			break;
+		}
+		case RingOp_close: {
+			client->ring.pending--;
+			client->ring.closed = true;
+			Ring_settle( client );
+			break;
+		}
+	}
+}
+
+// Everything that's finished since last time, handled in one go.
+static void Ring_reap( uv_poll_t *poll, int status, int events ) {
+	Ring *ring = poll->data;
+	unsigned head = *ring->cqHead;
+	while ( head != __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE ) ) {
+		struct io_uring_cqe *completion = &ring->completions[head & *ring->cqMask];
+		uint64_t data = completion->user_data;
+		int result = completion->res;
+		uint32_t flags = completion->flags;
+		// the slot goes back before the completion is handled, which may
+		// well queue more work.
+		__atomic_store_n( ring->cqHead, ++head, __ATOMIC_RELEASE );
+		Ring_complete( ring, data, result, flags );
+	}
+}
+
+// Runs once a turn, just before the loop waits, so everything queued
+// since the last one goes in together.
+static void Ring_flush( uv_prepare_t *flush ) {
+	Ring *ring = flush->data;
+	unsigned flags = __atomic_load_n( ring->sqFlags, __ATOMIC_RELAXED ) & IORING_SQ_CQ_OVERFLOW? IORING_ENTER_GETEVENTS: 0;
+	if ( ring->queued || flags )
+		Ring_submit( ring, flags );
+}
+
+int Ring_attachToLoop( Ring *ring, uv_loop_t *loop ) {
+	ring->loop = loop;
+	uv_os_fd_t fd;
+	checkFunction( uv_fileno( (uv_handle_t *)ring->server->handle.stream, &fd ) );
+	ring->listenFd = fd;
+
+	checkFunction( uv_poll_init( loop, &ring->poll, ring->fd ) );
+	ring->poll.data = ring;
+	checkFunction( uv_poll_start( &ring->poll, UV_READABLE, Ring_reap ) );
+	checkFunction( uv_prepare_init( loop, &ring->flush ) );
+	ring->flush.data = ring;
+	checkFunction( uv_prepare_start( &ring->flush, Ring_flush ) );
+
+	Ring_accept( ring );
+	return 0;
+}
+
+#else
+
+Ring *Ring_new( Server *server ) {
+	log_err( "io_uring is only on Linux 6.0 and later." );
+	return NULL;
+}
+
+void Ring_free( Ring *ring ) { }
+int  Ring_attachToLoop( Ring *ring, uv_loop_t *loop ) { return 1; }
+bool Ring_read( ClientConnection *client ) { return false; }
+void Ring_stopReading( ClientConnection *client ) { }
+void Ring_send( ClientConnection *client, uv_buf_t *buffers, int count ) { }
+void Ring_close( ClientConnection *client ) { }
+int  Ring_peerName( ClientConnection *client, struct sockaddr_storage *address ) { return 1; }
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h> // struct msghdr
+#include <uv.h>
+
+typedef struct _Ring Ring;
+typedef struct _RingConnection RingConnection;
+
+// Pipelined requests that turn up while the one before is still being
+// answered are left in the kernel's buffers, up to this many reads'
+// worth, until it's their turn.
+#define RingMaxHeldBuffers 4
+
+// What a connection needs on a server that uses io_uring, which is a
+// bare socket where the libuv path has a handle. It's ahead of the
+// includes because clients embed it.
+struct _RingConnection {
+	int fd;
+	// submissions the kernel hasn't answered yet. The client can't be
+	// reused until they're all in and the socket is closed.
+	int pending;
+	// whether the multishot recv is still armed.
+	bool receiving;
+	// whether what comes in goes straight to the parser, rather than
+	// being held until the request before it has been answered.
+	bool reading;
+	bool sending;
+	bool closing;
+	// set when the close went in behind the reply, to happen once it's
+	// written.
+	bool closeLinked;
+	bool closed;
+	int heldCount;
+	uint16_t held[RingMaxHeldBuffers];
+	uint32_t heldLength[RingMaxHeldBuffers];
+	// the kernel reads the reply's segments through this.
+	struct msghdr message;
+};
+
+#include "server.h"
+#include "client.h"
+
+// An io_uring engine for a TCP server, in place of libuv's accept, read,
+// write and close. Connections come from a multishot accept, are read
+// with a multishot recv into buffers handed to the kernel up front, and
+// a reply that ends the connection goes in linked to the close. Nothing
+// is submitted straight away: everything a turn of the loop asks for
+// goes to the kernel in one io_uring_enter just before the loop waits,
+// and every completion that's ready is handled in one go when the
+// ring's descriptor is readable. Linux only; elsewhere Ring_new fails.
+Ring *Ring_new( Server *server );
+void Ring_free( Ring *ring );
+// The server's socket has to be bound and listening.
+int  Ring_attachToLoop( Ring *ring, uv_loop_t *loop );
+
+// Starts passing what comes in to Client_read, beginning with anything
+// held since Ring_stopReading, which is added to the read buffer but
+// left for the caller to parse. Returns false if the client has been
+// terminated instead.
+bool Ring_read( ClientConnection *client );
+void Ring_stopReading( ClientConnection *client );
+// buffers have to stay put until the reply has been written, which is
+// reported to Client_written. One that doesn't keep the connection alive
+// closes it straight after.
+void Ring_send( ClientConnection *client, uv_buf_t *buffers, int count );
+// Gives up on anything in flight and closes the socket, then hands the
+// client to Client_closed.
+void Ring_close( ClientConnection *client );
+// Where the peer's address comes from, since there's no handle to ask.
+int  Ring_peerName( ClientConnection *client, struct sockaddr_storage *address );
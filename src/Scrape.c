@@ -4,77 +4,50 @@
 #include <ctype.h>
 
 #include "Scrape.h"
+#include "Bencode.h"
 #include "URLCommon.h"
 #include "macros.h"
 #include "dbg.h"
 
-static int dualDecodeInfoHash( const char *input, size_t length, char *compactHash, char *infoHash ) {
-	int c = 0, h = 0;
-	for ( int i = 0; (i < length) && (c < 20) && (h < 40); i++, c++, h++ ) {
-		if ( input[i] == '%' ) {
-			if ( i + 2 > length )
-				return -1;
-			char encodedChar[3] = { input[i + 1], input[i + 2], '\0' };
-			long decodedChar = strtol( encodedChar, NULL, 16 );
-			if ( decodedChar < UCHAR_MAX )
-				compactHash[c] = (char)decodedChar;
-			else
-				return -2;
-
-			infoHash[h++] = tolower( input[i + 1] );
-			infoHash[h]   = tolower( input[i + 2] );
-			i += 2;
-		} else {
-			compactHash[c] = input[i];
-			snprintf( infoHash + h++, 3, "%02x", input[i] );
-		}
-	}
-	// don't null terminate compactHash.
-	infoHash[h] = '\0';
-	return h;
-}
-
-ScrapeData *ScrapeData_new( void ) {
-	ScrapeData *scrape = malloc( sizeof(*scrape) );
+// Lives until the arena is reset, so there's nothing to free.
+ScrapeData *ScrapeData_new( Arena *arena ) {
+	ScrapeData *scrape = Arena_alloc( arena, sizeof(*scrape) );
 	if ( !scrape ) return NULL;
 
+	scrape->cached = false;
 	scrape->next = NULL;
 	return scrape;
 }
 
-void ScrapeData_free( ScrapeData *scrape ) {
-	ScrapeData *scratch = scrape;
-	while ( scratch ) {
-		scrape = scratch->next;
-		free( scratch );
-		scratch = scrape;
-	}
-}
-
+// Nothing but dbg_info, so it's empty when that is.
 void ScrapeData_dump( ScrapeData *scrape ) {
+#if !defined( NDEBUG )
 	int i = 0;
 	while ( scrape ) {
-		dbg_info( "Info hash %d: %s", i++, scrape->infoHash );
+		const unsigned char *hash = (const unsigned char *)scrape->compactHash;
+		dbg_info( "Info hash %d: %02x%02x%02x%02x...", i++, hash[0], hash[1], hash[2], hash[3] );
 		scrape = scrape->next;
 	}
+#endif
 }
 
 typedef struct _ScrapeCallback ScrapeCallbackData;
 struct _ScrapeCallback {
 	ScrapeData *top;
 	ScrapeData *last;
+	Arena *arena;
 };
 
 static int ScrapeData_parse( void *data, const char *key, size_t keyLength, const char *value, size_t valueLength ) {
 	if ( EqualLiteralLength( key, keyLength, "info_hash" ) ) {
 		ScrapeCallbackData *cbd = data;
 		if ( !cbd->top ) {
-			cbd->top = ScrapeData_new( );
+			cbd->top = ScrapeData_new( cbd->arena );
 			if ( !cbd->top ) return ScrapeError_unknown;
 			cbd->last->next = cbd->top;
 		}
 
-		if ( dualDecodeInfoHash( value, valueLength, cbd->top->compactHash, cbd->top->infoHash ) != 40 )
+		if ( decodeInfoHash( value, valueLength, cbd->top->compactHash ) != 20 )
 			return ScrapeError_malformedInfoHash;
 
 		// ugh.
@@ -86,13 +59,30 @@ static int ScrapeData_parse( void *data, const char *key, size_t keyLength, cons
 	return ScrapeError_okay;
 }
 
-ScrapeError ScrapeData_fromQuery( ScrapeData *scrape, const char *query, size_t queryLength ) {
-	ScrapeCallbackData data = { .top = scrape };
+ScrapeError ScrapeData_fromQuery( ScrapeData *scrape, const char *query, size_t queryLength, Arena *arena ) {
+	ScrapeCallbackData data = { .top = scrape, .arena = arena };
 	int e = parseQueryString( query, queryLength, ScrapeData_parse, &data );
 	if ( e ) return e;
 	// this will only be true if no info_hash keys are encountered in the
 	// query.
-	if ( data.last == NULL ) return 1;
+	if ( data.last == NULL ) return ScrapeError_noInfoHash;
 	ScrapeData_dump( scrape );
 	return ScrapeError_okay;
 }
+
+// downloaded isn't tracked, so it's always 0.
+size_t Scrape_fileLength( long long complete, long long incomplete ) {
+	return Bencode_stringLength( 20 ) + Bencode_literalLength( "d" )
+		+ Bencode_keyLength( "complete" ) + Bencode_integerLength( complete )
+		+ Bencode_keyLength( "downloaded" ) + Bencode_integerLength( 0 )
+		+ Bencode_keyLength( "incomplete" ) + Bencode_integerLength( incomplete )
+		+ Bencode_literalLength( "e" );
+}
+
+char *Scrape_writeFile( char *out, const char *infoHash, long long complete, long long incomplete ) {
+	out = Bencode_writeLiteral( Bencode_writeString( out, infoHash, 20 ), "d" );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "complete" ), complete );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "downloaded" ), 0 );
+	out = Bencode_writeInteger( Bencode_writeKey( out, "incomplete" ), incomplete );
+	return Bencode_writeLiteral( out, "e" );
+}
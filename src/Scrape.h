@@ -1,11 +1,20 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h> // size_t
+
 typedef struct _ScrapeData ScrapeData;
 typedef enum _ScrapeError ScrapeError;
 
+#include "Arena.h"
+
 struct _ScrapeData {
-	char infoHash[41];
+	// the raw info hash, which is also what redis keys are made from.
 	char compactHash[20];
+	// filled in by the backend.
+	long long complete, incomplete;
+	// the counts came from the scrape cache.
+	bool cached;
 	ScrapeData *next;
 };
 
@@ -14,8 +23,14 @@ enum _ScrapeError {
 	ScrapeError_invalidRequest,
 	ScrapeError_malformedInfoHash,
 	ScrapeError_unknown,
+	// a scrape of everything, which only the full scrape answers.
+	ScrapeError_noInfoHash,
 };
 
-ScrapeData *ScrapeData_new( void );
-void ScrapeData_free( ScrapeData *scrape );
-ScrapeError ScrapeData_fromQuery( ScrapeData *scrape, const char *query, size_t queryLength );
+ScrapeData *ScrapeData_new( Arena *arena );
+ScrapeError ScrapeData_fromQuery( ScrapeData *scrape, const char *query, size_t queryLength, Arena *arena );
+
+// One torrent's entry in a reply's files dictionary: the 20 byte info
+// hash, and its counts.
+size_t Scrape_fileLength( long long complete, long long incomplete );
+char *Scrape_writeFile( char *out, const char *infoHash, long long complete, long long incomplete );
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h> // uv_random
+
+#include "ScrapeCache.h"
+#include "dbg.h"
+
+#define InfoHashSize 20
+// Each hash can only live in one set of this many entries, so a lookup
+// touches at most one or two cache lines.
+#define ScrapeCacheWays 4
+
+typedef struct _ScrapeCacheEntry ScrapeCacheEntry;
+
+struct _ScrapeCacheEntry {
+	char infoHash[InfoHashSize];
+	uint32_t complete, incomplete;
+	// 0 marks an empty entry.
+	uint64_t expires;
+};
+
+struct _ScrapeCache {
+	ScrapeCacheEntry *entries;
+	// always a power of two.
+	size_t setCount;
+	uint64_t ttl;
+	// hashes are picked by clients, so they're keyed to keep anyone from
+	// deliberately piling them into one set.
+	uint64_t seed;
+	ScrapeCacheStats stats;
+};
+
+ScrapeCache *ScrapeCache_new( size_t capacity, uint64_t ttl ) {
+	if ( capacity < ScrapeCacheWays ) {
+		log_err( "The scrape cache needs room for at least %d entries.", ScrapeCacheWays );
+		goto badCache;
+	}
+
+	ScrapeCache *cache = malloc( sizeof(*cache) );
+	if ( !cache ) goto badCache;
+
+	cache->setCount = 1;
+	while ( cache->setCount * ScrapeCacheWays * 2 <= capacity )
+		cache->setCount *= 2;
+
+	cache->entries = calloc( cache->setCount * ScrapeCacheWays, sizeof(*cache->entries) );
+	if ( !cache->entries ) goto badEntries;
+
+	if ( uv_random( NULL, NULL, &cache->seed, sizeof(cache->seed), 0, NULL ) )
+		cache->seed = (uintptr_t)cache ^ uv_hrtime( );
+
+	cache->ttl = ttl;
+	memset( &cache->stats, 0, sizeof(cache->stats) );
+	cache->stats.capacity = cache->setCount * ScrapeCacheWays;
+	return cache;
+
+badEntries:
+	free( cache );
+badCache:
+	return NULL;
+}
+
+void ScrapeCache_free( ScrapeCache *cache ) {
+	if ( !cache ) return;
+
+	free( cache->entries );
+	free( cache );
+}
+
+static ScrapeCacheEntry *ScrapeCache_set( ScrapeCache *cache, const char *infoHash ) {
+	// info hashes are already uniformly distributed, unless someone is
+	// picking them, and the seed takes care of that.
+	uint64_t hash;
+	memcpy( &hash, infoHash, sizeof(hash) );
+	hash = (hash ^ cache->seed) * 0x9E3779B97F4A7C15ULL;
+	return cache->entries + ((hash >> 32) & (cache->setCount - 1)) * ScrapeCacheWays;
+}
+
+bool ScrapeCache_lookup( ScrapeCache *cache, const char *infoHash, uint64_t now, long long *complete, long long *incomplete ) {
+	ScrapeCacheEntry *set = ScrapeCache_set( cache, infoHash );
+	for ( int i = 0; i < ScrapeCacheWays; i++ ) {
+		ScrapeCacheEntry *entry = set + i;
+		if ( entry->expires <= now || memcmp( entry->infoHash, infoHash, InfoHashSize ) )
+			continue;
+
+		*complete   = entry->complete;
+		*incomplete = entry->incomplete;
+		cache->stats.hits++;
+		if ( !entry->complete && !entry->incomplete )
+			cache->stats.negativeHits++;
+		return true;
+	}
+
+	cache->stats.misses++;
+	return false;
+}
+
+// Replaces the entry for the same hash if there is one, then an expired
+// one, and failing that whichever one expires soonest.
+void ScrapeCache_store( ScrapeCache *cache, const char *infoHash, uint64_t now, long long complete, long long incomplete ) {
+	ScrapeCacheEntry *set = ScrapeCache_set( cache, infoHash ), *victim = set;
+	for ( int i = 0; i < ScrapeCacheWays; i++ ) {
+		ScrapeCacheEntry *entry = set + i;
+		if ( !memcmp( entry->infoHash, infoHash, InfoHashSize ) && entry->expires ) {
+			victim = entry;
+			break;
+		}
+		if ( entry->expires < victim->expires )
+			victim = entry;
+	}
+
+	if ( !victim->expires )
+		cache->stats.filled++;
+	else if ( victim->expires > now && memcmp( victim->infoHash, infoHash, InfoHashSize ) )
+		cache->stats.evictions++;
+
+	memcpy( victim->infoHash, infoHash, InfoHashSize );
+	victim->complete   = complete;
+	victim->incomplete = incomplete;
+	victim->expires    = now + cache->ttl;
+}
+
+void ScrapeCache_stats( ScrapeCache *cache, ScrapeCacheStats *stats ) {
+	*stats = cache->stats;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+typedef struct _ScrapeCache ScrapeCache;
+typedef struct _ScrapeCacheStats ScrapeCacheStats;
+
+struct _ScrapeCacheStats {
+	uint64_t hits;
+	// hits on torrents nobody is in, which are included in hits.
+	uint64_t negativeHits;
+	uint64_t misses;
+	// live entries pushed out to make room for others.
+	uint64_t evictions;
+	// entries that have ever been stored to. An expired one still counts
+	// until it's reused, since nothing goes looking for them.
+	size_t filled;
+	size_t capacity;
+};
+
+// Remembers scrape counts for a while, so popular torrents don't cost a
+// trip to redis every time someone scrapes them. Torrents with nobody in
+// them are cached like any other, which keeps scrapes for junk hashes
+// from getting through either. The cache never holds more than capacity
+// entries, which are all allocated up front, and it isn't locked, so
+// each loop needs its own. A capacity too small for even one set of
+// entries gives NULL.
+ScrapeCache *ScrapeCache_new( size_t capacity, uint64_t ttl );
+void ScrapeCache_free( ScrapeCache *cache );
+bool ScrapeCache_lookup( ScrapeCache *cache, const char *infoHash, uint64_t now, long long *complete, long long *incomplete );
+void ScrapeCache_store( ScrapeCache *cache, const char *infoHash, uint64_t now, long long complete, long long incomplete );
+void ScrapeCache_stats( ScrapeCache *cache, ScrapeCacheStats *stats );
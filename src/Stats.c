@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stats.h"
+#include "client.h"
+#include "dbg.h"
+
+static const char *protocolNames[StatsProtocol_count] = { "http", "udp" };
+static const char *routeNames[StatsRoute_count] = { "announce", "scrape", "full_scrape", "connect", "stats", "invalid" };
+static const char *phaseNames[StatsPhase_count] = { "parse", "backend", "write" };
+// in the same order as AnnounceError.
+static const char *announceErrorNames[AnnounceError_unknown + 1] = {
+	"okay", "invalidRequest", "missingField", "malformedField", "malformedID", "malformedInfoHash",
+	"malformedIP", "malformedIPv4", "malformedIPv6", "malformedPort", "noTorrent", "rejectedIP", "unknown"
+};
+// in the same order as ClientDeadline.
+static const char *deadlineNames[ClientDeadline_count] = { "idle", "headers", "backend", "write" };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+// Prometheus buckets go up by powers of two from a microsecond, which is
+// coarser than the histograms themselves. The quantiles above are worked
+// out from the full resolution.
+#define PrometheusBucketBits 27
+
+Stats *Stats_new( void ) {
+	Stats *stats = calloc( 1, sizeof(*stats) );
+	if ( !stats ) return NULL;
+
+	for ( int protocol = 0; protocol < StatsProtocol_count; protocol++ )
+		for ( int phase = 0; phase < StatsPhase_count; phase++ )
+			Histogram_init( &stats->phases[protocol][phase] );
+	stats->first = stats;
+	return stats;
+}
+
+void Stats_free( Stats *stats ) {
+	free( stats );
+}
+
+void Stats_join( Stats *stats, Stats *first ) {
+	Stats *last = first;
+	while ( last->next )
+		last = last->next;
+	last->next = stats;
+	stats->first = first;
+}
+
+void Stats_recordPhase( Stats *stats, StatsProtocol protocol, StatsPhase phase, uint64_t start, uint64_t end ) {
+	Histogram_record( &stats->phases[protocol][phase], (end - start) / 1000 );
+}
+
+#define StatsHeader( out, name, type, help ) StringBuffer_sprintf( out, "# HELP " name " " help "\n# TYPE " name " " type "\n" )
+
+static void Stats_writeCounters( Stats *first, StringBuffer *out ) {
+	StatsHeader( out, "reki_requests_total", "counter", "Requests received, by protocol and route." );
+	for ( int protocol = 0; protocol < StatsProtocol_count; protocol++ ) {
+		for ( int route = 0; route < StatsRoute_count; route++ ) {
+			uint64_t total = 0;
+			for ( Stats *stats = first; stats; stats = stats->next )
+				total += stats->requests[protocol][route];
+			StringBuffer_sprintf( out, "reki_requests_total{protocol=\"%s\",route=\"%s\"} %llu\n",
+			                          protocolNames[protocol], routeNames[route], (unsigned long long)total );
+		}
+	}
+
+	StatsHeader( out, "reki_announce_errors_total", "counter", "Announces refused, by reason." );
+	for ( int error = AnnounceError_okay + 1; error <= AnnounceError_unknown; error++ ) {
+		uint64_t total = 0;
+		for ( Stats *stats = first; stats; stats = stats->next )
+			total += stats->announceErrors[error];
+		StringBuffer_sprintf( out, "reki_announce_errors_total{error=\"%s\"} %llu\n", announceErrorNames[error], (unsigned long long)total );
+	}
+
+	uint64_t scrapeErrors = 0, redisErrors = 0, connections = 0, openConnections = 0, firstAnnounce = 0;
+	uint64_t shedAnnounces = 0, shedScrapes = 0, shedConnections = 0;
+	for ( Stats *stats = first; stats; stats = stats->next ) {
+		shedAnnounces   += stats->shedRequests[StatsRoute_announce];
+		shedScrapes     += stats->shedRequests[StatsRoute_scrape];
+		shedConnections += stats->shedConnections;
+		scrapeErrors    += stats->scrapeErrors;
+		redisErrors     += stats->redisErrors;
+		connections     += stats->connections;
+		openConnections += stats->openConnections;
+		if ( stats->firstAnnounce && (!firstAnnounce || stats->firstAnnounce < firstAnnounce) )
+			firstAnnounce = stats->firstAnnounce;
+	}
+	StatsHeader( out, "reki_scrape_errors_total", "counter", "Scrapes refused as invalid." );
+	StringBuffer_sprintf( out, "reki_scrape_errors_total %llu\n", (unsigned long long)scrapeErrors );
+	StatsHeader( out, "reki_redis_errors_total", "counter", "Requests that failed because of redis." );
+	StringBuffer_sprintf( out, "reki_redis_errors_total %llu\n", (unsigned long long)redisErrors );
+	StatsHeader( out, "reki_connections_total", "counter", "TCP connections accepted." );
+	StringBuffer_sprintf( out, "reki_connections_total %llu\n", (unsigned long long)connections );
+	StatsHeader( out, "reki_connections_open", "gauge", "TCP connections currently open." );
+	StringBuffer_sprintf( out, "reki_connections_open %llu\n", (unsigned long long)openConnections );
+	StatsHeader( out, "reki_shed_total", "counter", "Requests turned away while the backend was behind, and connections refused over the limit." );
+	StringBuffer_sprintf( out, "reki_shed_total{what=\"announce\"} %llu\n", (unsigned long long)shedAnnounces );
+	StringBuffer_sprintf( out, "reki_shed_total{what=\"scrape\"} %llu\n", (unsigned long long)shedScrapes );
+	StringBuffer_sprintf( out, "reki_shed_total{what=\"connection\"} %llu\n", (unsigned long long)shedConnections );
+	StatsHeader( out, "reki_connection_timeouts_total", "counter", "TCP connections closed for taking too long, by what they were waiting on." );
+	for ( int deadline = 0; deadline < ClientDeadline_count; deadline++ ) {
+		uint64_t total = 0;
+		for ( Stats *stats = first; stats; stats = stats->next )
+			total += stats->timeouts[deadline];
+		StringBuffer_sprintf( out, "reki_connection_timeouts_total{waiting=\"%s\"} %llu\n", deadlineNames[deadline], (unsigned long long)total );
+	}
+	if ( firstAnnounce && first->started ) {
+		StatsHeader( out, "reki_first_announce_seconds", "gauge", "Time from the process starting to the first announce being answered." );
+		StringBuffer_sprintf( out, "reki_first_announce_seconds %.6f\n", (firstAnnounce - first->started) / 1e9 );
+	}
+}
+
+#define QuantileCount (sizeof(quantiles) / sizeof(*quantiles))
+#define PhaseLabels "protocol=\"%s\",phase=\"%s\""
+
+static void Stats_writePhases( Stats *first, StringBuffer *out ) {
+	StatsHeader( out, "reki_request_phase_seconds", "histogram", "Time spent in each phase of a request." );
+	// in microseconds, saved for after the histograms.
+	uint64_t quantileValues[StatsProtocol_count][StatsPhase_count][QuantileCount];
+	Histogram histogram;
+	for ( int protocol = 0; protocol < StatsProtocol_count; protocol++ ) {
+		for ( int phase = 0; phase < StatsPhase_count; phase++ ) {
+			const char *protocolName = protocolNames[protocol], *phaseName = phaseNames[phase];
+			Histogram_init( &histogram );
+			for ( Stats *stats = first; stats; stats = stats->next )
+				Histogram_merge( &histogram, &stats->phases[protocol][phase] );
+
+			uint64_t cumulative = 0;
+			size_t bucket = 0;
+			for ( int bit = 0; bit < PrometheusBucketBits; bit++ ) {
+				// every bucket that only holds values below 2^bit.
+				for ( ; bucket < HistogramBucketCount && Histogram_bucketLimit( bucket ) < (UINT64_C(1) << bit); bucket++ )
+					cumulative += histogram.counts[bucket];
+				StringBuffer_sprintf( out, "reki_request_phase_seconds_bucket{" PhaseLabels ",le=\"%.6f\"} %llu\n",
+				                          protocolName, phaseName, (UINT64_C(1) << bit) / 1e6, (unsigned long long)cumulative );
+			}
+			StringBuffer_sprintf( out, "reki_request_phase_seconds_bucket{" PhaseLabels ",le=\"+Inf\"} %llu\n",
+			                          protocolName, phaseName, (unsigned long long)histogram.count );
+			StringBuffer_sprintf( out, "reki_request_phase_seconds_sum{" PhaseLabels "} %.6f\n", protocolName, phaseName, histogram.sum / 1e6 );
+			StringBuffer_sprintf( out, "reki_request_phase_seconds_count{" PhaseLabels "} %llu\n", protocolName, phaseName, (unsigned long long)histogram.count );
+
+			for ( size_t i = 0; i < QuantileCount; i++ )
+				quantileValues[protocol][phase][i] = Histogram_percentile( &histogram, quantiles[i] * 100 );
+		}
+	}
+
+	StatsHeader( out, "reki_request_phase_quantile_seconds", "gauge", "Quantiles of each phase since startup, to within 3 percent." );
+	for ( int protocol = 0; protocol < StatsProtocol_count; protocol++ )
+		for ( int phase = 0; phase < StatsPhase_count; phase++ )
+			for ( size_t i = 0; i < QuantileCount; i++ )
+				StringBuffer_sprintf( out, "reki_request_phase_quantile_seconds{" PhaseLabels ",quantile=\"%g\"} %.6f\n",
+				                          protocolNames[protocol], phaseNames[phase], quantiles[i], quantileValues[protocol][phase][i] / 1e6 );
+}
+
+// Every worker has its own connections to the same shards, in the same
+// order. Returns false past the last one.
+static bool Stats_redisShard( Stats *first, size_t shard, MemoryStoreRedisStats *total ) {
+	bool found = false;
+	memset( total, 0, sizeof(*total) );
+	for ( Stats *stats = first; stats; stats = stats->next ) {
+		MemoryStoreRedisStats worker;
+		if ( !stats->store || !MemoryStore_redisStats( stats->store, shard, &worker ) ) continue;
+		found = true;
+		total->pool.address = worker.pool.address;
+		total->pool.size += worker.pool.size;
+		total->pool.connected += worker.pool.connected;
+		total->pool.reconnects += worker.pool.reconnects;
+		total->pool.disconnects += worker.pool.disconnects;
+		total->outstanding += worker.outstanding;
+	}
+	return found;
+}
+
+static void Stats_writeSources( Stats *first, StringBuffer *out ) {
+	StatsHeader( out, "reki_client_pool_total", "counter", "Clients taken from the pool (hit) or built (miss), and request allocations that overflowed a client's arena." );
+	for ( int protocol = 0; protocol < StatsProtocol_count; protocol++ ) {
+		ClientPoolStats total = { 0 };
+		for ( Stats *stats = first; stats; stats = stats->next ) {
+			if ( !stats->pools[protocol] ) continue;
+			ClientPoolStats pool;
+			ClientPool_stats( stats->pools[protocol], &pool );
+			total.hits += pool.hits;
+			total.misses += pool.misses;
+			total.arenaOverflows += pool.arenaOverflows;
+		}
+		StringBuffer_sprintf( out, "reki_client_pool_total{protocol=\"%s\",result=\"hit\"} %llu\n", protocolNames[protocol], (unsigned long long)total.hits );
+		StringBuffer_sprintf( out, "reki_client_pool_total{protocol=\"%s\",result=\"miss\"} %llu\n", protocolNames[protocol], (unsigned long long)total.misses );
+		StringBuffer_sprintf( out, "reki_client_pool_total{protocol=\"%s\",result=\"arena_overflow\"} %llu\n", protocolNames[protocol], (unsigned long long)total.arenaOverflows );
+	}
+
+	ScrapeCacheStats cache = { 0 };
+	bool cached = false;
+	for ( Stats *stats = first; stats; stats = stats->next ) {
+		ScrapeCacheStats worker;
+		if ( !stats->store || !MemoryStore_scrapeCacheStats( stats->store, &worker ) ) continue;
+		cached = true;
+		cache.hits += worker.hits;
+		cache.negativeHits += worker.negativeHits;
+		cache.misses += worker.misses;
+		cache.evictions += worker.evictions;
+		cache.filled += worker.filled;
+	}
+	if ( cached ) {
+		StatsHeader( out, "reki_scrape_cache_total", "counter", "Scrape cache lookups and evictions. Negative hits are included in hits." );
+		StringBuffer_sprintf( out, "reki_scrape_cache_total{result=\"hit\"} %llu\n", (unsigned long long)cache.hits );
+		StringBuffer_sprintf( out, "reki_scrape_cache_total{result=\"negative_hit\"} %llu\n", (unsigned long long)cache.negativeHits );
+		StringBuffer_sprintf( out, "reki_scrape_cache_total{result=\"miss\"} %llu\n", (unsigned long long)cache.misses );
+		StringBuffer_sprintf( out, "reki_scrape_cache_total{result=\"eviction\"} %llu\n", (unsigned long long)cache.evictions );
+		StatsHeader( out, "reki_scrape_cache_filled_entries", "gauge", "Scrape cache entries that have been filled, including expired ones waiting to be reused." );
+		StringBuffer_sprintf( out, "reki_scrape_cache_filled_entries %zu\n", cache.filled );
+	}
+
+	MemoryStoreRedisStats redis;
+	if ( Stats_redisShard( first, 0, &redis ) ) {
+		StatsHeader( out, "reki_redis_connections", "gauge", "Connections to each redis shard across all of the workers' pools, and how many of them are up." );
+		for ( size_t shard = 0; Stats_redisShard( first, shard, &redis ); shard++ ) {
+			StringBuffer_sprintf( out, "reki_redis_connections{shard=\"%s\",state=\"pool\"} %zu\n", redis.pool.address, redis.pool.size );
+			StringBuffer_sprintf( out, "reki_redis_connections{shard=\"%s\",state=\"up\"} %zu\n", redis.pool.address, redis.pool.connected );
+		}
+		StatsHeader( out, "reki_redis_connection_events_total", "counter", "Connections to redis lost, and connections that came back after being lost or failing to connect." );
+		for ( size_t shard = 0; Stats_redisShard( first, shard, &redis ); shard++ ) {
+			StringBuffer_sprintf( out, "reki_redis_connection_events_total{shard=\"%s\",event=\"disconnect\"} %llu\n", redis.pool.address, (unsigned long long)redis.pool.disconnects );
+			StringBuffer_sprintf( out, "reki_redis_connection_events_total{shard=\"%s\",event=\"reconnect\"} %llu\n", redis.pool.address, (unsigned long long)redis.pool.reconnects );
+		}
+		StatsHeader( out, "reki_redis_outstanding", "gauge", "Announces and scrapes sent to each redis shard and not yet answered." );
+		for ( size_t shard = 0; Stats_redisShard( first, shard, &redis ); shard++ )
+			StringBuffer_sprintf( out, "reki_redis_outstanding{shard=\"%s\"} %zu\n", redis.pool.address, redis.outstanding );
+	}
+
+	// Only the first worker's store sweeps out expired peers.
+	if ( !first->store ) return;
+	MemoryStoreExpiryStats expiry;
+	MemoryStore_expiryStats( first->store, &expiry );
+	StatsHeader( out, "reki_expiry_passes_total", "counter", "Full passes of the expiry sweep." );
+	StringBuffer_sprintf( out, "reki_expiry_passes_total %llu\n", (unsigned long long)expiry.passes );
+	StatsHeader( out, "reki_expiry_expired_total", "counter", "Peers and swarms dropped by the expiry sweep." );
+	StringBuffer_sprintf( out, "reki_expiry_expired_total{kind=\"peer\"} %llu\n", (unsigned long long)expiry.expiredPeers );
+	StringBuffer_sprintf( out, "reki_expiry_expired_total{kind=\"swarm\"} %llu\n", (unsigned long long)expiry.emptiedSwarms );
+	StatsHeader( out, "reki_expiry_skipped_steps_total", "counter", "Expiry steps skipped while redis was busy with the last one." );
+	StringBuffer_sprintf( out, "reki_expiry_skipped_steps_total %llu\n", (unsigned long long)expiry.skippedSteps );
+	StatsHeader( out, "reki_expiry_lag_seconds", "gauge", "How far the expiry sweep is behind its target pass time." );
+	StringBuffer_sprintf( out, "reki_expiry_lag_seconds %.3f\n", expiry.lagMS / 1e3 );
+
+	FullScrape *scrape = MemoryStore_fullScrape( first->store );
+	if ( !scrape ) return;
+	FullScrapeStats full;
+	FullScrape_stats( scrape, &full );
+	StatsHeader( out, "reki_full_scrape_builds_total", "counter", "Full scrape snapshots built, and walks that didn't make it into one." );
+	StringBuffer_sprintf( out, "reki_full_scrape_builds_total{result=\"ok\"} %llu\n", (unsigned long long)full.builds );
+	StringBuffer_sprintf( out, "reki_full_scrape_builds_total{result=\"failed\"} %llu\n", (unsigned long long)full.failedBuilds );
+	StatsHeader( out, "reki_full_scrape_torrents", "gauge", "Torrents in the current full scrape." );
+	StringBuffer_sprintf( out, "reki_full_scrape_torrents %zu\n", full.torrents );
+	StatsHeader( out, "reki_full_scrape_bytes", "gauge", "Size of the current full scrape, as it's sent." );
+	StringBuffer_sprintf( out, "reki_full_scrape_bytes{encoding=\"identity\"} %zu\n", full.plainSize );
+	StringBuffer_sprintf( out, "reki_full_scrape_bytes{encoding=\"gzip\"} %zu\n", full.gzipSize );
+	if ( full.built ) {
+		StatsHeader( out, "reki_full_scrape_age_seconds", "gauge", "How long ago the current full scrape was built." );
+		StringBuffer_sprintf( out, "reki_full_scrape_age_seconds %.3f\n", (uv_hrtime( ) - full.built) / 1e9 );
+		StatsHeader( out, "reki_full_scrape_build_seconds", "gauge", "How long the last full scrape took, from the start of its walk to it being published." );
+		StringBuffer_sprintf( out, "reki_full_scrape_build_seconds %.3f\n", full.buildMS / 1e3 );
+	}
+}
+
+void Stats_write( Stats *stats, StringBuffer *out ) {
+	Stats *first = stats->first;
+	Stats_writeCounters( first, out );
+	Stats_writePhases( first, out );
+	Stats_writeSources( first, out );
+}
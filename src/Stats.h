@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct _Stats Stats;
+typedef enum _StatsProtocol StatsProtocol;
+typedef enum _StatsRoute StatsRoute;
+typedef enum _StatsPhase StatsPhase;
+
+#include "Histogram.h"
+#include "StringBuffer.h"
+#include "announce.h"
+#include "MemoryStore.h"
+
+enum _StatsProtocol {
+	StatsProtocol_http,
+	StatsProtocol_udp,
+	StatsProtocol_count,
+};
+
+enum _StatsRoute {
+	StatsRoute_announce,
+	StatsRoute_scrape,
+	// a scrape with no info hash, HTTP only.
+	StatsRoute_fullScrape,
+	// UDP only.
+	StatsRoute_connect,
+	StatsRoute_stats,
+	StatsRoute_invalid,
+	StatsRoute_count,
+};
+
+// Where a request's time goes: from the connection being accepted (or,
+// on a kept-alive connection, from the first byte of the request) to it
+// being parsed, from there to the backend's answer, and from there to
+// the reply being handed to the kernel.
+enum _StatsPhase {
+	StatsPhase_parse,
+	StatsPhase_backend,
+	StatsPhase_write,
+	StatsPhase_count,
+};
+
+// Each worker keeps its own counters and only ever writes to those, so
+// recording is a plain increment. A report reads every worker's counters
+// without locking, which can leave it a request or two behind, but never
+// blocks anyone.
+struct _Stats {
+	uint64_t requests[StatsProtocol_count][StatsRoute_count];
+	uint64_t announceErrors[AnnounceError_unknown + 1];
+	uint64_t scrapeErrors;
+	uint64_t redisErrors;
+	uint64_t connections;
+	uint64_t openConnections;
+	// connections closed for taking too long, by what they were waiting on.
+	uint64_t timeouts[ClientDeadline_count];
+	// turned away while the backend was behind, by route, and connections
+	// closed as soon as they were accepted, for being over the limit.
+	uint64_t shedRequests[StatsRoute_count];
+	uint64_t shedConnections;
+	// uv_hrtime when this worker answered its first announce, or 0. The
+	// first worker's started is when the process started, so the two
+	// together say how long it took to start serving.
+	uint64_t firstAnnounce;
+	uint64_t started;
+	// in microseconds.
+	Histogram phases[StatsProtocol_count][StatsPhase_count];
+
+	// Reported alongside the counters. Set up by the worker.
+	MemoryStore *store;
+	ClientPool *pools[StatsProtocol_count];
+	// every worker's stats, starting from the first one.
+	Stats *first;
+	Stats *next;
+};
+
+Stats *Stats_new( void );
+void Stats_free( Stats *stats );
+// Adds stats to the group that first starts, so a report from any of
+// them covers all of them. Has to happen before the workers start.
+void Stats_join( Stats *stats, Stats *first );
+void Stats_recordPhase( Stats *stats, StatsProtocol protocol, StatsPhase phase, uint64_t start, uint64_t end );
+// Appends the whole group's stats in the Prometheus text format.
+void Stats_write( Stats *stats, StringBuffer *out );
@@ -64,15 +64,35 @@ size_t StringBuffer_ensureFreeSize( StringBuffer *buf, size_t size ) {
 	return buf->alloc_size - buf->size;
 }
 
-// This is not too good because it will truncate the format string, but
-// I want something that doesn't need to allocate a temp buffer for the
-// format string.
+char *StringBuffer_reserve( StringBuffer *buf, size_t size ) {
+	StringBuffer_grow( buf, buf->size + size );
+
+	return buf->str + buf->size;
+}
+
+void StringBuffer_commit( StringBuffer *buf, const char *end ) {
+	buf->size = end - buf->str;
+}
+
+// Formats straight into whatever room is left, and only when that
+// isn't enough grows the buffer and formats again, so nothing is cut
+// short and the usual case doesn't pay for measuring.
 void StringBuffer_sprintf( StringBuffer *buf, const char *format, ... ) {
-	va_list args;
-  va_start( args, format );
-	int added = vsnprintf( buf->str + buf->size, buf->alloc_size - buf->size, format, args );
+	va_list args, args2;
+	va_start( args, format );
+	va_copy( args2, args );
+
+	size_t room = buf->alloc_size - buf->size;
+	int length = vsnprintf( buf->str + buf->size, room, format, args );
 	va_end( args );
-	buf->size += added;
+
+	if ( length >= 0 && (size_t)length >= room ) {
+		StringBuffer_grow( buf, buf->size + length + 1 );
+		vsnprintf( buf->str + buf->size, length + 1, format, args2 );
+	}
+	va_end( args2 );
+	if ( length > 0 )
+		buf->size += length;
 }
 
 // TURNS OUT VASPRINTF AINT POSIX AND I DONT WANT TO USE DUMB WEIRD
@@ -85,8 +105,10 @@ void StringBuffer_safeSprintf( StringBuffer *buf, const char *format, ... ) {
 	int length = vsnprintf( NULL, 0, format, args );
 	va_end( args );
 
-	StringBuffer_grow( buf, buf->size + length );
-	int added = vsnprintf( buf->str + buf->size, length, format, args2 );
+	// vsnprintf wants room for the terminating null, even though it isn't
+	// counted in the size.
+	StringBuffer_grow( buf, buf->size + length + 1 );
+	int added = vsnprintf( buf->str + buf->size, length + 1, format, args2 );
 	buf->size += added;
 	va_end( args2 );
 }
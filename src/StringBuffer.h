@@ -19,6 +19,12 @@ void StringBuffer_append( StringBuffer *buf, const char *append, size_t size );
 void StringBuffer_join( StringBuffer *joinee, StringBuffer *joiner );
 
 size_t StringBuffer_ensureFreeSize( StringBuffer *buf, size_t size );
+// Makes room for size more bytes and returns where they go, for writing
+// in place. StringBuffer_commit takes the end of what was written.
+char *StringBuffer_reserve( StringBuffer *buf, size_t size );
+void StringBuffer_commit( StringBuffer *buf, const char *end );
+// Both grow the buffer to fit: sprintf formats once when there's already
+// room, safeSprintf always measures first.
 void StringBuffer_sprintf( StringBuffer *buf, const char *format, ... );
 void StringBuffer_safeSprintf( StringBuffer *buf, const char *format, ... );
 
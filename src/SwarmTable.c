@@ -0,0 +1,786 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h> // clock_gettime
+#include <uv.h> // uv_random
+
+#include "SwarmTable.h"
+#include "CompactAddress.h"
+#include "MappedHeap.h"
+#include "dbg.h"
+
+#define InfoHashSize 20
+#define InitialBucketCount 1024
+#define InitialPeerCapacity 4
+// How many records each announce checks for expiry. This keeps busy
+// swarms trimmed between the periodic sweeps.
+#define InlineExpiryStep 2
+// The most records a random sample remembers drawing. More than that
+// falls back on the newest, though numwant never asks for as many.
+#define SampleLimit 64
+// The table is split by info hash into this many stripes, each with its
+// own buckets and lock, so workers only wait on each other when they're
+// after swarms in the same stripe.
+#define SwarmTableStripes 16
+// Bumped whenever anything kept in the heap changes shape, so that a
+// file from an older build is started over instead of misread.
+#define SwarmTableVersion 5
+
+typedef struct _SwarmPeerSet SwarmPeerSet;
+typedef struct _SwarmPeerLink SwarmPeerLink;
+typedef struct _SwarmTableStripe SwarmTableStripe;
+typedef struct _SwarmTableRoot SwarmTableRoot;
+typedef enum _SwarmFamily SwarmFamily;
+
+enum _SwarmFamily {
+	SwarmFamily_ipv4,
+	SwarmFamily_ipv6,
+	SwarmFamily_count,
+};
+
+// Where each family's address and port sit in a CompactAddress, and how
+// long they are, which is also how they go out in a response.
+static const int familyFlags[SwarmFamily_count]   = { CompactAddress_IPv4Flag, CompactAddress_IPv6Flag };
+static const int familyOffsets[SwarmFamily_count] = { CompactAddress_IPv4AddressOffset, CompactAddress_IPv6AddressOffset };
+static const int familyWidths[SwarmFamily_count]  = { CompactAddress_IPv4Size, CompactAddress_IPv6Size };
+// A CompactAddress with both has them side by side, IPv4 first.
+#define DualFlags (CompactAddress_IPv4Flag | CompactAddress_IPv6Flag)
+#define DualWidth (CompactAddress_IPv4Size + CompactAddress_IPv6Size)
+
+// The peers of one family. Addresses are packed back to back, width
+// bytes each, so a run of them can be copied straight into a response.
+// Everything in the table lives in its heap, so the arrays are block
+// offsets rather than pointers.
+struct _SwarmPeerSet {
+	uint64_t addresses;
+	uint64_t lastSeen;
+	// Linear probing table with twice as many slots as the addresses.
+	// Slots hold a position in addresses plus one, so zero means empty.
+	uint64_t index;
+	// A link for each address, which strings them together from the
+	// least to the most recently seen, since moving the records around
+	// to keep them in that order would mean rehashing them.
+	uint64_t links;
+	uint32_t count, capacity;
+	uint32_t expiryCursor;
+	uint32_t width;
+	// positions plus one of either end of links, or zero when it's empty.
+	uint32_t oldest, newest;
+};
+
+// Neighbouring positions plus one, with zero past either end.
+struct _SwarmPeerLink {
+	uint32_t older, newer;
+};
+
+// A peer with both an IPv4 and an IPv6 address is in both families, and
+// in the dual sets as well, under the two together, which is how it's
+// only counted once.
+struct _Swarm {
+	char infoHash[InfoHashSize];
+	SwarmPeerSet seeds[SwarmFamily_count], peers[SwarmFamily_count];
+	SwarmPeerSet dualSeeds, dualPeers;
+	uint64_t next;
+};
+
+struct _SwarmTableStripe {
+	// bucketCount offsets of the first swarm in each chain.
+	uint64_t buckets;
+	// always a power of two.
+	uint64_t bucketCount;
+	uint64_t swarmCount;
+	uint64_t expiryCursor;
+	// Set from a stripe's first change until its lock is let go. A file
+	// left with none of them set was between changes, whenever it was
+	// last synced.
+	uint64_t changing;
+};
+
+// The heap's root block, which is everything needed to pick the table
+// back up from a file.
+struct _SwarmTableRoot {
+	SwarmTableStripe stripes[SwarmTableStripes];
+	// the stripe expiry is sweeping.
+	uint64_t expiryStripe;
+	// Info hashes and addresses are picked by clients, so they're hashed
+	// with a random key to keep anyone from deliberately colliding them.
+	uint64_t seed;
+	// The table's clock, and the wall clock, when it was last synced,
+	// which carry last seen times over to the next process.
+	uint64_t syncedAt;
+	uint64_t syncedAtWall;
+};
+
+struct _SwarmTable {
+	MappedHeap *heap;
+	// where the heap is mapped, which doesn't change while it's open.
+	char *base;
+	SwarmTableRoot *root;
+	// The table's clock runs this far ahead of uv_now, which is only ever
+	// the case for a table that was reopened.
+	int64_t clockShift;
+	uv_mutex_t locks[SwarmTableStripes];
+};
+
+#define HeapAt( table, offset ) ((void *)((table)->base + (offset)))
+#define PeerSet_lastSeen( table, set ) ((uint64_t *)HeapAt( table, (set)->lastSeen ))
+#define PeerSet_index( table, set ) ((uint32_t *)HeapAt( table, (set)->index ))
+#define PeerSet_links( table, set ) ((SwarmPeerLink *)HeapAt( table, (set)->links ))
+#define PeerSet_address( table, set, position ) ((char *)HeapAt( table, (set)->addresses ) + (size_t)(position) * (set)->width)
+
+static uint64_t mix64( uint64_t hash ) {
+	hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+	return hash ^ (hash >> 31);
+}
+
+static uint64_t hashBytes( uint64_t seed, const char *bytes, size_t length ) {
+	uint64_t hash = seed, word;
+	for ( ; length >= 8; bytes += 8, length -= 8 ) {
+		memcpy( &word, bytes, 8 );
+		hash = mix64( hash ^ word );
+	}
+	if ( length ) {
+		word = 0;
+		memcpy( &word, bytes, length );
+		hash = mix64( hash ^ word );
+	}
+	return hash;
+}
+
+static uint32_t PeerSet_home( SwarmTable *table, SwarmPeerSet *set, const char *address ) {
+	return hashBytes( table->root->seed, address, set->width ) & (set->capacity * 2 - 1);
+}
+
+// Returns the slot that holds address, or the empty slot it would go
+// in. The set must have been allocated.
+static uint32_t PeerSet_slot( SwarmTable *table, SwarmPeerSet *set, const char *address ) {
+	uint32_t *index = PeerSet_index( table, set );
+	uint32_t mask = set->capacity * 2 - 1;
+	uint32_t slot = PeerSet_home( table, set, address );
+	while ( index[slot] ) {
+		if ( memcmp( PeerSet_address( table, set, index[slot] - 1 ), address, set->width ) == 0 )
+			break;
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+static void PeerSet_release( SwarmTable *table, SwarmPeerSet *set ) {
+	MappedHeap_release( table->heap, set->addresses, (size_t)set->capacity * set->width );
+	MappedHeap_release( table->heap, set->lastSeen, set->capacity * sizeof(uint64_t) );
+	MappedHeap_release( table->heap, set->index, set->capacity * 2 * sizeof(uint32_t) );
+	MappedHeap_release( table->heap, set->links, set->capacity * sizeof(SwarmPeerLink) );
+}
+
+static int PeerSet_grow( SwarmTable *table, SwarmPeerSet *set ) {
+	uint32_t capacity = set->capacity? set->capacity * 2: InitialPeerCapacity;
+	SwarmPeerSet grown = *set;
+	grown.capacity  = capacity;
+	grown.addresses = MappedHeap_alloc( table->heap, (size_t)capacity * set->width );
+	grown.lastSeen  = MappedHeap_alloc( table->heap, capacity * sizeof(uint64_t) );
+	grown.index     = MappedHeap_alloc( table->heap, capacity * 2 * sizeof(uint32_t) );
+	grown.links     = MappedHeap_alloc( table->heap, capacity * sizeof(SwarmPeerLink) );
+	if ( !grown.addresses || !grown.lastSeen || !grown.index || !grown.links ) {
+		PeerSet_release( table, &grown );
+		return 1;
+	}
+
+	memcpy( HeapAt( table, grown.addresses ), HeapAt( table, set->addresses ), (size_t)set->count * set->width );
+	memcpy( HeapAt( table, grown.lastSeen ), HeapAt( table, set->lastSeen ), set->count * sizeof(uint64_t) );
+	memset( HeapAt( table, grown.index ), 0, capacity * 2 * sizeof(uint32_t) );
+	memcpy( HeapAt( table, grown.links ), HeapAt( table, set->links ), set->count * sizeof(SwarmPeerLink) );
+	PeerSet_release( table, set );
+
+	*set = grown;
+	uint32_t *index = PeerSet_index( table, set );
+	for ( uint32_t i = 0; i < set->count; i++ )
+		index[PeerSet_slot( table, set, PeerSet_address( table, set, i ) )] = i + 1;
+
+	return 0;
+}
+
+// Takes position out of the order, leaving its own link as it was.
+static void PeerSet_unlink( SwarmTable *table, SwarmPeerSet *set, uint32_t position ) {
+	SwarmPeerLink *links = PeerSet_links( table, set );
+	SwarmPeerLink *link = &links[position];
+	if ( link->older ) links[link->older - 1].newer = link->newer;
+	else set->oldest = link->newer;
+	if ( link->newer ) links[link->newer - 1].older = link->older;
+	else set->newest = link->older;
+}
+
+static void PeerSet_pushNewest( SwarmTable *table, SwarmPeerSet *set, uint32_t position ) {
+	SwarmPeerLink *links = PeerSet_links( table, set );
+	links[position] = (SwarmPeerLink){ .older = set->newest, .newer = 0 };
+	if ( set->newest ) links[set->newest - 1].newer = position + 1;
+	else set->oldest = position + 1;
+	set->newest = position + 1;
+}
+
+static void PeerSet_remove( SwarmTable *table, SwarmPeerSet *set, uint32_t position ) {
+	uint32_t *index = PeerSet_index( table, set );
+	uint64_t *lastSeen = PeerSet_lastSeen( table, set );
+	uint32_t mask = set->capacity * 2 - 1;
+	uint32_t slot = PeerSet_slot( table, set, PeerSet_address( table, set, position ) );
+	index[slot] = 0;
+	PeerSet_unlink( table, set, position );
+
+	// Backward shift deletion, so that lookups never need tombstones.
+	for ( uint32_t next = (slot + 1) & mask; index[next]; next = (next + 1) & mask ) {
+		uint32_t home = PeerSet_home( table, set, PeerSet_address( table, set, index[next] - 1 ) );
+		if ( ((next - home) & mask) >= ((next - slot) & mask) ) {
+			index[slot] = index[next];
+			index[next] = 0;
+			slot = next;
+		}
+	}
+
+	// Keep the records contiguous by moving the last one into the hole.
+	uint32_t last = --set->count;
+	if ( position != last ) {
+		memcpy( PeerSet_address( table, set, position ), PeerSet_address( table, set, last ), set->width );
+		lastSeen[position] = lastSeen[last];
+		index[PeerSet_slot( table, set, PeerSet_address( table, set, position ) )] = position + 1;
+
+		// and its neighbours in the order to where it went.
+		SwarmPeerLink *links = PeerSet_links( table, set );
+		SwarmPeerLink *link = &links[position];
+		*link = links[last];
+		if ( link->older ) links[link->older - 1].newer = position + 1;
+		else set->oldest = position + 1;
+		if ( link->newer ) links[link->newer - 1].older = position + 1;
+		else set->newest = position + 1;
+	}
+}
+
+static void PeerSet_removeAddress( SwarmTable *table, SwarmPeerSet *set, const char *address ) {
+	if ( !set->count ) return;
+
+	uint32_t slot = PeerSet_slot( table, set, address );
+	uint32_t position = PeerSet_index( table, set )[slot];
+	if ( position )
+		PeerSet_remove( table, set, position - 1 );
+}
+
+static int PeerSet_upsert( SwarmTable *table, SwarmPeerSet *set, const char *address, uint64_t now ) {
+	if ( set->count == set->capacity && PeerSet_grow( table, set ) )
+		return 1;
+
+	uint32_t *index = PeerSet_index( table, set );
+	uint64_t *lastSeen = PeerSet_lastSeen( table, set );
+	uint32_t slot = PeerSet_slot( table, set, address );
+	if ( index[slot] ) {
+		uint32_t position = index[slot] - 1;
+		lastSeen[position] = now;
+		if ( set->newest != position + 1 ) {
+			PeerSet_unlink( table, set, position );
+			PeerSet_pushNewest( table, set, position );
+		}
+		return 0;
+	}
+
+	memcpy( PeerSet_address( table, set, set->count ), address, set->width );
+	lastSeen[set->count] = now;
+	PeerSet_pushNewest( table, set, set->count );
+	index[slot] = ++set->count;
+	return 0;
+}
+
+// Checks at most budget records, picking up where the last call left
+// off.
+static void PeerSet_expireSome( SwarmTable *table, SwarmPeerSet *set, uint64_t then, uint32_t budget ) {
+	while ( budget-- && set->count ) {
+		if ( set->expiryCursor >= set->count )
+			set->expiryCursor = 0;
+
+		// removal moves a new record under the cursor.
+		if ( PeerSet_lastSeen( table, set )[set->expiryCursor] < then )
+			PeerSet_remove( table, set, set->expiryCursor );
+		else
+			set->expiryCursor++;
+	}
+}
+
+static size_t PeerSet_expireAll( SwarmTable *table, SwarmPeerSet *set, uint64_t then ) {
+	size_t expired = 0;
+	for ( uint32_t i = 0; i < set->count; ) {
+		if ( PeerSet_lastSeen( table, set )[i] < then ) {
+			PeerSet_remove( table, set, i );
+			expired++;
+		} else
+			i++;
+	}
+	return expired;
+}
+
+static uint64_t monotonicMS( void ) {
+	return uv_hrtime( ) / 1000000;
+}
+
+static uint64_t wallClockMS( void ) {
+	struct timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int SwarmTable_init( SwarmTable *table ) {
+	uint64_t root = MappedHeap_alloc( table->heap, sizeof(SwarmTableRoot) );
+	if ( !root ) return 1;
+
+	// a file that was started over still has whatever it held before.
+	table->root = HeapAt( table, root );
+	memset( table->root, 0, sizeof(*table->root) );
+	for ( size_t i = 0; i < SwarmTableStripes; i++ ) {
+		SwarmTableStripe *stripe = &table->root->stripes[i];
+		stripe->buckets = MappedHeap_alloc( table->heap, InitialBucketCount / SwarmTableStripes * sizeof(uint64_t) );
+		if ( !stripe->buckets ) return 1;
+
+		stripe->bucketCount = InitialBucketCount / SwarmTableStripes;
+		memset( HeapAt( table, stripe->buckets ), 0, stripe->bucketCount * sizeof(uint64_t) );
+	}
+	if ( uv_random( NULL, NULL, &table->root->seed, sizeof(table->root->seed), 0, NULL ) ) {
+		log_err( "Could not generate a swarm table hash seed." );
+		return 1;
+	}
+
+	table->clockShift = 0;
+	MappedHeap_setRoot( table->heap, root );
+	return 0;
+}
+
+// Picks the clock up where the last process left it, plus however long
+// the file sat closed, so that last seen times keep their meaning.
+static void SwarmTable_resume( SwarmTable *table ) {
+	SwarmTableRoot *root = table->root;
+	uint64_t wall = wallClockMS( ), closed = wall > root->syncedAtWall? wall - root->syncedAtWall: 0;
+	table->clockShift = (int64_t)(root->syncedAt + closed) - (int64_t)monotonicMS( );
+}
+
+// The tracker before died with the file open. Every change it made is
+// in there, so unless it was in the middle of one, the swarms are as
+// good as they'd have been after a sync.
+static bool SwarmTable_settled( SwarmTable *table, const char *path ) {
+	for ( size_t i = 0; i < SwarmTableStripes; i++ ) {
+		if ( table->root->stripes[i].changing ) {
+			log_warn( "%s was left partway through a change, so it's being started over.", path );
+			return false;
+		}
+	}
+	log_warn( "%s wasn't closed, but it was left between changes, so its swarms are kept.", path );
+	return true;
+}
+
+SwarmTable *SwarmTable_new( const char *path ) {
+	uint64_t started = uv_hrtime( );
+	SwarmTable *table = malloc( sizeof(*table) );
+	if ( !table ) goto badTable;
+
+	table->heap = MappedHeap_open( path, SwarmTableVersion );
+	if ( !table->heap ) goto badHeap;
+	table->base = MappedHeap_base( table->heap );
+
+	if ( MappedHeap_reopened( table->heap ) ) {
+		table->root = HeapAt( table, MappedHeap_root( table->heap ) );
+		if ( !MappedHeap_clean( table->heap ) && !SwarmTable_settled( table, path ) )
+			MappedHeap_startOver( table->heap );
+	}
+
+	if ( MappedHeap_reopened( table->heap ) ) {
+		SwarmTable_resume( table );
+		uint64_t swarmCount = 0;
+		for ( size_t i = 0; i < SwarmTableStripes; i++ )
+			swarmCount += table->root->stripes[i].swarmCount;
+		log_info( "Reopened %llu swarms from %s in %.2fms.", (unsigned long long)swarmCount, path, (uv_hrtime( ) - started) / 1e6 );
+	} else if ( SwarmTable_init( table ) )
+		goto badInit;
+
+	size_t locks = 0;
+	for ( ; locks < SwarmTableStripes; locks++ ) {
+		if ( uv_mutex_init( &table->locks[locks] ) ) goto badLocks;
+	}
+	return table;
+
+badLocks:
+	while ( locks-- )
+		uv_mutex_destroy( &table->locks[locks] );
+badInit:
+	MappedHeap_close( table->heap );
+badHeap:
+	free( table );
+badTable:
+	return NULL;
+}
+
+// Records the clock, so that the next process can carry on from it.
+static void SwarmTable_stamp( SwarmTable *table ) {
+	table->root->syncedAt = SwarmTable_now( table, monotonicMS( ) );
+	table->root->syncedAtWall = wallClockMS( );
+}
+
+void SwarmTable_free( SwarmTable *table ) {
+	if ( !table ) return;
+
+	// The swarms are all in the heap, which goes away in one piece, or
+	// stays behind in its file for next time.
+	SwarmTable_stamp( table );
+	MappedHeap_close( table->heap );
+	for ( size_t i = 0; i < SwarmTableStripes; i++ )
+		uv_mutex_destroy( &table->locks[i] );
+	free( table );
+}
+
+// Every stripe is locked, in order, so that what's written back is the
+// table as it was at one moment.
+int SwarmTable_sync( SwarmTable *table ) {
+	for ( size_t i = 0; i < SwarmTableStripes; i++ )
+		uv_mutex_lock( &table->locks[i] );
+	SwarmTable_stamp( table );
+	int status = MappedHeap_sync( table->heap, false );
+	for ( size_t i = SwarmTableStripes; i > 0; i-- )
+		uv_mutex_unlock( &table->locks[i - 1] );
+	return status;
+}
+
+uint64_t SwarmTable_now( SwarmTable *table, uint64_t now ) {
+	int64_t shifted = (int64_t)now + table->clockShift;
+	return shifted > 0? (uint64_t)shifted: 0;
+}
+
+static uint64_t SwarmTable_hash( SwarmTable *table, const char *infoHash ) {
+	return hashBytes( table->root->seed, infoHash, InfoHashSize );
+}
+
+// The stripe comes from the top of the hash and the bucket from the
+// bottom, so neither says anything about the other. It's the keyed hash
+// rather than the info hash's own bytes, so nobody can crowd one stripe
+// on purpose.
+static size_t SwarmTable_stripeOf( SwarmTable *table, const char *infoHash ) {
+	return SwarmTable_hash( table, infoHash ) >> 32 & (SwarmTableStripes - 1);
+}
+
+static size_t SwarmTable_bucket( SwarmTable *table, SwarmTableStripe *stripe, const char *infoHash ) {
+	return SwarmTable_hash( table, infoHash ) & (stripe->bucketCount - 1);
+}
+
+size_t SwarmTable_lock( SwarmTable *table, const char *infoHash ) {
+	size_t stripe = SwarmTable_stripeOf( table, infoHash );
+	uv_mutex_lock( &table->locks[stripe] );
+	return stripe;
+}
+
+// The flag has to be in the mapping before the change is, and the
+// change before it's cleared, as far as a crash can see. Nothing else
+// reads it while the tracker is up, so the compiler is all that needs
+// holding back.
+static void SwarmTable_touch( SwarmTable *table, SwarmTableStripe *stripe ) {
+	MappedHeap_touch( table->heap );
+	if ( stripe->changing ) return;
+
+	stripe->changing = 1;
+	__atomic_signal_fence( __ATOMIC_SEQ_CST );
+}
+
+static void SwarmTable_settle( SwarmTableStripe *stripe ) {
+	if ( !stripe->changing ) return;
+
+	__atomic_signal_fence( __ATOMIC_SEQ_CST );
+	stripe->changing = 0;
+}
+
+void SwarmTable_unlock( SwarmTable *table, size_t stripe ) {
+	SwarmTable_settle( &table->root->stripes[stripe] );
+	uv_mutex_unlock( &table->locks[stripe] );
+}
+
+static void SwarmTable_grow( SwarmTable *table, SwarmTableStripe *stripe ) {
+	size_t bucketCount = stripe->bucketCount * 2;
+	uint64_t buckets = MappedHeap_alloc( table->heap, bucketCount * sizeof(uint64_t) );
+	// Not fatal. The chains just get longer.
+	if ( !buckets ) return;
+
+	uint64_t *newBuckets = HeapAt( table, buckets ), *old = HeapAt( table, stripe->buckets );
+	size_t oldCount = stripe->bucketCount;
+	memset( newBuckets, 0, bucketCount * sizeof(uint64_t) );
+	stripe->bucketCount = bucketCount;
+	for ( size_t i = 0; i < oldCount; i++ ) {
+		uint64_t offset = old[i];
+		while ( offset ) {
+			Swarm *swarm = HeapAt( table, offset );
+			uint64_t next = swarm->next;
+			size_t bucket = SwarmTable_bucket( table, stripe, swarm->infoHash );
+			swarm->next = newBuckets[bucket];
+			newBuckets[bucket] = offset;
+			offset = next;
+		}
+	}
+	MappedHeap_release( table->heap, stripe->buckets, oldCount * sizeof(uint64_t) );
+	stripe->buckets = buckets;
+}
+
+Swarm *SwarmTable_find( SwarmTable *table, const char *infoHash ) {
+	SwarmTableStripe *stripe = &table->root->stripes[SwarmTable_stripeOf( table, infoHash )];
+	uint64_t *buckets = HeapAt( table, stripe->buckets );
+	uint64_t offset = buckets[SwarmTable_bucket( table, stripe, infoHash )];
+	while ( offset ) {
+		Swarm *swarm = HeapAt( table, offset );
+		if ( !memcmp( swarm->infoHash, infoHash, InfoHashSize ) )
+			return swarm;
+		offset = swarm->next;
+	}
+	return NULL;
+}
+
+Swarm *SwarmTable_findOrCreate( SwarmTable *table, const char *infoHash ) {
+	Swarm *swarm = SwarmTable_find( table, infoHash );
+	if ( swarm ) return swarm;
+
+	SwarmTableStripe *stripe = &table->root->stripes[SwarmTable_stripeOf( table, infoHash )];
+	SwarmTable_touch( table, stripe );
+	if ( stripe->swarmCount >= stripe->bucketCount )
+		SwarmTable_grow( table, stripe );
+
+	uint64_t offset = MappedHeap_alloc( table->heap, sizeof(*swarm) );
+	if ( !offset ) return NULL;
+
+	swarm = HeapAt( table, offset );
+	memset( swarm, 0, sizeof(*swarm) );
+	memcpy( swarm->infoHash, infoHash, InfoHashSize );
+	for ( int family = 0; family < SwarmFamily_count; family++ )
+		swarm->seeds[family].width = swarm->peers[family].width = familyWidths[family];
+	swarm->dualSeeds.width = swarm->dualPeers.width = DualWidth;
+	uint64_t *buckets = HeapAt( table, stripe->buckets );
+	size_t bucket = SwarmTable_bucket( table, stripe, infoHash );
+	swarm->next = buckets[bucket];
+	buckets[bucket] = offset;
+	stripe->swarmCount++;
+	return swarm;
+}
+
+static void Swarm_free( SwarmTable *table, uint64_t offset ) {
+	Swarm *swarm = HeapAt( table, offset );
+	for ( int family = 0; family < SwarmFamily_count; family++ ) {
+		PeerSet_release( table, &swarm->seeds[family] );
+		PeerSet_release( table, &swarm->peers[family] );
+	}
+	PeerSet_release( table, &swarm->dualSeeds );
+	PeerSet_release( table, &swarm->dualPeers );
+	MappedHeap_release( table->heap, offset, sizeof(*swarm) );
+}
+
+int SwarmTable_announce( SwarmTable *table, Swarm *swarm, const char *compact, bool seeding, uint64_t now, uint64_t then ) {
+	SwarmTable_touch( table, &table->root->stripes[SwarmTable_stripeOf( table, swarm->infoHash )] );
+	int status = 0;
+	for ( int family = 0; family < SwarmFamily_count; family++ ) {
+		if ( !(compact[0] & familyFlags[family]) ) continue;
+
+		const char *address = compact + familyOffsets[family];
+		SwarmPeerSet *set   = seeding? &swarm->seeds[family]: &swarm->peers[family];
+		SwarmPeerSet *other = seeding? &swarm->peers[family]: &swarm->seeds[family];
+
+		// a peer that finished (or started over) shouldn't be listed twice.
+		PeerSet_removeAddress( table, other, address );
+		PeerSet_expireSome( table, other, then, InlineExpiryStep );
+		PeerSet_expireSome( table, set, then, InlineExpiryStep );
+		status |= PeerSet_upsert( table, set, address, now );
+	}
+
+	if ( (compact[0] & DualFlags) == DualFlags ) {
+		const char *pair    = compact + CompactAddress_IPv4AddressOffset;
+		SwarmPeerSet *set   = seeding? &swarm->dualSeeds: &swarm->dualPeers;
+		SwarmPeerSet *other = seeding? &swarm->dualPeers: &swarm->dualSeeds;
+		PeerSet_removeAddress( table, other, pair );
+		PeerSet_expireSome( table, other, then, InlineExpiryStep );
+		PeerSet_expireSome( table, set, then, InlineExpiryStep );
+		status |= PeerSet_upsert( table, set, pair, now );
+	}
+	return status;
+}
+
+// Sweeps up to budget of the stripe's buckets, continuing from where
+// the last call stopped, and drops swarms that end up empty. Returns how
+// many buckets it got through, and sets wrapped if the sweep got back
+// around to the start of the stripe.
+static size_t SwarmTable_expireStripe( SwarmTable *table, SwarmTableStripe *stripe, uint64_t then, size_t budget, size_t *expired, size_t *emptied, bool *wrapped ) {
+	uint64_t *buckets = HeapAt( table, stripe->buckets );
+	size_t swept = 0;
+	SwarmTable_touch( table, stripe );
+	while ( swept < budget && !*wrapped ) {
+		stripe->expiryCursor = (stripe->expiryCursor + 1) & (stripe->bucketCount - 1);
+		if ( stripe->expiryCursor == 0 )
+			*wrapped = true;
+		swept++;
+
+		uint64_t *link = &buckets[stripe->expiryCursor];
+		while ( *link ) {
+			Swarm *swarm = HeapAt( table, *link );
+			size_t remaining = 0, dropped = 0;
+			for ( int family = 0; family < SwarmFamily_count; family++ ) {
+				dropped += PeerSet_expireAll( table, &swarm->seeds[family], then );
+				dropped += PeerSet_expireAll( table, &swarm->peers[family], then );
+				remaining += swarm->seeds[family].count + swarm->peers[family].count;
+			}
+			// a peer in the dual sets was dropped from both families, and is
+			// only one peer.
+			size_t dual = PeerSet_expireAll( table, &swarm->dualSeeds, then )
+			            + PeerSet_expireAll( table, &swarm->dualPeers, then );
+			*expired += dropped > dual? dropped - dual: 0;
+			if ( !remaining ) {
+				uint64_t offset = *link;
+				*link = swarm->next;
+				Swarm_free( table, offset );
+				stripe->swarmCount--;
+				(*emptied)++;
+			} else
+				link = &swarm->next;
+		}
+	}
+	return swept;
+}
+
+// Only the one caller ever expires a table, so the stripe it's on is
+// its own to move along.
+bool SwarmTable_expire( SwarmTable *table, uint64_t then, size_t budget, size_t *expired, size_t *emptied ) {
+	SwarmTableRoot *root = table->root;
+	bool passDone = false;
+	while ( budget && !passDone ) {
+		size_t index = root->expiryStripe;
+		bool wrapped = false;
+		uv_mutex_lock( &table->locks[index] );
+		budget -= SwarmTable_expireStripe( table, &root->stripes[index], then, budget, expired, emptied, &wrapped );
+		SwarmTable_unlock( table, index );
+		if ( wrapped ) {
+			root->expiryStripe = (index + 1) % SwarmTableStripes;
+			passDone = root->expiryStripe == 0;
+		}
+	}
+	return passDone;
+}
+
+size_t SwarmTable_bucketCount( SwarmTable *table ) {
+	size_t bucketCount = 0;
+	for ( size_t i = 0; i < SwarmTableStripes; i++ ) {
+		uv_mutex_lock( &table->locks[i] );
+		bucketCount += table->root->stripes[i].bucketCount;
+		uv_mutex_unlock( &table->locks[i] );
+	}
+	return bucketCount;
+}
+
+bool SwarmTable_walk( SwarmTable *table, SwarmTableCursor *cursor, size_t budget, SwarmTableVisit *visit, void *context ) {
+	while ( budget && cursor->stripe < SwarmTableStripes ) {
+		size_t index = cursor->stripe;
+		SwarmTableStripe *stripe = &table->root->stripes[index];
+		uv_mutex_lock( &table->locks[index] );
+		uint64_t *buckets = HeapAt( table, stripe->buckets );
+		for ( ; budget && cursor->bucket < stripe->bucketCount; budget--, cursor->bucket++ ) {
+			for ( uint64_t offset = buckets[cursor->bucket]; offset; ) {
+				Swarm *swarm = HeapAt( table, offset );
+				visit( context, swarm );
+				offset = swarm->next;
+			}
+		}
+		if ( cursor->bucket >= stripe->bucketCount ) {
+			cursor->stripe++;
+			cursor->bucket = 0;
+		}
+		uv_mutex_unlock( &table->locks[index] );
+	}
+	return cursor->stripe >= SwarmTableStripes;
+}
+
+const char *Swarm_infoHash( Swarm *swarm ) {
+	return swarm->infoHash;
+}
+
+// Peers in both families are taken off once. The sets only expire a
+// few records at a time between sweeps, so they can be briefly out of
+// step, but there are never more dual peers than either family has.
+static size_t Swarm_distinct( SwarmPeerSet *sets, SwarmPeerSet *dual ) {
+	size_t ipv4 = sets[SwarmFamily_ipv4].count, ipv6 = sets[SwarmFamily_ipv6].count;
+	size_t both = ipv4 < ipv6? ipv4: ipv6;
+	return ipv4 + ipv6 - (dual->count < both? dual->count: both);
+}
+
+size_t Swarm_seedCount( Swarm *swarm ) {
+	return Swarm_distinct( swarm->seeds, &swarm->dualSeeds );
+}
+
+size_t Swarm_peerCount( Swarm *swarm ) {
+	return Swarm_distinct( swarm->peers, &swarm->dualPeers );
+}
+
+// Follows the links from the most recently seen, like redis's
+// ZREVRANGEBYSCORE, and appends up to limit addresses seen since then.
+// Each worker's clock is its own loop's, so the order is only right to a
+// millisecond or so, and anything too old is skipped rather than ending
+// the walk.
+static int PeerSet_select( SwarmTable *table, SwarmPeerSet *set, uint64_t then, int limit, StringBuffer *out ) {
+	uint64_t *lastSeen = PeerSet_lastSeen( table, set );
+	SwarmPeerLink *links = PeerSet_links( table, set );
+	int selected = 0;
+	for ( uint32_t i = set->newest; i && selected < limit; i = links[i - 1].older ) {
+		if ( lastSeen[i - 1] < then ) continue;
+
+		StringBuffer_append( out, PeerSet_address( table, set, i - 1 ), set->width );
+		selected++;
+	}
+	return selected;
+}
+
+static uint32_t nextRandom( uint64_t *state ) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return (uint32_t)(x >> 32);
+}
+
+// Floyd's algorithm: limit distinct records out of count, every set of
+// them as likely as any other, with limit draws. The draws are of
+// positions, which aren't in any order, so unlike redis, anything stale
+// is only found once it's been drawn, and is skipped rather than
+// replaced. The sweeps keep those few.
+static int PeerSet_sample( SwarmTable *table, SwarmPeerSet *set, uint64_t then, int limit, uint64_t *random, StringBuffer *out ) {
+	if ( limit <= 0 ) return 0;
+	if ( (uint32_t)limit >= set->count || limit > SampleLimit )
+		return PeerSet_select( table, set, then, limit, out );
+
+	uint64_t *lastSeen = PeerSet_lastSeen( table, set );
+	uint32_t drawn[SampleLimit];
+	int selected = 0, drawnCount = 0;
+	for ( uint32_t j = set->count - limit; j < set->count; j++ ) {
+		uint32_t pick = nextRandom( random ) % (j + 1);
+		for ( int i = 0; i < drawnCount; i++ ) {
+			if ( drawn[i] == pick ) {
+				pick = j;
+				break;
+			}
+		}
+		drawn[drawnCount++] = pick;
+		if ( lastSeen[pick] < then ) continue;
+
+		StringBuffer_append( out, PeerSet_address( table, set, pick ), set->width );
+		selected++;
+	}
+	return selected;
+}
+
+// random is NULL for the newest.
+static int PeerSet_pick( SwarmTable *table, SwarmPeerSet *set, uint64_t then, int limit, uint64_t *random, StringBuffer *out ) {
+	return random? PeerSet_sample( table, set, then, limit, random, out ): PeerSet_select( table, set, then, limit, out );
+}
+
+void SwarmTable_selectPeers( SwarmTable *table, Swarm *swarm, bool seeding, bool ipv6First, uint64_t then, int limit, uint32_t seed, StringBuffer *peerBuf, StringBuffer *peerBuf6 ) {
+	StringBuffer *out[SwarmFamily_count] = { peerBuf, peerBuf6 };
+	// xorshift never leaves 0, which seed can only be when it isn't used.
+	uint64_t state = (uint64_t)seed << 32 | seed, *random = seed? &state: NULL;
+	for ( int i = 0; i < SwarmFamily_count && limit > 0; i++ ) {
+		int family = ipv6First? SwarmFamily_count - 1 - i: i;
+		int selected = PeerSet_pick( table, &swarm->peers[family], then, limit, random, out[family] );
+		// don't give seeds to seeds.
+		if ( !seeding )
+			selected += PeerSet_pick( table, &swarm->seeds[family], then, limit - selected, random, out[family] );
+		limit -= selected;
+	}
+}
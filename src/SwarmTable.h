@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+typedef struct _SwarmTable SwarmTable;
+typedef struct _Swarm Swarm;
+typedef struct _SwarmTableCursor SwarmTableCursor;
+
+// Where a walk has got to. Starts out zeroed.
+struct _SwarmTableCursor {
+	size_t stripe;
+	uint64_t bucket;
+};
+
+#include "StringBuffer.h"
+
+// An in-process alternative to keeping swarms in redis. Torrents are
+// kept in a hash table keyed by the 20-byte info hash, and each one
+// holds its seeds and leechers, apart for IPv4 and IPv6, as contiguous
+// arrays of the addresses that go out in responses, along with the time
+// each was last seen.
+//
+// The whole table lives in a MappedHeap. Given a path, that's a file,
+// and a table reopened from it serves its swarms as they were straight
+// away, with nothing to load or rebuild. That holds for a tracker that
+// died, too, unless it died partway through changing a swarm, or the
+// machine went down before the file was closed. Without a path, it's
+// anonymous memory that goes away with the process.
+SwarmTable *SwarmTable_new( const char *path );
+// Writes a file back before closing it.
+void SwarmTable_free( SwarmTable *table );
+// Starts writing the table back to its file. Takes every stripe's lock,
+// so it's called with none of them held.
+int  SwarmTable_sync( SwarmTable *table );
+// The table keeps its own clock, which carries on from one process to
+// the next. This turns a uv_now time into one; every time passed to the
+// table should go through it.
+uint64_t SwarmTable_now( SwarmTable *table, uint64_t now );
+// A table may be shared by several workers. It's split into stripes by
+// info hash, each with its own lock. Lock returns the stripe an info
+// hash is in, which is what gets unlocked. Swarms and the functions
+// taking them are only good with their stripe's lock held; none of
+// them lock on their own.
+size_t SwarmTable_lock( SwarmTable *table, const char *infoHash );
+void SwarmTable_unlock( SwarmTable *table, size_t stripe );
+
+Swarm *SwarmTable_find( SwarmTable *table, const char *infoHash );
+Swarm *SwarmTable_findOrCreate( SwarmTable *table, const char *infoHash );
+int  SwarmTable_announce( SwarmTable *table, Swarm *swarm, const char *compact, bool seeding, uint64_t now, uint64_t then );
+
+// These go over the whole table, and lock one stripe at a time
+// themselves. Expire sweeps the next budget buckets, dropping peers seen
+// before then and swarms left empty, and returns true at the end of a
+// pass.
+bool SwarmTable_expire( SwarmTable *table, uint64_t then, size_t budget, size_t *expired, size_t *emptied );
+size_t SwarmTable_bucketCount( SwarmTable *table );
+// Calls visit on every swarm in the next budget buckets from cursor,
+// and returns true once it's been all the way through. The locks are
+// let go between calls: a stripe only ever doubles, which can show a
+// swarm twice, but never skips one.
+typedef void (SwarmTableVisit)( void *context, Swarm *swarm );
+bool SwarmTable_walk( SwarmTable *table, SwarmTableCursor *cursor, size_t budget, SwarmTableVisit *visit, void *context );
+
+const char *Swarm_infoHash( Swarm *swarm );
+
+// Each peer is counted once, whichever families it's in.
+size_t Swarm_seedCount( Swarm *swarm );
+size_t Swarm_peerCount( Swarm *swarm );
+// Appends up to limit addresses seen since then, between both
+// families: the announcer's own first, which is IPv4 unless it only has
+// IPv6, and then whatever room is left from the other. Within a family,
+// leechers come first, then seeds unless the announcer is seeding. A
+// seed of 0 picks the newest; anything else seeds an even random sample,
+// which takes O(limit) whatever the size of the swarm. Swarms point into
+// the table's heap, so only the table can read their peers.
+void SwarmTable_selectPeers( SwarmTable *table, Swarm *swarm, bool seeding, bool ipv6First, uint64_t then, int limit, uint32_t seed, StringBuffer *peerBuf, StringBuffer *peerBuf6 );
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+
+#include "TimerWheel.h"
+
+#define TimerWheelSlotBits 6
+#define TimerWheelSlots (1 << TimerWheelSlotBits)
+#define TimerWheelSlotMask (TimerWheelSlots - 1)
+#define TimerWheelLevels 4
+// The furthest ahead anything can be scheduled, which is 19 days of
+// 100ms ticks. Anything later is brought in to this.
+#define TimerWheelSpan ((uint64_t)1 << (TimerWheelSlotBits * TimerWheelLevels))
+
+struct _TimerWheel {
+	// Each slot is the head of a circular list, so that an entry can
+	// unlink itself without knowing where it is.
+	TimerWheelEntry slots[TimerWheelLevels][TimerWheelSlots];
+	// the last tick that's been handled.
+	uint64_t current;
+	uint64_t tickMS;
+	// uv_now when the wheel was attached, which is tick 0.
+	uint64_t start;
+	TimerWheelCallback *expired;
+	uv_timer_t timer;
+	bool attached;
+};
+
+TimerWheel *TimerWheel_new( uint64_t tickMS, TimerWheelCallback *expired ) {
+	TimerWheel *wheel = malloc( sizeof(*wheel) );
+	if ( !wheel ) return NULL;
+
+	for ( int level = 0; level < TimerWheelLevels; level++ ) {
+		for ( int slot = 0; slot < TimerWheelSlots; slot++ ) {
+			TimerWheelEntry *head = &wheel->slots[level][slot];
+			head->next = head->prev = head;
+		}
+	}
+	wheel->current  = 0;
+	wheel->tickMS   = tickMS? tickMS: 1;
+	wheel->start    = 0;
+	wheel->expired  = expired;
+	wheel->attached = false;
+	return wheel;
+}
+
+static void TimerWheel_closed( uv_handle_t *timer ) {
+	free( timer->data );
+}
+
+void TimerWheel_free( TimerWheel *wheel ) {
+	if ( !wheel ) return;
+
+	// A stopped worker has already closed everything on its loop.
+	if ( !wheel->attached || uv_is_closing( (uv_handle_t *)&wheel->timer ) ) {
+		free( wheel );
+		return;
+	}
+	uv_close( (uv_handle_t *)&wheel->timer, TimerWheel_closed );
+}
+
+static void TimerWheel_link( TimerWheel *wheel, TimerWheelEntry *entry ) {
+	uint64_t delta = entry->expiry - wheel->current;
+	if ( delta >= TimerWheelSpan ) {
+		entry->expiry = wheel->current + TimerWheelSpan - 1;
+		delta = TimerWheelSpan - 1;
+	}
+
+	// The level is the first whose slots are each wide enough that the
+	// entry's slot won't come around again before it's due.
+	int level = 0;
+	while ( delta >= (uint64_t)1 << (TimerWheelSlotBits * (level + 1)) )
+		level++;
+
+	TimerWheelEntry *head = &wheel->slots[level][(entry->expiry >> (TimerWheelSlotBits * level)) & TimerWheelSlotMask];
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static void TimerWheel_unlink( TimerWheelEntry *entry ) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+// Moves everything in a slot down to wherever it belongs now.
+static void TimerWheel_cascade( TimerWheel *wheel, int level ) {
+	TimerWheelEntry *head = &wheel->slots[level][(wheel->current >> (TimerWheelSlotBits * level)) & TimerWheelSlotMask];
+	while ( head->next != head ) {
+		TimerWheelEntry *entry = head->next;
+		TimerWheel_unlink( entry );
+		TimerWheel_link( wheel, entry );
+	}
+}
+
+static void TimerWheel_tick( TimerWheel *wheel ) {
+	wheel->current++;
+	// Each time a level wraps, the next one's slot for the time just
+	// reached comes down, highest level first, so that everything due
+	// this tick has reached the bottom before it's looked at.
+	int level = 1;
+	while ( level < TimerWheelLevels && !((wheel->current >> (TimerWheelSlotBits * (level - 1))) & TimerWheelSlotMask) )
+		level++;
+	while ( --level > 0 )
+		TimerWheel_cascade( wheel, level );
+
+	// Entries are always scheduled at least a tick out, so nothing the
+	// callbacks schedule ends up back in this slot.
+	TimerWheelEntry *head = &wheel->slots[0][wheel->current & TimerWheelSlotMask];
+	while ( head->next != head ) {
+		TimerWheelEntry *entry = head->next;
+		TimerWheel_unlink( entry );
+		wheel->expired( entry );
+	}
+}
+
+static void TimerWheel_timer( uv_timer_t *timer ) {
+	TimerWheel *wheel = timer->data;
+	// a busy loop can be a few ticks late, and catches up all at once.
+	uint64_t target = (uv_now( timer->loop ) - wheel->start) / wheel->tickMS;
+	while ( wheel->current < target )
+		TimerWheel_tick( wheel );
+}
+
+int TimerWheel_attachToLoop( TimerWheel *wheel, uv_loop_t *loop ) {
+	if ( uv_timer_init( loop, &wheel->timer ) ) return 1;
+
+	wheel->timer.data = wheel;
+	wheel->attached = true;
+	wheel->start = uv_now( loop );
+	wheel->current = 0;
+	// The wheel shouldn't be what keeps a loop running.
+	uv_unref( (uv_handle_t *)&wheel->timer );
+	return uv_timer_start( &wheel->timer, TimerWheel_timer, wheel->tickMS, wheel->tickMS );
+}
+
+void TimerWheel_initEntry( TimerWheelEntry *entry, void *data ) {
+	entry->next = entry->prev = NULL;
+	entry->expiry = 0;
+	entry->data = data;
+}
+
+void TimerWheel_schedule( TimerWheel *wheel, TimerWheelEntry *entry, uint64_t timeoutMS ) {
+	if ( entry->next )
+		TimerWheel_unlink( entry );
+
+	// Rounded up, and counted from the start of the current tick, so
+	// nothing fires early.
+	uint64_t elapsed = uv_now( wheel->timer.loop ) - wheel->start;
+	uint64_t expiry = (elapsed + timeoutMS + wheel->tickMS - 1) / wheel->tickMS;
+	entry->expiry = expiry > wheel->current? expiry: wheel->current + 1;
+	TimerWheel_link( wheel, entry );
+}
+
+void TimerWheel_cancel( TimerWheelEntry *entry ) {
+	if ( entry->next )
+		TimerWheel_unlink( entry );
+}
+
+bool TimerWheel_scheduled( TimerWheelEntry *entry ) {
+	return entry->next != NULL;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+typedef struct _TimerWheel TimerWheel;
+typedef struct _TimerWheelEntry TimerWheelEntry;
+typedef void (TimerWheelCallback)( TimerWheelEntry *entry );
+
+// Embedded in whatever it times, so scheduling never allocates.
+struct _TimerWheelEntry {
+	// the slot's list, or NULL while nothing is scheduled.
+	TimerWheelEntry *next;
+	TimerWheelEntry *prev;
+	// in ticks.
+	uint64_t expiry;
+	void *data;
+};
+
+// Deadlines for a whole loop's worth of connections, kept to within one
+// tick off a single uv_timer_t. Levels of 64 slots each cover 64 times
+// as much time as the one below, and an entry drops down a level each
+// time its slot comes around, so scheduling, cancelling and expiring
+// are all constant time however many entries there are.
+TimerWheel *TimerWheel_new( uint64_t tickMS, TimerWheelCallback *expired );
+// Anything still scheduled is forgotten without being called.
+void TimerWheel_free( TimerWheel *wheel );
+int  TimerWheel_attachToLoop( TimerWheel *wheel, uv_loop_t *loop );
+
+void TimerWheel_initEntry( TimerWheelEntry *entry, void *data );
+// Calls the wheel's callback timeoutMS from now, rounded up to a tick,
+// in place of anything the entry was scheduled for.
+void TimerWheel_schedule( TimerWheel *wheel, TimerWheelEntry *entry, uint64_t timeoutMS );
+void TimerWheel_cancel( TimerWheelEntry *entry );
+bool TimerWheel_scheduled( TimerWheelEntry *entry );
@@ -0,0 +1,433 @@
+#if defined(__linux__)
+// sendmmsg is a GNU extension.
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h> // htonl, ntohl
+#include <sys/socket.h>
+
+#include "UDPTracker.h"
+#include "MemoryStore.h"
+#include "announce.h"
+#include "Scrape.h"
+#include "dbg.h"
+#include "macros.h"
+
+// libuv hands out recvmmsg batches in slices of the maximum datagram
+// size, so the receive buffer has to be a multiple of 64 KiB to get
+// more than one datagram per syscall.
+#define MaxDatagramSize 65536
+#define ReceiveBatch 16
+// Replies are gathered over one loop iteration and sent in one go.
+#define SendBatch 64
+// BEP15 says clients may use a connection ID for one minute, and that
+// servers should accept them for two.
+#define ConnectionIDLifetimeMS (60 * 1000)
+#define ProtocolID 0x41727101980ULL
+// Also from BEP15: no more than 74 hashes fit in a single scrape.
+#define MaxScrapeHashes 74
+
+#define ConnectRequestSize  16
+#define AnnounceRequestSize 98
+#define ScrapeRequestSize   36
+
+struct _UDPTracker {
+	Server *server;
+	char *receiveBuffer;
+	uv_check_t *flusher;
+	int queued;
+	ClientConnection *sendQueue[SendBatch];
+};
+
+static uint32_t readUint32( const char *input ) {
+	uint32_t value;
+	memcpy( &value, input, 4 );
+	return ntohl( value );
+}
+
+static uint64_t readUint64( const char *input ) {
+	return ((uint64_t)readUint32( input ) << 32) | readUint32( input + 4 );
+}
+
+static void appendUint32( StringBuffer *buf, uint32_t value ) {
+	value = htonl( value );
+	StringBuffer_append( buf, (char *)&value, 4 );
+}
+
+// Connection IDs are derived from the peer address and the time, keyed
+// with this, so that nothing has to be stored per connection. It's
+// shared by every worker, since a client's connect and announce aren't
+// guaranteed to land on the same socket.
+static uint64_t connectionSecret[2];
+static int connectionSecretStatus;
+static uv_once_t connectionSecretOnce = UV_ONCE_INIT;
+
+static void UDPTracker_initSecret( void ) {
+	connectionSecretStatus = uv_random( NULL, NULL, connectionSecret, sizeof(connectionSecret), 0, NULL );
+}
+
+UDPTracker *UDPTracker_new( Server *server ) {
+	UDPTracker *tracker = malloc( sizeof(*tracker) );
+	if ( !tracker ) goto badTracker;
+
+	tracker->receiveBuffer = malloc( MaxDatagramSize * ReceiveBatch );
+	if ( !tracker->receiveBuffer ) goto badReceiveBuffer;
+
+	tracker->flusher = malloc( sizeof(*tracker->flusher) );
+	if ( !tracker->flusher ) goto badFlusher;
+
+	uv_once( &connectionSecretOnce, UDPTracker_initSecret );
+	if ( connectionSecretStatus ) {
+		log_err( "Could not generate a connection ID secret." );
+		goto badSecret;
+	}
+
+	tracker->server = server;
+	tracker->queued = 0;
+	tracker->flusher->data = tracker;
+	return tracker;
+
+badSecret:
+	free( tracker->flusher );
+badFlusher:
+	free( tracker->receiveBuffer );
+badReceiveBuffer:
+	free( tracker );
+badTracker:
+	return NULL;
+}
+
+void UDPTracker_free( UDPTracker *tracker ) {
+	if ( !tracker ) return;
+
+	free( tracker->receiveBuffer );
+	free( tracker->flusher );
+	free( tracker );
+}
+
+static socklen_t addressLength( const struct sockaddr_storage *address ) {
+	return address->ss_family == AF_INET6? sizeof(struct sockaddr_in6): sizeof(struct sockaddr_in);
+}
+
+static uint64_t UDPTracker_connectionID( const struct sockaddr_storage *address, uint64_t epoch ) {
+	const unsigned char *bytes;
+	size_t length;
+	uint16_t port;
+	if ( address->ss_family == AF_INET6 ) {
+		bytes  = ((struct sockaddr_in6 *)address)->sin6_addr.s6_addr;
+		length = 16;
+		port   = ((struct sockaddr_in6 *)address)->sin6_port;
+	} else {
+		bytes  = (unsigned char *)&((struct sockaddr_in *)address)->sin_addr;
+		length = 4;
+		port   = ((struct sockaddr_in *)address)->sin_port;
+	}
+
+	// FNV-1a over the address, keyed by the secret, with a splitmix64
+	// finalizer so neighbouring addresses don't produce related IDs.
+	uint64_t hash = connectionSecret[0] ^ epoch;
+	for ( size_t i = 0; i < length; i++ )
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	hash ^= port;
+	hash ^= connectionSecret[1];
+	hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+	return hash ^ (hash >> 31);
+}
+
+static bool UDPTracker_validConnection( UDPTracker *tracker, const char *packet, const struct sockaddr_storage *address ) {
+	uint64_t connectionID, epoch = uv_now( tracker->server->handle.udpHandle->loop ) / ConnectionIDLifetimeMS;
+	memcpy( &connectionID, packet, 8 );
+	return connectionID == UDPTracker_connectionID( address, epoch )
+	    || connectionID == UDPTracker_connectionID( address, epoch - 1 );
+}
+
+static void UDPTracker_flush( UDPTracker *tracker ) {
+	if ( !tracker->queued ) return;
+
+#if defined(__linux__)
+	struct mmsghdr messages[SendBatch];
+	struct iovec vectors[SendBatch];
+	memset( messages, 0, sizeof(*messages) * tracker->queued );
+	for ( int i = 0; i < tracker->queued; i++ ) {
+		ClientConnection *client = tracker->sendQueue[i];
+		vectors[i].iov_base = client->writeBuffer->str;
+		vectors[i].iov_len  = client->writeBuffer->size;
+		messages[i].msg_hdr.msg_name    = &client->peerAddress;
+		messages[i].msg_hdr.msg_namelen = addressLength( &client->peerAddress );
+		messages[i].msg_hdr.msg_iov     = vectors + i;
+		messages[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	uv_os_fd_t fd;
+	uv_fileno( (uv_handle_t *)tracker->server->handle.udpHandle, &fd );
+	int sent = 0;
+	while ( sent < tracker->queued ) {
+		int e = sendmmsg( fd, messages + sent, tracker->queued - sent, 0 );
+		if ( e < 0 ) {
+			if ( errno == EINTR ) continue;
+			// The socket buffer is full. UDP clients retry on their own, so
+			// it's cheaper to drop these than to queue them up.
+			dbg_warn( "Dropping %d UDP replies: %s", tracker->queued - sent, strerror( errno ) );
+			break;
+		}
+		sent += e;
+	}
+#else
+	for ( int i = 0; i < tracker->queued; i++ ) {
+		ClientConnection *client = tracker->sendQueue[i];
+		uv_buf_t message = StringBuffer_toUvBuf( client->writeBuffer );
+		int e = uv_udp_try_send( tracker->server->handle.udpHandle, &message, 1, (struct sockaddr *)&client->peerAddress );
+		if ( e < 0 )
+			dbg_warn( "Dropping UDP reply: %s", uv_err_name( e ) );
+	}
+#endif
+
+	for ( int i = 0; i < tracker->queued; i++ )
+		Client_terminate( tracker->sendQueue[i] );
+
+	tracker->queued = 0;
+}
+
+static void UDPTracker_flushCheck( uv_check_t *flusher ) {
+	UDPTracker_flush( flusher->data );
+}
+
+void UDPTracker_reply( ClientConnection *client ) {
+	UDPTracker *tracker = client->server->udpTracker;
+	if ( tracker->queued == SendBatch )
+		UDPTracker_flush( tracker );
+
+	dbg_info( "UDPTracker_reply: %zu bytes", client->writeBuffer->size );
+	tracker->sendQueue[tracker->queued++] = client;
+}
+
+void UDPTracker_replyError( ClientConnection *client, const char *message, size_t messageLength ) {
+	// throw away whatever had been written so far.
+	client->writeBuffer->size = 0;
+	appendUint32( client->writeBuffer, UDPAction_error );
+	StringBuffer_append( client->writeBuffer, (char *)&client->transactionID, 4 );
+	StringBuffer_append( client->writeBuffer, message, messageLength );
+	UDPTracker_reply( client );
+}
+
+void UDPTracker_appendAnnounce( ClientConnection *client, long long seedCount, long long peerCount, StringBuffer *peerBuf, StringBuffer *peerBuf6 ) {
+	appendUint32( client->writeBuffer, AnnounceInterval );
+	appendUint32( client->writeBuffer, peerCount );
+	appendUint32( client->writeBuffer, seedCount );
+
+	// There's no way to tell a UDP client which family a peer belongs
+	// to, other than by the family the request came in on. An IPv6
+	// client gets 18-byte peers, everyone else gets 6-byte peers.
+	StringBuffer *peers = CompactAddress_socketIsIPv4( &client->peerAddress )? peerBuf: peerBuf6;
+	if ( peers )
+		StringBuffer_join( client->writeBuffer, peers );
+}
+
+void UDPTracker_appendScrape( ClientConnection *client, long long complete, long long incomplete ) {
+	appendUint32( client->writeBuffer, complete );
+	// downloaded isn't tracked.
+	appendUint32( client->writeBuffer, 0 );
+	appendUint32( client->writeBuffer, incomplete );
+}
+
+static ClientConnection *UDPTracker_newClient( UDPTracker *tracker, const struct sockaddr *address, const char *packet, UDPAction action ) {
+	ClientConnection *client = Client_new( tracker->server );
+	if ( !client ) return NULL;
+
+	client->handle.udpHandle = tracker->server->handle.udpHandle;
+	memcpy( &client->peerAddress, address, addressLength( (struct sockaddr_storage *)address ) );
+	// kept in network order, since it only ever gets echoed back.
+	memcpy( &client->transactionID, packet + 12, 4 );
+	client->requestStart = uv_hrtime( );
+#if defined(CLIENTTIMEINFO)
+	client->startTime = uv_now( client->handle.udpHandle->loop );
+#endif
+
+	appendUint32( client->writeBuffer, action );
+	StringBuffer_append( client->writeBuffer, (char *)&client->transactionID, 4 );
+	return client;
+}
+
+static void UDPTracker_connect( UDPTracker *tracker, ClientConnection *client, const char *packet ) {
+	if ( readUint64( packet ) != ProtocolID ) {
+		// not a tracker client. Don't bother answering.
+		Client_terminate( client );
+		return;
+	}
+
+	uint64_t epoch = uv_now( client->handle.udpHandle->loop ) / ConnectionIDLifetimeMS;
+	uint64_t connectionID = UDPTracker_connectionID( &client->peerAddress, epoch );
+	StringBuffer_append( client->writeBuffer, (char *)&connectionID, 8 );
+	UDPTracker_reply( client );
+}
+
+static void UDPTracker_announce( UDPTracker *tracker, ClientConnection *client, const char *packet ) {
+	ClientAnnounceData *announce = ClientAnnounceData_new( client->arena );
+	Client_CheckAllocReplyError( client, announce );
+
+	client->requestType = ClientRequest_announce;
+	client->request.announce = announce;
+
+	announce->score = uv_now( client->handle.udpHandle->loop );
+	memcpy( announce->compactHash, packet + 16, 20 );
+	memcpy( announce->id, packet + 36, 20 );
+	announce->id[20]     = '\0';
+	announce->downloaded = readUint64( packet + 56 );
+	announce->left       = readUint64( packet + 64 );
+	announce->uploaded   = readUint64( packet + 72 );
+
+	switch ( readUint32( packet + 80 ) ) {
+		case 0: announce->event = AnnounceEvent_none;     break;
+		case 1: announce->event = AnnounceEvent_complete; break;
+		case 2: announce->event = AnnounceEvent_start;    break;
+		case 3: announce->event = AnnounceEvent_stop;     break;
+		default: announce->event = AnnounceEvent_unknown;
+	}
+
+	if ( announce->event == AnnounceEvent_stop ) {
+		UDPTracker_appendAnnounce( client, 0, 0, NULL, NULL );
+		UDPTracker_reply( client );
+		return;
+	}
+
+	// numwant is signed, and -1 means default.
+	int32_t numwant = (int32_t)readUint32( packet + 92 );
+	if ( numwant < MaxNumwant && numwant > 0 )
+		announce->numwant = numwant;
+
+	CompactError e = CompactAddress_fromSocket( announce->compact, &client->peerAddress, false );
+	if ( e ) {
+		AnnounceError error = e == CompactError_rejectedAddress? AnnounceError_rejectedIP: AnnounceError_malformedIP;
+		client->server->stats->announceErrors[error]++;
+		Client_replyErrorLen( client, AnnounceErrorMessage( error ) );
+		return;
+	}
+	// An explicit IPv4 address is only honored when the request came in
+	// over IPv4, and, like one in an HTTP query, ignored if it's rejected.
+	if ( CompactAddress_socketIsIPv4( &client->peerAddress ) && readUint32( packet + 84 )
+	     && !CompactAddress_isRejected( CompactAddress_IPv4Flag, (const uint8_t*)packet + 84 ) )
+		memcpy( announce->compact + CompactAddress_IPv4AddressOffset, packet + 84, 4 );
+
+	uint16_t port;
+	memcpy( &port, packet + 96, 2 );
+	if ( !port ) {
+		client->server->stats->announceErrors[AnnounceError_malformedPort]++;
+		Client_replyErrorLen( client, AnnounceErrorMessage( AnnounceError_malformedPort ) );
+		return;
+	}
+	CompactAddress_setPort( announce->compact, ntohs( port ) );
+
+	CompactAddress_dump( announce->compact );
+	Client_requestParsed( client );
+	MemoryStore_processAnnounce( tracker->server->memStore, client );
+}
+
+static void UDPTracker_scrape( UDPTracker *tracker, ClientConnection *client, const char *packet, size_t length ) {
+	int hashCount = (length - 16) / 20;
+	if ( hashCount > MaxScrapeHashes )
+		hashCount = MaxScrapeHashes;
+
+	client->requestType = ClientRequest_scrape;
+	ScrapeData *last = NULL;
+	for ( int i = 0; i < hashCount; i++ ) {
+		ScrapeData *scrape = ScrapeData_new( client->arena );
+		Client_CheckAllocReplyError( client, scrape );
+
+		if ( last )
+			last->next = scrape;
+		else
+			client->request.scrape = scrape;
+		last = scrape;
+
+		memcpy( scrape->compactHash, packet + 16 + i*20, 20 );
+	}
+
+	Client_requestParsed( client );
+	MemoryStore_processScrape( tracker->server->memStore, client );
+}
+
+static void UDPTracker_allocReceiveBuffer( uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf ) {
+	Server *server = handle->data;
+	// Every datagram is handled before the next one is read, so the same
+	// buffer can be handed out every time.
+	buf->base = server->udpTracker->receiveBuffer;
+	buf->len  = MaxDatagramSize * ReceiveBatch;
+}
+
+static void UDPTracker_receive( uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *address, unsigned flags ) {
+	if ( nread < 0 ) {
+		log_warn( "UDP read error: %s", uv_err_name( nread ) );
+		return;
+	}
+	// nread == 0 with no address just means there's nothing left to read.
+	if ( !address || nread < ConnectRequestSize ) return;
+
+	Server *server = handle->data;
+	UDPTracker *tracker = server->udpTracker;
+	const char *packet = buf->base;
+	UDPAction action = readUint32( packet + 8 );
+
+	if ( action != UDPAction_connect && !UDPTracker_validConnection( tracker, packet, (struct sockaddr_storage *)address ) ) {
+		server->stats->requests[StatsProtocol_udp][StatsRoute_invalid]++;
+		ClientConnection *client = UDPTracker_newClient( tracker, address, packet, UDPAction_error );
+		if ( !client ) return;
+		UDPTracker_replyError( client, "Invalid connection ID.", 22 );
+		return;
+	}
+
+	switch ( action ) {
+		case UDPAction_connect:
+		case UDPAction_announce:
+		case UDPAction_scrape:
+			break;
+		default: {
+			server->stats->requests[StatsProtocol_udp][StatsRoute_invalid]++;
+			dbg_info( "Unknown UDP action: %u", action );
+			return;
+		}
+	}
+
+	ClientConnection *client = UDPTracker_newClient( tracker, address, packet, action );
+	if ( !client ) return;
+
+	switch ( action ) {
+		case UDPAction_connect: {
+			server->stats->requests[StatsProtocol_udp][StatsRoute_connect]++;
+			UDPTracker_connect( tracker, client, packet );
+			break;
+		}
+		case UDPAction_announce: {
+			server->stats->requests[StatsProtocol_udp][StatsRoute_announce]++;
+			if ( nread < AnnounceRequestSize ) {
+				server->stats->announceErrors[AnnounceError_invalidRequest]++;
+				Client_replyErrorLen( client, AnnounceErrorMessage( AnnounceError_invalidRequest ) );
+				break;
+			}
+			UDPTracker_announce( tracker, client, packet );
+			break;
+		}
+		case UDPAction_scrape: {
+			server->stats->requests[StatsProtocol_udp][StatsRoute_scrape]++;
+			if ( nread < ScrapeRequestSize ) {
+				server->stats->scrapeErrors++;
+				Client_replyErrorLen( client, "Invalid scrape request." );
+				break;
+			}
+			UDPTracker_scrape( tracker, client, packet, nread );
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+int UDPTracker_start( UDPTracker *tracker ) {
+	uv_udp_t *handle = tracker->server->handle.udpHandle;
+	checkFunction( uv_check_init( handle->loop, tracker->flusher ) );
+	checkFunction( uv_check_start( tracker->flusher, UDPTracker_flushCheck ) );
+	checkFunction( uv_udp_recv_start( handle, UDPTracker_allocReceiveBuffer, UDPTracker_receive ) );
+	return 0;
+}
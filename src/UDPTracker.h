@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+
+typedef struct _UDPTracker UDPTracker;
+typedef enum _UDPAction UDPAction;
+
+#include "server.h"
+#include "client.h"
+#include "StringBuffer.h"
+
+// BEP15[1] action codes. These are sent over the wire as 32-bit
+// big-endian integers.
+// [1]: http://bittorrent.org/beps/bep_0015.html
+enum _UDPAction {
+	UDPAction_connect  = 0,
+	UDPAction_announce = 1,
+	UDPAction_scrape   = 2,
+	UDPAction_error    = 3,
+};
+
+UDPTracker *UDPTracker_new( Server *server );
+void UDPTracker_free( UDPTracker *tracker );
+int  UDPTracker_start( UDPTracker *tracker );
+
+void UDPTracker_reply( ClientConnection *client );
+void UDPTracker_replyError( ClientConnection *client, const char *message, size_t messageLength );
+void UDPTracker_appendAnnounce( ClientConnection *client, long long seedCount, long long peerCount, StringBuffer *peerBuf, StringBuffer *peerBuf6 );
+void UDPTracker_appendScrape( ClientConnection *client, long long complete, long long incomplete );
@@ -1,48 +1,62 @@
-#include <stdlib.h>
-#include <stdio.h> // snprintf
-#include <ctype.h> // tolower
-#include <limits.h> // uchar_max
+#include <stdint.h>
 
 #include "URLCommon.h"
 #include "dbg.h"
 
+// Each hex digit's value plus one, so that anything else is 0.
+static const uint8_t hexDigits[256] = {
+	['0'] =  1, ['1'] =  2, ['2'] =  3, ['3'] =  4, ['4'] =  5,
+	['5'] =  6, ['6'] =  7, ['7'] =  8, ['8'] =  9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// The byte that the two hex digits at escape stand for, or -1 if they
+// aren't both hex digits.
+static int decodeEscape( const char *escape ) {
+	int high = hexDigits[(unsigned char)escape[0]], low = hexDigits[(unsigned char)escape[1]];
+	if ( !high || !low )
+		return -1;
+	return (high - 1) << 4 | (low - 1);
+}
+
 int decodeURLString( const char *input, size_t length, char *output, size_t outputLength ) {
 	// output is guaranteed to be the same size as the input or smaller.
-	int o = 0;
-	for ( int i = 0; (i < length) && (o < length); i++, o++ ) {
+	size_t i = 0, o = 0;
+	for ( ; (i < length) && (o < outputLength); o++ ) {
 		if ( input[i] == '%' ) {
-			if ( i + 2 > length )
+			if ( i + 2 >= length )
 				return -1;
-			char encodedChar[3] = { input[i + 1], input[i + 2], '\0' };
-			long decodedChar = strtol( encodedChar, NULL, 16 );
-			if ( decodedChar < UCHAR_MAX )
-				output[o] = (char)decodedChar;
-			else
+			int decodedChar = decodeEscape( input + i + 1 );
+			if ( decodedChar < 0 )
 				return -2;
-			i += 2;
+			output[o] = (char)decodedChar;
+			i += 3;
 		} else
-			output[o] = input[i];
+			output[o] = input[i++];
 	}
 	output[o] = '\0';
 	return o;
 }
 
-int decodeInfoHash( const char *input, size_t length, char *output, size_t outputLength ) {
-	// kind of janky to hardcode the length. note: since snprintf null
-	// terminates, output has to be an extra character in width to avoid
-	// an OOB write.
-	int o = 0;
-	for ( int i = 0; (i < length) && (o < outputLength); i++, o++ ) {
+// Decodes the info hash into its raw bytes, at most 20 of them.
+int decodeInfoHash( const char *input, size_t length, char *compactHash ) {
+	size_t i = 0;
+	int c = 0;
+	for ( ; (i < length) && (c < 20); c++ ) {
 		if ( input[i] == '%' ) {
-			if ( i + 2 > length )
+			if ( i + 2 >= length )
 				return -1;
-			output[o++] = tolower( input[++i] );
-			output[o]   = tolower( input[++i] );
+			int decodedChar = decodeEscape( input + i + 1 );
+			if ( decodedChar < 0 )
+				return -2;
+			compactHash[c] = (char)decodedChar;
+			i += 3;
 		} else
-			snprintf( output + o++, 3, "%02x", input[i] );
+			compactHash[c] = input[i++];
 	}
-	output[o] = '\0';
-	return o;
+	// don't null terminate compactHash.
+	return c;
 }
 
 int parseQueryString( const char *query, size_t length, QueryCallback *callback, void *callbackData ) {
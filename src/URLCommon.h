@@ -5,6 +5,7 @@
 // I don't like typedefs to hide pointers.
 typedef int (QueryCallback)( void *data, const char *key, size_t keyLength, const char *value, size_t valueLength );
 
+// Both give a negative number for a truncated or malformed escape.
 int decodeURLString( const char *input, size_t length, char *output, size_t outputLength );
-int decodeInfoHash( const char *input, size_t length, char *output, size_t outputLength );
+int decodeInfoHash( const char *input, size_t length, char *compactHash );
 int parseQueryString( const char *query, size_t length, QueryCallback *callback, void *callbackData );
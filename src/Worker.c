@@ -0,0 +1,190 @@
+#if defined(__linux__)
+// sched_setaffinity and the CPU_* macros are GNU extensions.
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <stdlib.h>
+
+#include "Worker.h"
+#include "macros.h"
+#include "dbg.h"
+
+// The server is the worker's from the start, so that it's freed along
+// with the rest if it can't listen.
+static int Worker_startServer( Worker *worker, Server *server, Listener *listener ) {
+	server->reusePort = true;
+	server->options = listener->options;
+	server->memStore = worker->store;
+	server->stats = worker->stats;
+	// The stats only know of one pool for each protocol, so the first
+	// server of each lends its own to the rest.
+	ClientPool **pool = &worker->stats->pools[listener->protocol == ServerProtocol_UDP? StatsProtocol_udp: StatsProtocol_http];
+	if ( *pool )
+		Server_shareClientPool( server, *pool );
+	else
+		*pool = server->clientPool;
+	if ( Server_initWithLoop( server, worker->loop ) || Server_listen( server ) ) {
+		log_err( "Worker %d could not listen on %s [%s]:%s.", worker->index, listener->protocol == ServerProtocol_UDP? "UDP": "TCP", listener->address, listener->port );
+		return 1;
+	}
+	return 0;
+}
+
+static bool Worker_isListener( Worker *worker, uv_handle_t *handle ) {
+	for ( size_t i = 0; i < worker->serverCount; i++ )
+		if ( worker->servers[i] && (uv_handle_t *)worker->servers[i]->handle.stream == handle )
+			return true;
+	return false;
+}
+
+// Every TCP handle that isn't listening is a client connection, which
+// goes through Client_terminate so that it's handed back to its pool.
+// Everything else lives in something that's freed once the loop is done
+// with, so closing it is enough.
+static void Worker_closeHandle( uv_handle_t *handle, void *data ) {
+	Worker *worker = data;
+	if ( uv_is_closing( handle ) ) return;
+
+	if ( handle->type == UV_TCP && !Worker_isListener( worker, handle ) )
+		Client_terminate( handle->data );
+	else
+		uv_close( handle, NULL );
+}
+
+// Redis goes first, since freeing its contexts closes their handles and
+// can still write replies to clients that were waiting on it. Once the
+// closes have run, the loop has nothing left and returns.
+static void Worker_closeAll( Worker *worker ) {
+	MemoryStore_disconnect( worker->store );
+	uv_walk( worker->loop, Worker_closeHandle, worker );
+}
+
+static void Worker_stopCb( uv_async_t *stopSignal ) {
+	Worker *worker = stopSignal->data;
+	dbg_info( "Stopping worker %d.", worker->index );
+	Worker_closeAll( worker );
+}
+
+Worker *Worker_new( int index, int cpu, MemoryStore *store, Listener *listeners ) {
+	Worker *worker = malloc( sizeof(*worker) );
+	if ( !worker ) goto badWorker;
+
+	worker->index = index;
+	worker->cpu   = cpu;
+	worker->store = store;
+
+	worker->loop = malloc( sizeof(*worker->loop) );
+	if ( !worker->loop ) goto badLoop;
+	if ( uv_loop_init( worker->loop ) ) goto badLoopInit;
+
+	worker->stopSignal = malloc( sizeof(*worker->stopSignal) );
+	if ( !worker->stopSignal ) goto badStopSignal;
+
+	worker->stats = Stats_new( );
+	if ( !worker->stats ) goto badStats;
+	worker->stats->store = store;
+
+	if ( uv_async_init( worker->loop, worker->stopSignal, Worker_stopCb ) ) goto badAsync;
+	worker->stopSignal->data = worker;
+
+	worker->serverCount = 0;
+	for ( Listener *listener = listeners; listener; listener = listener->next )
+		worker->serverCount++;
+	worker->servers = calloc( worker->serverCount, sizeof(*worker->servers) );
+	if ( !worker->servers ) goto badServers;
+
+	// None of this runs until the worker's thread starts the loop, so it
+	// can all be set up from the main thread. Failures past this point
+	// leave handles on the loop, which are closed and run through before
+	// anything is freed.
+	if ( MemoryStore_attachToLoop( store, worker->loop ) ) goto badStart;
+
+	size_t i = 0;
+	for ( Listener *listener = listeners; listener; listener = listener->next ) {
+		worker->servers[i] = Server_new( listener->address, listener->port, listener->protocol );
+		if ( !worker->servers[i] ) goto badStart;
+		if ( Worker_startServer( worker, worker->servers[i++], listener ) ) goto badStart;
+	}
+
+	return worker;
+
+badStart:
+	Worker_closeAll( worker );
+	uv_run( worker->loop, UV_RUN_DEFAULT );
+	for ( size_t j = 0; j < worker->serverCount; j++ )
+		Server_free( worker->servers[j] );
+	free( worker->servers );
+	goto badAsync;
+badServers:
+	uv_close( (uv_handle_t *)worker->stopSignal, NULL );
+	uv_run( worker->loop, UV_RUN_DEFAULT );
+badAsync:
+	Stats_free( worker->stats );
+badStats:
+	free( worker->stopSignal );
+badStopSignal:
+	uv_loop_close( worker->loop );
+badLoopInit:
+	free( worker->loop );
+badLoop:
+	free( worker );
+badWorker:
+	return NULL;
+}
+
+static void Worker_pin( Worker *worker ) {
+#if defined(__linux__)
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	CPU_SET( worker->cpu, &cpus );
+	// pid 0 is the calling thread.
+	if ( sched_setaffinity( 0, sizeof(cpus), &cpus ) )
+		log_warn( "Could not pin worker %d to CPU %d: %s", worker->index, worker->cpu, strerror( errno ) );
+#else
+	log_warn( "CPU pinning isn't supported on this platform." );
+#endif
+}
+
+static void Worker_run( void *data ) {
+	Worker *worker = data;
+	if ( worker->cpu >= 0 )
+		Worker_pin( worker );
+
+	dbg_info( "Worker %d running.", worker->index );
+	uv_run( worker->loop, UV_RUN_DEFAULT );
+	if ( uv_loop_close( worker->loop ) )
+		log_warn( "Worker %d stopped with handles still open.", worker->index );
+}
+
+int Worker_start( Worker *worker ) {
+	return uv_thread_create( &worker->thread, Worker_run, worker );
+}
+
+// Safe to call from any thread.
+void Worker_stop( Worker *worker ) {
+	uv_async_send( worker->stopSignal );
+}
+
+void Worker_setConnectionLimit( Worker *worker, size_t limit ) {
+	for ( size_t i = 0; i < worker->serverCount; i++ )
+		worker->servers[i]->maxConnections = limit;
+}
+
+int Worker_join( Worker *worker ) {
+	return uv_thread_join( &worker->thread );
+}
+
+// Once the worker has been joined. The store is left alone, since it can
+// be shared.
+void Worker_free( Worker *worker ) {
+	if ( !worker ) return;
+
+	for ( size_t i = 0; i < worker->serverCount; i++ )
+		Server_free( worker->servers[i] );
+	free( worker->servers );
+	Stats_free( worker->stats );
+	free( worker->stopSignal );
+	free( worker->loop );
+	free( worker );
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <uv.h>
+
+typedef struct _Worker Worker;
+
+#include "server.h"
+#include "Listener.h"
+#include "MemoryStore.h"
+#include "Stats.h"
+
+// A worker owns one loop, running on its own thread, along with the
+// servers and store attached to it. Every worker binds the same
+// addresses with SO_REUSEPORT, and the kernel spreads connections
+// across them.
+struct _Worker {
+	int index;
+	// the CPU this worker is pinned to, or -1.
+	int cpu;
+	uv_thread_t thread;
+	uv_loop_t *loop;
+	uv_async_t *stopSignal;
+	MemoryStore *store;
+	Stats *stats;
+	// one for each listener, in the same order.
+	Server **servers;
+	size_t serverCount;
+};
+
+Worker *Worker_new( int index, int cpu, MemoryStore *store, Listener *listeners );
+int  Worker_start( Worker *worker );
+void Worker_stop( Worker *worker );
+// Shared between the worker's TCP servers, however many of them there are.
+void Worker_setConnectionLimit( Worker *worker, size_t limit );
+int  Worker_join( Worker *worker );
+void Worker_free( Worker *worker );
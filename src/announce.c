@@ -1,6 +1,5 @@
-#include <ctype.h> // tolower
 #include <string.h>
-#include <stdlib.h>
+#include <stdint.h>
 #include <stddef.h>
 
 #include "announce.h"
@@ -19,108 +18,44 @@ const static char *AnnounceErrorStrings[] = {
 	"The request contained a malformed ipv4.",
 	"The request contained a malformed ipv6.",
 	"The request contained a malformed port.",
-	"The requested torrent does not exist."
+	"The requested torrent does not exist.",
+	"The request came from an address that isn't accepted.",
 	"An unknown error has occurred."
 };
 
-static int handleIPv4( ClientAnnounceData *announce, const char *value, size_t valueLength ) {
-	char *ipv4 = malloc( (valueLength + 1) * sizeof(*ipv4) );
-	if ( !ipv4 ) return 1;
-
-	int decodedLength = decodeURLString( value, valueLength, ipv4, valueLength );
-	// 0.0.0.0 the shortest ipv4 address?
-	if ( decodedLength < 7 ) return 1;
-
-	char *port;
-	int portLength = 0;
-	for ( int i = 7; i < decodedLength; i++ ) {
-		if ( ipv4[i] == ':' ) {
-			ipv4[i] = '\0';
-			port = ipv4 + i + 1;
-			portLength = decodedLength - i - 1;
-			dbg_info( "handleIPv4: %s : %s; %d", ipv4, port, portLength );
-		}
-	}
-
-	int status = CompactAddress_fromString( announce->compact, ipv4, portLength? port: NULL );
-	if ( portLength )
-		announce->compact[0] |= CompactAddress_IPv4PortFlag;
-
-	free( ipv4 );
-	return status;
+const char *AnnounceErrorMessage( AnnounceError error ) {
+	if ( error > AnnounceError_unknown )
+		error = AnnounceError_unknown;
+	return AnnounceErrorStrings[error];
 }
 
-static int handleIPv6( ClientAnnounceData *announce, const char *value, size_t valueLength ) {
-	// ipv6 can be of form: [::1]:9001 or ::1
-	char *ipv6 = malloc( (valueLength + 1) * sizeof(*ipv6) );
-	if ( !ipv6 ) return 1;
-
-	int decodedLength = decodeURLString( value, valueLength, ipv6, valueLength );
-	if ( decodedLength < 2 ) return 1;
-
-	// have to use a scratch pointer because incrementing ipv6 means
-	// freeing is invalid, and keeping track of whether or not it has been
-	// incremented is probably worse than just using a scratch pointer.
-	char *port, *scratch = ipv6;
-	int portLength = 0;
-	if ( scratch[0] == '[' ) {
-		// chop off the [
-		scratch++;
-		for( int i = 2; i < decodedLength - 1; i++ ) {
-			if ( scratch[i] == ']' ) {
-				// null terminate ipv6. port will already be null terminated
-				// because decodeURLString null terminates its output.
-				scratch[i] = '\0';
-				port = scratch + i + 2;
-				portLength = decodedLength - i - 3;
-				dbg_info( "handleIPv6: %s : %s; %d", scratch, port, portLength );
-				if ( portLength < 1 || portLength > 5 || i < 2 ) return 1;
-				break;
-			}
-		}
-	}
+// Longer than any address, with a port and brackets, could be.
+#define IPStringSize 64
 
-	int status = CompactAddress_fromString( announce->compact, scratch, portLength? port: NULL );
-	if ( portLength )
-		announce->compact[0] |= CompactAddress_IPv6PortFlag;
+// Decodes value and reads the address in it. An address in the reject
+// list is left out as though it hadn't been sent, which falls back on
+// the address the request came from.
+static int handleAddress( ClientAnnounceData *announce, const char *value, size_t valueLength, int families ) {
+	char address[IPStringSize];
+	int decodedLength = decodeURLString( value, valueLength, address, sizeof(address) - 1 );
+	if ( decodedLength < 1 ) return 1;
 
-	free( ipv6 );
-	return status;
+	CompactError error = CompactAddress_fromString( announce->compact, address, decodedLength, families );
+	return error && error != CompactError_rejectedAddress;
 }
 
-#define InfoHashSize 40
+#define InfoHashSize 20
 #define PeerIDSize 20
-ClientAnnounceData *ClientAnnounceData_new( void ) {
-	ClientAnnounceData *announce = malloc( sizeof(*announce) );
-	if ( !announce ) goto badAnnounce;
-
-	announce->infoHash = malloc( (InfoHashSize + 1) * sizeof(*announce->infoHash) );
-	if ( !announce->infoHash ) goto badHash;
+// Lives until the arena is reset, so there's nothing to free.
+ClientAnnounceData *ClientAnnounceData_new( Arena *arena ) {
+	ClientAnnounceData *announce = Arena_alloc( arena, sizeof(*announce) );
+	if ( !announce ) return NULL;
 
-	announce->id = malloc( (PeerIDSize + 1) * sizeof(*announce->id) );
-	if ( !announce->id ) goto badID;
-
-	announce->numwant = 20;
+	announce->numwant = MaxNumwant;
 	announce->event   = AnnounceEvent_none;
 	CompactAddress_init( announce->compact );
 	announce->seenFields = 0;
 	return announce;
-
-badID:
-	free( announce->infoHash );
-badHash:
-	free( announce );
-badAnnounce:
-	return NULL;
-}
-
-void ClientAnnounceData_free( ClientAnnounceData *announce ) {
-	if ( !announce ) return;
-	dbg_info( "ClientAnnounceData_free" );
-
-	free( announce->infoHash );
-	free( announce->id );
-	free( announce );
 }
 
 // These break with the naming convention to allow for some preprocessor
@@ -138,83 +73,150 @@ enum _SeenFieldOffsets {
 	SeenFieldOffset_required  = SeenFieldOffset_peer_id | SeenFieldOffset_info_hash | SeenFieldOffset_port | SeenFieldOffset_left,
 };
 
+typedef struct _AnnounceKey AnnounceKey;
+struct _AnnounceKey {
+	const char *name;
+	size_t length;
+	int field;
+};
+
+// A perfect hash of the keys that mean something to us: every one of
+// them lands in its own slot, so a key is known after a single compare.
+// Anything else (uploaded, compact, key, ...) either misses every slot
+// or fails the compare. Adding a key means finding a new hash.
+#define AnnounceKeyHash( key, length ) ((2 * (length) + (unsigned char)(key)[0] + ((unsigned char)(key)[(length) - 1] << 2)) & 15)
+#define AnnounceKeyMinLength 2
+#define AnnounceKeyMaxLength 9
+#define Key( fieldName ) { #fieldName, sizeof(#fieldName) - 1, SeenFieldOffset_##fieldName }
+static const AnnounceKey announceKeys[16] = {
+	[ 1] = Key( ipv4 ),
+	[ 4] = Key( left ),
+	[ 8] = Key( port ),
+	[ 9] = Key( ipv6 ),
+	[11] = Key( info_hash ),
+	[12] = Key( numwant ),
+	[13] = Key( ip ),
+	[14] = Key( peer_id ),
+	[15] = Key( event ),
+};
+#undef Key
+
+// Reads the digits at the start of value, like strtoull, but stops at
+// the end of value rather than needing a NUL. More than maxDigits
+// digits (at most 19, which can't overflow) gives UINT64_MAX, and none
+// at all gives 0.
+static uint64_t parseDecimal( const char *value, size_t valueLength, size_t maxDigits ) {
+	uint64_t result = 0;
+	for ( size_t i = 0; i < valueLength; i++ ) {
+		unsigned digit = (unsigned char)value[i] - '0';
+		if ( digit > 9 )
+			break;
+		if ( i == maxDigits )
+			return UINT64_MAX;
+		result = result * 10 + digit;
+	}
+	return result;
+}
+
 #define CheckError( boolean, err ) if ( boolean ) { return err; }
-#define CheckField( fieldName ) !(announce->seenFields & SeenFieldOffset_##fieldName) && EqualLiteralLength( key, keyLength, #fieldName )
-static int ClientAnnounceData_parse( void *data, const char *key, size_t keyLength, const char *value, size_t valueLength ) {
-	ClientAnnounceData *announce = data;
-
-	// Compare keys to get values. This is not particularly elegant.
-	if ( CheckField( peer_id ) ) {
-		CheckError( decodeURLString( value, valueLength, announce->id, PeerIDSize ) < 1, AnnounceError_malformedID );
-		announce->seenFields |= SeenFieldOffset_peer_id;
-
-	} else if ( CheckField( info_hash ) ) {
-		CheckError( decodeInfoHash( value, valueLength, announce->infoHash, InfoHashSize ) != InfoHashSize, AnnounceError_malformedInfoHash );
-		dbg_info( "info_hash: %s", announce->infoHash );
-		announce->seenFields |= SeenFieldOffset_info_hash;
-
-	// The IP value in the request can allegedly be a DNS name,
-	// according to BEP3[1]. I don't know if any clients do this, but
-	// it's not currently supported.
-	// [1]: http://bittorrent.org/beps/bep_0003.html#trackers
-	} else if ( CheckField( ip ) ) {
-		char *ip = malloc( (valueLength + 1) * sizeof(*ip) );
-		if ( !ip ) return AnnounceError_unknown;
-		CheckError( decodeURLString( value, valueLength, ip, valueLength ) < 1, AnnounceError_malformedIP );
-		CheckError( CompactAddress_fromString( announce->compact, ip, NULL), AnnounceError_malformedIP );
-		free( ip );
-		announce->seenFields |= SeenFieldOffset_ip;
-
-	// Optional fields according to BEP7[1], I don't know if clients
-	// tend to send these or not. Not supported for now.
-	// [1]: http://bittorrent.org/beps/bep_0007.html#announce-parameter
-	} else if ( CheckField( ipv4 ) ) {
-		CheckError( handleIPv4( announce, value, valueLength ), AnnounceError_malformedIPv4 );
-		announce->seenFields |= SeenFieldOffset_ipv4;
-
-	} else if ( CheckField( ipv6 ) ) {
-		CheckError( handleIPv6( announce, value, valueLength ), AnnounceError_malformedIPv6 );
-		announce->seenFields |= SeenFieldOffset_ipv6;
-
-	} else if ( CheckField( port ) ) {
-		unsigned long port = strtoul( value, NULL, 10 );
-		dbg_info( "portlong: %lu", port );
-		CheckError( (port < 1) || (port > 65535), AnnounceError_malformedPort );
-		CompactAddress_setPort( announce->compact, (uint16_t)port );
-		announce->seenFields |= SeenFieldOffset_port;
-
-	} else if ( CheckField( left ) ) {
-		dbg_info( "left: %.*s", (int)valueLength, value );
-		announce->left = strtoull( value, NULL, 10 );
-		announce->seenFields |= SeenFieldOffset_left;
-
-	} else if ( CheckField( event ) ) {
-		if ( EqualLiteralLength( value, valueLength, "started" ) )
-			announce->event = AnnounceEvent_start;
-		else if ( EqualLiteralLength( value, valueLength, "completed" ) )
-			announce->event = AnnounceEvent_complete;
-		else if ( EqualLiteralLength( value, valueLength, "stopped" ) ) {
-			announce->event = AnnounceEvent_stop;
-			// just hang up.
-			return AnnounceError_okay;
-		} else
-			announce->event = AnnounceEvent_unknown;
-
-		announce->seenFields |= SeenFieldOffset_event;
-
-	} else if ( CheckField( numwant ) ) {
-		unsigned long numwant = strtoul( value, NULL, 10 );
-		if ( numwant < 20 && numwant > 0 )
-			announce->numwant = numwant;
-
-		announce->seenFields |= SeenFieldOffset_numwant;
+static AnnounceError ClientAnnounceData_parseField( ClientAnnounceData *announce, const char *key, size_t keyLength, const char *value, size_t valueLength ) {
+	if ( keyLength < AnnounceKeyMinLength || keyLength > AnnounceKeyMaxLength )
+		return AnnounceError_okay;
+
+	const AnnounceKey *known = &announceKeys[AnnounceKeyHash( key, keyLength )];
+	// Repeated fields are ignored, as are unknown ones.
+	if ( known->length != keyLength || memcmp( key, known->name, keyLength ) || (announce->seenFields & known->field) )
+		return AnnounceError_okay;
+
+	switch ( known->field ) {
+		case SeenFieldOffset_peer_id:
+			CheckError( decodeURLString( value, valueLength, announce->id, PeerIDSize ) < 1, AnnounceError_malformedID );
+			break;
+
+		case SeenFieldOffset_info_hash:
+			CheckError( decodeInfoHash( value, valueLength, announce->compactHash ) != InfoHashSize, AnnounceError_malformedInfoHash );
+			break;
+
+		// The IP value in the request can allegedly be a DNS name,
+		// according to BEP3[1]. I don't know if any clients do this, but
+		// it's not currently supported.
+		// [1]: http://bittorrent.org/beps/bep_0003.html#trackers
+		case SeenFieldOffset_ip:
+			CheckError( handleAddress( announce, value, valueLength, CompactAddress_IPv4Flag | CompactAddress_IPv6Flag ), AnnounceError_malformedIP );
+			break;
+
+		// Optional fields according to BEP7[1], I don't know if clients
+		// tend to send these or not.
+		// [1]: http://bittorrent.org/beps/bep_0007.html#announce-parameter
+		case SeenFieldOffset_ipv4:
+			CheckError( handleAddress( announce, value, valueLength, CompactAddress_IPv4Flag ), AnnounceError_malformedIPv4 );
+			break;
+
+		case SeenFieldOffset_ipv6:
+			CheckError( handleAddress( announce, value, valueLength, CompactAddress_IPv6Flag ), AnnounceError_malformedIPv6 );
+			break;
+
+		case SeenFieldOffset_port: {
+			uint64_t port = parseDecimal( value, valueLength, 5 );
+			dbg_info( "portlong: %llu", (unsigned long long)port );
+			CheckError( (port < 1) || (port > 65535), AnnounceError_malformedPort );
+			CompactAddress_setPort( announce->compact, (uint16_t)port );
+			break;
+		}
+
+		case SeenFieldOffset_left:
+			dbg_info( "left: %.*s", (int)valueLength, value );
+			announce->left = parseDecimal( value, valueLength, 19 );
+			break;
+
+		case SeenFieldOffset_event:
+			if ( EqualLiteralLength( value, valueLength, "started" ) )
+				announce->event = AnnounceEvent_start;
+			else if ( EqualLiteralLength( value, valueLength, "completed" ) )
+				announce->event = AnnounceEvent_complete;
+			else if ( EqualLiteralLength( value, valueLength, "stopped" ) )
+				announce->event = AnnounceEvent_stop;
+			else
+				announce->event = AnnounceEvent_unknown;
+			break;
+
+		case SeenFieldOffset_numwant: {
+			uint64_t numwant = parseDecimal( value, valueLength, 3 );
+			if ( numwant < MaxNumwant && numwant > 0 )
+				announce->numwant = numwant;
+			break;
+		}
 	}
 
+	announce->seenFields |= known->field;
+	return AnnounceError_okay;
+}
+
+// Goes through the query once, handing each key and value straight to
+// the field they belong to. memchr finds the separators, which libc does
+// a word or a vector at a time.
+static AnnounceError ClientAnnounceData_parse( ClientAnnounceData *announce, const char *query, size_t queryLength ) {
+	dbg_info( "Query: %.*s", (int)queryLength, query );
+	const char *end = query + queryLength;
+	for ( const char *key = query; key < end; ) {
+		const char *pairEnd = memchr( key, '&', end - key );
+		if ( !pairEnd )
+			pairEnd = end;
+
+		const char *value = memchr( key, '=', pairEnd - key );
+		CheckError( !value, AnnounceError_invalidRequest );
+		value++;
+
+		AnnounceError e = ClientAnnounceData_parseField( announce, key, value - key - 1, value, pairEnd - value );
+		if ( e )
+			return e;
+		key = pairEnd + 1;
+	}
 	return AnnounceError_okay;
 }
 
 AnnounceError ClientAnnounceData_fromQuery( ClientAnnounceData *announce, const char *query, size_t queryLength ) {
-	int e = parseQueryString( query, queryLength, ClientAnnounceData_parse, announce );
+	AnnounceError e = ClientAnnounceData_parse( announce, query, queryLength );
 	if ( e ) {
 		announce->errorMessage = AnnounceErrorStrings[e];
 		return e;
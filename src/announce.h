@@ -8,6 +8,10 @@ typedef enum   _AnnounceEvent AnnounceEvent;
 typedef enum   _AnnounceError AnnounceError;
 
 #include "CompactAddress.h"
+#include "Arena.h"
+
+// Will not serve more than this many peers at a time anyway.
+#define MaxNumwant 20
 
 enum _AnnounceError {
 	AnnounceError_okay,
@@ -21,17 +25,17 @@ enum _AnnounceError {
 	AnnounceError_malformedIPv6,
 	AnnounceError_malformedPort,
 	AnnounceError_noTorrent,
+	AnnounceError_rejectedIP,
 	AnnounceError_unknown,
 };
 
 struct _ClientAnnounceData {
-	// The IPs and port info should probably be sanity-checked to avoid
-	// sending junk info to clients. For later: check port within 0-65535
-	// and ip within RFC 1918/4007 limits.
-
-	char *id, *infoHash;
+	// NUL terminated.
+	char id[21];
+	// the raw info hash, which is also what redis keys are made from.
+	char compactHash[20];
 	char compact[CompactAddress_Size];
-	// Will not serve more than 20 peers at a time anyway.
+	// at most MaxNumwant.
 	uint8_t  numwant;
 	// Currently unused.
 	uint64_t uploaded, downloaded, left;
@@ -52,6 +56,5 @@ struct _ClientAnnounceData {
 };
 
 const char *AnnounceErrorMessage( AnnounceError error );
-ClientAnnounceData *ClientAnnounceData_new( void );
-void ClientAnnounceData_free( ClientAnnounceData *announce );
+ClientAnnounceData *ClientAnnounceData_new( Arena *arena );
 AnnounceError ClientAnnounceData_fromQuery( ClientAnnounceData *announce, const char *query, size_t queryLength );
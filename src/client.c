@@ -2,11 +2,82 @@
 #include <string.h>
 
 #include "client.h"
+#include "UDPTracker.h"
+#include "Bencode.h"
 #include "dbg.h"
 #include "macros.h"
 
-ClientConnection *Client_new( void ) {
-	ClientConnection *client = malloc( sizeof(*client) );
+// announces and scrapes are a single line and a few headers, so anything
+// much bigger than this is not worth buffering.
+#define MaxRequestSize 16384
+// Plenty for an announce, or a scrape of a few dozen hashes.
+#define ClientArenaSize 4096
+// A client whose buffers grew past this (a huge scrape, say) isn't worth
+// keeping around.
+#define MaxPooledBufferSize 65536
+// How long a connection gets for each thing it waits on, by
+// ClientDeadline. A client trickling in a request a byte at a time
+// still only gets the headers timeout for the whole of it.
+static const uint64_t deadlineMS[ClientDeadline_count] = { 30000, 10000, 10000, 30000 };
+#define ClientStatsProtocol( client ) ((client)->server->protocol == ServerProtocol_UDP? StatsProtocol_udp: StatsProtocol_http)
+
+struct _ClientPool {
+	ClientConnection *free;
+	size_t capacity;
+	ClientPoolStats stats;
+};
+
+ClientPool *ClientPool_new( size_t capacity ) {
+	ClientPool *pool = malloc( sizeof(*pool) );
+	if ( !pool ) return NULL;
+
+	pool->free = NULL;
+	pool->capacity = capacity;
+	memset( &pool->stats, 0, sizeof(pool->stats) );
+	return pool;
+}
+
+static void Client_clearReply( ClientConnection *client ) {
+	client->writeBuffer->size = 0;
+	client->replySegmentCount = 0;
+	client->bufferedFrom = 0;
+}
+
+static void Client_destroy( ClientConnection *client ) {
+	HttpParser_free( client->parserInfo );
+	Arena_free( client->arena );
+	StringBuffer_free( client->readBuffer  );
+	StringBuffer_free( client->writeBuffer );
+	free( client );
+}
+
+void ClientPool_free( ClientPool *pool ) {
+	if ( !pool ) return;
+
+	while ( pool->free ) {
+		ClientConnection *next = pool->free->nextFree;
+		Client_destroy( pool->free );
+		pool->free = next;
+	}
+	free( pool );
+}
+
+void ClientPool_stats( ClientPool *pool, ClientPoolStats *stats ) {
+	*stats = pool->stats;
+}
+
+ClientConnection *Client_new( Server *server ) {
+	ClientPool *pool = server->clientPool;
+	ClientConnection *client = pool->free;
+	if ( client ) {
+		pool->free = client->nextFree;
+		pool->stats.pooled--;
+		pool->stats.hits++;
+		goto ready;
+	}
+	pool->stats.misses++;
+
+	client = malloc( sizeof(*client) );
 	if ( !client ) goto badClient;
 
 	client->readBuffer = StringBuffer_new( );
@@ -15,10 +86,29 @@ ClientConnection *Client_new( void ) {
 	client->writeBuffer = StringBuffer_new( );
 	if ( !client->writeBuffer ) goto badWriteBuffer;
 
-	client->request.announce = NULL;
+	client->arena = Arena_new( ClientArenaSize );
+	if ( !client->arena ) goto badArena;
+
+	// only TCP connections need one, and only once they're accepted.
+	client->parserInfo = NULL;
 
+ready:
+	Client_clearReply( client );
+	client->server = server;
+	client->requestStart = 0;
+	client->requestParsed = 0;
+	client->replyReady = 0;
+	client->request.announce = NULL;
+	client->fullScrape = NULL;
+	client->keepAlive = false;
+	client->nextFree = NULL;
+	TimerWheel_initEntry( &client->timeout, client );
+	client->deadline = ClientDeadline_idle;
+	client->abandoned = 0;
 	return client;
 
+badArena:
+	StringBuffer_free( client->writeBuffer );
 badWriteBuffer:
 	StringBuffer_free( client->readBuffer );
 badReadBuffer:
@@ -27,82 +117,296 @@ badClient:
 	return NULL;
 }
 
+// The request's data all lives in the arena, so dropping it is just a
+// matter of forgetting about it.
+static void Client_freeRequest( ClientConnection *client ) {
+	client->server->clientPool->stats.arenaOverflows += Arena_reset( client->arena );
+	client->request.announce = NULL;
+	FullScrapeSnapshot_release( client->fullScrape );
+	client->fullScrape = NULL;
+}
+
+// Hands the client back to its server's pool, unless the pool is full.
 void Client_free( ClientConnection *client ) {
 	if ( !client ) return;
 	dbg_info( "Client_free" );
 
-	switch ( client->requestType ) {
-		case ClientRequest_announce: {
-			ClientAnnounceData_free( client->request.announce );
-			break;
-		}
-
-		case ClientRequest_scrape: {
-			ScrapeData_free( client->request.scrape );
-			break;
-		}
+	TimerWheel_cancel( &client->timeout );
+	Client_freeRequest( client );
+	ClientPool *pool = client->server->clientPool;
+	if ( pool->stats.pooled >= pool->capacity ||
+	     client->readBuffer->alloc_size > MaxPooledBufferSize ||
+	     client->writeBuffer->alloc_size > MaxPooledBufferSize ) {
+		Client_destroy( client );
+		return;
 	}
-	StringBuffer_free( client->readBuffer  );
-	StringBuffer_free( client->writeBuffer );
-	free( client );
+
+	client->readBuffer->size = 0;
+	if ( client->parserInfo )
+		HttpParser_reset( client->parserInfo );
+	client->nextFree = pool->free;
+	pool->free = client;
+	pool->stats.pooled++;
 }
 
-static void Client_cleanup( uv_handle_t *handle ) {
-	ClientConnection *client = handle->data;
+void Client_closed( ClientConnection *client ) {
 	checktime( client, "Close connection." );
-	HttpParser_free( client->parserInfo );
+	client->server->stats->openConnections--;
+	if ( client->abandoned && --client->abandoned ) return;
 	Client_free( client );
-	// this is the client tcp handle.
-	free( handle );
+}
+
+static void Client_cleanup( uv_handle_t *handle ) {
+	Client_closed( handle->data );
+}
+
+// Only TCP servers have a wheel, so UDP requests never time out.
+static void Client_setDeadline( ClientConnection *client, ClientDeadline deadline ) {
+	TimerWheel *timers = client->server->timers;
+	if ( !timers ) return;
+
+	client->deadline = deadline;
+	TimerWheel_schedule( timers, &client->timeout, deadlineMS[deadline] );
+}
+
+void Client_timedOut( TimerWheelEntry *entry ) {
+	ClientConnection *client = entry->data;
+	client->server->stats->timeouts[client->deadline]++;
+	dbg_info( "Connection timed out after %llums.", (unsigned long long)deadlineMS[client->deadline] );
+	if ( client->deadline == ClientDeadline_backend )
+		client->abandoned = 2;
+	Client_terminate( client );
 }
 
 void Client_terminate( ClientConnection *client ) {
-	uv_close( (uv_handle_t*)client->handle.tcpHandle, Client_cleanup );
+	// UDP requests borrow the server's handle, so there's nothing to close.
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		// the reply has just gone out, if there was one.
+		if ( client->replyReady )
+			Stats_recordPhase( client->server->stats, StatsProtocol_udp, StatsPhase_write, client->replyReady, uv_hrtime( ) );
+		Client_free( client );
+		return;
+	}
+	TimerWheel_cancel( &client->timeout );
+	if ( client->server->ring )
+		Ring_close( client );
+	else
+		uv_close( (uv_handle_t*)client->handle.tcpHandle, Client_cleanup );
 }
 
 static void Client_allocReadBuffer( uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf ) {
 	ClientConnection *client = handle->data;
-	buf->base = client->readBuffer->str + client->readBuffer->size;
-	// make sure the buffer has a length of at least one.
+	// make sure the buffer has a length of at least one, which can move
+	// it, so the base comes after.
 	buf->len = StringBuffer_ensureFreeSize( client->readBuffer, 1 );
+	buf->base = client->readBuffer->str + client->readBuffer->size;
+}
+
+static void Client_readRequest( uv_stream_t *clientConnection, ssize_t nread, const uv_buf_t *buf );
+static void Client_processRequest( ClientConnection *client );
+
+// An io_uring connection may already have some of the next request
+// waiting, which is in the read buffer once this returns. Returns false
+// if the client has been terminated instead.
+static bool Client_startReading( ClientConnection *client ) {
+	if ( client->server->ring )
+		return Ring_read( client );
+
+	uv_read_start( client->handle.stream, Client_allocReadBuffer, Client_readRequest );
+	return true;
+}
+
+static void Client_stopReading( ClientConnection *client ) {
+	if ( client->server->ring )
+		Ring_stopReading( client );
+	else
+		uv_read_stop( client->handle.stream );
+}
+
+// Drops the request that was just answered from the read buffer, and
+// starts on whatever was pipelined behind it.
+static void Client_nextRequest( ClientConnection *client ) {
+	StringBuffer *readBuffer = client->readBuffer;
+	size_t parsed = HttpParser_parsedLength( client->parserInfo );
+	memmove( readBuffer->str, readBuffer->str + parsed, readBuffer->size - parsed );
+	readBuffer->size -= parsed;
+	if ( !Client_startReading( client ) ) return;
+
+	Client_clearReply( client );
+	Client_freeRequest( client );
+	HttpParser_reset( client->parserInfo );
+	// the next request starts with its first byte, which may already be
+	// here.
+	client->requestStart = readBuffer->size? uv_hrtime( ): 0;
+	client->requestParsed = 0;
+	client->replyReady = 0;
+#if defined(CLIENTTIMEINFO)
+	client->startTime = uv_now( client->server->handle.stream->loop );
+#endif
+
+	Client_setDeadline( client, readBuffer->size? ClientDeadline_headers: ClientDeadline_idle );
+	if ( readBuffer->size )
+		Client_processRequest( client );
+}
+
+void Client_written( ClientConnection *client, int status ) {
+	TimerWheel_cancel( &client->timeout );
+	if ( client->replyReady )
+		Stats_recordPhase( client->server->stats, StatsProtocol_http, StatsPhase_write, client->replyReady, uv_hrtime( ) );
+	if ( status < 0 || !client->keepAlive ) {
+		Client_terminate( client );
+		return;
+	}
+
+	Client_nextRequest( client );
 }
 
 static void Client_replyDone( uv_write_t* reply, int status ) {
-	// it doesn't matter if there was an error replying, because either
-	// way we're closing the connection.
-	Client_terminate( reply->data );
-	free( reply );
+	ClientConnection *client = reply->data;
+	// the write ran out of time, and was cancelled by closing the handle.
+	if ( uv_is_closing( (uv_handle_t *)client->handle.tcpHandle ) ) return;
+
+	Client_written( client, status );
+}
+
+// Turns whatever has been written to the write buffer since the last
+// segment into one.
+static void Client_closeSegment( ClientConnection *client ) {
+	size_t length = client->writeBuffer->size - client->bufferedFrom;
+	if ( !length ) return;
+
+	client->replySegments[client->replySegmentCount++] = (ClientReplySegment){ NULL, client->bufferedFrom, length };
+	client->bufferedFrom = client->writeBuffer->size;
+}
+
+void Client_appendReference( ClientConnection *client, const char *data, size_t length ) {
+	// UDP replies go out as one datagram built in the write buffer, and a
+	// reply with too many pieces already isn't worth the trouble. Leave
+	// room for the buffered pieces on either side of this one.
+	if ( client->server->protocol == ServerProtocol_UDP || client->replySegmentCount + 3 > ClientMaxReplySegments ) {
+		StringBuffer_append( client->writeBuffer, data, length );
+		return;
+	}
+
+	Client_closeSegment( client );
+	client->replySegments[client->replySegmentCount++] = (ClientReplySegment){ data, 0, length };
+}
+
+void Client_requestParsed( ClientConnection *client ) {
+	client->requestParsed = uv_hrtime( );
+	Client_setDeadline( client, ClientDeadline_backend );
+	Stats_recordPhase( client->server->stats, ClientStatsProtocol( client ), StatsPhase_parse, client->requestStart, client->requestParsed );
 }
 
 void Client_reply( ClientConnection *client ) {
-	uv_write_t *reply = malloc( sizeof(*reply) );
-	if ( !reply ) {
-		Client_terminate( client );
+	// The connection is already gone. This was all that was keeping the
+	// client from going back to the pool.
+	if ( client->abandoned ) {
+		if ( !--client->abandoned )
+			Client_free( client );
 		return;
 	}
 
+	if ( client->requestParsed ) {
+		client->replyReady = uv_hrtime( );
+		Stats_recordPhase( client->server->stats, ClientStatsProtocol( client ), StatsPhase_backend, client->requestParsed, client->replyReady );
+	}
+
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		UDPTracker_reply( client );
+		return;
+	}
+
+	uv_write_t *reply = &client->writeRequest;
 	reply->data = client;
+	Client_setDeadline( client, ClientDeadline_write );
+
+	Client_closeSegment( client );
+	uv_buf_t *buffers = client->replyBuffers;
+	for ( int i = 0; i < client->replySegmentCount; i++ ) {
+		ClientReplySegment *segment = client->replySegments + i;
+		const char *base = segment->base? segment->base: client->writeBuffer->str + segment->offset;
+		buffers[i] = uv_buf_init( (char *)base, segment->length );
+		dbg_info( "Client_reply segment: %.*s", (int)segment->length, base );
+	}
+	if ( client->server->ring )
+		Ring_send( client, buffers, client->replySegmentCount );
+	else
+		uv_write( reply, client->handle.stream, buffers, client->replySegmentCount, Client_replyDone );
+}
 
-	uv_buf_t uvMessage = StringBuffer_toUvBuf( client->writeBuffer );
-	dbg_info( "Client_reply message: %.*s", (int)uvMessage.len, uvMessage.base );
-	uv_write( reply, client->handle.stream, &uvMessage, 1, Client_replyDone );
+// Told to come back in an hour, twice the usual interval, by clients
+// that understand BEP 31's retry in, and by the rest, which fall back on
+// interval if they look at it at all.
+#define BusyMessage "The tracker is busy, try again later."
+#define BusyReply "110\r\n\r\nd14:failure reason37:" BusyMessage "8:intervali3600e12:min intervali3600e8:retry ini60ee"
+void Client_replyBusy( ClientConnection *client ) {
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		UDPTracker_replyError( client, BusyMessage, strlen( BusyMessage ) );
+		return;
+	}
+
+	Client_appendReference( client, BusyReply, strlen( BusyReply ) );
+	Client_reply( client );
 }
+#undef BusyReply
+#undef BusyMessage
 
-#define ErrorFormat "d14:failure reason%lu:%se"
 void Client_replyError( ClientConnection *client, const char *message, size_t messageLength ) {
-	// I wonder if snprintf is optimized to not eat up a whole bunch of
-	// time in the case that n is 0
-	int length = snprintf( NULL, 0, ErrorFormat, messageLength, message );
-	StringBuffer_sprintf( client->writeBuffer, "%u\r\n\r\n" ErrorFormat, length, messageLength, message );
+	if ( client->server->protocol == ServerProtocol_UDP ) {
+		UDPTracker_replyError( client, message, messageLength );
+		return;
+	}
+
+	size_t length = Bencode_literalLength( "d" ) + Bencode_keyLength( "failure reason" ) + Bencode_stringLength( messageLength ) + Bencode_literalLength( "e" );
+	char *cursor = StringBuffer_reserve( client->writeBuffer, Bencode_contentLengthLength( length ) + length );
+	cursor = Bencode_writeContentLength( cursor, length );
+	cursor = Bencode_writeKey( Bencode_writeLiteral( cursor, "d" ), "failure reason" );
+	cursor = Bencode_writeLiteral( Bencode_writeString( cursor, message, messageLength ), "e" );
+	StringBuffer_commit( client->writeBuffer, cursor );
+	Client_reply( client );
+}
+
+// Straight from the snapshot, which the client holds on to until the
+// reply has been written. The okay header has already gone in, so this
+// only swaps it for one that says how the body is encoded.
+static void Client_replyFullScrape( ClientConnection *client, FullScrape *scrape ) {
+	#define FullScrapeRoute( connection, encoding ) "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" encoding "Vary: Accept-Encoding\r\nConnection: " connection "\r\nContent-Length:"
+	#define GzipEncoding "Content-Encoding: gzip\r\n"
+
+	FullScrapeSnapshot *snapshot = FullScrape_acquire( scrape );
+	if ( !snapshot ) {
+		Client_replyErrorLen( client, "The full scrape isn't ready yet, try again later." );
+		return;
+	}
+	client->fullScrape = snapshot;
+
+	bool gzip = HttpParser_acceptsGzip( client->parserInfo );
+	const char *route;
+	if ( gzip )
+		route = client->keepAlive? FullScrapeRoute( "keep-alive", GzipEncoding ): FullScrapeRoute( "close", GzipEncoding );
+	else
+		route = client->keepAlive? FullScrapeRoute( "keep-alive", "" ): FullScrapeRoute( "close", "" );
+	Client_clearReply( client );
+	Client_appendReference( client, route, strlen( route ) );
+
+	const char *body = gzip? snapshot->gzip: snapshot->plain;
+	size_t length = gzip? snapshot->gzipSize: snapshot->plainSize;
+	char *cursor = StringBuffer_reserve( client->writeBuffer, Bencode_contentLengthLength( length ) );
+	StringBuffer_commit( client->writeBuffer, Bencode_writeContentLength( cursor, length ) );
+	Client_appendReference( client, body, length );
 	Client_reply( client );
+	#undef FullScrapeRoute
+	#undef GzipEncoding
 }
-#undef ErrorFormat
 
 static void Client_route( ClientConnection *client ) {
-	#define OkayRoute "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length:"
-	#define InvalidRoute "HTTP/1.0 403 Forbidden\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length:12\r\n\r\nGET WRECKED\n"
+	#define OkayRoute( connection ) "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: " connection "\r\nContent-Length:"
+	#define InvalidRoute "HTTP/1.1 403 Forbidden\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length:12\r\n\r\nGET WRECKED\n"
 
 	HttpParserInfo *parserInfo = client->parserInfo;
+	client->keepAlive = HttpParser_keepAlive( parserInfo );
+	const char *okayRoute = client->keepAlive? OkayRoute( "keep-alive" ): OkayRoute( "close" );
 
 	char *path, *query;
 	size_t pathSize, querySize;
@@ -110,23 +414,28 @@ static void Client_route( ClientConnection *client ) {
 
 	dbg_info( "Requested path: %.*s", (int)pathSize, path );
 	dbg_info( "Request query: %.*s", (int)querySize, query );
+	Stats *stats = client->server->stats;
 	if ( EqualLiteralLength( path, pathSize, "/announce" ) ) {
-		StringBuffer_append( client->writeBuffer, OkayRoute, strlen( OkayRoute ) );
-		ClientAnnounceData *announce = ClientAnnounceData_new( );
+		stats->requests[StatsProtocol_http][StatsRoute_announce]++;
+		Client_appendReference( client, okayRoute, strlen( okayRoute ) );
+		ClientAnnounceData *announce = ClientAnnounceData_new( client->arena );
 		Client_CheckAllocReplyError( client, announce );
 
-		announce->score = uv_now( client->handle.stream->loop );
+		announce->score = uv_now( client->server->handle.stream->loop );
 		client->requestType = ClientRequest_announce;
 		client->request.announce = announce;
-		if ( ClientAnnounceData_fromQuery( announce, query, querySize ) ) {
+		AnnounceError error = ClientAnnounceData_fromQuery( announce, query, querySize );
+		if ( error ) {
+			stats->announceErrors[error > AnnounceError_unknown? AnnounceError_unknown: error]++;
 			log_warn( "%s", announce->errorMessage );
 			Client_replyErrorLen( client, announce->errorMessage );
 			return;
 		}
 
 		dbg_info( "There was no error parsing the announce." );
+		Client_requestParsed( client );
 		if ( announce->event == AnnounceEvent_stop ) {
-			StringBuffer_append( client->writeBuffer, "6\r\n\r\n3:bye\n", 11 );
+			Client_appendReference( client, "6\r\n\r\n3:bye\n", 11 );
 			Client_reply( client );
 			return;
 		}
@@ -134,49 +443,102 @@ static void Client_route( ClientConnection *client ) {
 		// check if ip has been set
 		if ( !(announce->compact[0] & CompactAddress_IPv4Flag) && !(announce->compact[0] & CompactAddress_IPv6Flag) ) {
 			// read from socket and header.
-			char *xRealIP = HttpParser_realIP( client->parserInfo );
-			if ( xRealIP ) {
-				CompactAddress_fromString( announce->compact, xRealIP, NULL );
-				free( xRealIP );
+			char xRealIP[64];
+			CompactError e;
+			if ( HttpParser_realIP( client->parserInfo, xRealIP, sizeof(xRealIP) ) ) {
+				e = CompactAddress_fromString( announce->compact, xRealIP, strlen( xRealIP ), CompactAddress_IPv4Flag | CompactAddress_IPv6Flag );
 			} else {
 				struct sockaddr_storage sock;
 				int len = sizeof(sock);
-				int e = uv_tcp_getpeername( client->handle.tcpHandle, (struct sockaddr*)&sock, &len );
-				if ( e ) {
+				if ( client->server->ring? Ring_peerName( client, &sock ): uv_tcp_getpeername( client->handle.tcpHandle, (struct sockaddr*)&sock, &len ) ) {
+					stats->announceErrors[AnnounceError_malformedIP]++;
 					Client_replyErrorLen( client, "IP could not be determined." );
 					return;
 				}
 
-				CompactAddress_fromSocket( announce->compact, &sock, false );
+				e = CompactAddress_fromSocket( announce->compact, &sock, false );
+			}
+			if ( e ) {
+				AnnounceError error = e == CompactError_rejectedAddress? AnnounceError_rejectedIP: AnnounceError_malformedIP;
+				stats->announceErrors[error]++;
+				Client_replyErrorLen( client, AnnounceErrorMessage( error ) );
+				return;
 			}
 		}
 		CompactAddress_dump( announce->compact );
 		MemoryStore_processAnnounce( client->server->memStore, client );
 
 	} else if ( EqualLiteralLength( path, pathSize, "/scrape" ) ) {
-		StringBuffer_append( client->writeBuffer, OkayRoute, strlen( OkayRoute ) );
-		ScrapeData *scrape = ScrapeData_new( );
+		stats->requests[StatsProtocol_http][StatsRoute_scrape]++;
+		Client_appendReference( client, okayRoute, strlen( okayRoute ) );
+		ScrapeData *scrape = ScrapeData_new( client->arena );
 		Client_CheckAllocReplyError( client, scrape );
 
 		client->requestType = ClientRequest_scrape;
 		client->request.scrape = scrape;
-		if ( ScrapeData_fromQuery( scrape, query, querySize ) ) {
+		ScrapeError error = ScrapeData_fromQuery( scrape, query, querySize, client->arena );
+		if ( error == ScrapeError_noInfoHash && MemoryStore_fullScrape( client->server->memStore ) ) {
+			// counted as a full scrape instead.
+			stats->requests[StatsProtocol_http][StatsRoute_scrape]--;
+			stats->requests[StatsProtocol_http][StatsRoute_fullScrape]++;
+			Client_replyFullScrape( client, MemoryStore_fullScrape( client->server->memStore ) );
+			return;
+		}
+		if ( error ) {
+			stats->scrapeErrors++;
 			Client_replyErrorLen( client, "Invalid scrape request." );
 			return;
 		}
 
+		Client_requestParsed( client );
 		MemoryStore_processScrape( client->server->memStore, client );
 
+	} else if ( EqualLiteralLength( path, pathSize, "/stats" ) ) {
+		stats->requests[StatsProtocol_http][StatsRoute_stats]++;
+		// Nowhere near as busy as the other routes, so it doesn't need to
+		// avoid a scratch buffer.
+		StringBuffer *body = StringBuffer_new( );
+		Client_CheckAllocReplyError( client, body );
+		Stats_write( stats, body );
+
+		Client_appendReference( client, okayRoute, strlen( okayRoute ) );
+		char *cursor = StringBuffer_reserve( client->writeBuffer, Bencode_contentLengthLength( body->size ) );
+		StringBuffer_commit( client->writeBuffer, Bencode_writeContentLength( cursor, body->size ) );
+		StringBuffer_join( client->writeBuffer, body );
+		StringBuffer_free( body );
+		Client_reply( client );
+
 	} else {
-		StringBuffer_append( client->writeBuffer, InvalidRoute, strlen( InvalidRoute ) );
+		stats->requests[StatsProtocol_http][StatsRoute_invalid]++;
+		client->keepAlive = false;
+		Client_appendReference( client, InvalidRoute, strlen( InvalidRoute ) );
 		Client_reply( client );
 	}
 	#undef OkayRoute
 	#undef InvalidRoute
 }
 
-static void Client_readRequest( uv_stream_t *clientConnection, ssize_t nread, const uv_buf_t *buf ) {
-	ClientConnection *client = clientConnection->data;
+static void Client_processRequest( ClientConnection *client ) {
+	StringBuffer *readBuffer = client->readBuffer;
+	if ( HttpParser_parse( client->parserInfo, readBuffer->str, readBuffer->size ) ) {
+		// Should actually reply to the peer in this case?
+		Client_terminate( client );
+		return;
+	}
+
+	if ( HttpParser_done( client->parserInfo ) ) {
+		// nothing more is read until this request has been answered, which
+		// keeps pipelined replies in order.
+		Client_stopReading( client );
+		TimerWheel_cancel( &client->timeout );
+		Client_route( client );
+	} else if ( readBuffer->size > MaxRequestSize ) {
+		log_warn( "Request exceeded %d bytes.", MaxRequestSize );
+		Client_terminate( client );
+	}
+}
+
+void Client_read( ClientConnection *client, ssize_t nread ) {
 	if ( nread < 0 ) {
 		dbg_info( "Read error %zd: %s", nread, uv_err_name( nread ) );
 
@@ -185,25 +547,30 @@ static void Client_readRequest( uv_stream_t *clientConnection, ssize_t nread, co
 	}
 
 	if ( nread > 0 ) {
-		if ( HttpParser_parse( client->parserInfo, buf->base, nread ) ) {
-			// Should actually reply to the peer in this case?
-			Client_terminate( client );
-			return;
-		}
+		if ( !client->requestStart )
+			client->requestStart = uv_hrtime( );
+		// the first of the request is here, and the rest has to follow
+		// within the headers timeout, however slowly it comes.
+		if ( client->deadline == ClientDeadline_idle )
+			Client_setDeadline( client, ClientDeadline_headers );
+		client->readBuffer->size += nread;
+		Client_processRequest( client );
 	}
+}
 
-	if ( HttpParser_done( client->parserInfo ) ) {
-		uv_read_stop( client->handle.stream );
-		Client_route( client );
-	}
+static void Client_readRequest( uv_stream_t *clientConnection, ssize_t nread, const uv_buf_t *buf ) {
+	Client_read( clientConnection->data, nread );
 }
 
 void Client_handleConnection( ClientConnection *client ) {
-	client->parserInfo = HttpParser_new( );
+	// a pooled client still has the parser from its last connection.
+	if ( !client->parserInfo )
+		client->parserInfo = HttpParser_new( );
 	if ( !client->parserInfo ) {
 		Client_replyErrorLen( client, "An unknown error occurred." );
 		return;
 	}
 
-	uv_read_start( client->handle.stream, Client_allocReadBuffer, Client_readRequest );
+	Client_setDeadline( client, ClientDeadline_idle );
+	Client_startReading( client );
 }
@@ -7,12 +7,43 @@
 typedef struct _ClientConnection ClientConnection;
 typedef union  _ClientRequestData ClientRequestData;
 typedef enum   _ClientRequestType ClientRequestType;
+typedef struct _ClientPoolStats ClientPoolStats;
+typedef struct _ClientReplySegment ClientReplySegment;
+typedef enum   _ClientDeadline ClientDeadline;
+
+// What a TCP connection is waiting for, each with its own timeout: the
+// first byte of a request, the rest of it, the backend's answer, and
+// the reply going out. It's ahead of the includes because Stats counts
+// timeouts by it, in the same order as its names there.
+enum _ClientDeadline {
+	ClientDeadline_idle,
+	ClientDeadline_headers,
+	ClientDeadline_backend,
+	ClientDeadline_write,
+	ClientDeadline_count,
+};
 
 #include "server.h"
 #include "StringBuffer.h"
 #include "RequestParser.h"
 #include "announce.h"
 #include "Scrape.h"
+#include "FullScrape.h"
+#include "Arena.h"
+#include "TimerWheel.h"
+#include "Ring.h"
+
+// literals, the formatted bits in between, and two sets of peers, with
+// room to spare.
+#define ClientMaxReplySegments 8
+
+// A piece of the reply. Pieces that were written into the write buffer
+// are kept as offsets, because the buffer can move as it grows.
+struct _ClientReplySegment {
+	const char *base;
+	size_t offset;
+	size_t length;
+};
 
 struct _ClientConnection {
 	ServerHandle handle;
@@ -20,6 +51,28 @@ struct _ClientConnection {
 	HttpParserInfo *parserInfo;
 	StringBuffer *readBuffer;
 	StringBuffer *writeBuffer;
+	// The reply is sent as these, in order, in a single write. Anything
+	// appended to writeBuffer since the last segment becomes a segment of
+	// its own.
+	ClientReplySegment replySegments[ClientMaxReplySegments];
+	int replySegmentCount;
+	// The segments as they're written. libuv copies these, but io_uring
+	// reads them when it gets to the write.
+	uv_buf_t replyBuffers[ClientMaxReplySegments];
+	size_t bufferedFrom;
+	// Everything that only lasts as long as one request comes out of
+	// here, and is thrown away all at once when the request is answered.
+	Arena *arena;
+
+	// TCP connections point handle at these, so a connection doesn't
+	// need any allocations beyond the client itself.
+	uv_tcp_t tcp;
+	uv_write_t writeRequest;
+	// and connections on an io_uring server have a socket and this
+	// instead.
+	RingConnection ring;
+	// links clients waiting in the pool.
+	ClientConnection *nextFree;
 
 	union _ClientRequestData {
 		ClientAnnounceData *announce;
@@ -30,17 +83,76 @@ struct _ClientConnection {
 		ClientRequest_announce,
 		ClientRequest_scrape,
 	} requestType;
+	// The full scrape a reply is being written from, held until the
+	// write is done.
+	FullScrapeSnapshot *fullScrape;
+	// whether the connection stays open for another request once the
+	// reply has been written.
+	bool keepAlive;
+
+	// On the server's wheel whenever the connection is waiting on
+	// something.
+	TimerWheelEntry timeout;
+	ClientDeadline deadline;
+	// A connection that runs out of time waiting on redis is closed
+	// straight away, but redis still has the client, so it can't be
+	// handed back yet. This counts down what's left to happen: the
+	// handle closing and the answer coming in. Whichever is last frees
+	// the client.
+	int abandoned;
+
+	// uv_hrtime stamps for the phases in Stats. requestParsed is only set
+	// for announces and scrapes, and 0 means the request isn't timed.
+	uint64_t requestStart;
+	uint64_t requestParsed;
+	uint64_t replyReady;
+
+	// Only used by UDP requests, which share the server's handle and so
+	// have nowhere else to keep track of who they're talking to.
+	struct sockaddr_storage peerAddress;
+	uint32_t transactionID;
 
 #if defined(CLIENTTIMEINFO)
 	uint64_t startTime;
 #endif
 };
 
-ClientConnection *Client_new( void );
+struct _ClientPoolStats {
+	// clients handed out from the pool, and ones that had to be built.
+	uint64_t hits;
+	uint64_t misses;
+	// request allocations that didn't fit in a client's arena.
+	uint64_t arenaOverflows;
+	size_t pooled;
+};
+
+// Finished clients are kept around, buffers and all, for the next
+// connection or datagram on the same server. Only one loop ever touches a
+// server, so the pool needs no locking.
+ClientPool *ClientPool_new( size_t capacity );
+void ClientPool_free( ClientPool *pool );
+void ClientPool_stats( ClientPool *pool, ClientPoolStats *stats );
+
+ClientConnection *Client_new( Server *server );
 void Client_free( ClientConnection *client );
 void Client_handleConnection( ClientConnection *client );
 void Client_reply( ClientConnection *client );
+// Marks the end of the parse phase for an announce or scrape.
+void Client_requestParsed( ClientConnection *client );
+// Adds data to the reply without copying it. It has to stay where it is
+// until the reply has been written, so it should be a literal or come
+// from the client's arena.
+void Client_appendReference( ClientConnection *client, const char *data, size_t length );
 #define Client_replyErrorLen( client, message ) Client_replyError( client, message, strlen(message) )
 #define Client_CheckAllocReplyError( client, ptr ) if ( !ptr ) { Client_replyErrorLen( client, "An unknown error occurred." ); return; }
 void Client_replyError( ClientConnection *client, const char *message, size_t messageLength );
+// A canned reply for a request the tracker is too busy to take on.
+void Client_replyBusy( ClientConnection *client );
 void Client_terminate( ClientConnection *client );
+// The callback for a server's TimerWheel.
+void Client_timedOut( TimerWheelEntry *entry );
+// Where an io_uring server reports on a connection: nread bytes added to
+// the read buffer, or an error; the reply written; and the socket closed.
+void Client_read( ClientConnection *client, ssize_t nread );
+void Client_written( ClientConnection *client, int status );
+void Client_closed( ClientConnection *client );
@@ -10,7 +10,7 @@
 #define EqualLiteralLength( in, inlen, lit ) ((strlen(lit) == inlen) && EqualLiteral( in, lit ))
 
 #if defined( CLIENTTIMEINFO )
-	#define checktime( client, id ) fprintf( stderr, "\e[1;34m>>\e[m " id " time elapsed: %llums\n", (uv_now( client->handle.stream->loop ) - client->startTime))
+	#define checktime( client, id ) fprintf( stderr, "\e[1;34m>>\e[m " id " time elapsed: %llums\n", (unsigned long long)(uv_now( client->server->handle.stream->loop ) - client->startTime))
 #else
 	#define checktime( client, id )
 #endif
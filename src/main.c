@@ -1,45 +1,249 @@
 #include <uv.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h> // getopt
 
 #include "macros.h"
 #include "dbg.h"
+#include "CompactAddress.h"
 #include "MemoryStore.h"
 #include "server.h"
+#include "Listener.h"
+#include "Worker.h"
 
 static void interruptCb( uv_signal_t *interrupt, int signal ) {
 	puts( "" );
-	log_info( "SIGINT caught. \e[1;31mQuitting\e[m." );
-	MemoryStore_disconnect( interrupt->data );
+	log_info( "%s caught. \e[1;31mQuitting\e[m.", signal == SIGTERM? "SIGTERM": "SIGINT" );
+	// the list is NULL-terminated.
+	for ( Worker **worker = interrupt->data; *worker; worker++ )
+		Worker_stop( *worker );
 	uv_stop( interrupt->loop );
 }
 
+static void usage( const char *name ) {
+	fprintf( stderr, "usage: %s [-b redis|native] [-w workers] [-a] [-e slice] [-s ttl] [-c entries] [-p newest|random] [-r] [-f file] [-g seconds] [-G file] [-m connections] [-q requests] [-d host:port|path[,...]] [-n connections] [-l tcp|udp:address:port[,option...]]...\n", name );
+}
+
+static int cpuCount( void ) {
+	uv_cpu_info_t *cpus;
+	int count;
+	if ( uv_cpu_info( &cpus, &count ) ) return 1;
+	uv_free_cpu_info( cpus, count );
+	return count;
+}
+
 int main ( int argc, char **argv ) {
+	uint64_t started = uv_hrtime( );
+	MemoryStoreBackend backend = MemoryStoreBackend_redis;
+	MemoryStorePeerSelection peerSelection = MemoryStorePeerSelection_newest;
+	int workerCount = 1;
+	bool pinWorkers = false;
+	size_t expirySlice = 0;
+	// seconds, and how many torrents each worker remembers.
+	uint64_t scrapeTTL = 60;
+	size_t scrapeCacheSize = 65536;
+	// where the native backend keeps its swarms between runs.
+	const char *swarmFile = NULL;
+	// how often the full scrape is rebuilt, in seconds, 0 for never, and
+	// where it's also written, gzipped.
+	uint64_t fullScrapePeriod = 0;
+	const char *fullScrapeFile = NULL;
+	// across all of the workers, which each get an even share. 0 is no
+	// limit.
+	size_t connectionLimit = 0, backendLimit = 16384;
+	// a comma separated list of shards, each a unix socket if it's a
+	// path. Each worker makes its own connections to every one.
+	const char *redisAddress = "localhost:6379";
+	size_t redisConnections = 4;
+	// in the order they're given, and if none are, TCP on every address
+	// and UDP on every IPv4 one, both on port 9001.
+	Listener *listeners = NULL, **lastListener = &listeners;
+	int option;
+	while ( (option = getopt( argc, argv, "b:w:ae:s:c:p:rf:g:G:m:q:d:n:l:" )) != -1 ) {
+		switch ( option ) {
+			case 'b': {
+				if ( strcmp( optarg, "redis" ) == 0 )
+					backend = MemoryStoreBackend_redis;
+				else if ( strcmp( optarg, "native" ) == 0 )
+					backend = MemoryStoreBackend_native;
+				else {
+					usage( argv[0] );
+					return 1;
+				}
+				break;
+			}
+			case 'w': {
+				// 0 means one per CPU.
+				workerCount = atoi( optarg );
+				if ( workerCount < 0 ) {
+					usage( argv[0] );
+					return 1;
+				}
+				break;
+			}
+			case 'a': {
+				pinWorkers = true;
+				break;
+			}
+			case 'e': {
+				// 0 means pick one from the number of swarms.
+				expirySlice = strtoul( optarg, NULL, 10 );
+				break;
+			}
+			case 's': {
+				// 0 turns the scrape cache off.
+				scrapeTTL = strtoull( optarg, NULL, 10 );
+				break;
+			}
+			case 'c': {
+				scrapeCacheSize = strtoul( optarg, NULL, 10 );
+				break;
+			}
+			case 'p': {
+				if ( strcmp( optarg, "newest" ) == 0 )
+					peerSelection = MemoryStorePeerSelection_newest;
+				else if ( strcmp( optarg, "random" ) == 0 )
+					peerSelection = MemoryStorePeerSelection_random;
+				else {
+					usage( argv[0] );
+					return 1;
+				}
+				break;
+			}
+			case 'r': {
+				CompactAddress_setRejectBogons( true );
+				break;
+			}
+			case 'f': {
+				swarmFile = optarg;
+				break;
+			}
+			case 'g': {
+				fullScrapePeriod = strtoull( optarg, NULL, 10 );
+				break;
+			}
+			case 'G': {
+				fullScrapeFile = optarg;
+				break;
+			}
+			case 'm': {
+				connectionLimit = strtoul( optarg, NULL, 10 );
+				break;
+			}
+			case 'q': {
+				backendLimit = strtoul( optarg, NULL, 10 );
+				break;
+			}
+			case 'd': {
+				redisAddress = optarg;
+				break;
+			}
+			case 'n': {
+				redisConnections = strtoul( optarg, NULL, 10 );
+				if ( !redisConnections ) {
+					usage( argv[0] );
+					return 1;
+				}
+				break;
+			}
+			case 'l': {
+				*lastListener = Listener_parse( optarg );
+				if ( !*lastListener ) {
+					usage( argv[0] );
+					return 1;
+				}
+				lastListener = &(*lastListener)->next;
+				break;
+			}
+			default: {
+				usage( argv[0] );
+				return 1;
+			}
+		}
+	}
+
+	if ( !listeners ) {
+		listeners = Listener_parse( "tcp:[::]:9001" );
+		checkConstructor( listeners );
+		listeners->next = Listener_parse( "udp:0.0.0.0:9001" );
+		checkConstructor( listeners->next );
+	}
+
+	int cpus = cpuCount( );
+	if ( workerCount == 0 )
+		workerCount = cpus;
+
+	// The default loop only handles signals. All of the serving happens
+	// on the workers' loops.
 	uv_loop_t *loop = uv_default_loop( );
 	if ( !loop ) {
 		log_err( "uv loop creation failed." );
 		return 1;
 	}
 
-	Server *server = Server_new( "::", "9001", ServerProtocol_TCP );
-	checkConstructor( server );
-	checkFunction( Server_initWithLoop( server, loop ) );
-	checkFunction( Server_listen( server ) );
+	Worker **workers = calloc( workerCount + 1, sizeof(*workers) );
+	checkConstructor( workers );
+
+	// Every worker serves the same one, built by the first.
+	FullScrape *fullScrape = NULL;
+	if ( fullScrapePeriod ) {
+		fullScrape = FullScrape_new( fullScrapeFile );
+		checkConstructor( fullScrape );
+	}
+
+	for ( int i = 0; i < workerCount; i++ ) {
+		// Each worker gets its own redis connections. The native backend
+		// keeps one swarm table that all of them share. Either way, only
+		// the first worker sweeps out expired peers.
+		MemoryStore *store = MemoryStore_new( "reki2", backend );
+		checkConstructor( store );
+		checkFunction( MemoryStore_initConnection( store, redisAddress, redisConnections ) );
+		MemoryStore_setExpirySlice( store, expirySlice );
+		MemoryStore_setBackendLimit( store, (backendLimit + workerCount - 1) / workerCount );
+		checkFunction( MemoryStore_setScrapeCache( store, scrapeCacheSize, scrapeTTL * 1000 ) );
+		checkFunction( MemoryStore_setPeerSelection( store, peerSelection ) );
+		MemoryStore_setFullScrape( store, fullScrape, fullScrapePeriod * 1000 );
+		if ( i == 0 && swarmFile )
+			checkFunction( MemoryStore_setSwarmFile( store, swarmFile ) );
+		if ( i > 0 )
+			MemoryStore_shareSwarms( store, workers[0]->store );
 
-	MemoryStore *store = MemoryStore_new( "reki2" );
-	checkConstructor( store );
-	checkFunction( MemoryStore_initConnection( store, "localhost", 6379 ) );
-	checkFunction( MemoryStore_attachToLoop( store, loop ) );
+		workers[i] = Worker_new( i, pinWorkers? i % cpus: -1, store, listeners );
+		checkConstructor( workers[i] );
+		Worker_setConnectionLimit( workers[i], (connectionLimit + workerCount - 1) / workerCount );
+		// so /stats on any worker reports on all of them.
+		if ( i > 0 )
+			Stats_join( workers[i]->stats, workers[0]->stats );
+	}
 
-	server->memStore = store;
+	workers[0]->stats->started = started;
+	for ( int i = 0; i < workerCount; i++ )
+		checkFunction( Worker_start( workers[i] ) );
+	log_info( "Started %d worker%s.", workerCount, workerCount == 1? "": "s" );
 
-	uv_signal_t interrupt;
-	interrupt.data = (void*)store;
+	uv_signal_t interrupt, terminate;
+	interrupt.data = terminate.data = (void*)workers;
 	uv_signal_init( loop, &interrupt );
 	uv_signal_start( &interrupt, interruptCb, SIGINT );
+	uv_signal_init( loop, &terminate );
+	uv_signal_start( &terminate, interruptCb, SIGTERM );
 
 	uv_run( loop, UV_RUN_DEFAULT );
+	for ( int i = 0; i < workerCount; i++ )
+		Worker_join( workers[i] );
+	// The first store goes last, since it owns the swarms the others
+	// share, and closing them is what leaves a swarm file good to reopen.
+	for ( int i = workerCount - 1; i >= 0; i-- )
+		MemoryStore_free( workers[i]->store );
+	FullScrape_free( fullScrape );
+	for ( int i = 0; i < workerCount; i++ )
+		Worker_free( workers[i] );
+	free( workers );
 	uv_loop_close( loop );
+	Listener_free( listeners );
 
 	return 0;
 }
@@ -1,5 +1,12 @@
+#if defined(__linux__)
+// glibc only exposes SO_REUSEPORT with the default feature set.
+#define _DEFAULT_SOURCE
+#endif
+
 #include <netinet/in.h> // struct sockaddr
+#include <netinet/tcp.h> // TCP_DEFER_ACCEPT
 #include <stdlib.h>  // calloc, malloc, free
+#include <string.h>  // memset
 #include <stdbool.h> // bool, true, false;
 #include <stdint.h>
 
@@ -9,6 +16,14 @@
 #include "client.h"
 #include "dbg.h"
 
+// How many finished clients each server keeps around for reuse.
+#define ClientPoolCapacity 1024
+// How finely connection deadlines are kept.
+#define ClientTimerTickMS 100
+// Connections waiting to be accepted, which the kernel caps at
+// net.core.somaxconn.
+#define ListenBacklog 4096
+
 Server *Server_new( const char *bindIP, const char *port, ServerProtocol type ) {
 	Server *server = malloc( sizeof(*server) );
 	if ( !server ) return NULL;
@@ -16,8 +31,40 @@ Server *Server_new( const char *bindIP, const char *port, ServerProtocol type )
 	server->bindIP = strdup( bindIP );
 	server->bindPort = strdup( port );
 	server->protocol = type;
+	server->reusePort = false;
+	server->udpTracker = NULL;
+	server->stats = NULL;
+	server->timers = NULL;
+	server->ring = NULL;
+	server->maxConnections = 0;
+	server->handle.stream = NULL;
+	server->sharesClientPool = false;
+	memset( &server->options, 0, sizeof(server->options) );
+
+	server->clientPool = ClientPool_new( ClientPoolCapacity );
+	if ( !server->clientPool ) goto badPool;
 
 	return server;
+
+badPool:
+	free( (char *)server->bindIP );
+	free( (char *)server->bindPort );
+	free( server );
+	return NULL;
+}
+
+void Server_free( Server *server ) {
+	if ( !server ) return;
+
+	Ring_free( server->ring );
+	UDPTracker_free( server->udpTracker );
+	TimerWheel_free( server->timers );
+	if ( !server->sharesClientPool )
+		ClientPool_free( server->clientPool );
+	free( server->handle.stream );
+	free( (char *)server->bindIP );
+	free( (char *)server->bindPort );
+	free( server );
 }
 
 static void Server_newTCPConnection( uv_stream_t *server, int status ) {
@@ -27,30 +74,37 @@ static void Server_newTCPConnection( uv_stream_t *server, int status ) {
 	}
 	dbg_info( "Connection received." );
 
-	ClientConnection *client = Client_new( );
-	if ( !client ) goto badClient;
-
-	client->handle.tcpHandle = malloc( sizeof(*client->handle.tcpHandle) );
-	if ( !client->handle.tcpHandle ) goto badHandle;
+	ClientConnection *client = Client_new( server->data );
+	if ( !client ) {
+		log_warn( "Couldn't allocate a client." );
+		return;
+	}
 
+	client->handle.tcpHandle = &client->tcp;
 	uv_tcp_init( server->loop, client->handle.tcpHandle );
 	client->handle.tcpHandle->data = client;
+	client->requestStart = uv_hrtime( );
+	client->server->stats->connections++;
+	client->server->stats->openConnections++;
 
 	if ( uv_accept( server, client->handle.stream ) == 0 ) {
-		client->server = server->data;
+		if ( client->server->options.noDelay )
+			uv_tcp_nodelay( client->handle.tcpHandle, 1 );
 #if defined(CLIENTTIMEINFO)
 		client->startTime = uv_now( server->loop );
 #endif
+		// It has to be accepted to get it out of the backlog, but that's as
+		// far as it gets.
+		Server *owner = client->server;
+		if ( owner->maxConnections && owner->stats->openConnections > owner->maxConnections ) {
+			owner->stats->shedConnections++;
+			Client_terminate( client );
+			return;
+		}
 		Client_handleConnection( client );
 	} else {
 		Client_terminate( client );
 	}
-	return;
-
-badHandle:
-	Client_free( client );
-badClient:
-	return;
 }
 
 static int Server_AddressInfo( Server *server, struct sockaddr_storage *outAddress ) {
@@ -70,20 +124,99 @@ static int Server_AddressInfo( Server *server, struct sockaddr_storage *outAddre
 	return 0;
 }
 
+static int Server_setReusePort( Server *server ) {
+#if defined(SO_REUSEPORT)
+	uv_os_fd_t fd;
+	checkFunction( uv_fileno( (uv_handle_t *)server->handle.stream, &fd ) );
+	int on = 1;
+	if ( setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) ) {
+		fancy_perror( "setsockopt(SO_REUSEPORT)" );
+		return 1;
+	}
+	return 0;
+#else
+	log_err( "SO_REUSEPORT isn't supported on this platform." );
+	return 1;
+#endif
+}
+
+// The socket's buffers can only be sized once it exists.
+static int Server_setBufferSizes( Server *server ) {
+	uv_handle_t *handle = (uv_handle_t *)server->handle.stream;
+	int size = server->options.receiveBuffer;
+	if ( size && uv_recv_buffer_size( handle, &size ) ) {
+		log_err( "Couldn't set the receive buffer to %d bytes.", server->options.receiveBuffer );
+		return 1;
+	}
+	size = server->options.sendBuffer;
+	if ( size && uv_send_buffer_size( handle, &size ) ) {
+		log_err( "Couldn't set the send buffer to %d bytes.", server->options.sendBuffer );
+		return 1;
+	}
+	return 0;
+}
+
+static int Server_setDeferAccept( Server *server ) {
+#if defined(TCP_DEFER_ACCEPT)
+	uv_os_fd_t fd;
+	checkFunction( uv_fileno( (uv_handle_t *)server->handle.stream, &fd ) );
+	int seconds = server->options.deferAccept;
+	if ( setsockopt( fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds) ) ) {
+		fancy_perror( "setsockopt(TCP_DEFER_ACCEPT)" );
+		return 1;
+	}
+	return 0;
+#else
+	log_warn( "TCP_DEFER_ACCEPT isn't supported on this platform, so [%s]:%s accepts connections straight away.", server->bindIP, server->bindPort );
+	return 0;
+#endif
+}
+
+// libuv never sees the socket listening, so it leaves it alone for the
+// ring to accept from. Accepted sockets get TCP_NODELAY from the
+// listening one on Linux, which is the only place there's a ring.
+static int Server_listenWithRing( Server *server, int backlog ) {
+	uv_os_fd_t fd;
+	checkFunction( uv_fileno( (uv_handle_t *)server->handle.stream, &fd ) );
+	if ( server->options.noDelay )
+		checkFunction( uv_tcp_nodelay( server->handle.tcpHandle, 1 ) );
+	if ( listen( fd, backlog ) ) {
+		fancy_perror( "listen" );
+		return 1;
+	}
+	return Ring_attachToLoop( server->ring, server->handle.stream->loop );
+}
+
 int Server_initWithLoop( Server *server, uv_loop_t *loop ) {
+	// The address is needed up front, because the socket has to exist
+	// (and so needs a family) before SO_REUSEPORT can be set on it.
+	checkFunction( Server_AddressInfo( server, &server->address ) );
+	server->ipFamily = server->address.ss_family;
+
 	switch ( server->protocol ) {
 		case ServerProtocol_TCP: {
 			server->handle.tcpHandle = malloc( sizeof(*server->handle.tcpHandle) );
 			if ( !server->handle.tcpHandle ) return 1;
 
-			checkFunction( uv_tcp_init( loop, server->handle.tcpHandle ) );
+			checkFunction( uv_tcp_init_ex( loop, server->handle.tcpHandle, server->ipFamily ) );
+			server->timers = TimerWheel_new( ClientTimerTickMS, Client_timedOut );
+			if ( !server->timers ) return 1;
+			checkFunction( TimerWheel_attachToLoop( server->timers, loop ) );
+			if ( server->options.ioUring ) {
+				server->ring = Ring_new( server );
+				if ( !server->ring ) return 1;
+			}
 			break;
 		}
 		case ServerProtocol_UDP: {
 			server->handle.udpHandle = malloc( sizeof(*server->handle.udpHandle) );
 			if ( !server->handle.udpHandle ) return 1;
 
-			checkFunction( uv_udp_init( loop, server->handle.udpHandle ) );
+			// Lets a single read drain several datagrams at once where the
+			// platform supports it (recvmmsg).
+			checkFunction( uv_udp_init_ex( loop, server->handle.udpHandle, server->ipFamily | UV_UDP_RECVMMSG ) );
+			server->udpTracker = UDPTracker_new( server );
+			if ( !server->udpTracker ) return 1;
 			break;
 		}
 		default: {
@@ -93,28 +226,36 @@ int Server_initWithLoop( Server *server, uv_loop_t *loop ) {
 	}
 
 	server->handle.stream->data = server;
+	if ( server->reusePort )
+		checkFunction( Server_setReusePort( server ) );
+	checkFunction( Server_setBufferSizes( server ) );
+
 	return 0;
 }
 
 int Server_listen( Server *server ) {
-	struct sockaddr_storage address;
-	checkFunction( Server_AddressInfo( server, &address ) );
-	server->ipFamily = address.ss_family;
-
-	unsigned int flags = 0;
-	if ( address.ss_family == AF_INET6 )
-		flags |= IPV6_V6ONLY;
+	struct sockaddr_storage address = server->address;
+	bool v6Only = address.ss_family == AF_INET6 && server->options.v6Only;
 
 	switch ( server->protocol ) {
 		case ServerProtocol_TCP: {
-			checkFunction( uv_tcp_bind( server->handle.tcpHandle, (struct sockaddr*)&address, flags ) );
+			// libuv only looks at its own flags, so IPV6_V6ONLY can't be
+			// passed through as-is.
+			checkFunction( uv_tcp_bind( server->handle.tcpHandle, (struct sockaddr*)&address, v6Only? UV_TCP_IPV6ONLY: 0 ) );
+			if ( server->options.deferAccept )
+				checkFunction( Server_setDeferAccept( server ) );
+			int backlog = server->options.backlog? server->options.backlog: ListenBacklog;
+			if ( server->ring ) {
+				checkFunction( Server_listenWithRing( server, backlog ) );
+			} else {
+				checkFunction( uv_listen( server->handle.stream, backlog, Server_newTCPConnection ) );
+			}
 			break;
 		}
 		case ServerProtocol_UDP: {
-			checkFunction( uv_udp_bind( server->handle.udpHandle, (struct sockaddr*)&address, flags ) );
-			log_err( "UDP actually isn't supported yet." );
-			return 1;
-			// break;
+			checkFunction( uv_udp_bind( server->handle.udpHandle, (struct sockaddr*)&address, v6Only? UV_UDP_IPV6ONLY: 0 ) );
+			checkFunction( UDPTracker_start( server->udpTracker ) );
+			break;
 		}
 		default: {
 			log_err( "An unknown server protocol happened." );
@@ -122,12 +263,15 @@ int Server_listen( Server *server ) {
 		}
 	}
 
-	// e = uv_udp_recv_start( server->handle.udpHandle, allocCB, readCB );
-	checkFunction( uv_listen( server->handle.stream, 128, Server_newTCPConnection ) );
-
 	char namebuf[INET6_ADDRSTRLEN];
 	checkFunction( getnameinfo( (struct sockaddr *)&address, sizeof(address), namebuf, sizeof(namebuf), NULL, 0, NI_NUMERICHOST ) );
 	dbg_info( "Listening on [%s]:%d.", namebuf, ntohs(((struct sockaddr_in*)&address)->sin_port) );
 
 	return 0;
 }
+
+void Server_shareClientPool( Server *server, ClientPool *pool ) {
+	ClientPool_free( server->clientPool );
+	server->clientPool = pool;
+	server->sharesClientPool = true;
+}
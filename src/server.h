@@ -1,9 +1,12 @@
 #pragma once
+#include <stdbool.h>
 #include <uv.h>
 
 typedef struct _Server Server;
 typedef union _uvServerHandle ServerHandle;
 typedef enum _ServerProtocol ServerProtocol;
+typedef struct _ServerOptions ServerOptions;
+typedef struct _ClientPool ClientPool;
 
 union _uvServerHandle {
 	uv_tcp_t *tcpHandle;
@@ -11,7 +14,31 @@ union _uvServerHandle {
 	uv_stream_t *stream;
 };
 
+// How a listening socket is set up. Zero for any of them leaves it as
+// the system has it, other than the backlog, which defaults to 4096.
+struct _ServerOptions {
+	int backlog;
+	// SO_RCVBUF and SO_SNDBUF, in bytes.
+	int receiveBuffer;
+	int sendBuffer;
+	// TCP_NODELAY, on each connection as it's accepted.
+	bool noDelay;
+	// TCP_DEFER_ACCEPT, in seconds: connections are only accepted once
+	// they've sent something, or given up on after this long. Linux only.
+	int deferAccept;
+	// An IPv6 address takes IPv4 clients as well, as mapped addresses,
+	// unless this is set.
+	bool v6Only;
+	// Connections go through io_uring rather than libuv. TCP and Linux
+	// only.
+	bool ioUring;
+};
+
 #include "MemoryStore.h"
+#include "UDPTracker.h"
+#include "Stats.h"
+#include "TimerWheel.h"
+#include "Ring.h"
 
 struct _Server {
 	enum _ServerProtocol {
@@ -22,10 +49,37 @@ struct _Server {
 	const char *bindIP;
 	const char *bindPort;
 	short ipFamily;
+	struct sockaddr_storage address;
+	// Set before Server_initWithLoop so several workers can bind the
+	// same address and let the kernel spread connections between them.
+	bool reusePort;
+	// also set before Server_initWithLoop.
+	ServerOptions options;
 	MemoryStore *memStore;
 	ServerHandle handle;
+	UDPTracker *udpTracker;
+	ClientPool *clientPool;
+	// set when clientPool is another server's.
+	bool sharesClientPool;
+	// Connection deadlines, for TCP servers.
+	TimerWheel *timers;
+	// For a TCP server with ioUring set, which only uses handle for the
+	// listening socket.
+	Ring *ring;
+	// Open connections past this are closed as soon as they're accepted.
+	// 0 is no limit.
+	size_t maxConnections;
+	// the worker's, shared by its servers.
+	Stats *stats;
 };
 
 Server *Server_new( const char *bindIP, const char *port, ServerProtocol type );
+// Only once everything it had on the loop has been closed, and the loop
+// has run the closes through, since its handles live here.
+void Server_free( Server *server );
 int Server_initWithLoop( Server *server, uv_loop_t *loop );
 int Server_listen( Server *server );
+// For servers on the same loop and of the same protocol, which can hand
+// out clients from one pool, since a client only belongs to a server
+// while it's in use.
+void Server_shareClientPool( Server *server, ClientPool *pool );
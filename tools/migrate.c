@@ -0,0 +1,231 @@
+// Rewrites a redis namespace written by an older reki into the layout
+// reki uses now. Older versions kept each torrent's seeds and peers in
+// namespace:<info hash>:seeds and :peers, as whole 25 byte
+// CompactAddresses, with the info hash first in its 40 character hex form
+// and later in its raw 20 bytes. Now each address family has its own
+// sets, :seeds4, :peers4, :seeds6 and :peers6 under the raw hash, which
+// hold only the address and port, and peers with both are also in
+// :seeds46 or :peers46 under the two together. It's safe to run while reki is up:
+// each torrent is moved in one script, and anything the running tracker
+// has already written under the new keys is merged rather than
+// overwritten. Running it again finds nothing left to do.
+
+#include <hiredis/hiredis.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // getopt
+
+#include "../src/dbg.h"
+
+#define HexHashSize 40
+#define HashSize 20
+// the suffixes of the keys being moved, which are the same length.
+#define OldSuffixSize 6
+// how many keys each SCAN and SSCAN asks for.
+#define ScanCount 1000
+
+typedef struct _Migration Migration;
+
+struct _Migration {
+	redisContext *redis;
+	const char *namespace;
+	size_t namespaceLength;
+	char sha[41];
+
+	unsigned long long torrents;
+	unsigned long long keys;
+};
+
+// Splits one torrent's seeds and peers into the family sets, keeping
+// the latest announce for anyone already there, and swaps the name it
+// had in the torrent index for the raw hash. Old members carry the same
+// flags as CompactAddress: 1 for IPv4 and 2 for IPv6.
+//   KEYS: old seeds, old peers, seeds4, peers4, seeds6, peers6, torrent
+//         index, seeds46, peers46
+//   ARGV: old info hash (hex or raw), raw info hash
+//   returns: how many keys were moved
+static const char MigrateScript[] =
+	"local function add( key, score, member )\n"
+	"	local current = redis.call( 'ZSCORE', key, member )\n"
+	"	if not current or tonumber( current ) < score then\n"
+	"		redis.call( 'ZADD', key, score, member )\n"
+	"	end\n"
+	"end\n"
+	"local moved = 0\n"
+	"for i = 1, 2 do\n"
+	"	local members = redis.call( 'ZRANGE', KEYS[i], 0, -1, 'WITHSCORES' )\n"
+	"	for m = 1, #members, 2 do\n"
+	"		local compact, score = members[m], tonumber( members[m + 1] )\n"
+	"		local flags = string.byte( compact, 1 )\n"
+	"		if flags % 2 == 1 then add( KEYS[i + 2], score, string.sub( compact, 2, 7 ) ) end\n"
+	"		if math.floor( flags / 2 ) % 2 == 1 then add( KEYS[i + 4], score, string.sub( compact, 8, 25 ) ) end\n"
+	"		if flags % 4 == 3 then add( KEYS[i + 7], score, string.sub( compact, 2, 25 ) ) end\n"
+	"	end\n"
+	"	if #members > 0 then\n"
+	"		redis.call( 'DEL', KEYS[i] )\n"
+	"		moved = moved + 1\n"
+	"	end\n"
+	"end\n"
+	"redis.call( 'SREM', KEYS[7], ARGV[1] )\n"
+	"if redis.call( 'EXISTS', KEYS[3], KEYS[4], KEYS[5], KEYS[6] ) > 0 then\n"
+	"	redis.call( 'SADD', KEYS[7], ARGV[2] )\n"
+	"end\n"
+	"return moved\n";
+
+static int hexValue( char digit ) {
+	if ( digit >= '0' && digit <= '9' ) return digit - '0';
+	if ( digit >= 'a' && digit <= 'f' ) return digit - 'a' + 10;
+	if ( digit >= 'A' && digit <= 'F' ) return digit - 'A' + 10;
+	return -1;
+}
+
+// Only something that is exactly a hex info hash decodes, so index
+// members that are already raw are left alone.
+static bool decodeHexHash( const char *hex, size_t length, char *hash ) {
+	if ( length != HexHashSize ) return false;
+	for ( int i = 0; i < HashSize; i++ ) {
+		int high = hexValue( hex[2 * i] ), low = hexValue( hex[2 * i + 1] );
+		if ( high < 0 || low < 0 ) return false;
+		hash[i] = (char)(high << 4 | low);
+	}
+	return true;
+}
+
+static int Migration_loadScript( Migration *migration ) {
+	redisReply *reply = redisCommand( migration->redis, "SCRIPT LOAD %s", MigrateScript );
+	if ( !reply || (reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_STATUS) || reply->len != sizeof(migration->sha) - 1 ) {
+		log_err( "Couldn't load the migration script: %s", reply && reply->str? reply->str: migration->redis->errstr );
+		if ( reply ) freeReplyObject( reply );
+		return 1;
+	}
+	memcpy( migration->sha, reply->str, reply->len + 1 );
+	freeReplyObject( reply );
+	return 0;
+}
+
+static int Migration_torrent( Migration *migration, const char *old, size_t oldSize, const char *hash ) {
+	const char *namespace = migration->namespace;
+	size_t hashSize = HashSize;
+	redisReply *reply = redisCommand( migration->redis, "EVALSHA %s 9 %s:%b:seeds %s:%b:peers %s:%b:seeds4 %s:%b:peers4 %s:%b:seeds6 %s:%b:peers6 %s:torrents %s:%b:seeds46 %s:%b:peers46 %b %b",
+		migration->sha,
+		namespace, old, oldSize, namespace, old, oldSize,
+		namespace, hash, hashSize, namespace, hash, hashSize, namespace, hash, hashSize, namespace, hash, hashSize,
+		namespace, namespace, hash, hashSize, namespace, hash, hashSize,
+		old, oldSize, hash, hashSize );
+	if ( !reply || reply->type != REDIS_REPLY_INTEGER ) {
+		log_err( "Couldn't migrate a torrent: %s", reply && reply->str? reply->str: migration->redis->errstr );
+		if ( reply ) freeReplyObject( reply );
+		return 1;
+	}
+
+	if ( reply->integer ) {
+		migration->torrents++;
+		migration->keys += reply->integer;
+	}
+	freeReplyObject( reply );
+	return 0;
+}
+
+// Picks the info hash out of namespace:<hash>:seeds or
+// namespace:<hash>:peers, where hash is hex or raw. Gives the length of
+// the hash as it is in the key, or 0 if key isn't one of those.
+static size_t Migration_parseKey( Migration *migration, redisReply *key, char *hash ) {
+	size_t namespaceLength = migration->namespaceLength;
+	if ( key->len < namespaceLength + 1 + OldSuffixSize ) return 0;
+
+	size_t oldSize = key->len - namespaceLength - 1 - OldSuffixSize;
+	const char *old = key->str + namespaceLength + 1, *suffix = old + oldSize;
+	if ( memcmp( suffix, ":seeds", OldSuffixSize ) && memcmp( suffix, ":peers", OldSuffixSize ) ) return 0;
+
+	if ( oldSize == HashSize ) {
+		memcpy( hash, old, HashSize );
+		return oldSize;
+	}
+	return decodeHexHash( old, oldSize, hash )? oldSize: 0;
+}
+
+// Goes through a SCAN or SSCAN to the end, handing each old key, or
+// each hex hash left in the index, to Migration_torrent.
+static int Migration_scan( Migration *migration, const char *command, bool keys ) {
+	char cursor[24] = "0";
+	do {
+		redisReply *reply = keys?
+			redisCommand( migration->redis, "%s %s MATCH %s:* COUNT %d", command, cursor, migration->namespace, ScanCount ):
+			redisCommand( migration->redis, "%s %s:torrents %s COUNT %d", command, migration->namespace, cursor, ScanCount );
+		if ( !reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 || reply->element[0]->len >= sizeof(cursor) ) {
+			log_err( "%s failed: %s", command, reply && reply->str? reply->str: migration->redis->errstr );
+			if ( reply ) freeReplyObject( reply );
+			return 1;
+		}
+		memcpy( cursor, reply->element[0]->str, reply->element[0]->len + 1 );
+
+		redisReply *elements = reply->element[1];
+		for ( size_t i = 0; i < elements->elements; i++ ) {
+			redisReply *element = elements->element[i];
+			const char *old = keys? element->str + migration->namespaceLength + 1: element->str;
+			char hash[HashSize];
+			size_t oldSize = keys? Migration_parseKey( migration, element, hash ):
+			                       decodeHexHash( element->str, element->len, hash )? HexHashSize: 0;
+			if ( oldSize && Migration_torrent( migration, old, oldSize, hash ) ) {
+				freeReplyObject( reply );
+				return 1;
+			}
+		}
+		freeReplyObject( reply );
+	} while ( strcmp( cursor, "0" ) );
+	return 0;
+}
+
+static void usage( const char *name ) {
+	fprintf( stderr,
+		"Usage: %s [-h host] [-p port] [-n namespace]\n"
+		"  -h  redis host (default localhost)\n"
+		"  -p  redis port (default 6379)\n"
+		"  -n  namespace to rewrite (default reki2)\n", name );
+}
+
+int main( int argc, char **argv ) {
+	const char *host = "localhost";
+	int port = 6379;
+	Migration migration = { .namespace = "reki2" };
+
+	int option;
+	while ( (option = getopt( argc, argv, "h:p:n:" )) != -1 ) {
+		switch ( option ) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi( optarg );
+				break;
+			case 'n':
+				migration.namespace = optarg;
+				break;
+			default:
+				usage( argv[0] );
+				return 1;
+		}
+	}
+	migration.namespaceLength = strlen( migration.namespace );
+
+	migration.redis = redisConnect( host, port );
+	if ( !migration.redis || migration.redis->err ) {
+		log_err( "Couldn't connect to redis at %s:%d: %s", host, port, migration.redis? migration.redis->errstr: "out of memory" );
+		return 1;
+	}
+
+	int status = Migration_loadScript( &migration );
+	// Every torrent with any peers has keys, which finds them whether or
+	// not they made it into the index. What's left to fix in the index
+	// after that is hex hashes of torrents whose keys are already gone.
+	if ( !status )
+		status = Migration_scan( &migration, "SCAN", true );
+	if ( !status )
+		status = Migration_scan( &migration, "SSCAN", false );
+
+	log_info( "Moved %llu keys of %llu torrents in %s.", migration.keys, migration.torrents, migration.namespace );
+	redisFree( migration.redis );
+	return status;
+}